@@ -0,0 +1,378 @@
+/*
+ * atlas.c - Atlas of masked map tiles
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The map is drawn from ground textures masked to the shape of up and
+   down pointing triangles. Masking a texture means unpacking the mask,
+   so all combinations of textures and masks are prepared in an atlas
+   once. The atlas is stored next to the data file and mapped into
+   memory on later runs. It is rebuilt if the textures or masks in
+   the data file do not match the ones it was built from. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#include "atlas.h"
+#include "freeserf_endian.h"
+#include "gfx.h"
+#include "data.h"
+#include "log.h"
+
+
+#define ATLAS_MAGIC    0x41545346 /* "FSTA" */
+#define ATLAS_VERSION  1
+#define ATLAS_SUFFIX   ".tiles"
+
+#define ATLAS_TEXTURES  DATA_MAP_GROUND_COUNT
+#define ATLAS_MASKS     DATA_MAP_MASK_UP_COUNT
+#define ATLAS_TILES     (2*ATLAS_TEXTURES*ATLAS_MASKS)
+
+/* The atlas starts with a header of four 32 bit words (magic, version,
+   hash of the source sprites and number of tiles), followed by an
+   entry for each tile and the tile data. The down tiles come first,
+   ordered by mask and then texture. The data of a tile is the texture
+   with the pixels outside the mask set to zero, in the size of the
+   mask. Tiles of the undefined (illegal) masks have zero size. All
+   values are little endian. */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t source;
+	uint32_t tile_count;
+} atlas_header_t;
+
+typedef struct {
+	uint32_t offset;
+	uint16_t width;
+	uint16_t height;
+} atlas_entry_t;
+
+
+static uint8_t *atlas;
+static size_t atlas_size;
+static int atlas_mapped;
+
+
+static int
+tile_mask_index(int tile)
+{
+	int up = tile >= ATLAS_TEXTURES*ATLAS_MASKS;
+	int mask = (tile / ATLAS_TEXTURES) % ATLAS_MASKS;
+	return (up ? DATA_MAP_MASK_UP_BASE : DATA_MAP_MASK_DOWN_BASE) + mask;
+}
+
+static int
+tile_sprite_index(int tile)
+{
+	return DATA_MAP_GROUND_BASE + tile % ATLAS_TEXTURES;
+}
+
+/* FNV-1a hash of the ground textures and masks in the data file. */
+static uint32_t
+source_hash()
+{
+	uint32_t hash = 2166136261;
+
+	for (int i = 0; i < ATLAS_TEXTURES + 2*ATLAS_MASKS; i++) {
+		int index;
+		if (i < ATLAS_TEXTURES) index = DATA_MAP_GROUND_BASE + i;
+		else if (i < ATLAS_TEXTURES + ATLAS_MASKS) {
+			index = DATA_MAP_MASK_UP_BASE + i - ATLAS_TEXTURES;
+		} else {
+			index = DATA_MAP_MASK_DOWN_BASE + i -
+				ATLAS_TEXTURES - ATLAS_MASKS;
+		}
+
+		if (!gfx_data_object_defined(index)) continue;
+
+		size_t size;
+		const uint8_t *data = gfx_get_data_object(index, &size);
+		for (size_t j = 0; j < size; j++) {
+			hash ^= data[j];
+			hash *= 16777619;
+		}
+	}
+
+	return hash;
+}
+
+/* Return non-zero if the atlas in memory is valid for the
+   data file with the given source hash. */
+static int
+atlas_check(uint32_t source)
+{
+	if (atlas_size < sizeof(atlas_header_t) +
+	    ATLAS_TILES*sizeof(atlas_entry_t)) return 0;
+
+	const atlas_header_t *header = (atlas_header_t *)atlas;
+	if (le32toh(header->magic) != ATLAS_MAGIC ||
+	    le32toh(header->version) != ATLAS_VERSION ||
+	    le32toh(header->source) != source ||
+	    le32toh(header->tile_count) != ATLAS_TILES) return 0;
+
+	const atlas_entry_t *entries = (atlas_entry_t *)(header + 1);
+	for (int i = 0; i < ATLAS_TILES; i++) {
+		size_t offset = le32toh(entries[i].offset);
+		size_t width = le16toh(entries[i].width);
+		size_t height = le16toh(entries[i].height);
+
+		size_t mask_width = 0;
+		size_t mask_height = 0;
+		if (gfx_data_object_defined(tile_mask_index(i))) {
+			const sprite_t *mask =
+				gfx_get_data_object(tile_mask_index(i), NULL);
+			mask_width = le16toh(mask->w);
+			mask_height = le16toh(mask->h);
+		}
+
+		if (width != mask_width || height != mask_height ||
+		    offset > atlas_size ||
+		    width*height > atlas_size - offset) return 0;
+	}
+
+	return 1;
+}
+
+/* Build the atlas in memory. */
+static void
+atlas_build(uint32_t source)
+{
+	size_t size = sizeof(atlas_header_t) +
+		ATLAS_TILES*sizeof(atlas_entry_t);
+	for (int i = 0; i < ATLAS_TILES; i++) {
+		if (!gfx_data_object_defined(tile_mask_index(i))) continue;
+		const sprite_t *mask =
+			gfx_get_data_object(tile_mask_index(i), NULL);
+		size += (size_t)le16toh(mask->w) * le16toh(mask->h);
+	}
+
+	atlas = malloc(size);
+	if (atlas == NULL) abort();
+
+	atlas_size = size;
+	atlas_mapped = 0;
+
+	/* Conversion is symmetric, so le32toh also converts to LE. */
+	atlas_header_t *header = (atlas_header_t *)atlas;
+	header->magic = le32toh(ATLAS_MAGIC);
+	header->version = le32toh(ATLAS_VERSION);
+	header->source = le32toh(source);
+	header->tile_count = le32toh(ATLAS_TILES);
+
+	atlas_entry_t *entries = (atlas_entry_t *)(header + 1);
+	size_t offset = sizeof(atlas_header_t) +
+		ATLAS_TILES*sizeof(atlas_entry_t);
+	for (int i = 0; i < ATLAS_TILES; i++) {
+		if (!gfx_data_object_defined(tile_mask_index(i))) {
+			entries[i].offset = 0;
+			entries[i].width = 0;
+			entries[i].height = 0;
+			continue;
+		}
+
+		const sprite_t *mask =
+			gfx_get_data_object(tile_mask_index(i), NULL);
+		const sprite_t *sprite =
+			gfx_get_data_object(tile_sprite_index(i), NULL);
+
+		entries[i].offset = le32toh((uint32_t)offset);
+		entries[i].width = mask->w;
+		entries[i].height = mask->h;
+
+		gfx_mask_sprite(&atlas[offset], sprite, mask);
+		offset += (size_t)le16toh(mask->w) * le16toh(mask->h);
+	}
+}
+
+/* Write the atlas in memory to path. The atlas is written to a
+   temporary file first, so a partial atlas is never left at path. */
+static int
+atlas_write(const char *path)
+{
+	char *tmp_path = malloc(strlen(path)+5);
+	if (tmp_path == NULL) abort();
+	sprintf(tmp_path, "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL) {
+		free(tmp_path);
+		return -1;
+	}
+
+	size_t wr = fwrite(atlas, atlas_size, 1, f);
+	int r = fclose(f);
+	if (wr < 1 || r != 0 || rename(tmp_path, path) < 0) {
+		remove(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+
+	free(tmp_path);
+	return 0;
+}
+
+/* Read the atlas at path into memory. */
+static int
+atlas_read(const char *path)
+{
+	int r;
+
+#ifdef HAVE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat sb;
+	r = fstat(fd, &sb);
+	if (r < 0 || sb.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	atlas_size = sb.st_size;
+	atlas = mmap(NULL, atlas_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (atlas == MAP_FAILED) {
+		atlas = NULL;
+		return -1;
+	}
+
+	atlas_mapped = 1;
+#else /* ! HAVE_MMAP */
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return -1;
+
+	r = fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (r < 0 || size <= 0 || fseek(f, 0, SEEK_SET) < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	atlas_size = size;
+	atlas = malloc(atlas_size);
+	if (atlas == NULL) abort();
+
+	size_t rd = fread(atlas, atlas_size, 1, f);
+	fclose(f);
+	if (rd < 1) {
+		free(atlas);
+		atlas = NULL;
+		return -1;
+	}
+
+	atlas_mapped = 0;
+#endif
+
+	return 0;
+}
+
+/* Load the atlas for the data file at data_path. The atlas is built
+   and saved if it does not exist or does not match the data file. */
+int
+atlas_load(const char *data_path)
+{
+	atlas_unload();
+
+	uint32_t source = source_hash();
+
+	char *path = malloc(strlen(data_path)+strlen(ATLAS_SUFFIX)+1);
+	if (path == NULL) abort();
+	sprintf(path, "%s" ATLAS_SUFFIX, data_path);
+
+	int r = atlas_read(path);
+	if (r == 0 && atlas_check(source)) {
+		LOGI("atlas", "Loaded map tile atlas `%s'.", path);
+		free(path);
+		return 0;
+	}
+
+	atlas_unload();
+
+	LOGI("atlas", "Building map tile atlas...");
+	atlas_build(source);
+
+	r = atlas_write(path);
+	if (r < 0) {
+		LOGW("atlas", "Unable to save map tile atlas to `%s'.", path);
+	}
+
+	free(path);
+	return 0;
+}
+
+void
+atlas_unload()
+{
+	if (atlas == NULL) return;
+
+#ifdef HAVE_MMAP
+	if (atlas_mapped) munmap(atlas, atlas_size);
+	else free(atlas);
+#else /* ! HAVE_MMAP */
+	free(atlas);
+#endif
+
+	atlas = NULL;
+	atlas_size = 0;
+}
+
+/* Return the masked data of the map tile drawn with the mask and
+   ground sprite at the given data file indices, or NULL if the
+   combination is not in the atlas. */
+const uint8_t *
+atlas_get_tile(int mask, int sprite)
+{
+	if (atlas == NULL) return NULL;
+
+	if (sprite < DATA_MAP_GROUND_BASE ||
+	    sprite >= DATA_MAP_GROUND_BASE + ATLAS_TEXTURES) return NULL;
+
+	int tile;
+	if (mask >= DATA_MAP_MASK_DOWN_BASE &&
+	    mask < DATA_MAP_MASK_DOWN_BASE + ATLAS_MASKS) {
+		tile = (mask - DATA_MAP_MASK_DOWN_BASE)*ATLAS_TEXTURES;
+	} else if (mask >= DATA_MAP_MASK_UP_BASE &&
+		   mask < DATA_MAP_MASK_UP_BASE + ATLAS_MASKS) {
+		tile = (ATLAS_MASKS + mask - DATA_MAP_MASK_UP_BASE)*ATLAS_TEXTURES;
+	} else {
+		return NULL;
+	}
+	tile += sprite - DATA_MAP_GROUND_BASE;
+
+	const atlas_entry_t *entries =
+		(atlas_entry_t *)(atlas + sizeof(atlas_header_t));
+	if (entries[tile].width == 0) return NULL;
+
+	return atlas + le32toh(entries[tile].offset);
+}
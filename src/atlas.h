@@ -0,0 +1,31 @@
+/*
+ * atlas.h - Atlas of masked map tiles
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ATLAS_H
+#define _ATLAS_H
+
+#include <stdint.h>
+
+int atlas_load(const char *data_path);
+void atlas_unload();
+const uint8_t *atlas_get_tile(int mask, int sprite);
+
+#endif /* ! _ATLAS_H */
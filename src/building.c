@@ -24,6 +24,9 @@
 #include <assert.h>
 
 #include "building.h"
+#include "globals.h"
+#include "pool.h"
+#include "misc.h"
 
 
 int
@@ -37,3 +40,204 @@ building_get_score_from_type(building_type_t type)
 
 	return building_score_from_type[type-1];
 }
+
+
+/* Index of military buildings by player and map area. The map is
+   divided into cells of 16x16 positions, and each military building
+   is linked into the list of its player and cell. This allows
+   finding the military buildings near a position without scanning
+   the map. The index is updated when a military building is placed,
+   changes owner or is freed, and is rebuilt from the building array
+   when a game is started or loaded. The NULL building (index 0)
+   terminates the lists. */
+#define BUILDING_CELL_SHIFT  4
+#define BUILDING_CELL_SIZE   (1 << BUILDING_CELL_SHIFT)
+
+typedef struct {
+	int next;
+	int prev;
+	uint key; /* Player and cell the building is listed under */
+} building_link_t;
+
+#define BUILDING_LINK_NONE  ((uint)-1)
+
+static building_link_t *building_links;
+static int *cell_first;
+static uint cell_cols;
+static uint cell_rows;
+
+static int building_index_ready = 0;
+
+static int
+building_is_military(building_t *building)
+{
+	switch (BUILDING_TYPE(building)) {
+	case BUILDING_HUT:
+	case BUILDING_TOWER:
+	case BUILDING_FORTRESS:
+	case BUILDING_CASTLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Move building to the list for key. */
+static void
+building_link_update(int index, uint key)
+{
+	building_link_t *link = &building_links[index];
+	if (link->key == key) return;
+
+	if (link->key != BUILDING_LINK_NONE) {
+		if (link->prev != 0) building_links[link->prev].next = link->next;
+		else cell_first[link->key] = link->next;
+		if (link->next != 0) building_links[link->next].prev = link->prev;
+	}
+
+	link->key = key;
+	link->prev = 0;
+	link->next = 0;
+
+	if (key != BUILDING_LINK_NONE) {
+		link->next = cell_first[key];
+		if (link->next != 0) building_links[link->next].prev = index;
+		cell_first[key] = index;
+	}
+}
+
+/* Return the list key of building. */
+static uint
+building_index_key(building_t *building)
+{
+	if (!building_is_military(building) ||
+	    building->pos >= globals.map.tile_count) {
+		return BUILDING_LINK_NONE;
+	}
+
+	uint col = MAP_POS_COL(building->pos) >> BUILDING_CELL_SHIFT;
+	uint row = MAP_POS_ROW(building->pos) >> BUILDING_CELL_SHIFT;
+	return (BUILDING_PLAYER(building)*cell_rows + row)*cell_cols + col;
+}
+
+/* Build the index from the building array. */
+void
+building_index_rebuild()
+{
+	if (building_links == NULL) {
+		building_links = malloc(globals.max_building_cnt*
+					sizeof(building_link_t));
+		if (building_links == NULL) abort();
+	}
+
+	uint cols = globals.map.cols >> BUILDING_CELL_SHIFT;
+	uint rows = globals.map.rows >> BUILDING_CELL_SHIFT;
+	if (cell_first == NULL || cols != cell_cols || rows != cell_rows) {
+		free(cell_first);
+		cell_cols = cols;
+		cell_rows = rows;
+		cell_first = malloc(4*cell_cols*cell_rows*sizeof(int));
+		if (cell_first == NULL) abort();
+	}
+
+	for (int i = 0; i < globals.max_building_cnt; i++) {
+		building_links[i].key = BUILDING_LINK_NONE;
+	}
+
+	for (uint i = 0; i < 4*cell_cols*cell_rows; i++) cell_first[i] = 0;
+
+	building_index_ready = 1;
+
+	int i;
+	pool_foreach_from(&globals.building_pool, i, 1) {
+		building_index_update(i);
+	}
+}
+
+/* Update the index after a building was placed on the
+   map or changed owner. */
+void
+building_index_update(int index)
+{
+	if (!building_index_ready || index == 0) return;
+
+	building_link_update(index,
+			     building_index_key(&globals.buildings[index]));
+}
+
+/* Remove building from the index when it is freed. */
+void
+building_index_remove(int index)
+{
+	if (!building_index_ready || index == 0) return;
+
+	building_link_update(index, BUILDING_LINK_NONE);
+}
+
+/* Return the distance between two coordinates on an axis of the
+   given size, taking the wrapping of the map into account. */
+static uint
+axis_dist(uint a, uint b, uint mask)
+{
+	uint d = (a - b) & mask;
+	return min(d, mask + 1 - d);
+}
+
+/* Call callback for each military building of player (or of all
+   players if player is negative) that is at most radius columns
+   and radius rows away from pos. The order of the buildings is
+   undefined. */
+void
+building_index_search_range(map_pos_t pos, int radius, int player,
+			    building_search_func *callback, void *data)
+{
+	if (!building_index_ready) building_index_rebuild();
+
+	uint col = MAP_POS_COL(pos);
+	uint row = MAP_POS_ROW(pos);
+
+	/* Range of cells, each wrapped around the map. */
+	uint col_start = 0;
+	uint col_count = cell_cols;
+	if (2*radius+1 < (int)globals.map.cols) {
+		uint start = (col - radius) & globals.map.col_mask;
+		col_start = start >> BUILDING_CELL_SHIFT;
+		col_count = min(((start + 2*radius) >> BUILDING_CELL_SHIFT) -
+			       col_start + 1, cell_cols);
+	}
+
+	uint row_start = 0;
+	uint row_count = cell_rows;
+	if (2*radius+1 < (int)globals.map.rows) {
+		uint start = (row - radius) & globals.map.row_mask;
+		row_start = start >> BUILDING_CELL_SHIFT;
+		row_count = min(((start + 2*radius) >> BUILDING_CELL_SHIFT) -
+			       row_start + 1, cell_rows);
+	}
+
+	for (int p = 0; p < 4; p++) {
+		if (player >= 0 && p != player) continue;
+
+		for (uint r = 0; r < row_count; r++) {
+			uint cell_row = (row_start + r) % cell_rows;
+			for (uint c = 0; c < col_count; c++) {
+				uint cell_col = (col_start + c) % cell_cols;
+				uint key = (p*cell_rows + cell_row)*cell_cols + cell_col;
+
+				int i = cell_first[key];
+				while (i != 0) {
+					int next = building_links[i].next;
+					building_t *building = &globals.buildings[i];
+					map_pos_t bld_pos = building->pos;
+					if (axis_dist(MAP_POS_COL(bld_pos), col,
+						      globals.map.col_mask) <= (uint)radius &&
+					    axis_dist(MAP_POS_ROW(bld_pos), row,
+						      globals.map.row_mask) <= (uint)radius) {
+						if (callback(building, data)) return;
+					}
+					i = next;
+				}
+			}
+		}
+	}
+}
@@ -91,7 +91,17 @@ struct building {
 };
 
 
+/* Callback for building_index_search_range(). Return non-zero
+   to stop the search. */
+typedef int building_search_func(building_t *building, void *data);
+
 int building_get_score_from_type(building_type_t type);
 
+void building_index_rebuild();
+void building_index_update(int index);
+void building_index_remove(int index);
+void building_index_search_range(map_pos_t pos, int radius, int player,
+				 building_search_func *callback, void *data);
+
 
 #endif /* ! _BUILDING_H */
@@ -0,0 +1,445 @@
+/*
+ * checksum.c - Checksums of the game state
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "freeserf_endian.h"
+#include "globals.h"
+#include "serf.h"
+#include "flag.h"
+#include "building.h"
+#include "player.h"
+#include "map.h"
+#include "game.h"
+#include "log.h"
+
+
+#define CHECKSUM_INIT   0xcbf29ce484222325ull
+#define CHECKSUM_PRIME  0x100000001b3ull
+
+#define CHECKSUM_STREAM_MAGIC    0x53435346 /* "FSCS" */
+#define CHECKSUM_STREAM_VERSION  1
+
+static FILE *stream_file;
+static uint stream_interval;
+static uint stream_updates;
+
+
+/* Mix bytes into hash. Works on 64 bit words where possible,
+   which is a lot faster than the byte-wise FNV-1a. */
+static uint64_t
+hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * CHECKSUM_PRIME;
+		h ^= h >> 29;
+		p += 8;
+		len -= 8;
+	}
+
+	while (len > 0) {
+		h = (h ^ *p) * CHECKSUM_PRIME;
+		p += 1;
+		len -= 1;
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_uint(uint64_t h, uint32_t value)
+{
+	return hash_bytes(h, &value, sizeof(value));
+}
+
+/* Hash bytes of a struct from member first up to (not including)
+   member last. Used to skip padding and fields that are not part
+   of the game state. */
+#define HASH_FIELDS(h, ptr, type, first, last)			\
+	hash_bytes((h), (const uint8_t *)(ptr) + offsetof(type, first), \
+		   offsetof(type, last) - offsetof(type, first))
+
+#define HASH_FIELDS_TO_END(h, ptr, type, first)			\
+	hash_bytes((h), (const uint8_t *)(ptr) + offsetof(type, first), \
+		   sizeof(type) - offsetof(type, first))
+
+/* Convert a pointer to a game object into a value that
+   does not depend on where the object arrays were allocated. */
+static uint32_t
+object_ptr_id(const void *ptr)
+{
+	uintptr_t p = (uintptr_t)ptr;
+	if (ptr == NULL) return 0;
+
+	uintptr_t flags = (uintptr_t)globals.flgs;
+	if (p >= flags && p < flags + globals.max_flg_cnt*sizeof(flag_t) &&
+	    (p - flags) % sizeof(flag_t) == 0) {
+		return 0x10000 | ((p - flags) / sizeof(flag_t));
+	}
+
+	uintptr_t buildings = (uintptr_t)globals.buildings;
+	if (p >= buildings &&
+	    p < buildings + globals.max_building_cnt*sizeof(building_t) &&
+	    (p - buildings) % sizeof(building_t) == 0) {
+		return 0x20000 | ((p - buildings) / sizeof(building_t));
+	}
+
+	uintptr_t inventories = (uintptr_t)globals.inventories;
+	if (p >= inventories &&
+	    p < inventories + globals.max_inventory_cnt*sizeof(inventory_t) &&
+	    (p - inventories) % sizeof(inventory_t) == 0) {
+		return 0x30000 | ((p - inventories) / sizeof(inventory_t));
+	}
+
+	return 0xffffffff;
+}
+
+#define SERF_STATE_DATA_SIZE(member)  sizeof(((serf_t *)NULL)->s.member)
+
+/* Return the number of bytes of the state union used in state.
+   The rest of the union may hold bytes left over from an earlier
+   state, including a flag pointer from idle_on_path. */
+static size_t
+serf_state_data_size(serf_state_t state)
+{
+	switch (state) {
+	case SERF_STATE_IDLE_IN_STOCK:
+		return SERF_STATE_DATA_SIZE(idle_in_stock);
+	case SERF_STATE_WALKING:
+	case SERF_STATE_TRANSPORTING:
+	case SERF_STATE_DELIVERING:
+		return SERF_STATE_DATA_SIZE(walking);
+	case SERF_STATE_ENTERING_BUILDING:
+		return SERF_STATE_DATA_SIZE(entering_building);
+	case SERF_STATE_LEAVING_BUILDING:
+	case SERF_STATE_READY_TO_LEAVE:
+	case SERF_STATE_KNIGHT_LEAVE_FOR_FIGHT:
+		return SERF_STATE_DATA_SIZE(leaving_building);
+	case SERF_STATE_READY_TO_ENTER:
+		return SERF_STATE_DATA_SIZE(ready_to_enter);
+	case SERF_STATE_DIGGING:
+		return SERF_STATE_DATA_SIZE(digging);
+	case SERF_STATE_BUILDING:
+		return SERF_STATE_DATA_SIZE(building);
+	case SERF_STATE_BUILDING_CASTLE:
+		return SERF_STATE_DATA_SIZE(building_castle);
+	case SERF_STATE_MOVE_RESOURCE_OUT:
+	case SERF_STATE_WAIT_FOR_RESOURCE_OUT:
+	case SERF_STATE_DROP_RESOURCE_OUT:
+		return SERF_STATE_DATA_SIZE(move_resource_out);
+	case SERF_STATE_READY_TO_LEAVE_INVENTORY:
+		return SERF_STATE_DATA_SIZE(ready_to_leave_inventory);
+	case SERF_STATE_FREE_WALKING:
+	case SERF_STATE_LOGGING:
+	case SERF_STATE_PLANTING:
+	case SERF_STATE_STONECUTTER_FREE_WALKING:
+	case SERF_STATE_STONECUTTING:
+	case SERF_STATE_FREE_SAILING:
+	case SERF_STATE_FISHING:
+	case SERF_STATE_FARMING:
+	case SERF_STATE_SAMPLING_GEO_SPOT:
+	case SERF_STATE_KNIGHT_FREE_WALKING:
+	case SERF_STATE_KNIGHT_ATTACKING_FREE_WAIT:
+		return SERF_STATE_DATA_SIZE(free_walking);
+	case SERF_STATE_SAWING:
+		return SERF_STATE_DATA_SIZE(sawing);
+	case SERF_STATE_LOST:
+		return SERF_STATE_DATA_SIZE(lost);
+	case SERF_STATE_MINING:
+		return SERF_STATE_DATA_SIZE(mining);
+	case SERF_STATE_SMELTING:
+		return SERF_STATE_DATA_SIZE(smelting);
+	case SERF_STATE_MILLING:
+		return SERF_STATE_DATA_SIZE(milling);
+	case SERF_STATE_BAKING:
+		return SERF_STATE_DATA_SIZE(baking);
+	case SERF_STATE_PIGFARMING:
+		return SERF_STATE_DATA_SIZE(pigfarming);
+	case SERF_STATE_BUTCHERING:
+		return SERF_STATE_DATA_SIZE(butchering);
+	case SERF_STATE_MAKING_WEAPON:
+		return SERF_STATE_DATA_SIZE(making_weapon);
+	case SERF_STATE_MAKING_TOOL:
+		return SERF_STATE_DATA_SIZE(making_tool);
+	case SERF_STATE_BUILDING_BOAT:
+		return SERF_STATE_DATA_SIZE(building_boat);
+	case SERF_STATE_KNIGHT_ENGAGING_BUILDING:
+	case SERF_STATE_KNIGHT_PREPARE_ATTACKING:
+	case SERF_STATE_KNIGHT_ATTACKING:
+	case SERF_STATE_KNIGHT_ATTACKING_VICTORY:
+	case SERF_STATE_KNIGHT_ATTACKING_DEFEAT:
+	case SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE:
+	case SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE_JOIN:
+	case SERF_STATE_KNIGHT_PREPARE_ATTACKING_FREE:
+	case SERF_STATE_KNIGHT_ATTACKING_FREE:
+	case SERF_STATE_KNIGHT_ATTACKING_VICTORY_FREE:
+	case SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE:
+		return SERF_STATE_DATA_SIZE(attacking);
+	case SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE:
+	case SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE:
+	case SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE_WAIT:
+	case SERF_STATE_KNIGHT_DEFENDING_FREE:
+	case SERF_STATE_KNIGHT_DEFENDING_VICTORY_FREE:
+		return SERF_STATE_DATA_SIZE(defending_free);
+	case SERF_STATE_KNIGHT_LEAVE_FOR_WALK_TO_FIGHT:
+		return SERF_STATE_DATA_SIZE(leave_for_walk_to_fight);
+	case SERF_STATE_DEFENDING_HUT:
+	case SERF_STATE_DEFENDING_TOWER:
+	case SERF_STATE_DEFENDING_FORTRESS:
+	case SERF_STATE_DEFENDING_CASTLE:
+		return SERF_STATE_DATA_SIZE(defending);
+	default:
+		/* No state data. The idle_on_path states hold a
+		   pointer and are handled by the caller. */
+		return 0;
+	}
+}
+
+static uint64_t
+hash_serfs()
+{
+	uint64_t h = CHECKSUM_INIT;
+
+	int i;
+	pool_foreach_from(&globals.serf_pool, i, 1) {
+		serf_t *serf = game_get_serf(i);
+		h = hash_uint(h, i);
+		/* Skip padding after anim. */
+		h = HASH_FIELDS(h, serf, serf_t, type, anim);
+		h = hash_bytes(h, &serf->anim, sizeof(serf->anim));
+		h = hash_uint(h, serf->state);
+
+		switch (serf->state) {
+		case SERF_STATE_IDLE_ON_PATH:
+		case SERF_STATE_WAIT_IDLE_ON_PATH:
+		case SERF_STATE_WAKE_AT_FLAG:
+		case SERF_STATE_WAKE_ON_PATH:
+			/* Hash the flag as an index and skip padding. */
+			h = hash_uint(h, serf->s.idle_on_path.rev_dir);
+			h = hash_uint(h, object_ptr_id(serf->s.idle_on_path.flag));
+			h = hash_uint(h, serf->s.idle_on_path.field_E);
+			break;
+		default:
+			h = hash_bytes(h, &serf->s,
+				       serf_state_data_size(serf->state));
+			break;
+		}
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_flags()
+{
+	uint64_t h = CHECKSUM_INIT;
+
+	int i;
+	pool_foreach_from(&globals.flg_pool, i, 1) {
+		flag_t *flag = game_get_flag(i);
+		h = hash_uint(h, i);
+		h = hash_uint(h, flag->pos);
+		/* Skip search_num and search_dir. */
+		h = HASH_FIELDS(h, flag, flag_t, path_con, other_endpoint);
+		for (int d = 0; d < 6; d++) {
+			h = hash_uint(h, object_ptr_id(flag->other_endpoint.v[d]));
+		}
+		/* Skip the route cache. */
+		h = HASH_FIELDS(h, flag, flag_t, other_end_dir, route);
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_buildings()
+{
+	uint64_t h = CHECKSUM_INIT;
+
+	int i;
+	pool_foreach_from(&globals.building_pool, i, 1) {
+		building_t *building = game_get_building(i);
+		h = hash_uint(h, i);
+		h = HASH_FIELDS(h, building, building_t, pos, u);
+
+		/* The union holds either a pointer to a game object
+		   or a small value. */
+		uint32_t id = object_ptr_id(building->u.inventory);
+		if (id == 0xffffffff) {
+			h = hash_bytes(h, &building->u.s, sizeof(building->u.s));
+		} else {
+			h = hash_uint(h, id);
+		}
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_inventories()
+{
+	uint64_t h = CHECKSUM_INIT;
+
+	int i;
+	pool_foreach_from(&globals.inventory_pool, i, 0) {
+		inventory_t *inventory = game_get_inventory(i);
+		h = hash_uint(h, i);
+		h = hash_bytes(h, inventory, sizeof(inventory_t));
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_players()
+{
+	uint64_t h = CHECKSUM_INIT;
+
+	for (int p = 0; p < 4; p++) {
+		player_sett_t *sett = globals.player_sett[p];
+
+		/* Skip padding after the 16 bit fields. */
+		h = HASH_FIELDS(h, sett, player_sett_t,
+				tool_prio, serf_to_knight_counter);
+		h = hash_bytes(h, &sett->serf_to_knight_counter,
+			       sizeof(sett->serf_to_knight_counter));
+		h = HASH_FIELDS(h, sett, player_sett_t,
+				attacking_building_count, last_anim);
+		h = hash_bytes(h, &sett->last_anim, sizeof(sett->last_anim));
+		h = HASH_FIELDS_TO_END(h, sett, player_sett_t,
+				       reproduction_counter);
+	}
+
+	return h;
+}
+
+/* Compute checksum of the current game state. */
+void
+checksum_game_state(state_checksum_t *sum)
+{
+	uint64_t h = CHECKSUM_INIT;
+	h = hash_bytes(h, globals.map.tiles,
+		       globals.map.tile_count*sizeof(map_tile_t));
+	h = hash_bytes(h, &globals.rnd, sizeof(random_state_t));
+	h = hash_uint(h, globals.game_tick);
+	h = hash_uint(h, globals.anim);
+	sum->map = h;
+
+	sum->serfs = hash_serfs();
+	sum->flags = hash_flags();
+	sum->buildings = hash_buildings();
+	sum->inventories = hash_inventories();
+	sum->players = hash_players();
+
+	h = CHECKSUM_INIT;
+	h = hash_bytes(h, sum, offsetof(state_checksum_t, total));
+	sum->total = h;
+}
+
+static int
+write_uint32(FILE *f, uint32_t value)
+{
+	/* Conversion is symmetric, so le32toh also converts to LE. */
+	uint32_t v = le32toh(value);
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -1;
+}
+
+static int
+write_uint64(FILE *f, uint64_t value)
+{
+	uint64_t v = le64toh(value);
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -1;
+}
+
+/* Open a checksum stream. A record is written to the stream every
+   interval game updates. The stream is a header of three 32 bit words
+   (magic, version, interval) followed by records of the update count
+   and game tick as 32 bit words and the fields of state_checksum_t as
+   64 bit words. All values are little endian. */
+int
+checksum_stream_open(const char *path, uint interval)
+{
+	if (interval == 0) return -1;
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) return -1;
+
+	if (write_uint32(f, CHECKSUM_STREAM_MAGIC) < 0 ||
+	    write_uint32(f, CHECKSUM_STREAM_VERSION) < 0 ||
+	    write_uint32(f, interval) < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	checksum_stream_close();
+
+	stream_file = f;
+	stream_interval = interval;
+	stream_updates = 0;
+
+	return 0;
+}
+
+void
+checksum_stream_close()
+{
+	if (stream_file != NULL) {
+		fclose(stream_file);
+		stream_file = NULL;
+	}
+}
+
+/* Count a game update and write a record if the interval was reached. */
+void
+checksum_stream_update()
+{
+	if (stream_file == NULL) return;
+
+	stream_updates += 1;
+	if (stream_updates % stream_interval != 0) return;
+
+	state_checksum_t sum;
+	checksum_game_state(&sum);
+
+	int r = 0;
+	r |= write_uint32(stream_file, stream_updates);
+	r |= write_uint32(stream_file, globals.game_tick);
+	r |= write_uint64(stream_file, sum.map);
+	r |= write_uint64(stream_file, sum.serfs);
+	r |= write_uint64(stream_file, sum.flags);
+	r |= write_uint64(stream_file, sum.buildings);
+	r |= write_uint64(stream_file, sum.inventories);
+	r |= write_uint64(stream_file, sum.players);
+	r |= write_uint64(stream_file, sum.total);
+
+	if (r < 0) {
+		LOGW("checksum", "Unable to write checksum stream.");
+		checksum_stream_close();
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * checksum.h - Checksums of the game state
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stdint.h>
+
+#include "misc.h"
+
+/* Checksum of each part of the game state. The total is computed
+   from all the parts. Search bookkeeping and other caches that do not
+   influence the game are not included, so two runs that only differ
+   in how they compute the game are expected to give the same checksum.
+   The checksum depends on the native byte order and struct layout, so
+   it can only be compared between runs on the same platform. */
+typedef struct {
+	uint64_t map;
+	uint64_t serfs;
+	uint64_t flags;
+	uint64_t buildings;
+	uint64_t inventories;
+	uint64_t players;
+	uint64_t total;
+} state_checksum_t;
+
+void checksum_game_state(state_checksum_t *sum);
+
+int checksum_stream_open(const char *path, uint interval);
+void checksum_stream_close();
+void checksum_stream_update();
+
+#endif /* ! _CHECKSUM_H */
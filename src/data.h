@@ -82,7 +82,8 @@
 
 /* undefined: 310-320 */
 
-#define DATA_GAME_OBJECT_BASE  320
+#define DATA_GAME_OBJECT_BASE   320
+#define DATA_GAME_OBJECT_COUNT  202
 
 /* undefined: 347-351,366,373-447 */
 /* undefined: 522-599 */
@@ -174,6 +175,7 @@
 /* undefined: 1188-1249 */
 
 #define DATA_MAP_OBJECT_BASE          1250
+#define DATA_MAP_OBJECT_COUNT         194
 #define DATA_MAP_OBJECT_FLAG          (DATA_MAP_OBJECT_BASE+128)
 #define DATA_MAP_OBJECT_CROSS         (DATA_MAP_OBJECT_BASE+144)
 #define DATA_MAP_OBJECT_CORNER_STONE  (DATA_MAP_OBJECT_BASE+145)
@@ -199,14 +201,17 @@
 /* undefined: 1806-1849 */
 
 #define DATA_SERF_ARMS_BASE   1850
+#define DATA_SERF_ARMS_COUNT  541
 
 /* undefined: 2391-2499 */
 
-#define DATA_SERF_TORSO_BASE  2500
+#define DATA_SERF_TORSO_BASE   2500
+#define DATA_SERF_TORSO_COUNT  541
 
 /* undefined: 3041-3149 */
 
 #define DATA_SERF_HEAD_BASE   3150
+#define DATA_SERF_HEAD_COUNT  630
 
 /* undefined: 3780-3879 */
 
@@ -27,28 +27,61 @@
 #include "player.h"
 #include "game.h"
 #include "globals.h"
-#include "list.h"
 #include "misc.h"
 
 #define SEARCH_MAX_DEPTH  0x10000
 
 
-typedef struct {
-	list_elm_t elm;
-	flag_t *flag;
-} flag_proxy_t;
+/* Queue of flag indices shared by all flag searches. Each flag is
+   queued at most once per search, so the queue never needs more room
+   than the maximum number of flags. */
+static int *search_queue = NULL;
+static uint search_queue_size = 0;
+static uint search_queue_head = 0;
+static uint search_queue_count = 0;
 
 
-static flag_proxy_t *
-flag_proxy_alloc(flag_t *flag)
+static void
+search_queue_reset()
 {
-	flag_proxy_t *proxy = malloc(sizeof(flag_proxy_t));
-	if (proxy == NULL) abort();
+	if (search_queue_size != globals.max_flg_cnt) {
+		free(search_queue);
 
-	proxy->flag = flag;
-	return proxy;
+		search_queue_size = globals.max_flg_cnt;
+		search_queue = malloc(search_queue_size*sizeof(int));
+		if (search_queue == NULL) abort();
+	}
+
+	search_queue_head = 0;
+	search_queue_count = 0;
+}
+
+static void
+search_queue_push(flag_t *flag)
+{
+	if (search_queue_count == search_queue_size) abort();
+
+	uint i = (search_queue_head + search_queue_count) % search_queue_size;
+	search_queue[i] = FLAG_INDEX(flag);
+	search_queue_count += 1;
+}
+
+static flag_t *
+search_queue_pop()
+{
+	flag_t *flag = game_get_flag(search_queue[search_queue_head]);
+	search_queue_head = (search_queue_head + 1) % search_queue_size;
+	search_queue_count -= 1;
+	return flag;
 }
 
+/* Current route generation for each player and route type. Cached
+   routes of a flag are valid when their generation matches the current
+   generation of the owner. */
+static uint route_gen[4][FLAG_ROUTE_TYPES];
+static uint route_counter = 0;
+
+
 static int
 next_search_id()
 {
@@ -72,32 +105,27 @@ next_search_id()
 void
 flag_search_init(flag_search_t *search)
 {
-	list_init(&search->queue);
+	search_queue_reset();
 	search->id = next_search_id();
 }
 
 void
 flag_search_add_source(flag_search_t *search, flag_t *flag)
 {
-	flag_proxy_t *flag_proxy = flag_proxy_alloc(flag);
-	list_append(&search->queue, (list_elm_t *)flag_proxy);
+	search_queue_push(flag);
 	flag->search_num = search->id;
 }
 
 int
 flag_search_execute(flag_search_t *search, flag_search_func *callback, int land, int transporter, void *data)
 {
-	for (int i = 0; i < SEARCH_MAX_DEPTH && !list_is_empty(&search->queue); i++) {
-		flag_proxy_t *proxy = (flag_proxy_t *)list_remove_head(&search->queue);
-		flag_t *flag = proxy->flag;
-		free(proxy);
+	for (int i = 0; i < SEARCH_MAX_DEPTH && search_queue_count > 0; i++) {
+		flag_t *flag = search_queue_pop();
 
 		int r = callback(flag, data);
 		if (r) {
 			/* Clean up */
-			while (!list_is_empty(&search->queue)) {
-				free(list_remove_head(&search->queue));
-			}
+			search_queue_count = 0;
 			return 0;
 		}
 
@@ -107,16 +135,13 @@ flag_search_execute(flag_search_t *search, flag_search_func *callback, int land,
 			    flag->other_endpoint.f[5-i]->search_num != search->id) {
 				flag->other_endpoint.f[5-i]->search_num = search->id;
 				flag->other_endpoint.f[5-i]->search_dir = flag->search_dir;
-				flag_proxy_t *other_flag_proxy = flag_proxy_alloc(flag->other_endpoint.f[5-i]);
-				list_append(&search->queue, (list_elm_t *)other_flag_proxy);
+				search_queue_push(flag->other_endpoint.f[5-i]);
 			}
 		}
 	}
 
 	/* Clean up */
-	while (!list_is_empty(&search->queue)) {
-		free(list_remove_head(&search->queue));
-	}
+	search_queue_count = 0;
 
 	return -1;
 }
@@ -131,6 +156,142 @@ flag_search_single(flag_t *src, flag_search_func *callback,
 	return flag_search_execute(&search, callback, land, transporter, data);
 }
 
+static int
+route_serf_search_cb(flag_t *flag, flag_t **dest)
+{
+	if (BIT_TEST(flag->bld_flags, 7)) { /* Has inventory */
+		*dest = flag;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+route_resource_search_cb(flag_t *flag, flag_t **dest)
+{
+	if (BIT_TEST(flag->bld2_flags, 7)) {
+		*dest = flag;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Search for the serf route from flag. The search is seeded with the
+   neighbouring flags in the same way as the search done by walking serfs,
+   so the direction found is the one those serfs would choose when walking
+   towards the inventory. */
+static void
+route_update_serf(flag_t *flag, flag_route_t *route)
+{
+	route->dir = -1;
+
+	if (BIT_TEST(flag->bld_flags, 7)) {
+		building_t *building = flag->other_endpoint.b[DIR_UP_LEFT];
+		route->inventory = building->flg_index;
+		return;
+	}
+
+	flag_search_t search;
+	flag_search_init(&search);
+	for (int i = 0; i < 6; i++) {
+		if (BIT_TEST(flag->endpoint, 5-i)) {
+			flag_t *other_flag = flag->other_endpoint.f[5-i];
+			other_flag->search_dir = 5-i;
+			flag_search_add_source(&search, other_flag);
+		}
+	}
+
+	flag_t *dest = NULL;
+	flag_search_execute(&search, (flag_search_func *)route_serf_search_cb,
+			    1, 0, &dest);
+	if (dest != NULL) {
+		building_t *building = dest->other_endpoint.b[DIR_UP_LEFT];
+		route->inventory = building->flg_index;
+		route->dir = dest->search_dir;
+	} else {
+		route->inventory = -1;
+	}
+}
+
+static void
+route_update_resource(flag_t *flag, flag_route_t *route)
+{
+	flag_t *dest = NULL;
+	flag_search_single(flag, (flag_search_func *)route_resource_search_cb,
+			   0, 1, &dest);
+
+	route->inventory = (dest != NULL) ? FLAG_INDEX(dest) : -1;
+	route->dir = -1;
+}
+
+/* Return the flag index of the inventory nearest to flag for the
+   route type, or -1 if no inventory can be reached. For serf routes
+   the direction of the first path to follow is returned in dir (-1 if
+   flag is itself the inventory). The route is only searched for if the
+   cached route was invalidated. */
+int
+flag_route_find_inventory(flag_t *flag, flag_route_type_t type, int *dir)
+{
+	flag_route_t *route = &flag->route[type];
+	uint gen = route_gen[FLAG_PLAYER(flag)][type];
+
+	if (route->gen != gen) {
+		if (type == FLAG_ROUTE_SERF) route_update_serf(flag, route);
+		else route_update_resource(flag, route);
+		route->gen = gen;
+	}
+
+	if (dir != NULL) *dir = route->dir;
+	return route->inventory;
+}
+
+/* Invalidate cached routes of type for all flags of the owner of flag.
+   Must be called when the paths or inventories that the route type
+   depends on are changed. */
+void
+flag_route_invalidate(flag_t *flag, flag_route_type_t type)
+{
+	route_counter += 1;
+
+	/* Reset all routes if the counter has overflown. */
+	if (route_counter == 0) {
+		flag_route_reset();
+		return;
+	}
+
+	route_gen[FLAG_PLAYER(flag)][type] = route_counter;
+}
+
+/* Invalidate all cached routes of the owner of flag. */
+void
+flag_route_invalidate_paths(flag_t *flag)
+{
+	for (int i = 0; i < FLAG_ROUTE_TYPES; i++) {
+		flag_route_invalidate(flag, i);
+	}
+}
+
+/* Invalidate all cached routes. Must be called when the flags are
+   replaced, e.g. when a game is loaded. */
+void
+flag_route_reset()
+{
+	route_counter = 1;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < FLAG_ROUTE_TYPES; j++) {
+			route_gen[i][j] = route_counter;
+		}
+	}
+
+	for (int i = 0; i < globals.max_flg_cnt; i++) {
+		for (int j = 0; j < FLAG_ROUTE_TYPES; j++) {
+			globals.flgs[i].route[j].gen = 0;
+		}
+	}
+}
+
 void
 flag_prioritize_pickup(flag_t *flag, dir_t dir, const int flag_prio[])
 {
@@ -23,7 +23,6 @@
 #define _FLAG_H
 
 #include "freeserf.h"
-#include "list.h"
 #include "map.h"
 
 #define FLAG_INDEX(ptr)  ((int)((ptr) - globals.flgs))
@@ -34,6 +33,22 @@
 
 typedef struct flag flag_t;
 
+/* Cached routes from a flag to the nearest inventory. Serf routes
+   follow land paths to inventories accepting serfs, resource routes
+   follow paths with transporters to inventories accepting resources. */
+typedef enum {
+	FLAG_ROUTE_SERF = 0,
+	FLAG_ROUTE_RESOURCE,
+
+	FLAG_ROUTE_TYPES
+} flag_route_type_t;
+
+typedef struct {
+	uint gen;
+	int inventory;
+	int dir;
+} flag_route_t;
+
 struct flag {
 	map_pos_t pos; /* ADDITION */
 	int search_num;
@@ -54,12 +69,14 @@ struct flag {
 	int stock1_prio;
 	int bld2_flags;
 	int stock2_prio;
+	flag_route_t route[FLAG_ROUTE_TYPES]; /* ADDITION */
 };
 
 typedef int flag_search_func(flag_t *flag, void *data);
 
+/* The search queue is shared, so only one search
+   can be in progress at a time. */
 typedef struct {
-	list_t queue;
 	int id;
 } flag_search_t;
 
@@ -70,6 +87,11 @@ int flag_search_execute(flag_search_t *search, flag_search_func *callback,
 int flag_search_single(flag_t *src, flag_search_func *callback,
 		       int land, int transporter, void *data);
 
+int flag_route_find_inventory(flag_t *flag, flag_route_type_t type, int *dir);
+void flag_route_invalidate(flag_t *flag, flag_route_type_t type);
+void flag_route_invalidate_paths(flag_t *flag);
+void flag_route_reset();
+
 void flag_prioritize_pickup(flag_t *flag, dir_t dir, const int flag_prio[]);
 void flag_cancel_transported_stock(flag_t *flag, int res);
 
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <math.h>
 #include <limits.h>
 #include <unistd.h>
@@ -47,6 +48,7 @@
 #include "viewport.h"
 #include "interface.h"
 #include "gfx.h"
+#include "atlas.h"
 #include "data.h"
 #include "sdl-video.h"
 #include "misc.h"
@@ -54,6 +56,8 @@
 #include "log.h"
 #include "audio.h"
 #include "savegame.h"
+#include "checksum.h"
+#include "profile.h"
 #include "version.h"
 
 /* TODO This file is one big of mess of all the things that should really
@@ -75,6 +79,12 @@ static unsigned int tick;
 
 static int game_loop_run;
 
+/* Run the game simulation without video, audio or input. */
+static int headless;
+
+/* Save games in the text format instead of binary snapshots. */
+static int save_text;
+
 static frame_t screen_frame;
 static frame_t cursor_buffer;
 
@@ -260,6 +270,14 @@ init_player_structs(player_t *p[])
 static void
 init_players_svga(player_t *p[])
 {
+	/* Setup screen frame */
+	frame_t *screen = sdl_get_screen_frame();
+	sdl_frame_init(&screen_frame, 0, 0, sdl_frame_get_width(screen),
+		       sdl_frame_get_height(screen), screen);
+
+	/* Setup cursor occlusion buffer */
+	sdl_frame_init(&cursor_buffer, 0, 0, 16, 16, NULL);
+
 	globals.frame = &screen_frame;
 	int width = sdl_frame_get_width(globals.frame);
 	int height = sdl_frame_get_height(globals.frame);
@@ -346,7 +364,7 @@ player_interface_init()
 	/* Mark player 2 inactive */
 	globals.player[1]->flags |= BIT(0);
 
-	init_players_svga(globals.player);
+	if (!headless) init_players_svga(globals.player);
 }
 
 static int
@@ -410,6 +428,13 @@ reset_game_objs()
 	globals.max_ever_serf_index = 0;
 	globals.max_ever_inventory_index = 0;
 
+	pool_reset(&globals.flg_pool);
+	pool_reset(&globals.building_pool);
+	pool_reset(&globals.serf_pool);
+	pool_reset(&globals.inventory_pool);
+
+	flag_route_reset();
+
 	/* Create NULL-serf */
 	serf_t *serf;
 	game_alloc_serf(&serf, NULL);
@@ -633,23 +658,22 @@ strreplace(char *target, const char *needle, char replace)
 	}
 }
 
+/* Build file name of a save game including time stamp. */
 static int
-save_game(int autosave)
+save_game_name(char *name, size_t size, int autosave)
 {
 	int r;
 
-	/* Build filename including time stamp. */
-	char name[128];
 	time_t t = time(NULL);
 
 	struct tm *tm = localtime(&t);
 	if (tm == NULL) return -1;
 
 	if (!autosave) {
-		r = strftime(name, sizeof(name), "%c.save", tm);
+		r = strftime(name, size, "%c.save", tm);
 		if (r == 0) return -1;
 	} else {
-		r = strftime(name, sizeof(name), "autosave-%c.save", tm);
+		r = strftime(name, size, "autosave-%c.save", tm);
 		if (r == 0) return -1;
 	}
 
@@ -659,13 +683,161 @@ save_game(int autosave)
 	/* TODO Possibly use PathCleanupSpec() when building for windows platform. */
 	strreplace(name, "\\/:*?\"<>| ", '_');
 
+	return 0;
+}
+
+/* Write snapshot to file and flush it to disk. */
+static int
+write_snapshot_file(const snapshot_t *snapshot, const char *name)
+{
 	FILE *f = fopen(name, "wb");
 	if (f == NULL) return -1;
 
-	r = save_text_state(f);
+	int r = snapshot_write(snapshot, f);
+	if (r == 0 && fflush(f) != 0) r = -1;
+#ifdef HAVE_FSYNC
+	if (r == 0 && fsync(fileno(f)) < 0) r = -1;
+#endif
+	if (fclose(f) != 0) r = -1;
+
+	return r;
+}
+
+/* Autosaves are written by a background thread so the game loop never
+   waits for the disk. The game loop only copies its state into a
+   snapshot and passes it to the thread. If the thread is still busy
+   when the next autosave is made, the pending snapshot is replaced. */
+static SDL_Thread *autosave_thread;
+static SDL_mutex *autosave_lock;
+static SDL_cond *autosave_cond;
+static snapshot_t *autosave_snapshot;
+static char autosave_name[128];
+static int autosave_quit;
+
+static int
+autosave_thread_main(void *data)
+{
+	SDL_LockMutex(autosave_lock);
+
+	while (1) {
+		while (autosave_snapshot == NULL && !autosave_quit) {
+			SDL_CondWait(autosave_cond, autosave_lock);
+		}
+
+		if (autosave_snapshot == NULL) break;
+
+		snapshot_t *snapshot = autosave_snapshot;
+		autosave_snapshot = NULL;
+
+		char name[sizeof(autosave_name)];
+		strcpy(name, autosave_name);
+
+		SDL_UnlockMutex(autosave_lock);
+
+		int r = write_snapshot_file(snapshot, name);
+		snapshot_free(snapshot);
+
+		if (r < 0) LOGW("main", "Autosave to `%s' failed.", name);
+		else LOGI("main", "Game saved to `%s'.", name);
+
+		SDL_LockMutex(autosave_lock);
+	}
+
+	SDL_UnlockMutex(autosave_lock);
+
+	return 0;
+}
+
+static int
+autosave_start()
+{
+	if (autosave_thread != NULL) return 0;
+
+	autosave_lock = SDL_CreateMutex();
+	autosave_cond = SDL_CreateCond();
+	if (autosave_lock == NULL || autosave_cond == NULL) goto error;
+
+	autosave_snapshot = NULL;
+	autosave_quit = 0;
+
+	autosave_thread = SDL_CreateThread(autosave_thread_main, NULL);
+	if (autosave_thread == NULL) goto error;
+
+	return 0;
+
+error:
+	LOGW("main", "Unable to start autosave thread: %s.", SDL_GetError());
+	if (autosave_cond != NULL) SDL_DestroyCond(autosave_cond);
+	if (autosave_lock != NULL) SDL_DestroyMutex(autosave_lock);
+	autosave_cond = NULL;
+	autosave_lock = NULL;
+	return -1;
+}
+
+/* Wait for pending autosaves and stop the thread. */
+static void
+autosave_stop()
+{
+	if (autosave_thread == NULL) return;
+
+	SDL_LockMutex(autosave_lock);
+	autosave_quit = 1;
+	SDL_CondSignal(autosave_cond);
+	SDL_UnlockMutex(autosave_lock);
+
+	SDL_WaitThread(autosave_thread, NULL);
+	autosave_thread = NULL;
+
+	SDL_DestroyCond(autosave_cond);
+	SDL_DestroyMutex(autosave_lock);
+	autosave_cond = NULL;
+	autosave_lock = NULL;
+}
+
+static void
+autosave_queue(snapshot_t *snapshot, const char *name)
+{
+	SDL_LockMutex(autosave_lock);
+
+	if (autosave_snapshot != NULL) {
+		LOGW("main", "Autosave to `%s' skipped.", autosave_name);
+		snapshot_free(autosave_snapshot);
+	}
+
+	autosave_snapshot = snapshot;
+	strncpy(autosave_name, name, sizeof(autosave_name));
+	autosave_name[sizeof(autosave_name)-1] = '\0';
+
+	SDL_CondSignal(autosave_cond);
+	SDL_UnlockMutex(autosave_lock);
+}
+
+static int
+save_game(int autosave)
+{
+	int r;
+
+	char name[128];
+	r = save_game_name(name, sizeof(name), autosave);
 	if (r < 0) return -1;
 
-	fclose(f);
+	/* Autosaves are written in the background. */
+	if (autosave && !save_text && autosave_start() == 0) {
+		autosave_queue(snapshot_create(), name);
+		return 0;
+	}
+
+	FILE *f = fopen(name, "wb");
+	if (f == NULL) return -1;
+
+	if (save_text) r = save_text_state(f);
+	else r = save_snapshot_state(f);
+
+	if (fclose(f) != 0) r = -1;
+	if (r < 0) {
+		LOGE("main", "Unable to save game to `%s'.", name);
+		return -1;
+	}
 
 	LOGI("main", "Game saved to `%s'.", name);
 
@@ -683,6 +855,9 @@ anim_update_and_more()
 	globals.anim = globals.game_tick >> 16;
 	globals.anim_diff = globals.anim - globals.old_anim;
 
+	/* The rest only updates the user interface. */
+	if (headless) return;
+
 	int anim_xor = globals.anim ^ globals.old_anim;
 
 	/* Viewport animation does not care about low bits in anim */
@@ -935,6 +1110,7 @@ start_game()
 	init_spiral_pos_pattern();
 	map_init();
 	map_init_minimap();
+	game_rebuild_caches();
 
 	reset_player_settings();
 
@@ -943,18 +1119,22 @@ start_game()
 }
 
 
+/* Run one fixed step of the game simulation. */
+static void
+update_game()
+{
+	update_game_tick();
+	anim_update_and_more();
+	game_update();
+	checksum_stream_update();
+}
+
 /* One iteration of game_loop(). */
 static void
 game_loop_iter()
 {
 	/* TODO music and sound effects */
 
-	anim_update_and_more();
-
-	/* TODO ... */
-
-	game_update();
-
 	/* TODO ... */
 
 	handle_player_inputs();
@@ -965,18 +1145,17 @@ game_loop_iter()
 
 	/* TODO */
 
+	/* Redrawn interface objects mark their area dirty. */
 	gui_object_redraw((gui_object_t *)&interface, globals.frame);
 
-	/* TODO very crude dirty marking algortihm: mark everything. */
-	sdl_mark_dirty(0, 0, sdl_frame_get_width(globals.frame),
-		       sdl_frame_get_height(globals.frame));
-
 	/* ADDITIONS */
 
 	/* Mouse cursor */
 	gfx_draw_transp_sprite(globals.player[0]->pointer_x-8,
 			       globals.player[0]->pointer_y-8,
 			       DATA_CURSOR, sdl_get_screen_frame());
+	sdl_mark_dirty(globals.player[0]->pointer_x-8,
+		       globals.player[0]->pointer_y-8, 16, 16);
 
 #if 0
 	draw_green_string(2, 316, sdl_get_screen_frame(), "Col:");
@@ -1000,6 +1179,11 @@ game_loop_iter()
 /* The length of a game tick in miliseconds. */
 #define TICK_LENGTH  20
 
+/* Maximum number of game ticks run before the next frame when the
+   game falls behind. The remaining time is dropped, so the game
+   slows down instead of running ever longer bursts of ticks. */
+#define MAX_TICKS_PER_FRAME  5
+
 /* How fast consequtive mouse events need to be generated
    in order to be interpreted as click and double click. */
 #define MOUSE_SENSITIVITY  600
@@ -1101,6 +1285,8 @@ game_loop()
 						/* Undraw cursor */
 						sdl_draw_frame(globals.player[0]->pointer_x-8, globals.player[0]->pointer_y-8,
 							       sdl_get_screen_frame(), 0, 0, &cursor_buffer, 16, 16);
+						sdl_mark_dirty(globals.player[0]->pointer_x-8,
+							       globals.player[0]->pointer_y-8, 16, 16);
 
 						globals.player[0]->pointer_x = min(max(0, event.motion.x), globals.player[0]->pointer_x_max);
 						globals.player[0]->pointer_y = min(max(0, event.motion.y), globals.player[0]->pointer_y_max);
@@ -1216,6 +1402,10 @@ game_loop()
 				case SDLK_g:
 					viewport.layers ^= VIEWPORT_LAYER_GRID;
 					break;
+				case SDLK_F9:
+					profile_enable(!profile_is_enabled());
+					sdl_log_sprite_cache_stats();
+					break;
 				case SDLK_j: {
 					int current = 0;
 					for (int i = 0; i < 4; i++) {
@@ -1255,12 +1445,21 @@ game_loop()
 		current_ticks = new_ticks;
 
 		accum += delta_ticks;
+		int frame_ticks = 0;
 		while (accum >= TICK_LENGTH) {
+			if (frame_ticks == MAX_TICKS_PER_FRAME) {
+				LOGV("main", "Dropped %u ms of game time.",
+				     accum - accum % TICK_LENGTH);
+				accum %= TICK_LENGTH;
+				break;
+			}
+
 			/* This is main_timer_cb */
 			tick += 1;
+			frame_ticks += 1;
 			/* In original, deep_tree is called which will call update_game.
 			   Here, update_game is just called directly. */
-			update_game_tick();
+			update_game();
 
 			/* FPS */
 			fps = 1000*((float)accum_frames / accum);
@@ -1288,16 +1487,44 @@ game_loop()
 	}
 }
 
+/* Run the game for a number of ticks as fast as possible
+   and report the simulation speed and final state. */
+static void
+run_headless(uint ticks)
+{
+	uint64_t start = profile_time();
+
+	for (uint i = 0; i < ticks; i++) {
+		tick += 1;
+		update_game();
+	}
+
+	double secs = (profile_time() - start) / 1e9;
+
+	state_checksum_t sum;
+	checksum_game_state(&sum);
+
+	printf("ticks: %u\n", ticks);
+	printf("seconds: %.3f\n", secs);
+	printf("ticks/sec: %.1f\n", secs > 0 ? ticks / secs : 0);
+	printf("state hash: %016" PRIx64 "\n", sum.total);
+}
+
+/* Load the game state from path in any of the save game formats. */
 static int
-load_game(const char *path)
+load_game_state(const char *path)
 {
+	/* Try the binary snapshot format first. */
+	int r = load_snapshot_state(path);
+	if (r == 0) return 0;
+
 	FILE *f = fopen(path, "rb");
 	if (f == NULL) {
 		LOGE("main", "Unable to open save game file: `%s'.", path);
 		return -1;
 	}
 
-	int r = load_text_state(f);
+	r = load_text_state(f);
 	if (r < 0) {
 		LOGW("main", "Unable to load save game, trying compatability mode.");
 
@@ -1312,8 +1539,18 @@ load_game(const char *path)
 
 	fclose(f);
 
+	return 0;
+}
+
+static int
+load_game(const char *path)
+{
+	int r = load_game_state(path);
+	if (r < 0) return -1;
+
 	init_spiral_pos_pattern();
 	map_init_minimap();
+	game_rebuild_caches();
 
 	return 0;
 }
@@ -1375,8 +1612,9 @@ allocate_global_memory()
 	globals.max_building_cnt = (0x54c * (1 << max_map_size) - 4) / 0x91;
 	globals.max_inventory_cnt = (0x54c * (1 << max_map_size) - 4) / 0x3c1;
 
-	/* Serfs */
-	globals.serfs = malloc(globals.max_serf_cnt * sizeof(serf_t));
+	/* Serfs. Cleared so the parts of the state data a serf has not
+	   written are the same in every run, as game checksums hash them. */
+	globals.serfs = calloc(globals.max_serf_cnt, sizeof(serf_t));
 	if (globals.serfs == NULL) abort();
 
 	globals.serfs_bitmap = malloc(((globals.max_serf_cnt-1) / 8) + 1);
@@ -1403,13 +1641,14 @@ allocate_global_memory()
 	globals.inventories_bitmap = malloc(((globals.max_inventory_cnt-1) / 8) + 1);
 	if (globals.inventories_bitmap == NULL) abort();
 
-	/* Setup screen frame */
-	frame_t *screen = sdl_get_screen_frame();
-	sdl_frame_init(&screen_frame, 0, 0, sdl_frame_get_width(screen),
-		       sdl_frame_get_height(screen), screen);
-
-	/* Setup cursor occlusion buffer */
-	sdl_frame_init(&cursor_buffer, 0, 0, 16, 16, NULL);
+	pool_init(&globals.serf_pool, globals.serfs_bitmap,
+		  globals.max_serf_cnt, &globals.max_ever_serf_index);
+	pool_init(&globals.flg_pool, globals.flg_bitmap,
+		  globals.max_flg_cnt, &globals.max_ever_flag_index);
+	pool_init(&globals.building_pool, globals.buildings_bitmap,
+		  globals.max_building_cnt, &globals.max_ever_building_index);
+	pool_init(&globals.inventory_pool, globals.inventories_bitmap,
+		  globals.max_inventory_cnt, &globals.max_ever_inventory_index);
 }
 
 /* Initialize interface configuration. */
@@ -1419,7 +1658,7 @@ init_global_config()
 	/* TODO load saved configuration */
 	globals.cfg_left = 0x39;
 	globals.cfg_right = 0x39;
-	audio_set_volume(75);
+	if (!headless) audio_set_volume(75);
 }
 
 #define MAX_DATA_PATH      1024
@@ -1483,15 +1722,23 @@ load_data_file(const char *path)
 	"Usage: %s [-g DATA-FILE]\n"
 #define HELP							\
 	USAGE							\
+	" -b\t\tBenchmark sprite unpacking and exit\n"		\
+	" -c FILE\tWrite game state checksums to FILE\n"		\
+	" -C MB\t\tMemory limit of sprite cache (default 64)\n"	\
 	" -d NUM\t\tSet debug output level\n"			\
 	" -f\t\tFullscreen mode (CTRL-q to exit)\n"		\
 	" -g DATA-FILE\tUse specified data file\n"		\
 	" -h\t\tShow this help text\n"				\
+	" -i NUM\t\tGame updates between checksums (default 100)\n"	\
 	" -l FILE\tLoad saved game\n"				\
+	" -L MB\t\tMemory limit of landscape cache (default 32)\n"	\
 	" -m MAP\t\tSelect world map (1-3)\n"			\
 	" -p\t\tPreserve map bugs of the original game\n"	\
+	" -P FILE\tProfile game updates and write CSV to FILE\n"	\
 	" -r RES\t\tSet display resolution (e.g. 800x600)\n"	\
-	" -t GEN\t\tMap generator (0 or 1)\n"
+	" -s TICKS\tRun TICKS game ticks without video and exit\n"	\
+	" -t GEN\t\tMap generator (0 or 1)\n"		\
+	" -T\t\tSave games in the text format\n"
 
 int
 main(int argc, char *argv[])
@@ -1507,15 +1754,31 @@ main(int argc, char *argv[])
 	int game_map = 1;
 	int map_generator = 0;
 	int preserve_map_bugs = 0;
+	uint headless_ticks = 0;
+	char *checksum_file = NULL;
+	char *profile_file = NULL;
+	uint checksum_interval = 100;
+	int benchmark = 0;
 
 	int log_level = DEFAULT_LOG_LEVEL;
 
 	int opt;
 	while (1) {
-		opt = getopt(argc, argv, "d:fg:hl:m:pr:t:");
+		opt = getopt(argc, argv, "bc:C:d:fg:hi:l:L:m:pP:r:s:t:T");
 		if (opt < 0) break;
 
 		switch (opt) {
+		case 'b':
+			benchmark = 1;
+			break;
+		case 'c':
+			checksum_file = malloc(strlen(optarg)+1);
+			if (checksum_file == NULL) exit(EXIT_FAILURE);
+			strcpy(checksum_file, optarg);
+			break;
+		case 'C':
+			sdl_set_sprite_cache_limit((size_t)atoi(optarg)*1024*1024);
+			break;
 		case 'd':
 		{
 			int d = atoi(optarg);
@@ -1536,17 +1799,28 @@ main(int argc, char *argv[])
 			fprintf(stdout, HELP, argv[0]);
 			exit(EXIT_SUCCESS);
 			break;
+		case 'i':
+			checksum_interval = atoi(optarg);
+			break;
 		case 'l':
 			save_file = malloc(strlen(optarg)+1);
 			if (save_file == NULL) exit(EXIT_FAILURE);
 			strcpy(save_file, optarg);
 			break;
+		case 'L':
+			viewport_set_landscape_cache_limit((size_t)atoi(optarg)*1024*1024);
+			break;
 		case 'm':
 			game_map = atoi(optarg);
 			break;
 		case 'p':
 			preserve_map_bugs = 1;
 			break;
+		case 'P':
+			profile_file = malloc(strlen(optarg)+1);
+			if (profile_file == NULL) exit(EXIT_FAILURE);
+			strcpy(profile_file, optarg);
+			break;
 		case 'r':
 		{
 			char *hstr = strchr(optarg, 'x');
@@ -1558,9 +1832,16 @@ main(int argc, char *argv[])
 			screen_height = atoi(hstr+1);
 		}
 			break;
+		case 's':
+			headless = 1;
+			headless_ticks = atoi(optarg);
+			break;
 		case 't':
 			map_generator = atoi(optarg);
 			break;
+		case 'T':
+			save_text = 1;
+			break;
 		default:
 			fprintf(stderr, USAGE, argv[0]);
 			exit(EXIT_FAILURE);
@@ -1584,21 +1865,34 @@ main(int argc, char *argv[])
 
 	gfx_data_fixup();
 
-	LOGI("main", "SDL init...");
+	if (benchmark) {
+		r = gfx_benchmark();
+		gfx_unload();
+		return (r < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!headless) {
+		atlas_load(gfx_get_data_path());
 
-	r = sdl_init();
-	if (r < 0) exit(EXIT_FAILURE);
+		LOGI("main", "SDL init...");
 
-	/* TODO move to right place */
-	midi_play_track(MIDI_TRACK_0);
+		r = sdl_init();
+		if (r < 0) exit(EXIT_FAILURE);
 
-	/*gfx_set_palette(DATA_PALETTE_INTRO);*/
-	gfx_set_palette(DATA_PALETTE_GAME);
+		/* TODO move to right place */
+		midi_play_track(MIDI_TRACK_0);
 
-	LOGI("main", "SDL resolution %ix%i...", screen_width, screen_height);
+		/*gfx_set_palette(DATA_PALETTE_INTRO);*/
+		gfx_set_palette(DATA_PALETTE_GAME);
 
-	r = sdl_set_resolution(screen_width, screen_height, fullscreen);
-	if (r < 0) exit(EXIT_FAILURE);
+		LOGI("main", "SDL resolution %ix%i...",
+		     screen_width, screen_height);
+
+		r = sdl_set_resolution(screen_width, screen_height, fullscreen);
+		if (r < 0) exit(EXIT_FAILURE);
+	} else {
+		sfx_enable(0);
+	}
 
 	globals.svga |= BIT(7); /* set svga mode */
 
@@ -1625,6 +1919,38 @@ main(int argc, char *argv[])
 		start_game();
 	}
 
+	if (checksum_file != NULL) {
+		int r = checksum_stream_open(checksum_file, checksum_interval);
+		if (r < 0) {
+			LOGE("main", "Unable to open checksum file: `%s'.",
+			     checksum_file);
+			exit(EXIT_FAILURE);
+		}
+		free(checksum_file);
+	}
+
+	FILE *profile_csv = NULL;
+	if (profile_file != NULL) {
+		profile_csv = fopen(profile_file, "w");
+		if (profile_csv == NULL) {
+			LOGE("main", "Unable to open profile file: `%s'.",
+			     profile_file);
+			exit(EXIT_FAILURE);
+		}
+		free(profile_file);
+
+		profile_set_csv_file(profile_csv);
+		profile_enable(1);
+	}
+
+	if (headless) {
+		run_headless(headless_ticks);
+		if (profile_csv != NULL) fclose(profile_csv);
+		checksum_stream_close();
+		gfx_unload();
+		return EXIT_SUCCESS;
+	}
+
 	/* Move viewport to initial position */
 	map_pos_t init_pos = MAP_POS(globals.player_sett[0]->map_cursor_col,
 				     globals.player_sett[0]->map_cursor_row);
@@ -1636,8 +1962,12 @@ main(int argc, char *argv[])
 	LOGI("main", "Cleaning up...");
 
 	/* Clean up */
+	checksum_stream_close();
+	if (profile_csv != NULL) fclose(profile_csv);
+	autosave_stop();
 	audio_cleanup();
 	sdl_deinit();
+	atlas_unload();
 	gfx_unload();
 
 	return EXIT_SUCCESS;
@@ -33,53 +33,39 @@
 #include "building.h"
 #include "globals.h"
 #include "random.h"
+#include "profile.h"
 #include "log.h"
 #include "debug.h"
 
-#define GROUND_ANALYSIS_RADIUS  25
-
 
 /* Allocate and initialize a new flag_t object.
    Return -1 if no more flags can be allocated, otherwise 0. */
 int
 game_alloc_flag(flag_t **flag, int *index)
 {
-	for (int i = 0; i*8 < globals.max_flg_cnt; i++) {
-		if (globals.flg_bitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (!BIT_TEST(globals.flg_bitmap[i], 7-j)) {
-					int ix = 8*i + j;
-					if (ix >= globals.max_flg_cnt) return -1; /* TODO looks unneccesary */
-
-					globals.flg_bitmap[i] |= BIT(7-j);
-
-					if (ix == globals.max_ever_flag_index) globals.max_ever_flag_index += 1;
-
-					flag_t *f = &globals.flgs[ix];
-					f->pos = 0;
-					f->search_num = 0;
-					f->search_dir = 0;
-					f->path_con = 0;
-					f->endpoint = 0;
-					f->transporter = 0;
-					memset(&f->length, 0, sizeof(f->length));
-					memset(&f->res_waiting, 0, sizeof(f->res_waiting));
-					f->bld_flags = 0;
-					f->stock1_prio = 0;
-					f->bld2_flags = 0;
-					f->stock2_prio = 0;
-					memset(&f->other_end_dir, 0, sizeof(f->other_end_dir));
-
-					if (flag != NULL) *flag = f;
-					if (index != NULL) *index = ix;
-
-					return 0;
-				}
-			}
-		}
-	}
+	int ix = pool_alloc(&globals.flg_pool);
+	if (ix < 0) return -1;
+
+	flag_t *f = &globals.flgs[ix];
+	f->pos = 0;
+	f->search_num = 0;
+	f->search_dir = 0;
+	f->path_con = 0;
+	f->endpoint = 0;
+	f->transporter = 0;
+	memset(&f->length, 0, sizeof(f->length));
+	memset(&f->res_waiting, 0, sizeof(f->res_waiting));
+	f->bld_flags = 0;
+	f->stock1_prio = 0;
+	f->bld2_flags = 0;
+	f->stock2_prio = 0;
+	memset(&f->other_end_dir, 0, sizeof(f->other_end_dir));
+	memset(&f->route, 0, sizeof(f->route));
+
+	if (flag != NULL) *flag = f;
+	if (index != NULL) *index = ix;
 
-	return -1;
+	return 0;
 }
 
 /* Return flag_t object with index. */
@@ -95,16 +81,7 @@ game_get_flag(int index)
 void
 game_free_flag(int index)
 {
-	/* Remove flag from allocation bitmap. */
-	globals.flg_bitmap[index/8] &= ~BIT(7-(index&7));
-
-	/* Decrement max_ever_flag_index as much as possible. */
-	if (index == globals.max_ever_flag_index + 1) {
-		while (--globals.max_ever_flag_index > 0) {
-			index -= 1;
-			if (FLAG_ALLOCATED(index)) break;
-		}
-	}
+	pool_free(&globals.flg_pool, index);
 }
 
 /* Allocate and initialize a new building_t object.
@@ -112,36 +89,21 @@ game_free_flag(int index)
 int
 game_alloc_building(building_t **building, int *index)
 {
-	for (int i = 0; i*8 < globals.max_building_cnt; i++) {
-		if (globals.buildings_bitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (!BIT_TEST(globals.buildings_bitmap[i], 7-j)) {
-					int ix = 8*i + j;
-
-					if (ix >= globals.max_building_cnt) return -1; /* TODO looks unneccesary */
-
-					globals.buildings_bitmap[i] |= BIT(7-j);
-
-					if (ix == globals.max_ever_building_index) globals.max_ever_building_index += 1;
-
-					building_t *b = &globals.buildings[ix];
-					b->bld = 0;
-					b->flg_index = 0;
-					b->serf = 0;
-					b->stock1 = 0;
-					b->stock2 = 0;
-					b->serf_index = 0;
+	int ix = pool_alloc(&globals.building_pool);
+	if (ix < 0) return -1;
 
-					if (building != NULL) *building = b;
-					if (index != NULL) *index = ix;
+	building_t *b = &globals.buildings[ix];
+	b->bld = 0;
+	b->flg_index = 0;
+	b->serf = 0;
+	b->stock1 = 0;
+	b->stock2 = 0;
+	b->serf_index = 0;
 
-					return 0;
-				}
-			}
-		}
-	}
+	if (building != NULL) *building = b;
+	if (index != NULL) *index = ix;
 
-	return -1;
+	return 0;
 }
 
 /* Return building_t object with index. */
@@ -157,16 +119,8 @@ game_get_building(int index)
 void
 game_free_building(int index)
 {
-	/* Remove building from allocation bitmap. */
-	globals.buildings_bitmap[index/8] &= ~BIT(7-(index&7));
-
-	/* Decrement max_ever_building_index as much as possible. */
-	if (index == globals.max_ever_building_index + 1) {
-		while (--globals.max_ever_building_index > 0) {
-			index -= 1;
-			if (BUILDING_ALLOCATED(index)) break;
-		}
-	}
+	building_index_remove(index);
+	pool_free(&globals.building_pool, index);
 }
 
 /* Allocate and initialize a new inventory_t object.
@@ -174,34 +128,19 @@ game_free_building(int index)
 int
 game_alloc_inventory(inventory_t **inventory, int *index)
 {
-	for (int i = 0; i*8 < globals.max_inventory_cnt; i++) {
-		if (globals.inventories_bitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (!BIT_TEST(globals.inventories_bitmap[i], 7-j)) {
-					int ix = 8*i + j;
-
-					if (ix >= globals.max_inventory_cnt) return -1; /* TODO looks unneccesary */
+	int ix = pool_alloc(&globals.inventory_pool);
+	if (ix < 0) return -1;
 
-					globals.inventories_bitmap[i] |= BIT(7-j);
+	inventory_t *iv = &globals.inventories[ix];
+	memset(iv, 0, sizeof(inventory_t));
 
-					if (ix == globals.max_ever_inventory_index) globals.max_ever_inventory_index += 1;
+	iv->out_queue[0] = -1;
+	iv->out_queue[1] = -1;
 
-					inventory_t *iv = &globals.inventories[ix];
-					memset(iv, 0, sizeof(inventory_t));
+	if (inventory != NULL) *inventory = iv;
+	if (index != NULL) *index = ix;
 
-					iv->out_queue[0] = -1;
-					iv->out_queue[1] = -1;
-
-					if (inventory != NULL) *inventory = iv;
-					if (index != NULL) *index = ix;
-
-					return 0;
-				}
-			}
-		}
-	}
-
-	return -1;
+	return 0;
 }
 
 /* Return inventory_t object with index. */
@@ -217,16 +156,7 @@ game_get_inventory(int index)
 void
 game_free_inventory(int index)
 {
-	/* Remove inventory from allocation bitmap. */
-	globals.inventories_bitmap[index/8] &= ~BIT(7-(index&7));
-
-	/* Decrement max_ever_inventory_index as much as possible. */
-	if (index == globals.max_ever_inventory_index + 1) {
-		while (--globals.max_ever_inventory_index > 0) {
-			index -= 1;
-			if (INVENTORY_ALLOCATED(index)) break;
-		}
-	}
+	pool_free(&globals.inventory_pool, index);
 }
 
 /* Allocate and initialize a new serf_t object.
@@ -234,30 +164,15 @@ game_free_inventory(int index)
 int
 game_alloc_serf(serf_t **serf, int *index)
 {
-	for (int i = 0; i*8 < globals.max_serf_cnt; i++) {
-		if (globals.serfs_bitmap[i] != 0xff) {
-			for (int j = 0; j < 8; j++) {
-				if (!BIT_TEST(globals.serfs_bitmap[i], 7-j)) {
-					int ix = 8*i + j;
-
-					if (ix >= globals.max_serf_cnt) return -1; /* TODO looks unneccesary */
-
-					globals.serfs_bitmap[i] |= BIT(7-j);
+	int ix = pool_alloc(&globals.serf_pool);
+	if (ix < 0) return -1;
 
-					if (ix == globals.max_ever_serf_index) globals.max_ever_serf_index += 1;
+	serf_t *s = &globals.serfs[ix];
 
-					serf_t *s = &globals.serfs[ix];
+	if (serf != NULL) *serf = s;
+	if (index != NULL) *index = ix;
 
-					if (serf != NULL) *serf = s;
-					if (index != NULL) *index = ix;
-
-					return 0;
-				}
-			}
-		}
-	}
-
-	return -1;
+	return 0;
 }
 
 /* Return serf_t object with index. */
@@ -273,16 +188,8 @@ game_get_serf(int index)
 void
 game_free_serf(int index)
 {
-	/* Remove serf from allocation bitmap. */
-	globals.serfs_bitmap[index/8] &= ~BIT(7-(index&7));
-
-	/* Decrement max_ever_serf_index as much as possible. */
-	if (index == globals.max_ever_serf_index + 1) {
-		while (--globals.max_ever_serf_index > 0) {
-			index -= 1;
-			if (SERF_ALLOCATED(index)) break;
-		}
-	}
+	serf_index_remove(index);
+	pool_free(&globals.serf_pool, index);
 
 	globals.map_max_serfs_left += 1;
 }
@@ -336,9 +243,9 @@ game_spawn_serf(player_sett_t *sett, serf_t **serf, inventory_t **inventory, int
 	s->type = (SERF_GENERIC << 2) | sett->player_num;
 	s->animation = 0;
 	s->counter = 0;
-	s->pos = building->pos;
+	serf_set_pos(s, building->pos);
 	s->anim = globals.anim;
-	s->state = SERF_STATE_IDLE_IN_STOCK;
+	serf_set_state(s, SERF_STATE_IDLE_IN_STOCK);
 	s->s.idle_in_stock.inv_index = INVENTORY_INDEX(inv);
 
 	if (serf) *serf = s;
@@ -418,19 +325,16 @@ check_win_and_flags_buildings()
 	/* TODO */
 
 	/* TODO Approximately right */
-	for (int i = 1; i < globals.max_ever_building_index; i++) {
-		if (BUILDING_ALLOCATED(i)) {
-			building_t *building = game_get_building(i);
-			building->serf &= ~BIT(2);
-		}
+	int i;
+	pool_foreach_from(&globals.building_pool, i, 1) {
+		building_t *building = game_get_building(i);
+		building->serf &= ~BIT(2);
 	}
 
 	/* TODO Approximately right */
-	for (int i = 1; i < globals.max_ever_flag_index; i++) {
-		if (FLAG_ALLOCATED(i)) {
-			flag_t *flag = game_get_flag(i);
-			flag->transporter &= ~BIT(7);
-		}
+	pool_foreach_from(&globals.flg_pool, i, 1) {
+		flag_t *flag = game_get_flag(i);
+		flag->transporter &= ~BIT(7);
 	}
 }
 
@@ -810,34 +714,19 @@ send_serf_to_road(flag_t *src, dir_t dir, int water)
 	serf_t *serf = game_get_serf(serf_index);
 
 	serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-	serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+	serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 	serf->s.ready_to_leave_inventory.mode = dir;
-	serf->s.ready_to_leave_inventory.dest = FLAG_INDEX(src);
+	serf_set_dest(serf, FLAG_INDEX(src));
 	serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inventory);
 
 	return 0;
 }
 
-static int
-find_nearest_inventory_search_cb(flag_t *flag, flag_t **dest)
-{
-	if (BIT_TEST(flag->bld2_flags, 7)) {
-		*dest = flag;
-		return 1;
-	}
-	return 0;
-}
-
 /* Return the flag index of the inventory nearest to flag. */
 static int
 find_nearest_inventory(flag_t *flag)
 {
-	flag_t *dest = NULL;
-	flag_search_single(flag, (flag_search_func *)find_nearest_inventory_search_cb,
-			   0, 1, &dest);
-	if (dest != NULL) return FLAG_INDEX(dest);
-
-	return -1;
+	return flag_route_find_inventory(flag, FLAG_ROUTE_RESOURCE, NULL);
 }
 
 typedef struct {
@@ -919,46 +808,62 @@ update_flags()
 	if (globals.next_index >= 32) return;
 
 	int index = globals.next_index << 5;
-	for (int i = index ? index : 1; i < globals.max_ever_flag_index; i++) {
-		if (FLAG_ALLOCATED(i)) {
-			flag_t *flag = game_get_flag(i);
-
-			for (int j = 0; j < 4; j++) globals.field_218[j] = 0;
-
-			for (int j = 0; j < 8; j++) {
-				int res_dir = (flag->res_waiting[j] >> 5) - 1;
-				if (res_dir >= 0) {
-					for (int k = 3; k >= 0; k--) {
-						if (!BIT_TEST(globals.field_218[k], res_dir)) {
-							globals.field_218[k] |= BIT(res_dir);
-							break;
-						}
+	int i;
+	pool_foreach_from(&globals.flg_pool, i, index ? index : 1) {
+		flag_t *flag = game_get_flag(i);
+
+		for (int j = 0; j < 4; j++) globals.field_218[j] = 0;
+
+		for (int j = 0; j < 8; j++) {
+			int res_dir = (flag->res_waiting[j] >> 5) - 1;
+			if (res_dir >= 0) {
+				for (int k = 3; k >= 0; k--) {
+					if (!BIT_TEST(globals.field_218[k], res_dir)) {
+						globals.field_218[k] |= BIT(res_dir);
+						break;
 					}
 				}
 			}
+		}
 
-			globals.field_24E = 0;
+		globals.field_24E = 0;
 
-			if (BIT_TEST(flag->endpoint, 7)) { /* Resources waiting */
-				flag->endpoint &= ~BIT(7);
-				for (int slot = 7; slot >= 0; slot--) {
-					if (flag->res_waiting[slot] != 0) {
-						globals.field_24E += 1;
+		if (BIT_TEST(flag->endpoint, 7)) { /* Resources waiting */
+			flag->endpoint &= ~BIT(7);
+			for (int slot = 7; slot >= 0; slot--) {
+				if (flag->res_waiting[slot] != 0) {
+					globals.field_24E += 1;
 
-						/* Only schedule the slot if it has not already
-						   been scheduled for fetch. */
-						if (((flag->res_waiting[slot] >> 5) & 7) == 0) {
-							if (flag->res_dest[slot] != 0) { /* Destination is known */
-								flag_search_t search;
-								flag_search_init(&search);
+					/* Only schedule the slot if it has not already
+					   been scheduled for fetch. */
+					if (((flag->res_waiting[slot] >> 5) & 7) == 0) {
+						if (flag->res_dest[slot] != 0) { /* Destination is known */
+							flag_search_t search;
+							flag_search_init(&search);
+
+							flag->search_num = search.id;
+							flag->search_dir = 6;
+							int tr = flag->transporter & 0x3f;
 
-								flag->search_num = search.id;
-								flag->search_dir = 6;
-								int tr = flag->transporter & 0x3f;
+							int sources = 0;
+							int flags = (globals.field_218[3] ^ 0x3f) & flag->transporter;
+							if (flags != 0) {
+								for (int k = 0; k < 6; k++) {
+									if (BIT_TEST(flags, 5-k)) {
+										tr &= ~BIT(5-k);
+										flag_t *other_flag = flag->other_endpoint.f[5-k];
+										if (other_flag->search_num != search.id) {
+											other_flag->search_dir = 5-k;
+											flag_search_add_source(&search, other_flag);
+											sources += 1;
+										}
+									}
+								}
+							}
 
-								int sources = 0;
-								int flags = (globals.field_218[3] ^ 0x3f) & flag->transporter;
-								if (flags != 0) {
+							if (tr != 0) {
+								for (int j = 0; j < 3; j++) {
+									flags = (globals.field_218[3-j] ^ globals.field_218[2-j]);
 									for (int k = 0; k < 6; k++) {
 										if (BIT_TEST(flags, 5-k)) {
 											tr &= ~BIT(5-k);
@@ -973,97 +878,72 @@ update_flags()
 								}
 
 								if (tr != 0) {
-									for (int j = 0; j < 3; j++) {
-										flags = (globals.field_218[3-j] ^ globals.field_218[2-j]);
-										for (int k = 0; k < 6; k++) {
-											if (BIT_TEST(flags, 5-k)) {
-												tr &= ~BIT(5-k);
-												flag_t *other_flag = flag->other_endpoint.f[5-k];
-												if (other_flag->search_num != search.id) {
-													other_flag->search_dir = 5-k;
-													flag_search_add_source(&search, other_flag);
-													sources += 1;
-												}
-											}
-										}
-									}
-
-									if (tr != 0) {
-										flags = globals.field_218[0];
-										for (int k = 0; k < 6; k++) {
-											if (BIT_TEST(flags, 5-k)) {
-												tr &= ~BIT(5-k);
-												flag_t *other_flag = flag->other_endpoint.f[5-k];
-												if (other_flag->search_num != search.id) {
-													other_flag->search_dir = 5-k;
-													flag_search_add_source(&search, other_flag);
-													sources += 1;
-												}
+									flags = globals.field_218[0];
+									for (int k = 0; k < 6; k++) {
+										if (BIT_TEST(flags, 5-k)) {
+											tr &= ~BIT(5-k);
+											flag_t *other_flag = flag->other_endpoint.f[5-k];
+											if (other_flag->search_num != search.id) {
+												other_flag->search_dir = 5-k;
+												flag_search_add_source(&search, other_flag);
+												sources += 1;
 											}
 										}
-										if (flags == 0) return;
 									}
+									if (flags == 0) return;
 								}
+							}
 
-								if (sources > 0) {
-									update_flags_search_data_t data;
-									data.src = flag;
-									data.dest = game_get_flag(flag->res_dest[slot]);
-									data.res = slot;
-									int r = flag_search_execute(&search,
-												    (flag_search_func *)update_flags_search_cb,
-												    0, 1, &data);
-									if (r < 0 || data.dest->search_dir == 6) {
-										LOGD("game", "update flags: unable to deliver.");
-										flag_cancel_transported_stock(data.dest, flag->res_waiting[slot] & 0x1f);
-										flag->res_dest[slot] = 0;
-										flag->endpoint |= BIT(7);
-									}
-								} else {
+							if (sources > 0) {
+								update_flags_search_data_t data;
+								data.src = flag;
+								data.dest = game_get_flag(flag->res_dest[slot]);
+								data.res = slot;
+								int r = flag_search_execute(&search,
+											    (flag_search_func *)update_flags_search_cb,
+											    0, 1, &data);
+								if (r < 0 || data.dest->search_dir == 6) {
+									LOGD("game", "update flags: unable to deliver.");
+									flag_cancel_transported_stock(data.dest, flag->res_waiting[slot] & 0x1f);
+									flag->res_dest[slot] = 0;
 									flag->endpoint |= BIT(7);
 								}
-							} else { /* Destination is not known */
-								int res = flag->res_waiting[slot] & 0x1f;
-								if (arr2[2*res] >= 0) {
-									flag_search_t search;
-									flag_search_init(&search);
-									flag_search_add_source(&search, flag);
-
-									update_flags_search2_t data;
-									data.arr = &arr2[2*res];
-									data.flag = NULL;
-									data.max_prio = 0;
-
-									flag_search_execute(&search,
-											    (flag_search_func *)update_flags_search2_cb,
-											    0, 1, &data);
-									if (data.flag != NULL) {
-										LOGV("game", "dest for flag %u res %i found: flag %u",
-										     FLAG_INDEX(flag), slot, FLAG_INDEX(data.flag));
-										building_t *dest_bld = data.flag->other_endpoint.b[DIR_UP_LEFT];
-										int prio = (arr2[2*res+1] == 66) ? data.flag->stock1_prio :
-											data.flag->stock2_prio;
-										if ((prio & 1) == 0) prio = 0;
-										if (arr2[2*res+1] == 66) {
-											data.flag->stock1_prio = prio >> 1;
-											dest_bld->stock1 += 1;
-										} else {
-											data.flag->stock2_prio = prio >> 1;
-											dest_bld->stock2 += 1;
-										}
-
-										flag->res_dest[slot] = dest_bld->flg_index;
-										flag->endpoint |= BIT(7);
-									} else { /* No flag requests this resource */
-										int r = find_nearest_inventory(flag);
-										if (r < 0) {
-											/* TODO */
-										} else {
-											flag->res_dest[slot] = r;
-											flag->endpoint |= BIT(7);
-										}
+							} else {
+								flag->endpoint |= BIT(7);
+							}
+						} else { /* Destination is not known */
+							int res = flag->res_waiting[slot] & 0x1f;
+							if (arr2[2*res] >= 0) {
+								flag_search_t search;
+								flag_search_init(&search);
+								flag_search_add_source(&search, flag);
+
+								update_flags_search2_t data;
+								data.arr = &arr2[2*res];
+								data.flag = NULL;
+								data.max_prio = 0;
+
+								flag_search_execute(&search,
+										    (flag_search_func *)update_flags_search2_cb,
+										    0, 1, &data);
+								if (data.flag != NULL) {
+									LOGV("game", "dest for flag %u res %i found: flag %u",
+									     FLAG_INDEX(flag), slot, FLAG_INDEX(data.flag));
+									building_t *dest_bld = data.flag->other_endpoint.b[DIR_UP_LEFT];
+									int prio = (arr2[2*res+1] == 66) ? data.flag->stock1_prio :
+										data.flag->stock2_prio;
+									if ((prio & 1) == 0) prio = 0;
+									if (arr2[2*res+1] == 66) {
+										data.flag->stock1_prio = prio >> 1;
+										dest_bld->stock1 += 1;
+									} else {
+										data.flag->stock2_prio = prio >> 1;
+										dest_bld->stock2 += 1;
 									}
-								} else { /* This resource can not be requested by a flag */
+
+									flag->res_dest[slot] = dest_bld->flg_index;
+									flag->endpoint |= BIT(7);
+								} else { /* No flag requests this resource */
 									int r = find_nearest_inventory(flag);
 									if (r < 0) {
 										/* TODO */
@@ -1072,52 +952,65 @@ update_flags()
 										flag->endpoint |= BIT(7);
 									}
 								}
+							} else { /* This resource can not be requested by a flag */
+								int r = find_nearest_inventory(flag);
+								if (r < 0) {
+									/* TODO */
+								} else {
+									flag->res_dest[slot] = r;
+									flag->endpoint |= BIT(7);
+								}
 							}
 						}
 					}
 				}
 			}
+		}
 
-			/* Update transporter flags, decide if serf needs to be sent to road */
-			int tr = flag->transporter;
-			int flags = globals.field_218[1];
-			int path = flag->path_con & 0x3f;
-			if (globals.field_24E >= 7) path |= BIT(7);
+		/* Update transporter flags, decide if serf needs to be sent to road */
+		int tr = flag->transporter;
+		int flags = globals.field_218[1];
+		int path = flag->path_con & 0x3f;
+		if (globals.field_24E >= 7) path |= BIT(7);
 
-			for (int j = 0; j < 6; j++) {
-				if (BIT_TEST(path, 5-j)) {
-					if (BIT_TEST(flag->length[5-j], 7)) {
-						if (BIT_TEST(flags, 5-j)) {
-							if (BIT_TEST(path, 7)) tr &= BIT(5-j);
-						} else {
-							if ((flag->length[5-j] & 0xf) != 0) tr |= BIT(5-j);
-						}
-					} else if ((flag->length[5-j] & 0xf) == 0) {
+		for (int j = 0; j < 6; j++) {
+			if (BIT_TEST(path, 5-j)) {
+				if (BIT_TEST(flag->length[5-j], 7)) {
+					if (BIT_TEST(flags, 5-j)) {
+						if (BIT_TEST(path, 7)) tr &= BIT(5-j);
+					} else {
+						if ((flag->length[5-j] & 0xf) != 0) tr |= BIT(5-j);
+					}
+				} else if ((flag->length[5-j] & 0xf) == 0) {
+					if (!BIT_TEST(tr, 7)) {
+						int r = 0;
+						if (BIT_TEST(flag->endpoint, 5-j)) r = send_serf_to_road(flag, 5-j, 0);
+						else r = send_serf_to_road(flag, 5-j, 1);
+						if (r < 0) tr |= BIT(7);
+					}
+					if (BIT_TEST(path, 7)) tr &= BIT(5-j);
+				} else if (BIT_TEST(flags, 5-j)) {
+					if (arr[(flag->length[5-j] >> 4) & 7] != (flag->length[5-j] & 0xf)) {
 						if (!BIT_TEST(tr, 7)) {
 							int r = 0;
 							if (BIT_TEST(flag->endpoint, 5-j)) r = send_serf_to_road(flag, 5-j, 0);
 							else r = send_serf_to_road(flag, 5-j, 1);
 							if (r < 0) tr |= BIT(7);
 						}
-						if (BIT_TEST(path, 7)) tr &= BIT(5-j);
-					} else if (BIT_TEST(flags, 5-j)) {
-						if (arr[(flag->length[5-j] >> 4) & 7] != (flag->length[5-j] & 0xf)) {
-							if (!BIT_TEST(tr, 7)) {
-								int r = 0;
-								if (BIT_TEST(flag->endpoint, 5-j)) r = send_serf_to_road(flag, 5-j, 0);
-								else r = send_serf_to_road(flag, 5-j, 1);
-								if (r < 0) tr |= BIT(7);
-							}
-						}
-						if (BIT_TEST(path, 7)) tr &= BIT(5-j);
-					} else {
-						tr |= BIT(5-j);
 					}
+					if (BIT_TEST(path, 7)) tr &= BIT(5-j);
+				} else {
+					tr |= BIT(5-j);
 				}
 			}
+		}
 
-			flag->transporter = tr;
+		/* Routes via transporters change with the transporter bits. */
+		if ((flag->transporter ^ tr) & 0x3f) {
+			flag_route_invalidate(flag, FLAG_ROUTE_RESOURCE);
 		}
+
+		flag->transporter = tr;
 	}
 }
 
@@ -1157,9 +1050,9 @@ send_serf_to_flag_search_cb(flag_t *flag, send_serf_to_flag_data_t *data)
 				data->building->serf &= ~BIT(7);
 
 				serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-				serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+				serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 				serf->s.ready_to_leave_inventory.mode = -1;
-				serf->s.ready_to_leave_inventory.dest = data->building->flg_index;
+				serf_set_dest(serf, data->building->flg_index);
 				serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inv);
 
 				inv->serfs[SERF_4] += 1;
@@ -1182,9 +1075,9 @@ send_serf_to_flag_search_cb(flag_t *flag, send_serf_to_flag_data_t *data)
 					serf_t *serf = game_get_serf(inv->serfs[type]);
 
 					serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-					serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+					serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 					serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inv);
-					serf->s.ready_to_leave_inventory.dest = data->dest_index;
+					serf_set_dest(serf, data->dest_index);
 
 					inv->serfs[type] = 0;
 					if (type == SERF_GENERIC) {
@@ -1254,9 +1147,9 @@ send_serf_to_flag(flag_t *dest, building_t *building, int dest_index,
 			building->serf &= ~BIT(7);
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-			serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 			serf->s.ready_to_leave_inventory.mode = -1;
-			serf->s.ready_to_leave_inventory.dest = building->flg_index;
+			serf_set_dest(serf, building->flg_index);
 			serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inventory);
 			serf->type = (serf->type & 0x83) | (SERF_KNIGHT_0 << 2);
 
@@ -1270,17 +1163,17 @@ send_serf_to_flag(flag_t *dest, building_t *building, int dest_index,
 			sett->total_military_score += 1;
 		} else {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-			serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 			serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inventory);
 
 			if (type == SERF_GEOLOGIST) {
 				serf->s.ready_to_leave_inventory.mode = 6;
-				serf->s.ready_to_leave_inventory.dest = dest_index;
+				serf_set_dest(serf, dest_index);
 			} else {
 				building_t *dest_bld = game_get_flag(dest_index)->other_endpoint.b[DIR_UP_LEFT];
 				dest_bld->serf |= BIT(7);
 				serf->s.ready_to_leave_inventory.mode = -1;
-				serf->s.ready_to_leave_inventory.dest = dest_index;
+				serf_set_dest(serf, dest_index);
 			}
 			serf->type = (serf->type & 0x83) | (type << 2);
 
@@ -1326,6 +1219,7 @@ update_unfinished_building(building_t *building)
 			!BIT_TEST(building->serf, 6) &&
 			!BIT_TEST(building->serf, 7)) {
 		building->progress = 1;
+		player_invalidate_build_sites(building->pos);
 		/*if (BIT_TEST(sett->field_163, 6) &&
 				sett->lumberjack_index != BUILDING_INDEX(building) &&
 				sett->sawmill_index != BUILDING_INDEX(building) &&
@@ -1430,7 +1324,7 @@ update_building_castle(building_t *building)
 			serf_t *serf = game_get_serf(serf_index);
 
 			serf_log_state_change(serf, SERF_STATE_DEFENDING_CASTLE);
-			serf->state = SERF_STATE_DEFENDING_CASTLE;
+			serf_set_state(serf, SERF_STATE_DEFENDING_CASTLE);
 			serf->s.defending.next_knight = building->serf_index;
 			serf->counter = 6000;
 			building->serf_index = serf_index;
@@ -1674,9 +1568,9 @@ handle_building_update(building_t *building)
 
 				/* Update serf state. */
 				serf_log_state_change(leaving_serf, SERF_STATE_READY_TO_LEAVE);
-				leaving_serf->state = SERF_STATE_READY_TO_LEAVE;
+				serf_set_state(leaving_serf, SERF_STATE_READY_TO_LEAVE);
 				leaving_serf->s.leaving_building.field_B = -2;
-				leaving_serf->s.leaving_building.dest = 0;
+				serf_set_dest(leaving_serf, 0);
 				leaving_serf->s.leaving_building.dir = 0;
 				leaving_serf->s.leaving_building.next_state = SERF_STATE_WALKING;
 
@@ -1909,9 +1803,9 @@ handle_building_update(building_t *building)
 
 				/* Update serf state. */
 				serf_log_state_change(leaving_serf, SERF_STATE_READY_TO_LEAVE);
-				leaving_serf->state = SERF_STATE_READY_TO_LEAVE;
+				serf_set_state(leaving_serf, SERF_STATE_READY_TO_LEAVE);
 				leaving_serf->s.leaving_building.field_B = -2;
-				leaving_serf->s.leaving_building.dest = 0;
+				serf_set_dest(leaving_serf, 0);
 				leaving_serf->s.leaving_building.dir = 0;
 				leaving_serf->s.leaving_building.next_state = SERF_STATE_WALKING;
 
@@ -1985,9 +1879,9 @@ handle_building_update(building_t *building)
 
 				/* Update serf state. */
 				serf_log_state_change(leaving_serf, SERF_STATE_READY_TO_LEAVE);
-				leaving_serf->state = SERF_STATE_READY_TO_LEAVE;
+				serf_set_state(leaving_serf, SERF_STATE_READY_TO_LEAVE);
 				leaving_serf->s.leaving_building.field_B = -2;
-				leaving_serf->s.leaving_building.dest = 0;
+				serf_set_dest(leaving_serf, 0);
 				leaving_serf->s.leaving_building.dir = 0;
 				leaving_serf->s.leaving_building.next_state = SERF_STATE_WALKING;
 
@@ -2088,30 +1982,29 @@ update_buildings()
 	if (globals.next_index >= 32) return;
 
 	int index = globals.next_index << 5;
-	for (int i = index ? index : 1; i < globals.max_ever_building_index; i++) {
-		if (BUILDING_ALLOCATED(i)) {
-			building_t *building = game_get_building(i);
-			if (BIT_TEST(building->serf, 5)) { /* Building is burning */
-				uint16_t delta = globals.anim - building->u.anim;
-				building->u.anim = globals.anim;
-				if (building->serf_index >= delta) {
-					building->serf_index -= delta;
-				} else {
-					/* 2355E */
-					map_pos_t pos = building->pos;
-					int p = building->u.s.planks_needed;
+	int i;
+	pool_foreach_from(&globals.building_pool, i, index ? index : 1) {
+		building_t *building = game_get_building(i);
+		if (BIT_TEST(building->serf, 5)) { /* Building is burning */
+			uint16_t delta = globals.anim - building->u.anim;
+			building->u.anim = globals.anim;
+			if (building->serf_index >= delta) {
+				building->serf_index -= delta;
+			} else {
+				/* 2355E */
+				map_pos_t pos = building->pos;
+				int p = building->u.s.planks_needed;
 
-					tiles[pos].flags &= ~BIT(6);
-					map_set_object(pos, MAP_OBJ_NONE, 0);
-					game_free_building(i);
+				tiles[pos].flags &= ~BIT(6);
+				map_set_object(pos, MAP_OBJ_NONE, 0);
+				game_free_building(i);
 
-					if ((p & 0x1f) != 0) {
-						/* TODO */
-					}
+				if ((p & 0x1f) != 0) {
+					/* TODO */
 				}
-			} else {
-				handle_building_update(building);
 			}
+		} else {
+			handle_building_update(building);
 		}
 	}
 }
@@ -2124,11 +2017,10 @@ update_serfs()
 
 	/*int index = globals.next_index & 0xf;
 	  for (int i = index ? index : 1; i < globals.max_ever_serf_index; i++) {*/
-	for (int i = 1; i < globals.max_ever_serf_index; i++) {
-		if (SERF_ALLOCATED(i)) {
-			serf_t *serf = game_get_serf(i);
-			update_serf(serf);
-		}
+	int i;
+	pool_foreach_from(&globals.serf_pool, i, 1) {
+		serf_t *serf = game_get_serf(i);
+		update_serf(serf);
 	}
 }
 
@@ -2279,13 +2171,23 @@ update_game_stats()
 void
 game_update()
 {
+	uint64_t t = profile_begin();
+
 	update_map_and_players();
+	t = profile_end_phase(PROFILE_PHASE_MAP_AND_PLAYERS, t);
 	update_ai_and_more();
+	t = profile_end_phase(PROFILE_PHASE_AI_AND_MORE, t);
 	update_flags();
+	t = profile_end_phase(PROFILE_PHASE_FLAGS, t);
 	update_buildings();
+	t = profile_end_phase(PROFILE_PHASE_BUILDINGS, t);
 	update_serfs();
+	t = profile_end_phase(PROFILE_PHASE_SERFS, t);
 	/*update_visible_serfs(); OBSOLETE */
 	update_game_stats();
+	profile_end_phase(PROFILE_PHASE_GAME_STATS, t);
+
+	profile_end_update();
 }
 
 /* Pause or unpause the game. */
@@ -2302,89 +2204,24 @@ game_pause(int enable)
 	LOGI("game", "Game speed: %u", globals.game_speed >> 16);
 }
 
-/* Generate an estimate of the amount of resources in the ground at map pos.*/
-static void
-get_resource_estimate(map_pos_t pos, int weight, player_t *player)
-{
-	if ((MAP_OBJ(pos) == MAP_OBJ_NONE ||
-	     MAP_OBJ(pos) >= MAP_OBJ_TREE_0) &&
-	     MAP_RES_TYPE(pos) != GROUND_DEPOSIT_NONE) {
-		int value = weight*MAP_RES_AMOUNT(pos);
-
-		switch (MAP_RES_TYPE(pos)) {
-		case GROUND_DEPOSIT_GOLD:
-			player->sett->analysis_goldore += value;
-			break;
-		case GROUND_DEPOSIT_IRON:
-			player->sett->analysis_ironore += value;
-			break;
-		case GROUND_DEPOSIT_COAL:
-			player->sett->analysis_coal += value;
-			break;
-		case GROUND_DEPOSIT_STONE:
-			player->sett->analysis_stone += value;
-			break;
-		default:
-			NOT_REACHED();
-			break;
-		}
-	}
-}
-
 /* Prepare a ground analysis for player.
    The cursor position is the center of the analysis. */
 void
 game_prepare_ground_analysis(player_t *player)
 {
-	player->sett->analysis_goldore = 0;
-	player->sett->analysis_ironore = 0;
-	player->sett->analysis_coal = 0;
-	player->sett->analysis_stone = 0;
-
 	/* Use cursor position, not viewport position as
 	   was used in the original game. */
 	map_pos_t pos = MAP_POS(player->sett->map_cursor_col,
 				player->sett->map_cursor_row);
 
-	/* Sample the cursor position with maximum weighting. */
-	get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS, player);
-
-	/* Move outward in a spiral around the initial pos.
-	   The weighting of the samples attenuates linearly
-	   with the distance to the center. */
-	for (int i = 0; i < GROUND_ANALYSIS_RADIUS-1; i++) {
-		pos = MAP_MOVE_RIGHT(pos);
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_DOWN(pos);
-		}
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_LEFT(pos);
-		}
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_UP_LEFT(pos);
-		}
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_UP(pos);
-		}
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_RIGHT(pos);
-		}
-
-		for (int j = 0; j < i+1; j++) {
-			get_resource_estimate(pos, GROUND_ANALYSIS_RADIUS-i, player);
-			pos = MAP_MOVE_DOWN_RIGHT(pos);
-		}
-	}
+	player->sett->analysis_goldore =
+		map_get_deposit_estimate(pos, GROUND_DEPOSIT_GOLD);
+	player->sett->analysis_ironore =
+		map_get_deposit_estimate(pos, GROUND_DEPOSIT_IRON);
+	player->sett->analysis_coal =
+		map_get_deposit_estimate(pos, GROUND_DEPOSIT_COAL);
+	player->sett->analysis_stone =
+		map_get_deposit_estimate(pos, GROUND_DEPOSIT_STONE);
 
 	/* Process the samples. */
 	player->sett->analysis_goldore >>= 4;
@@ -2447,42 +2284,41 @@ static void
 flag_reset_transport(flag_t *flag)
 {
 	/* Clear destination for any serf with resources for this flag. */
-	for (int i = 1; i < globals.max_ever_serf_index; i++) {
-		if (SERF_ALLOCATED(i)) {
-			serf_t *serf = game_get_serf(i);
-
-			if (serf->state == SERF_STATE_WALKING &&
-			    serf->s.walking.dest == FLAG_INDEX(flag) &&
-			    serf->s.walking.res < 0) {
-				serf->s.walking.res = -2;
-				serf->s.walking.dest = 0;
-			} else if (serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY &&
-				   serf->s.ready_to_leave_inventory.dest == FLAG_INDEX(flag) &&
-				   serf->s.ready_to_leave_inventory.mode < 0) {
-				serf->s.ready_to_leave_inventory.mode = -2;
-				serf->s.ready_to_leave_inventory.dest = 0;
-			} else if ((serf->state == SERF_STATE_LEAVING_BUILDING ||
-				    serf->state == SERF_STATE_READY_TO_LEAVE) &&
-				   serf->s.leaving_building.next_state == SERF_STATE_WALKING &&
-				   serf->s.leaving_building.dest == FLAG_INDEX(flag) &&
-				   serf->s.leaving_building.field_B < 0) {
-				serf->s.leaving_building.field_B = -2;
-				serf->s.leaving_building.dest = 0;
-			} else if (serf->state == SERF_STATE_TRANSPORTING &&
-				   serf->s.walking.dest == FLAG_INDEX(flag)) {
-				serf->s.walking.dest = 0;
-			} else if (serf->state == SERF_STATE_MOVE_RESOURCE_OUT &&
-				   serf->s.move_resource_out.next_state == SERF_STATE_DROP_RESOURCE_OUT &&
-				   serf->s.move_resource_out.res_dest == FLAG_INDEX(flag)) {
-				serf->s.move_resource_out.res_dest = 0;
-			} else if (serf->state == SERF_STATE_DROP_RESOURCE_OUT &&
-				   serf->s.move_resource_out.res_dest == FLAG_INDEX(flag)) {
-				serf->s.move_resource_out.res_dest = 0;
-			} else if (serf->state == SERF_STATE_LEAVING_BUILDING &&
-				   serf->s.leaving_building.next_state == SERF_STATE_DROP_RESOURCE_OUT &&
-				   serf->s.leaving_building.dest == FLAG_INDEX(flag)) {
-				serf->s.leaving_building.dest = 0;
-			}
+	int i, next;
+	serf_foreach_with_dest(FLAG_INDEX(flag), i, next) {
+		serf_t *serf = game_get_serf(i);
+
+		if (serf->state == SERF_STATE_WALKING &&
+		    serf->s.walking.dest == FLAG_INDEX(flag) &&
+		    serf->s.walking.res < 0) {
+			serf->s.walking.res = -2;
+			serf_set_dest(serf, 0);
+		} else if (serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY &&
+			   serf->s.ready_to_leave_inventory.dest == FLAG_INDEX(flag) &&
+			   serf->s.ready_to_leave_inventory.mode < 0) {
+			serf->s.ready_to_leave_inventory.mode = -2;
+			serf_set_dest(serf, 0);
+		} else if ((serf->state == SERF_STATE_LEAVING_BUILDING ||
+			    serf->state == SERF_STATE_READY_TO_LEAVE) &&
+			   serf->s.leaving_building.next_state == SERF_STATE_WALKING &&
+			   serf->s.leaving_building.dest == FLAG_INDEX(flag) &&
+			   serf->s.leaving_building.field_B < 0) {
+			serf->s.leaving_building.field_B = -2;
+			serf_set_dest(serf, 0);
+		} else if (serf->state == SERF_STATE_TRANSPORTING &&
+			   serf->s.walking.dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
+		} else if (serf->state == SERF_STATE_MOVE_RESOURCE_OUT &&
+			   serf->s.move_resource_out.next_state == SERF_STATE_DROP_RESOURCE_OUT &&
+			   serf->s.move_resource_out.res_dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
+		} else if (serf->state == SERF_STATE_DROP_RESOURCE_OUT &&
+			   serf->s.move_resource_out.res_dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
+		} else if (serf->state == SERF_STATE_LEAVING_BUILDING &&
+			   serf->s.leaving_building.next_state == SERF_STATE_DROP_RESOURCE_OUT &&
+			   serf->s.leaving_building.dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
 		}
 	}
 
@@ -2557,6 +2393,7 @@ remove_road_backref_until_flag(map_pos_t pos, dir_t dir)
 
 		/* Clear backreference */
 		tiles[pos].flags &= ~BIT(DIR_REVERSE(dir));
+		player_invalidate_build_sites(pos);
 
 		if (MAP_OBJ(pos) == MAP_OBJ_FLAG) break;
 
@@ -2611,23 +2448,27 @@ remove_road_backrefs(map_pos_t pos)
 static int
 path_serf_idle_to_wait_state(map_pos_t pos)
 {
-	/* Look through serf array for the corresponding serf. */
-	for (int i = 1; i < globals.max_ever_serf_index; i++) {
-		if (SERF_ALLOCATED(i)) {
-			serf_t *serf = game_get_serf(i);
-			if (serf->pos == pos &&
-			    (serf->state == SERF_STATE_IDLE_ON_PATH ||
-			     serf->state == SERF_STATE_WAIT_IDLE_ON_PATH ||
-			     serf->state == SERF_STATE_WAKE_AT_FLAG ||
-			     serf->state == SERF_STATE_WAKE_ON_PATH)) {
-				serf_log_state_change(serf, SERF_STATE_WAKE_AT_FLAG);
-				serf->state = SERF_STATE_WAKE_AT_FLAG;
-				return 0;
-			}
+	/* Look up the corresponding serf in the serf index. If there is
+	   more than one, take the first in the serf array. */
+	serf_t *idle = NULL;
+	int i, next;
+	serf_foreach_at_pos(pos, i, next) {
+		serf_t *serf = game_get_serf(i);
+		if ((idle == NULL || i < SERF_INDEX(idle)) &&
+		    (serf->state == SERF_STATE_IDLE_ON_PATH ||
+		     serf->state == SERF_STATE_WAIT_IDLE_ON_PATH ||
+		     serf->state == SERF_STATE_WAKE_AT_FLAG ||
+		     serf->state == SERF_STATE_WAKE_ON_PATH)) {
+			idle = serf;
 		}
 	}
 
-	return -1;
+	if (idle == NULL) return -1;
+
+	serf_log_state_change(idle, SERF_STATE_WAKE_AT_FLAG);
+	serf_set_state(idle, SERF_STATE_WAKE_AT_FLAG);
+
+	return 0;
 }
 
 static void
@@ -2686,7 +2527,7 @@ mark_serf_as_lost(serf_t *serf)
 		}
 
 		serf_log_state_change(serf, SERF_STATE_LOST);
-		serf->state = SERF_STATE_LOST;
+		serf_set_state(serf, SERF_STATE_LOST);
 		serf->s.lost.field_B = 0;
 	} else if (serf->state == SERF_STATE_TRANSPORTING ||
 		   serf->state == SERF_STATE_DELIVERING) {
@@ -2699,11 +2540,11 @@ mark_serf_as_lost(serf_t *serf)
 
 		if (SERF_TYPE(serf) != SERF_SAILOR) {
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 			serf->s.lost.field_B = 0;
 		} else {
 			serf_log_state_change(serf, SERF_STATE_LOST_SAILOR);
-			serf->state = SERF_STATE_LOST_SAILOR;
+			serf_set_state(serf, SERF_STATE_LOST_SAILOR);
 		}
 	}
 }
@@ -2742,42 +2583,42 @@ remove_road_forwards(map_pos_t pos, dir_t dir)
 			flag->path_con &= ~BIT(rev_dir);
 			flag->transporter &= ~BIT(rev_dir);
 			flag->endpoint &= ~BIT(rev_dir);
+			flag_route_invalidate_paths(flag);
 
 			if (BIT_TEST(flag->length[rev_dir], 7)) {
 				flag->length[rev_dir] &= ~BIT(7);
 
-				for (int i = 1; i < globals.max_ever_serf_index; i++) {
-					if (SERF_ALLOCATED(i)) {
-						int dest = MAP_OBJ_INDEX(pos);
-						serf_t *serf = game_get_serf(i);
-
-						switch (serf->state) {
-						case SERF_STATE_WALKING:
-							if (serf->s.walking.dest == dest &&
-							    serf->s.walking.res == rev_dir) {
-								serf->s.walking.res = -2;
-								serf->s.walking.dest = 0;
-							}
-							break;
-						case SERF_STATE_READY_TO_LEAVE_INVENTORY:
-							if (serf->s.ready_to_leave_inventory.dest == dest &&
-							    serf->s.ready_to_leave_inventory.mode == rev_dir) {
-								serf->s.ready_to_leave_inventory.mode = -2;
-								serf->s.ready_to_leave_inventory.dest = 0;
-							}
-							break;
-						case SERF_STATE_LEAVING_BUILDING:
-						case SERF_STATE_READY_TO_LEAVE:
-							if (serf->s.leaving_building.dest == dest &&
-							    serf->s.leaving_building.field_B == rev_dir &&
-							    serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
-								serf->s.leaving_building.field_B = -2;
-								serf->s.leaving_building.dest = 0;
-							}
-							break;
-						default:
-							break;
+				int dest = MAP_OBJ_INDEX(pos);
+				int i, next;
+				serf_foreach_with_dest(dest, i, next) {
+					serf_t *serf = game_get_serf(i);
+
+					switch (serf->state) {
+					case SERF_STATE_WALKING:
+						if (serf->s.walking.dest == dest &&
+						    serf->s.walking.res == rev_dir) {
+							serf->s.walking.res = -2;
+							serf_set_dest(serf, 0);
+						}
+						break;
+					case SERF_STATE_READY_TO_LEAVE_INVENTORY:
+						if (serf->s.ready_to_leave_inventory.dest == dest &&
+						    serf->s.ready_to_leave_inventory.mode == rev_dir) {
+							serf->s.ready_to_leave_inventory.mode = -2;
+							serf_set_dest(serf, 0);
 						}
+						break;
+					case SERF_STATE_LEAVING_BUILDING:
+					case SERF_STATE_READY_TO_LEAVE:
+						if (serf->s.leaving_building.dest == dest &&
+						    serf->s.leaving_building.field_B == rev_dir &&
+						    serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
+							serf->s.leaving_building.field_B = -2;
+							serf_set_dest(serf, 0);
+						}
+						break;
+					default:
+						break;
 					}
 				}
 			}
@@ -2798,11 +2639,13 @@ remove_road_forwards(map_pos_t pos, dir_t dir)
 
 		/* Clear forward reference. */
 		tiles[pos].flags &= ~BIT(dir);
+		player_invalidate_build_sites(pos);
 		pos = MAP_MOVE(pos, dir);
 		in_dir = dir;
 
 		/* Clear backreference. */
 		tiles[pos].flags &= ~BIT(DIR_REVERSE(dir));
+		player_invalidate_build_sites(pos);
 
 		/* Find next direction of path. */
 		dir = -1;
@@ -2883,7 +2726,7 @@ game_demolish_flag(map_pos_t pos)
 		case SERF_STATE_WALKING:
 			if (MAP_PATHS(pos) == 0) {
 				serf_log_state_change(serf, SERF_STATE_LOST);
-				serf->state = SERF_STATE_LOST;
+				serf_set_state(serf, SERF_STATE_LOST);
 			}
 			break;
 		default:
@@ -2893,6 +2736,7 @@ game_demolish_flag(map_pos_t pos)
 
 	flag_t *flag = game_get_flag(MAP_OBJ_INDEX(pos));
 	flag_remove_player_refs(flag);
+	flag_route_invalidate_paths(flag);
 
 	/* Handle connected flag. */
 	if (MAP_PATHS(pos)) {
@@ -2904,27 +2748,26 @@ game_demolish_flag(map_pos_t pos)
 	tiles[pos].flags &= ~BIT(7);
 
 	/* Update serfs with reference to this flag. */
-	for (int i = 1; i < globals.max_ever_serf_index; i++) {
-		if (SERF_ALLOCATED(i)) {
-			serf_t *serf = game_get_serf(i);
-
-			if (serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY &&
-			    serf->s.ready_to_leave_inventory.dest == FLAG_INDEX(flag)) {
-				serf->s.ready_to_leave_inventory.dest = 0;
-				serf->s.ready_to_leave_inventory.mode = -2;
-			} else if (serf->state == SERF_STATE_WALKING &&
-				   serf->s.walking.dest == FLAG_INDEX(flag)) {
-				serf->s.walking.dest = 0;
-				serf->s.walking.res = -2;
-			} else if (serf->state == SERF_STATE_IDLE_IN_STOCK && 1/*...*/) {
-				/* TODO */
-			} else if ((serf->state == SERF_STATE_LEAVING_BUILDING ||
-				    serf->state == SERF_STATE_READY_TO_LEAVE) &&
-				   serf->s.leaving_building.dest == FLAG_INDEX(flag) &&
-				   serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
-				serf->s.leaving_building.dest = 0;
-				serf->s.leaving_building.field_B = -2;
-			}
+	int i, next;
+	serf_foreach_with_dest(FLAG_INDEX(flag), i, next) {
+		serf_t *serf = game_get_serf(i);
+
+		if (serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY &&
+		    serf->s.ready_to_leave_inventory.dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
+			serf->s.ready_to_leave_inventory.mode = -2;
+		} else if (serf->state == SERF_STATE_WALKING &&
+			   serf->s.walking.dest == FLAG_INDEX(flag)) {
+			serf_set_dest(serf, 0);
+			serf->s.walking.res = -2;
+		} else if (serf->state == SERF_STATE_IDLE_IN_STOCK && 1/*...*/) {
+			/* TODO */
+		} else if ((serf->state == SERF_STATE_LEAVING_BUILDING ||
+			    serf->state == SERF_STATE_READY_TO_LEAVE) &&
+			   serf->s.leaving_building.dest == FLAG_INDEX(flag) &&
+			   serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
+			serf_set_dest(serf, 0);
+			serf->s.leaving_building.field_B = -2;
 		}
 	}
 
@@ -2961,6 +2804,7 @@ game_demolish_building(map_pos_t pos)
 	/* Remove path to building. */
 	tiles[pos].flags &= ~BIT(1);
 	tiles[MAP_MOVE_DOWN_RIGHT(pos)].flags &= ~BIT(4);
+	player_invalidate_build_sites(pos);
 
 	/* Remove lost gold stock from total count. */
 	if (BUILDING_IS_DONE(building) &&
@@ -3006,29 +2850,29 @@ game_demolish_building(map_pos_t pos)
 			globals.map_gold_deposit -= inventory->resources[RESOURCE_GOLDORE];
 		}
 
-		/* Let some serfs escape while the building is burning. */
+		/* Let some serfs escape while the building is burning.
+		   The serfs in the building are found in the serf index
+		   in the order of the serf array. */
 		int escaping_serfs = 0;
-		for (int i = 1; i < globals.max_ever_serf_index; i++) {
-			if (SERF_ALLOCATED(i)) {
-				serf_t *serf = game_get_serf(i);
-
-				if (serf->pos == building->pos &&
-				    (serf->state == SERF_STATE_IDLE_IN_STOCK ||
-				     serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY)) {
-					if (escaping_serfs < 12) {
-						/* Serf is escaping. */
-						escaping_serfs += 1;
-						serf->state = SERF_STATE_ESCAPE_BUILDING;
-					} else {
-						/* Kill this serf. */
-						if (SERF_TYPE(serf) >= SERF_KNIGHT_0 &&
-						    SERF_TYPE(serf) <= SERF_KNIGHT_4) {
-							int score = 1 << (SERF_TYPE(serf)-SERF_KNIGHT_0);
-							sett->total_military_score -= score;
-						}
-						sett->serf_count[SERF_TYPE(serf)] -= 1;
-						game_free_serf(SERF_INDEX(serf));
+		int i, next;
+		serf_foreach_at_pos(building->pos, i, next) {
+			serf_t *serf = game_get_serf(i);
+
+			if (serf->state == SERF_STATE_IDLE_IN_STOCK ||
+			    serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY) {
+				if (escaping_serfs < 12) {
+					/* Serf is escaping. */
+					escaping_serfs += 1;
+					serf_set_state(serf, SERF_STATE_ESCAPE_BUILDING);
+				} else {
+					/* Kill this serf. */
+					if (SERF_TYPE(serf) >= SERF_KNIGHT_0 &&
+					    SERF_TYPE(serf) <= SERF_KNIGHT_4) {
+						int score = 1 << (SERF_TYPE(serf)-SERF_KNIGHT_0);
+						sett->total_military_score -= score;
 					}
+					sett->serf_count[SERF_TYPE(serf)] -= 1;
+					game_free_serf(SERF_INDEX(serf));
 				}
 			}
 		}
@@ -3074,11 +2918,11 @@ game_demolish_building(map_pos_t pos)
 
 				if (MAP_SERF_INDEX(serf->pos) == SERF_INDEX(serf)) {
 					serf_log_state_change(serf, SERF_STATE_LOST);
-					serf->state = SERF_STATE_LOST;
+					serf_set_state(serf, SERF_STATE_LOST);
 					serf->s.lost.field_B = 0;
 				} else {
 					serf_log_state_change(serf, SERF_STATE_ESCAPE_BUILDING);
-					serf->state = SERF_STATE_ESCAPE_BUILDING;
+					serf_set_state(serf, SERF_STATE_ESCAPE_BUILDING);
 				}
 			}
 		}
@@ -3094,11 +2938,11 @@ game_demolish_building(map_pos_t pos)
 
 				if (MAP_SERF_INDEX(serf->pos) == SERF_INDEX(serf)) {
 					serf_log_state_change(serf, SERF_STATE_LOST);
-					serf->state = SERF_STATE_LOST;
+					serf_set_state(serf, SERF_STATE_LOST);
 					serf->s.lost.field_B = 0;
 				} else {
 					serf_log_state_change(serf, SERF_STATE_ESCAPE_BUILDING);
-					serf->state = SERF_STATE_ESCAPE_BUILDING;
+					serf_set_state(serf, SERF_STATE_ESCAPE_BUILDING);
 				}
 			}
 		} else {
@@ -3111,11 +2955,11 @@ game_demolish_building(map_pos_t pos)
 
 			if (MAP_SERF_INDEX(serf->pos) == SERF_INDEX(serf)) {
 				serf_log_state_change(serf, SERF_STATE_LOST);
-				serf->state = SERF_STATE_LOST;
+				serf_set_state(serf, SERF_STATE_LOST);
 				serf->s.lost.field_B = 0;
 			} else {
 				serf_log_state_change(serf, SERF_STATE_ESCAPE_BUILDING);
-				serf->state = SERF_STATE_ESCAPE_BUILDING;
+				serf_set_state(serf, SERF_STATE_ESCAPE_BUILDING);
 			}
 		}
 	}
@@ -3127,6 +2971,7 @@ game_demolish_building(map_pos_t pos)
 
 	flag->bld_flags = 0;
 	flag->bld2_flags = 0;
+	flag_route_invalidate_paths(flag);
 
 	flag_reset_transport(flag);
 
@@ -3212,122 +3057,216 @@ game_surrender_land(map_pos_t pos)
 	}
 }
 
-/* Update land ownership around map position. */
-void
-game_update_land_ownership(map_pos_t init_pos)
+/* Military influence of the players on the land. Each military
+   building adds influence to the positions around it, depending on
+   the type of building and the closeness to the building. A position
+   that is very close to a building is owned by that player outright.
+   The influence of each player is kept for every map position and
+   updated when a military building starts or stops influencing the
+   land, so land ownership can be updated without looking for
+   buildings in the surroundings. */
+#define INFLUENCE_RADIUS    8
+#define INFLUENCE_DIAMETER  (1 + 2*INFLUENCE_RADIUS)
+
+typedef struct {
+	uint16_t sum[4]; /* Influence of each player */
+	uint8_t core[4]; /* Buildings owning the position outright */
+	uint8_t source; /* Influence added by the building at this position */
+} land_influence_t;
+
+static land_influence_t *land_influence;
+static uint land_influence_size;
+
+static const int military_influence[] = {
+	0, 1, 2, 4, 7, 12, 18, 29, -1, -1,	/* hut */
+	0, 3, 5, 8, 11, 15, 22, 30, -1, -1,	/* tower */
+	0, 6, 10, 14, 19, 23, 27, 31, -1, -1	/* fortress */
+};
+
+static const int map_closeness[] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0,
+	1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1, 0, 0, 0, 0, 0, 0,
+	1, 2, 3, 4, 4, 4, 4, 4, 4, 3, 2, 1, 0, 0, 0, 0, 0,
+	1, 2, 3, 4, 5, 5, 5, 5, 5, 4, 3, 2, 1, 0, 0, 0, 0,
+	1, 2, 3, 4, 5, 6, 6, 6, 6, 5, 4, 3, 2, 1, 0, 0, 0,
+	1, 2, 3, 4, 5, 6, 7, 7, 7, 6, 5, 4, 3, 2, 1, 0, 0,
+	1, 2, 3, 4, 5, 6, 7, 8, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 8, 7, 6, 5, 4, 3, 2, 1,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 7, 6, 5, 4, 3, 2, 1,
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 7, 6, 5, 4, 3, 2, 1,
+	0, 0, 0, 1, 2, 3, 4, 5, 6, 6, 6, 6, 5, 4, 3, 2, 1,
+	0, 0, 0, 0, 1, 2, 3, 4, 5, 5, 5, 5, 5, 4, 3, 2, 1,
+	0, 0, 0, 0, 0, 1, 2, 3, 4, 4, 4, 4, 4, 4, 3, 2, 1,
+	0, 0, 0, 0, 0, 0, 1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1,
+	0, 0, 0, 0, 0, 0, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+/* Influence source of the building at pos, as stored in
+   land_influence_t: bit 7 is set if the building has
+   influence, bits 2-3 are the military type and bits 0-1
+   are the player. Return 0 if there is no influence. */
+static int
+building_influence_source(map_pos_t pos)
 {
-	/* Currently the below algorithm will only work when
-	   both influence_radius and calculate_radius are 8. */
-	const int influence_radius = 8;
-	const int influence_diameter = 1 + 2*influence_radius;
+	if (MAP_OBJ(pos) < MAP_OBJ_SMALL_BUILDING ||
+	    MAP_OBJ(pos) > MAP_OBJ_CASTLE ||
+	    !BIT_TEST(MAP_PATHS(pos), DIR_DOWN_RIGHT)) { /* TODO Why wouldn't this be set? */
+		return 0;
+	}
 
-	int calculate_radius = influence_radius;
-	int calculate_diameter = 1 + 2*calculate_radius;
+	building_t *building = game_get_building(MAP_OBJ_INDEX(pos));
+	if (BUILDING_IS_BURNING(building)) return 0;
 
-	int *temp_arr = calloc(4*calculate_diameter*calculate_diameter, sizeof(int));
-	if (temp_arr == NULL) abort();
+	int mil_type = -1;
+	if (BUILDING_TYPE(building) == BUILDING_CASTLE) {
+		/* Castle has military influence even when not done. */
+		mil_type = 2;
+	} else if (BUILDING_IS_DONE(building) &&
+		   BUILDING_IS_ACTIVE(building)) {
+		switch (BUILDING_TYPE(building)) {
+		case BUILDING_HUT: mil_type = 0; break;
+		case BUILDING_TOWER: mil_type = 1; break;
+		case BUILDING_FORTRESS: mil_type = 2; break;
+		default: break;
+		}
+	}
 
-	const int military_influence[] = {
-		0, 1, 2, 4, 7, 12, 18, 29, -1, -1,	/* hut */
-		0, 3, 5, 8, 11, 15, 22, 30, -1, -1,	/* tower */
-		0, 6, 10, 14, 19, 23, 27, 31, -1, -1	/* fortress */
-	};
+	if (mil_type < 0) return 0;
 
-	const int map_closeness[] = {
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
-		1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0,
-		1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1, 0, 0, 0, 0, 0, 0,
-		1, 2, 3, 4, 4, 4, 4, 4, 4, 3, 2, 1, 0, 0, 0, 0, 0,
-		1, 2, 3, 4, 5, 5, 5, 5, 5, 4, 3, 2, 1, 0, 0, 0, 0,
-		1, 2, 3, 4, 5, 6, 6, 6, 6, 5, 4, 3, 2, 1, 0, 0, 0,
-		1, 2, 3, 4, 5, 6, 7, 7, 7, 6, 5, 4, 3, 2, 1, 0, 0,
-		1, 2, 3, 4, 5, 6, 7, 8, 8, 7, 6, 5, 4, 3, 2, 1, 0,
-		1, 2, 3, 4, 5, 6, 7, 8, 9, 8, 7, 6, 5, 4, 3, 2, 1,
-		0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 7, 6, 5, 4, 3, 2, 1,
-		0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 7, 6, 5, 4, 3, 2, 1,
-		0, 0, 0, 1, 2, 3, 4, 5, 6, 6, 6, 6, 5, 4, 3, 2, 1,
-		0, 0, 0, 0, 1, 2, 3, 4, 5, 5, 5, 5, 5, 4, 3, 2, 1,
-		0, 0, 0, 0, 0, 1, 2, 3, 4, 4, 4, 4, 4, 4, 3, 2, 1,
-		0, 0, 0, 0, 0, 0, 1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1,
-		0, 0, 0, 0, 0, 0, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1,
-		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1
-	};
+	return BIT(7) | (mil_type << 2) | BUILDING_PLAYER(building);
+}
 
-	/* Find influence from buildings in 33*33 square
-	   around the center. */
-	for (int i = -(influence_radius+calculate_radius);
-	     i <= influence_radius+calculate_radius; i++) {
-		for (int j = -(influence_radius+calculate_radius);
-		     j <= influence_radius+calculate_radius; j++) {
-			map_pos_t pos = MAP_POS_ADD(init_pos,
-						    MAP_POS(j & globals.map.col_mask,
-							    i & globals.map.row_mask));
+/* Add (sign = 1) or remove (sign = -1) the influence
+   of source at pos to the surrounding land. */
+static void
+apply_land_influence(map_pos_t pos, int source, int sign)
+{
+	if (!BIT_TEST(source, 7)) return;
 
-			if (MAP_OBJ(pos) >= MAP_OBJ_SMALL_BUILDING &&
-			    MAP_OBJ(pos) <= MAP_OBJ_CASTLE &&
-			    BIT_TEST(MAP_PATHS(pos), DIR_DOWN_RIGHT)) { /* TODO Why wouldn't this be set? */
-				building_t *building = game_get_building(MAP_OBJ_INDEX(pos));
-				int mil_type = -1;
-
-				if (BUILDING_TYPE(building) == BUILDING_CASTLE) {
-					/* Castle has military influence even when not done. */
-					mil_type = 2;
-				} else if (BUILDING_IS_DONE(building) &&
-					   BUILDING_IS_ACTIVE(building)) {
-					switch (BUILDING_TYPE(building)) {
-					case BUILDING_HUT: mil_type = 0; break;
-					case BUILDING_TOWER: mil_type = 1; break;
-					case BUILDING_FORTRESS: mil_type = 2; break;
-					default: break;
-					}
-				}
+	int player = source & 3;
+	const int *influence = military_influence + 10*((source >> 2) & 3);
+	const int *closeness = map_closeness;
 
-				if (mil_type >= 0 &&
-				    !BUILDING_IS_BURNING(building)) {
-					const int *influence = military_influence + 10*mil_type;
-					const int *closeness = map_closeness +
-						influence_diameter*max(-i, 0) + max(-j, 0);
-					int *arr = temp_arr +
-						(BUILDING_PLAYER(building) * calculate_diameter*calculate_diameter) +
-						calculate_diameter*max(i, 0) + max(j, 0);
+	for (int i = -INFLUENCE_RADIUS; i <= INFLUENCE_RADIUS; i++) {
+		for (int j = -INFLUENCE_RADIUS; j <= INFLUENCE_RADIUS; j++) {
+			int inf = influence[*closeness++];
+			if (inf == 0) continue;
 
-					for (int k = 0; k < influence_diameter - abs(i); k++) {
-						for (int l = 0; l < influence_diameter - abs(j); l++) {
-							int inf = influence[*closeness];
-							if (inf < 0) *arr = 128;
-							else if (*arr < 128) *arr = min(*arr + inf, 127);
+			map_pos_t p = MAP_POS_ADD(pos,
+						  MAP_POS(j & globals.map.col_mask,
+							  i & globals.map.row_mask));
+			land_influence_t *li = &land_influence[p];
+			if (inf < 0) li->core[player] += sign;
+			else li->sum[player] += sign*inf;
+		}
+	}
+}
 
-							closeness += 1;
-							arr += 1;
-						}
-						closeness += abs(j);
-						arr += abs(j);
-					}
-				}
-			}
+/* Build the influence of all military buildings from the map. The
+   ownership on the map is not changed. */
+void
+game_init_land_influence()
+{
+	if (land_influence_size != globals.map.tile_count) {
+		free(land_influence);
+		land_influence_size = globals.map.tile_count;
+		land_influence = malloc(land_influence_size*sizeof(land_influence_t));
+		if (land_influence == NULL) abort();
+	}
+
+	memset(land_influence, 0, land_influence_size*sizeof(land_influence_t));
+
+	int i;
+	pool_foreach_from(&globals.building_pool, i, 1) {
+		building_t *building = &globals.buildings[i];
+		map_pos_t pos = building->pos;
+		if (pos >= land_influence_size ||
+		    MAP_OBJ_INDEX(pos) != i) continue;
+
+		int source = building_influence_source(pos);
+		apply_land_influence(pos, source, 1);
+		land_influence[pos].source = source;
+	}
+}
+
+/* Rebuild the state derived from the map and the game objects, after
+   a game was started or loaded. */
+void
+game_rebuild_caches()
+{
+	serf_index_rebuild();
+	game_init_land_influence();
+	building_index_rebuild();
+	player_reset_build_sites();
+	map_reset_deposit_estimate();
+}
+
+static int
+update_military_flag_state_cb(building_t *building, void *data)
+{
+	map_pos_t pos = building->pos;
+	if (MAP_OBJ(pos) >= MAP_OBJ_SMALL_BUILDING &&
+	    MAP_OBJ(pos) <= MAP_OBJ_CASTLE &&
+	    MAP_OBJ_INDEX(pos) == (uint)BUILDING_INDEX(building) &&
+	    BIT_TEST(MAP_PATHS(pos), DIR_DOWN_RIGHT)) {
+		if ((BUILDING_IS_DONE(building) &&
+		     (BUILDING_TYPE(building) == BUILDING_HUT ||
+		      BUILDING_TYPE(building) == BUILDING_TOWER ||
+		      BUILDING_TYPE(building) == BUILDING_FORTRESS)) ||
+		    BUILDING_TYPE(building) == BUILDING_CASTLE) {
+			game_calculate_military_flag_state(building);
 		}
 	}
 
+	return 0;
+}
+
+/* Update land ownership around map position. The influence
+   of the military building at the position is updated, and
+   positions in reach of it change owner if another player
+   now has the strongest influence. */
+void
+game_update_land_ownership(map_pos_t init_pos)
+{
+	if (land_influence_size != globals.map.tile_count) {
+		game_init_land_influence();
+	}
+
+	/* Update influence of building at position. */
+	int source = building_influence_source(init_pos);
+	if (source != land_influence[init_pos].source) {
+		apply_land_influence(init_pos, land_influence[init_pos].source, -1);
+		apply_land_influence(init_pos, source, 1);
+		land_influence[init_pos].source = source;
+	}
+
 	map_tile_t *tiles = globals.map.tiles;
 
 	/* Update owner of 17*17 square. */
-	for (int i = -calculate_radius; i <= calculate_radius; i++) {
-		for (int j = -calculate_radius; j <= calculate_radius; j++) {
+	for (int i = -INFLUENCE_RADIUS; i <= INFLUENCE_RADIUS; i++) {
+		for (int j = -INFLUENCE_RADIUS; j <= INFLUENCE_RADIUS; j++) {
+			map_pos_t pos = MAP_POS_ADD(init_pos,
+						    MAP_POS(j & globals.map.col_mask,
+							    i & globals.map.row_mask));
+			const land_influence_t *li = &land_influence[pos];
+
 			int max_val = 0;
 			int player = -1;
 			for (int p = 0; p < 4; p++) {
-				int *arr = temp_arr +
-					p*calculate_diameter*calculate_diameter +
-					calculate_diameter*(i+calculate_radius) + (j+calculate_radius);
-				if (*arr > max_val) {
-					max_val = *arr;
+				int val = (li->core[p] > 0) ? 128 :
+					min(li->sum[p], 127);
+				if (val > max_val) {
+					max_val = val;
 					player = p;
 				}
 			}
 
-			map_pos_t pos = MAP_POS_ADD(init_pos,
-						    MAP_POS(j & globals.map.col_mask,
-							    i & globals.map.row_mask));
+			int changed = MAP_HAS_OWNER(pos) ?
+				(player < 0 || MAP_OWNER(pos) != player) :
+				(player >= 0);
+
 			if (player >= 0) {
 				if (MAP_HAS_OWNER(pos) &&
 				    MAP_OWNER(pos) != player) {
@@ -3342,32 +3281,14 @@ game_update_land_ownership(map_pos_t init_pos)
 				game_surrender_land(pos);
 				tiles[pos].height = (0 << 7) | (0 << 5) | MAP_HEIGHT(pos);
 			}
+
+			if (changed) player_invalidate_build_sites(pos);
 		}
 	}
 
-	free(temp_arr);
-
 	/* Update military building flag state. */
-	for (int i = -25; i <= 25; i++) {
-		for (int j = -25; j <= 25; j++) {
-			map_pos_t pos = MAP_POS_ADD(init_pos,
-						    MAP_POS(i & globals.map.col_mask,
-							    j & globals.map.row_mask));
-
-			if (MAP_OBJ(pos) >= MAP_OBJ_SMALL_BUILDING &&
-			    MAP_OBJ(pos) <= MAP_OBJ_CASTLE &&
-			    BIT_TEST(MAP_PATHS(pos), DIR_DOWN_RIGHT)) {
-				building_t *building = game_get_building(MAP_OBJ_INDEX(pos));
-				if ((BUILDING_IS_DONE(building) &&
-				     (BUILDING_TYPE(building) == BUILDING_HUT ||
-				      BUILDING_TYPE(building) == BUILDING_TOWER ||
-				      BUILDING_TYPE(building) == BUILDING_FORTRESS)) ||
-				    BUILDING_TYPE(building) == BUILDING_CASTLE) {
-					game_calculate_military_flag_state(building);
-				}
-			}
-		}
-	}
+	building_index_search_range(init_pos, 25, -1,
+				    update_military_flag_state_cb, NULL);
 }
 
 static void
@@ -3436,17 +3357,21 @@ game_occupy_enemy_building(building_t *building, int player)
 		map_tile_t *tiles = globals.map.tiles;
 		tiles[building->pos].height = (1 << 7) | (player << 5) |
 			MAP_HEIGHT(building->pos);
+		player_invalidate_build_sites(building->pos);
 
 		for (dir_t d = DIR_RIGHT; d <= DIR_UP; d++) {
 			map_pos_t pos = MAP_MOVE(building->pos, d);
 			tiles[pos].height = (1 << 7) | (player << 5) | MAP_HEIGHT(pos);
+			player_invalidate_build_sites(pos);
 			if (pos != flag->pos) {
 				game_demolish_flag_and_roads(pos);
 			}
 		}
 
 		/* Change owner of flag. */
+		flag_route_invalidate_paths(flag);
 		flag->path_con = (player << 6) | (flag->path_con & 0x3f);
+		flag_route_invalidate_paths(flag);
 
 		/* Reset destination of stolen resources. */
 		for (int i = 0; i < 8; i++) {
@@ -3474,6 +3399,7 @@ game_occupy_enemy_building(building_t *building, int player)
 
 		/* Change owner of building */
 		building->bld = (building->bld & 0xfc) | player;
+		building_index_update(BUILDING_INDEX(building));
 
 		game_update_land_ownership(building->pos);
 
@@ -3497,42 +3423,43 @@ game_set_inventory_resource_mode(inventory_t *inventory, int mode)
 		inventory->res_dir = (inventory->res_dir & 0xfc) | 3;
 	}
 
+	flag_route_invalidate(flag, FLAG_ROUTE_RESOURCE);
+
 	if (mode > 0) {
 		flag->bld2_flags &= ~BIT(7);
 
 		/* Clear destination of serfs with resources destined
 		   for this inventory. */
 		int dest = FLAG_INDEX(flag);
-		for (int i = 1; i < globals.max_ever_serf_index; i++) {
-			if (SERF_ALLOCATED(i)) {
-				serf_t *serf = game_get_serf(i);
-
-				switch (serf->state) {
-				case SERF_STATE_TRANSPORTING:
-					if (serf->s.walking.dest == dest) {
-						serf->s.walking.dest = 0;
-					}
-					break;
-				case SERF_STATE_DROP_RESOURCE_OUT:
-					if (serf->s.move_resource_out.res_dest == dest) {
-						serf->s.move_resource_out.res_dest = 0;
-					}
-					break;
-				case SERF_STATE_LEAVING_BUILDING:
-					if (serf->s.leaving_building.dest == dest &&
-					    serf->s.leaving_building.next_state == SERF_STATE_DROP_RESOURCE_OUT) {
-						serf->s.leaving_building.dest = 0;
-					}
-					break;
-				case SERF_STATE_MOVE_RESOURCE_OUT:
-					if (serf->s.move_resource_out.res_dest == dest &&
-					    serf->s.move_resource_out.next_state == SERF_STATE_DROP_RESOURCE_OUT) {
-						serf->s.move_resource_out.res_dest = 0;
-					}
-					break;
-				default:
-					break;
+		int i, next;
+		serf_foreach_with_dest(dest, i, next) {
+			serf_t *serf = game_get_serf(i);
+
+			switch (serf->state) {
+			case SERF_STATE_TRANSPORTING:
+				if (serf->s.walking.dest == dest) {
+					serf_set_dest(serf, 0);
+				}
+				break;
+			case SERF_STATE_DROP_RESOURCE_OUT:
+				if (serf->s.move_resource_out.res_dest == dest) {
+					serf_set_dest(serf, 0);
+				}
+				break;
+			case SERF_STATE_LEAVING_BUILDING:
+				if (serf->s.leaving_building.dest == dest &&
+				    serf->s.leaving_building.next_state == SERF_STATE_DROP_RESOURCE_OUT) {
+					serf_set_dest(serf, 0);
 				}
+				break;
+			case SERF_STATE_MOVE_RESOURCE_OUT:
+				if (serf->s.move_resource_out.res_dest == dest &&
+				    serf->s.move_resource_out.next_state == SERF_STATE_DROP_RESOURCE_OUT) {
+					serf_set_dest(serf, 0);
+				}
+				break;
+			default:
+				break;
 			}
 		}
 	} else {
@@ -3554,42 +3481,43 @@ game_set_inventory_serf_mode(inventory_t *inventory, int mode)
 		inventory->res_dir = (inventory->res_dir & 0xf3) | (3 << 2);
 	}
 
+	flag_route_invalidate(flag, FLAG_ROUTE_SERF);
+
 	if (mode > 0) {
 		flag->bld_flags &= ~BIT(7);
 
 		/* Clear destination of serfs destined for this inventory. */
 		int dest = FLAG_INDEX(flag);
-		for (int i = 1; i < globals.max_ever_serf_index; i++) {
-			if (SERF_ALLOCATED(i)) {
-				serf_t *serf = game_get_serf(i);
-
-				switch (serf->state) {
-				case SERF_STATE_WALKING:
-					if (serf->s.walking.dest == dest &&
-					    serf->s.walking.res < 0) {
-						serf->s.walking.res = -2;
-						serf->s.walking.dest = 0;
-					}
-					break;
-				case SERF_STATE_READY_TO_LEAVE_INVENTORY:
-					if (serf->s.ready_to_leave_inventory.dest == dest &&
-					    serf->s.ready_to_leave_inventory.mode < 0) {
-						serf->s.ready_to_leave_inventory.mode = -2;
-						serf->s.ready_to_leave_inventory.dest = 0;
-					}
-					break;
-				case SERF_STATE_LEAVING_BUILDING:
-				case SERF_STATE_READY_TO_LEAVE:
-					if (serf->s.leaving_building.dest == dest &&
-					    serf->s.leaving_building.field_B < 0 &&
-					    serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
-						serf->s.leaving_building.field_B = -2;
-						serf->s.leaving_building.dest = 0;
-					}
-					break;
-				default:
-					break;
+		int i, next;
+		serf_foreach_with_dest(dest, i, next) {
+			serf_t *serf = game_get_serf(i);
+
+			switch (serf->state) {
+			case SERF_STATE_WALKING:
+				if (serf->s.walking.dest == dest &&
+				    serf->s.walking.res < 0) {
+					serf->s.walking.res = -2;
+					serf_set_dest(serf, 0);
 				}
+				break;
+			case SERF_STATE_READY_TO_LEAVE_INVENTORY:
+				if (serf->s.ready_to_leave_inventory.dest == dest &&
+				    serf->s.ready_to_leave_inventory.mode < 0) {
+					serf->s.ready_to_leave_inventory.mode = -2;
+					serf_set_dest(serf, 0);
+				}
+				break;
+			case SERF_STATE_LEAVING_BUILDING:
+			case SERF_STATE_READY_TO_LEAVE:
+				if (serf->s.leaving_building.dest == dest &&
+				    serf->s.leaving_building.field_B < 0 &&
+				    serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
+					serf->s.leaving_building.field_B = -2;
+					serf_set_dest(serf, 0);
+				}
+				break;
+			default:
+				break;
 			}
 		}
 	} else {
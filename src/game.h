@@ -63,6 +63,8 @@ void game_demolish_flag(map_pos_t pos);
 void game_demolish_building(map_pos_t pos);
 
 void game_calculate_military_flag_state(building_t *building);
+void game_init_land_influence();
+void game_rebuild_caches();
 void game_update_land_ownership(map_pos_t pos);
 void game_occupy_enemy_building(building_t *building, int player);
 
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -37,10 +38,20 @@
 # include <sys/mman.h>
 #endif
 
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define GFX_SIMD  "AVX2"
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define GFX_SIMD  "SSE2"
+#endif
+
 #include "freeserf_endian.h"
 #include "sdl-video.h"
 #include "gfx.h"
 #include "data.h"
+#include "misc.h"
+#include "profile.h"
 #include "log.h"
 
 /* There are different types of sprites:
@@ -62,6 +73,7 @@ typedef struct {
 static void *sprites;
 static size_t sprites_size;
 static unsigned int entry_count;
+static char *data_path;
 
 
 /* Load data file at path and let the global variable sprites refer to the memory
@@ -117,6 +129,11 @@ gfx_load_file(const char *path)
 	fclose(f);
 #endif
 
+	free(data_path);
+	data_path = malloc(strlen(path)+1);
+	if (data_path == NULL) abort();
+	strcpy(data_path, path);
+
 	/* Read the number of entries in the index table.
 	   Some entries are undefined (size and offset are zero). */
 	entry_count = le32toh(*((uint32_t *)sprites + 1)) + 1;
@@ -152,6 +169,16 @@ gfx_unload()
 #else /* ! HAVE_MMAP */
 	free(sprites);
 #endif
+
+	free(data_path);
+	data_path = NULL;
+}
+
+/* Return the path of the loaded data file. */
+const char *
+gfx_get_data_path()
+{
+	return data_path;
 }
 
 /* Return a pointer to the data object at index.
@@ -173,6 +200,14 @@ gfx_get_data_object(int index, size_t *size)
 	return &bytes[offset];
 }
 
+/* Return non-zero if the data object at index is defined. */
+int
+gfx_data_object_defined(int index)
+{
+	spae_entry_t *entries = sprites;
+	return index > 0 && index < entry_count && entries[index].offset != 0;
+}
+
 /* Draw a character at x, y in the dest frame. */
 static void
 gfx_draw_char_sprite(int x, int y, unsigned int c, int color, int shadow, frame_t *dest)
@@ -328,32 +363,145 @@ gfx_set_palette(int palette)
 	sdl_set_palette(pal);
 }
 
-/* Unpack the uncompressed data of a transparent sprite. */
+/* Pixel kernels. The vector versions are selected at compile time
+   from the instruction sets the compiler targets. The scalar versions
+   are always built, so the benchmark can compare the two. */
+
+/* Copy n bytes from src to dest adding offset to each byte. */
+static void
+copy_add_scalar(uint8_t *dest, const uint8_t *src, size_t n, uint8_t offset)
+{
+	for (size_t i = 0; i < n; i++) dest[i] = src[i] + offset;
+}
+
+/* Clear the bytes of dest where mask is zero. Mask bytes must be
+   either zero or 0xff. */
+static void
+apply_mask_scalar(uint8_t *dest, const uint8_t *mask, size_t n)
+{
+	for (size_t i = 0; i < n; i++) dest[i] &= mask[i];
+}
+
+/* Look up each byte of src in lut and store the result in dest. */
+static void
+palette_lookup_scalar(uint32_t *dest, const uint8_t *src, size_t n,
+		      const uint32_t *lut)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint32_t a = lut[src[i]];
+		uint32_t b = lut[src[i+1]];
+		uint32_t c = lut[src[i+2]];
+		uint32_t d = lut[src[i+3]];
+		dest[i] = a;
+		dest[i+1] = b;
+		dest[i+2] = c;
+		dest[i+3] = d;
+	}
+	for (; i < n; i++) dest[i] = lut[src[i]];
+}
+
+#ifdef GFX_SIMD
+
+static void
+copy_add_simd(uint8_t *dest, const uint8_t *src, size_t n, uint8_t offset)
+{
+	__m128i off = _mm_set1_epi8((char)offset);
+
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+		_mm_storeu_si128((__m128i *)&dest[i], _mm_add_epi8(v, off));
+	}
+	copy_add_scalar(&dest[i], &src[i], n - i, offset);
+}
+
+static void
+apply_mask_simd(uint8_t *dest, const uint8_t *mask, size_t n)
+{
+	size_t i = 0;
+# ifdef __AVX2__
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&dest[i]);
+		__m256i m = _mm256_loadu_si256((const __m256i *)&mask[i]);
+		_mm256_storeu_si256((__m256i *)&dest[i], _mm256_and_si256(v, m));
+	}
+# endif
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&dest[i]);
+		__m128i m = _mm_loadu_si128((const __m128i *)&mask[i]);
+		_mm_storeu_si128((__m128i *)&dest[i], _mm_and_si128(v, m));
+	}
+	apply_mask_scalar(&dest[i], &mask[i], n - i);
+}
+
+/* SSE2 has no gather, so without AVX2 the unrolled scalar
+   lookup is used. */
+static void
+palette_lookup_simd(uint32_t *dest, const uint8_t *src, size_t n,
+		    const uint32_t *lut)
+{
+	size_t i = 0;
+# ifdef __AVX2__
+	for (; i + 8 <= n; i += 8) {
+		__m128i b = _mm_loadl_epi64((const __m128i *)&src[i]);
+		__m256i idx = _mm256_cvtepu8_epi32(b);
+		__m256i v = _mm256_i32gather_epi32((const int *)lut, idx, 4);
+		_mm256_storeu_si256((__m256i *)&dest[i], v);
+	}
+# endif
+	palette_lookup_scalar(&dest[i], &src[i], n - i, lut);
+}
+
+#else /* ! GFX_SIMD */
+
+# define copy_add_simd        copy_add_scalar
+# define apply_mask_simd      apply_mask_scalar
+# define palette_lookup_simd  palette_lookup_scalar
+
+#endif
+
+/* Clear the bytes of dest where mask is zero. The mask must be
+   unpacked with gfx_unpack_mask_sprite(). */
 void
-gfx_unpack_transparent_sprite(void *dest, const void *src, size_t destlen, int offset)
+gfx_apply_mask(void *dest, const void *mask, size_t n)
 {
-	const uint8_t *bsrc = (uint8_t *)src;
-	uint8_t *bdest = (uint8_t *)dest;
+	apply_mask_simd(dest, mask, n);
+}
+
+/* Convert n palette indices from src to pixels in dest,
+   using lut to map each of the 256 indices to a pixel value. */
+void
+gfx_palette_to_rgba(uint32_t *dest, const uint8_t *src, size_t n,
+		    const uint32_t *lut)
+{
+	palette_lookup_simd(dest, src, n, lut);
+}
 
+static void
+unpack_transparent_sprite(uint8_t *dest, const uint8_t *src, size_t destlen,
+			  int offset,
+			  void (*copy_add)(uint8_t *, const uint8_t *, size_t, uint8_t))
+{
 	int i = 0;
 	int j = 0;
 	while (j < destlen) {
-		j += bsrc[i];
-		int n = bsrc[i+1];
+		j += src[i];
+		int n = src[i+1];
 
-		if (n) {
-			memcpy(&bdest[j], &bsrc[i+2], n);
-			if (offset) {
-				for (int k = 0; k < n; k++) {
-					bdest[j+k] += offset;
-				}
-			}
-		}
+		if (n) copy_add(&dest[j], &src[i+2], n, offset);
 		i += n + 2;
 		j += n;
 	}
 }
 
+/* Unpack the uncompressed data of a transparent sprite. */
+void
+gfx_unpack_transparent_sprite(void *dest, const void *src, size_t destlen, int offset)
+{
+	unpack_transparent_sprite(dest, src, destlen, offset, copy_add_simd);
+}
+
 /* Unpack the uncompressed data of a bitmap sprite. */
 static void
 gfx_unpack_bitmap_sprite(void *dest, const void *src, size_t destlen, int value)
@@ -367,7 +515,7 @@ gfx_unpack_bitmap_sprite(void *dest, const void *src, size_t destlen, int value)
 		j += bsrc[i];
 		int n = bsrc[i+1];
 
-		for (int k = 0; k < n; k++) bdest[j+k] = value;
+		memset(&bdest[j], value, n);
 
 		i += 2;
 		j += n;
@@ -387,3 +535,289 @@ gfx_unpack_mask_sprite(void *dest, const void *src, size_t destlen)
 {
 	gfx_unpack_bitmap_sprite(dest, src, destlen, 0xff);
 }
+
+/* Copy the data of a non-packed sprite to dest and clear the pixels
+   outside the mask. The sprite data is repeated if the mask is larger
+   than the sprite. Dest must have room for the size of the mask. */
+void
+gfx_mask_sprite(void *dest, const sprite_t *sprite, const sprite_t *mask)
+{
+	size_t m_width = le16toh(mask->w);
+	size_t m_height = le16toh(mask->h);
+
+	size_t s_width = le16toh(sprite->w);
+	size_t s_height = le16toh(sprite->h);
+
+	const uint8_t *s_data = (uint8_t *)sprite + sizeof(sprite_t);
+	uint8_t *bdest = (uint8_t *)dest;
+
+	size_t to_copy = m_width * m_height;
+	uint8_t *copy_dest = bdest;
+	while (to_copy) {
+		size_t s = min(to_copy, s_width * s_height);
+		memcpy(copy_dest, s_data, s * sizeof(uint8_t));
+		to_copy -= s;
+		copy_dest += s;
+	}
+
+	/* Unpack mask */
+	const void *m_data = (uint8_t *)mask + sizeof(sprite_t);
+
+	size_t unpack_size = m_width * m_height;
+	uint8_t *m_unpack = calloc(unpack_size, sizeof(uint8_t));
+	if (m_unpack == NULL) abort();
+
+	gfx_unpack_mask_sprite(m_unpack, m_data, unpack_size);
+
+	gfx_apply_mask(bdest, m_unpack, unpack_size);
+
+	free(m_unpack);
+}
+
+
+
+/* Sprite kernel benchmark */
+
+#define BENCHMARK_ROUNDS  20
+
+#define BENCHMARK_MASKS  (DATA_MAP_MASK_UP_COUNT + DATA_MAP_MASK_DOWN_COUNT)
+
+/* Ranges of transparent sprites in the data file, as base and count. */
+static const int benchmark_transp_ranges[][2] = {
+	{ DATA_GAME_OBJECT_BASE, DATA_GAME_OBJECT_COUNT },
+	{ DATA_MAP_OBJECT_BASE, DATA_MAP_OBJECT_COUNT },
+	{ DATA_SERF_ARMS_BASE, DATA_SERF_ARMS_COUNT },
+	{ DATA_SERF_TORSO_BASE, DATA_SERF_TORSO_COUNT },
+	{ DATA_SERF_HEAD_BASE, DATA_SERF_HEAD_COUNT }
+};
+
+/* No offset and the color offsets of the four players. */
+static const int benchmark_color_offsets[] = { 0, 64, 68, 72, 76 };
+
+#define BENCHMARK_COLORS  (sizeof(benchmark_color_offsets)/sizeof(int))
+
+typedef struct {
+	const sprite_t **sprites;
+	uint8_t **unpacked;
+	int count;
+	uint8_t *masks[BENCHMARK_MASKS];
+	uint32_t lut[256];
+	uint8_t *buf;
+	uint32_t *rgba;
+} benchmark_t;
+
+typedef struct {
+	const char *name;
+	uint64_t time[2];
+	uint64_t hash[2];
+	size_t pixels;
+} benchmark_result_t;
+
+static uint64_t
+benchmark_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+	return h;
+}
+
+static size_t
+sprite_pixels(const sprite_t *sprite)
+{
+	return (size_t)le16toh(sprite->w) * le16toh(sprite->h);
+}
+
+/* Unpack all transparent sprites in each player color. If hash is
+   non-NULL the result is hashed. Returns the number of pixels. */
+static size_t
+benchmark_unpack(benchmark_t *b, int simd, uint64_t *hash)
+{
+	size_t pixels = 0;
+	for (int i = 0; i < b->count; i++) {
+		const sprite_t *s = b->sprites[i];
+		size_t size = sprite_pixels(s);
+		for (int c = 0; c < BENCHMARK_COLORS; c++) {
+			memset(b->buf, 0, size);
+			unpack_transparent_sprite(b->buf, (uint8_t *)s + sizeof(sprite_t),
+						  size, benchmark_color_offsets[c],
+						  simd ? copy_add_simd : copy_add_scalar);
+			if (hash != NULL) *hash = benchmark_hash(*hash, b->buf, size);
+			pixels += size;
+		}
+	}
+
+	return pixels;
+}
+
+/* Convert all unpacked sprites to RGBA. */
+static size_t
+benchmark_palette(benchmark_t *b, int simd, uint64_t *hash)
+{
+	size_t pixels = 0;
+	for (int i = 0; i < b->count; i++) {
+		size_t size = sprite_pixels(b->sprites[i]);
+		if (simd) palette_lookup_simd(b->rgba, b->unpacked[i], size, b->lut);
+		else palette_lookup_scalar(b->rgba, b->unpacked[i], size, b->lut);
+		if (hash != NULL) {
+			*hash = benchmark_hash(*hash, b->rgba, size*sizeof(uint32_t));
+		}
+		pixels += size;
+	}
+
+	return pixels;
+}
+
+/* Mask every ground texture with every map mask. */
+static size_t
+benchmark_mask(benchmark_t *b, int simd, uint64_t *hash)
+{
+	size_t pixels = 0;
+	for (int m = 0; m < BENCHMARK_MASKS; m++) {
+		if (b->masks[m] == NULL) continue;
+
+		const sprite_t *mask = gfx_get_data_object(DATA_MAP_MASK_UP_BASE + m, NULL);
+		size_t size = sprite_pixels(mask);
+		for (int t = 0; t < DATA_MAP_GROUND_COUNT; t++) {
+			const sprite_t *s = gfx_get_data_object(DATA_MAP_GROUND_BASE + t, NULL);
+			memcpy(b->buf, (uint8_t *)s + sizeof(sprite_t),
+			       min(size, sprite_pixels(s)));
+
+			if (simd) apply_mask_simd(b->buf, b->masks[m], size);
+			else apply_mask_scalar(b->buf, b->masks[m], size);
+
+			if (hash != NULL) *hash = benchmark_hash(*hash, b->buf, size);
+			pixels += size;
+		}
+	}
+
+	return pixels;
+}
+
+static void
+benchmark_run(benchmark_t *b, benchmark_result_t *result,
+	      size_t (*kernel)(benchmark_t *, int, uint64_t *))
+{
+	for (int simd = 0; simd < 2; simd++) {
+		uint64_t start = profile_time();
+		size_t pixels = 0;
+		for (int r = 0; r < BENCHMARK_ROUNDS; r++) {
+			pixels += kernel(b, simd, NULL);
+		}
+		result->time[simd] = profile_time() - start;
+		result->pixels = pixels;
+
+		result->hash[simd] = 0xcbf29ce484222325ull;
+		kernel(b, simd, &result->hash[simd]);
+	}
+}
+
+/* Time the scalar and vector sprite kernels over the sprites in the
+   data file and check that they give the same results. Returns -1 if
+   the results differ. */
+int
+gfx_benchmark()
+{
+	benchmark_t b;
+	size_t max_size = 0;
+
+	/* Collect transparent sprites */
+	int count = 0;
+	for (int i = 0; i < sizeof(benchmark_transp_ranges)/(2*sizeof(int)); i++) {
+		count += benchmark_transp_ranges[i][1];
+	}
+
+	b.sprites = malloc(count * sizeof(sprite_t *));
+	b.unpacked = malloc(count * sizeof(uint8_t *));
+	if (b.sprites == NULL || b.unpacked == NULL) abort();
+
+	b.count = 0;
+	for (int i = 0; i < sizeof(benchmark_transp_ranges)/(2*sizeof(int)); i++) {
+		int base = benchmark_transp_ranges[i][0];
+		int end = base + benchmark_transp_ranges[i][1];
+		for (int j = base; j < end; j++) {
+			if (!gfx_data_object_defined(j)) continue;
+
+			const sprite_t *s = gfx_get_data_object(j, NULL);
+			size_t size = sprite_pixels(s);
+			max_size = max(max_size, size);
+
+			uint8_t *unpacked = calloc(size, sizeof(uint8_t));
+			if (unpacked == NULL) abort();
+			gfx_unpack_transparent_sprite(unpacked, (uint8_t *)s + sizeof(sprite_t),
+						      size, 0);
+
+			b.sprites[b.count] = s;
+			b.unpacked[b.count] = unpacked;
+			b.count += 1;
+		}
+	}
+
+	/* Unpack map masks */
+	for (int m = 0; m < BENCHMARK_MASKS; m++) {
+		b.masks[m] = NULL;
+		if (!gfx_data_object_defined(DATA_MAP_MASK_UP_BASE + m)) continue;
+
+		const sprite_t *mask = gfx_get_data_object(DATA_MAP_MASK_UP_BASE + m, NULL);
+		size_t size = sprite_pixels(mask);
+		max_size = max(max_size, size);
+
+		b.masks[m] = calloc(size, sizeof(uint8_t));
+		if (b.masks[m] == NULL) abort();
+		gfx_unpack_mask_sprite(b.masks[m], (uint8_t *)mask + sizeof(sprite_t), size);
+	}
+
+	b.buf = malloc(max_size);
+	b.rgba = malloc(max_size * sizeof(uint32_t));
+	if (b.buf == NULL || b.rgba == NULL) abort();
+
+	const uint8_t *pal = gfx_get_data_object(DATA_PALETTE_GAME, NULL);
+	for (int i = 0; i < 256; i++) {
+		b.lut[i] = pal[3*i] | (pal[3*i+1] << 8) | (pal[3*i+2] << 16) |
+			(i > 0 ? 0xff000000 : 0);
+	}
+
+	benchmark_result_t results[] = {
+		{ .name = "unpack" }, { .name = "palette" }, { .name = "mask" }
+	};
+
+	benchmark_run(&b, &results[0], benchmark_unpack);
+	benchmark_run(&b, &results[1], benchmark_palette);
+	benchmark_run(&b, &results[2], benchmark_mask);
+
+#ifdef GFX_SIMD
+	const char *simd_name = GFX_SIMD;
+#else
+	const char *simd_name = "none";
+#endif
+	LOGI("gfx", "Sprite kernels: %i transparent sprites, %i rounds,"
+	     " vector instructions: %s.", b.count, BENCHMARK_ROUNDS, simd_name);
+
+	int r = 0;
+	for (int i = 0; i < sizeof(results)/sizeof(results[0]); i++) {
+		benchmark_result_t *res = &results[i];
+		double scalar_ms = res->time[0] / 1000000.0;
+		double simd_ms = res->time[1] / 1000000.0;
+		double mpixels = res->pixels / 1000000.0;
+
+		LOGI("gfx", "%-8s scalar %8.2f ms (%7.1f Mpx/s)"
+		     "  vector %8.2f ms (%7.1f Mpx/s)  %.2fx",
+		     res->name,
+		     scalar_ms, scalar_ms > 0 ? 1000*mpixels/scalar_ms : 0,
+		     simd_ms, simd_ms > 0 ? 1000*mpixels/simd_ms : 0,
+		     simd_ms > 0 ? scalar_ms/simd_ms : 0);
+
+		if (res->hash[0] != res->hash[1]) {
+			LOGE("gfx", "%s: vector result differs from scalar.", res->name);
+			r = -1;
+		}
+	}
+
+	for (int m = 0; m < BENCHMARK_MASKS; m++) free(b.masks[m]);
+	for (int i = 0; i < b.count; i++) free(b.unpacked[i]);
+	free(b.unpacked);
+	free(b.sprites);
+	free(b.rgba);
+	free(b.buf);
+
+	return r;
+}
@@ -51,7 +51,9 @@ typedef struct {
 
 int gfx_load_file(const char *path);
 void gfx_unload();
+const char *gfx_get_data_path();
 void *gfx_get_data_object(int index, size_t *size);
+int gfx_data_object_defined(int index);
 void gfx_draw_string(int x, int y, int color, int shadow, frame_t *dest, const char *str);
 void gfx_draw_number(int x, int y, int color, int shadow, frame_t *dest, int n);
 void gfx_draw_sprite(int x, int y, int sprite, frame_t *dest);
@@ -63,6 +65,11 @@ void gfx_set_palette(int palette);
 void gfx_unpack_transparent_sprite(void *dest, const void *src, size_t destlen, int offset);
 void gfx_unpack_overlay_sprite(void *dest, const void *src, size_t destlen);
 void gfx_unpack_mask_sprite(void *dest, const void *src, size_t destlen);
+void gfx_mask_sprite(void *dest, const sprite_t *sprite, const sprite_t *mask);
+void gfx_apply_mask(void *dest, const void *mask, size_t n);
+void gfx_palette_to_rgba(uint32_t *dest, const uint8_t *src, size_t n, const uint32_t *lut);
+
+int gfx_benchmark();
 
 
 #endif /* ! _GFX_H */
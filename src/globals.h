@@ -32,6 +32,7 @@
 #include "flag.h"
 #include "player.h"
 #include "random.h"
+#include "pool.h"
 
 
 /* Globals struct */
@@ -159,6 +160,11 @@ typedef struct {
 	uint16_t max_ever_serf_index;
 	uint16_t max_inventory_cnt;
 	uint16_t max_ever_inventory_index;
+	/* ADDITION */
+	pool_t flg_pool;
+	pool_t building_pool;
+	pool_t serf_pool;
+	pool_t inventory_pool;
 	/* 26C */
 	uint16_t next_index;
 	uint16_t flag_search_counter;
@@ -42,6 +42,8 @@ interface_draw(interface_t *interface, frame_t *frame)
 	if (interface->top->displayed &&
 	    (interface->redraw_top || redraw_above)) {
 		gui_object_redraw(interface->top, frame);
+		sdl_mark_dirty(frame->clip.x, frame->clip.y,
+			       interface->top->width, interface->top->height);
 		interface->redraw_top = 0;
 		redraw_above = 1;
 	}
@@ -57,6 +59,8 @@ interface_draw(interface_t *interface, frame_t *frame)
 				       frame->clip.y + fl->y,
 				       fl->obj->width, fl->obj->height, frame);
 			gui_object_redraw(fl->obj, &float_frame);
+			sdl_mark_dirty(float_frame.clip.x, float_frame.clip.y,
+				       fl->obj->width, fl->obj->height);
 			fl->redraw = 0;
 			redraw_above = 1;
 		}
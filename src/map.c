@@ -43,6 +43,7 @@
 
 #include "map.h"
 #include "viewport.h"
+#include "player.h"
 #include "random.h"
 #include "globals.h"
 #include "misc.h"
@@ -1314,12 +1315,147 @@ map_init()
 	/* globals.svga |= BIT(5); */
 }
 
+/* Ground analysis estimates. For every map position the weighted sum
+   of each ground deposit type within GROUND_ANALYSIS_RADIUS is kept, so
+   a ground analysis is a lookup instead of a walk over 1801 positions.
+   The weight of a sample attenuates linearly with the distance to the
+   center. The estimates are built on the first query and updated
+   incrementally when a deposit changes. */
+#define GROUND_ANALYSIS_RADIUS  25
+
+typedef struct {
+	map_pos_t offset;
+	int weight;
+} deposit_sample_t;
+
+static uint32_t *deposit_estimate;
+static deposit_sample_t *deposit_samples;
+static int deposit_sample_count;
+
+/* Return the value a map position adds to the estimate of the
+   deposit type stored in type, or zero if it is not a deposit. */
+static int
+deposit_value(map_pos_t pos, ground_deposit_t *type)
+{
+	*type = MAP_RES_TYPE(pos);
+	if ((MAP_OBJ(pos) != MAP_OBJ_NONE &&
+	     MAP_OBJ(pos) < MAP_OBJ_TREE_0) ||
+	    *type < GROUND_DEPOSIT_GOLD || *type > GROUND_DEPOSIT_STONE) {
+		return 0;
+	}
+
+	return MAP_RES_AMOUNT(pos);
+}
+
+/* Add value of type at pos to the estimate of every position
+   that samples pos. */
+static void
+scatter_deposit_value(map_pos_t pos, ground_deposit_t type, int value)
+{
+	for (int i = 0; i < deposit_sample_count; i++) {
+		map_pos_t center = MAP_POS_ADD(pos, deposit_samples[i].offset);
+		deposit_estimate[4*center + type - 1] +=
+			deposit_samples[i].weight*value;
+	}
+}
+
+/* Add a sample at pos relative to the origin. The offset is stored
+   negated, so adding it to the sampled position gives the center. */
+static void
+add_deposit_sample(map_pos_t pos, int weight)
+{
+	map_pos_t offset = MAP_POS(-MAP_POS_COL(pos) & globals.map.col_mask,
+				   -MAP_POS_ROW(pos) & globals.map.row_mask);
+	deposit_samples[deposit_sample_count].offset = offset;
+	deposit_samples[deposit_sample_count].weight = weight;
+	deposit_sample_count += 1;
+}
+
+static void
+build_deposit_estimate()
+{
+	/* Follow the spiral of the original analysis, so positions
+	   that are sampled twice on small maps are weighted the same. */
+	int max = 1 + 3*GROUND_ANALYSIS_RADIUS*(GROUND_ANALYSIS_RADIUS-1);
+	deposit_samples = malloc(max*sizeof(deposit_sample_t));
+	if (deposit_samples == NULL) abort();
+
+	deposit_sample_count = 0;
+
+	map_pos_t pos = 0;
+	add_deposit_sample(pos, GROUND_ANALYSIS_RADIUS);
+
+	const dir_t dirs[] = {
+		DIR_DOWN, DIR_LEFT, DIR_UP_LEFT,
+		DIR_UP, DIR_RIGHT, DIR_DOWN_RIGHT
+	};
+
+	for (int i = 0; i < GROUND_ANALYSIS_RADIUS-1; i++) {
+		pos = MAP_MOVE_RIGHT(pos);
+
+		for (int d = 0; d < 6; d++) {
+			for (int j = 0; j < i+1; j++) {
+				add_deposit_sample(pos, GROUND_ANALYSIS_RADIUS-i);
+				pos = MAP_MOVE(pos, dirs[d]);
+			}
+		}
+	}
+
+	deposit_estimate = calloc(4*globals.map.tile_count, sizeof(uint32_t));
+	if (deposit_estimate == NULL) abort();
+
+	for (uint pos = 0; pos < globals.map.tile_count; pos++) {
+		ground_deposit_t type;
+		int value = deposit_value(pos, &type);
+		if (value > 0) scatter_deposit_value(pos, type, value);
+	}
+}
+
+/* Update the estimates after a change of the ground deposit or object
+   at pos. The value and type are those returned by deposit_value()
+   before the change. */
+static void
+update_deposit_estimate(map_pos_t pos, ground_deposit_t old_type,
+			int old_value)
+{
+	if (deposit_estimate == NULL) return;
+
+	ground_deposit_t type;
+	int value = deposit_value(pos, &type);
+	if (value == old_value && type == old_type) return;
+
+	if (old_value > 0) scatter_deposit_value(pos, old_type, -old_value);
+	if (value > 0) scatter_deposit_value(pos, type, value);
+}
+
+/* Return the weighted amount of ground deposit type around pos,
+   as sampled by a ground analysis at pos. */
+uint
+map_get_deposit_estimate(map_pos_t pos, ground_deposit_t type)
+{
+	if (type < GROUND_DEPOSIT_GOLD || type > GROUND_DEPOSIT_STONE) return 0;
+	if (deposit_estimate == NULL) build_deposit_estimate();
+	return deposit_estimate[4*pos + type - 1];
+}
+
+/* Discard the estimates. Must be called when a new map is set up. */
+void
+map_reset_deposit_estimate()
+{
+	free(deposit_estimate);
+	deposit_estimate = NULL;
+	free(deposit_samples);
+	deposit_samples = NULL;
+	deposit_sample_count = 0;
+}
+
 /* Change the height of a map position. */
 void
 map_set_height(map_pos_t pos, int height)
 {
 	map_tile_t *tiles = globals.map.tiles;
 	tiles[pos].height = (tiles[pos].height & 0xe0) | (height & 0x1f);
+	player_invalidate_build_sites(pos);
 
 	/* Mark landscape dirty in viewport. */
 	viewport_redraw_map_pos(pos);
@@ -1332,10 +1468,16 @@ void
 map_set_object(map_pos_t pos, map_obj_t obj, int index)
 {
 	map_tile_t *tiles = globals.map.tiles;
+	ground_deposit_t type;
+	int value = deposit_value(pos, &type);
+
 	tiles[pos].obj = (tiles[pos].obj & 0x80) | (obj & 0x7f);
 	if (index >= 0) tiles[pos].u.index = index;
+	update_deposit_estimate(pos, type, value);
+	player_invalidate_build_sites(pos);
 
-	/* TODO Mark dirty in viewport. */
+	/* Mark object for drawing in viewport. */
+	if (obj != MAP_OBJ_NONE) viewport_index_add_object(pos);
 }
 
 /* Remove resources from the ground at a map position. */
@@ -1343,12 +1485,17 @@ void
 map_remove_ground_deposit(map_pos_t pos, int amount)
 {
 	map_tile_t *tiles = globals.map.tiles;
+	ground_deposit_t type;
+	int value = deposit_value(pos, &type);
+
 	tiles[pos].u.s.resource -= amount;
 
 	if (MAP_RES_AMOUNT(pos) == 0) {
 		/* Also sets the ground deposit type to none. */
 		tiles[pos].u.s.resource = 0;
 	}
+
+	update_deposit_estimate(pos, type, value);
 }
 
 /* Remove fish at a map position (must be water). */
@@ -1356,7 +1503,11 @@ void
 map_remove_fish(map_pos_t pos, int amount)
 {
 	map_tile_t *tiles = globals.map.tiles;
+	ground_deposit_t type;
+	int value = deposit_value(pos, &type);
+
 	tiles[pos].u.s.resource -= amount;
+	update_deposit_estimate(pos, type, value);
 }
 
 /* Set the index of the serf occupying map position. */
@@ -1366,7 +1517,8 @@ map_set_serf_index(map_pos_t pos, int index)
 	map_tile_t *tiles = globals.map.tiles;
 	tiles[pos].serf_index = index;
 
-	/* TODO Mark dirty in viewport. */
+	/* Mark serf for drawing in viewport. */
+	if (index != 0) viewport_index_add_serf(pos);
 }
 
 /* Return non-zero if the neighbours of position are
@@ -1453,7 +1605,10 @@ map_update_hidden(map_pos_t pos)
 
 			if (tiles[pos].u.s.resource < 10 && (r & 0x3f00)) {
 				/* Spawn more fish. */
+				ground_deposit_t type;
+				int value = deposit_value(pos, &type);
 				tiles[pos].u.s.resource += 1;
+				update_deposit_estimate(pos, type, value);
 			}
 
 			/* Move in a random direction of: right, down right, left, up left */
@@ -1468,8 +1623,13 @@ map_update_hidden(map_pos_t pos)
 
 			if (MAP_DEEP_WATER(adj_pos)) {
 				/* Migrate a fish to adjacent water space. */
+				ground_deposit_t type, adj_type;
+				int value = deposit_value(pos, &type);
+				int adj_value = deposit_value(adj_pos, &adj_type);
 				tiles[pos].u.s.resource -= 1;
 				tiles[adj_pos].u.s.resource += 1;
+				update_deposit_estimate(pos, type, value);
+				update_deposit_estimate(adj_pos, adj_type, adj_value);
 			}
 		}
 	}
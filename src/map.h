@@ -268,6 +268,9 @@ void map_remove_ground_deposit(map_pos_t pos, int amount);
 void map_remove_fish(map_pos_t pos, int amount);
 void map_set_serf_index(map_pos_t pos, int index);
 
+uint map_get_deposit_estimate(map_pos_t pos, ground_deposit_t type);
+void map_reset_deposit_estimate();
+
 int map_is_deep_water(map_pos_t pos);
 
 void map_init_dimensions(map_t *map);
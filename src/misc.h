@@ -30,6 +30,9 @@
 #define min(x,y)      (((x) < (y)) ? (x) : (y))
 #define clamp(l,x,h)  (max((l),min((x),(h))))
 
+/* Fail compilation if cond is false. Use at file scope. */
+#define STATIC_ASSERT(cond, name)  typedef char static_assert_##name[(cond) ? 1 : -1]
+
 typedef unsigned int uint;
 
 #endif /* ! _MISC_H */
@@ -19,24 +19,58 @@
  * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "map.h"
 #include "pqueue.h"
-#include "list.h"
 #include "game.h"
 #include "globals.h"
 #include "freeserf.h"
 
+/* Number of search nodes in each block of the node arena. */
+#define NODE_BLOCK_SIZE  1024
+
 typedef struct search_node search_node_t;
+typedef struct node_block node_block_t;
 
 struct search_node {
-	list_elm_t elm;
 	map_pos_t pos;
 	uint g_score;
 	uint f_score;
 	search_node_t *parent;
 	dir_t dir;
+	int closed;
+	uint heap_index;
+};
+
+struct node_block {
+	node_block_t *next;
+	search_node_t nodes[NODE_BLOCK_SIZE];
 };
 
+/* Search nodes are allocated from a list of blocks that are kept
+   between searches. Resetting the arena releases all nodes at once. */
+static node_block_t *node_arena = NULL;
+static node_block_t *node_arena_current = NULL;
+static uint node_arena_used = 0;
+
+/* Open list is kept between searches to retain its capacity. */
+static pqueue_t open_list;
+static int open_initialized = 0;
+
+/* Nodes indexed by map position. An entry is only valid if its
+   generation matches the current search generation, which allows
+   the whole table to be reset by incrementing the generation. */
+static search_node_t **node_table = NULL;
+static uint *node_table_gen = NULL;
+static uint node_table_size = 0;
+static uint node_table_generation = 0;
+
+/* The directions of the last path found. The array grows
+   to fit the longest path and is kept between searches. */
+static dir_t *solution = NULL;
+static uint solution_size = 0;
+
 
 static int
 search_node_less(search_node_t *n1, search_node_t *n2)
@@ -44,6 +78,87 @@ search_node_less(search_node_t *n1, search_node_t *n2)
 	return n1->f_score < n2->f_score;
 }
 
+static void
+search_node_set_index(search_node_t *node, uint index)
+{
+	node->heap_index = index;
+}
+
+static void
+node_arena_reset()
+{
+	node_arena_current = node_arena;
+	node_arena_used = 0;
+}
+
+static search_node_t *
+node_arena_alloc()
+{
+	if (node_arena_current == NULL ||
+	    node_arena_used == NODE_BLOCK_SIZE) {
+		node_block_t *next = (node_arena_current != NULL) ?
+			node_arena_current->next : node_arena;
+		if (next == NULL) {
+			/* Out of blocks, extend the arena. */
+			next = malloc(sizeof(node_block_t));
+			if (next == NULL) abort();
+
+			next->next = NULL;
+			if (node_arena_current != NULL) {
+				node_arena_current->next = next;
+			} else {
+				node_arena = next;
+			}
+		}
+
+		node_arena_current = next;
+		node_arena_used = 0;
+	}
+
+	return &node_arena_current->nodes[node_arena_used++];
+}
+
+/* Prepare node table for a new search. */
+static void
+node_table_reset()
+{
+	if (node_table_size != globals.map.tile_count) {
+		free(node_table);
+		free(node_table_gen);
+
+		node_table_size = globals.map.tile_count;
+		node_table = malloc(node_table_size*sizeof(search_node_t *));
+		if (node_table == NULL) abort();
+
+		node_table_gen = calloc(node_table_size, sizeof(uint));
+		if (node_table_gen == NULL) abort();
+
+		node_table_generation = 0;
+	}
+
+	node_table_generation += 1;
+
+	/* Clear the table if the generation counter has overflown. */
+	if (node_table_generation == 0) {
+		memset(node_table_gen, 0, node_table_size*sizeof(uint));
+		node_table_generation = 1;
+	}
+}
+
+static search_node_t *
+node_table_get(map_pos_t pos)
+{
+	if (node_table_gen[pos] != node_table_generation) return NULL;
+	return node_table[pos];
+}
+
+static void
+node_table_set(map_pos_t pos, search_node_t *node)
+{
+	node_table[pos] = node;
+	node_table_gen[pos] = node_table_generation;
+}
+
 static const uint walk_cost[] = { 255, 319, 383, 447, 511 };
 
 static uint
@@ -81,33 +196,47 @@ actual_cost(map_pos_t pos, dir_t dir)
 
 /* Find the shortest path from start to end (using A*) considering that
    the walking time for a serf walking in any direction of the path
-   should be minimized. Returns a malloc'ed array of directions and
-   the size of this array in length. */
-dir_t *
-pathfinder_map(map_pos_t start, map_pos_t end, uint *length)
+   should be minimized. The directions of the path are returned in dirs
+   and the number of directions in length. The array is owned by the
+   pathfinder and is valid until the next search. Returns -1 if no path
+   was found. */
+int
+pathfinder_map(map_pos_t start, map_pos_t end,
+	       const dir_t **dirs, uint *length)
 {
-	list_t closed;
-	list_init(&closed);
+	if (!open_initialized) {
+		int r = pqueue_init(&open_list, 32,
+				    (pqueue_less_func *)search_node_less);
+		if (r < 0) abort();
+
+		pqueue_set_index_func(&open_list,
+				      (pqueue_index_func *)search_node_set_index);
+		open_initialized = 1;
+	}
 
-	pqueue_t open;
-	pqueue_init(&open, 32,
-		    (pqueue_less_func *)search_node_less);
+	open_list.size = 0;
+	node_arena_reset();
+	node_table_reset();
 
-	dir_t *solution = NULL;
+	int result = -1;
 
 	/* Create start node */
-	search_node_t *node = malloc(sizeof(search_node_t));
-	if (node == NULL) abort();
-
+	search_node_t *node = node_arena_alloc();
 	node->pos = start;
 	node->g_score = 0;
 	node->f_score = heuristic_cost(start, end);
 	node->parent = NULL;
-	int r = pqueue_insert(&open, node);
+	node->closed = 0;
+	node_table_set(start, node);
+	int r = pqueue_insert(&open_list, node);
 	if (r < 0) abort();
 
-	while (!pqueue_is_empty(&open)) {
-		node = pqueue_pop(&open);
+	while (!pqueue_is_empty(&open_list)) {
+		node = pqueue_pop(&open_list);
+
+		/* Put current node on closed list. */
+		node->closed = 1;
+
 		if (node->pos == end) {
 			/* Construct solution */
 			*length = 0;
@@ -117,19 +246,23 @@ pathfinder_map(map_pos_t start, map_pos_t end, uint *length)
 				n = n->parent;
 			}
 
-			solution = malloc(*length*sizeof(dir_t));
-			if (solution == NULL) abort();
+			if (*length > solution_size) {
+				solution_size = max(*length, 2*solution_size);
+				solution = realloc(solution,
+						   solution_size*sizeof(dir_t));
+				if (solution == NULL) abort();
+			}
 
 			for (int i = *length-1; i >= 0; i--) {
 				solution[i] = node->dir;
 				node = node->parent;
 			}
+
+			*dirs = solution;
+			result = 0;
 			break;
 		}
 
-		/* Put current node on closed list. */
-		list_prepend(&closed, (list_elm_t *)node);
-
 		for (dir_t d = DIR_RIGHT; d <= DIR_UP; d++) {
 			map_pos_t new_pos = MAP_MOVE(node->pos, d);
 			uint cost = actual_cost(node->pos, d);
@@ -139,67 +272,35 @@ pathfinder_map(map_pos_t start, map_pos_t end, uint *length)
 				continue;
 			}
 
-			/* Check if neighbour is in closed list. */
-			int in_closed = 0;
-			list_elm_t *elm;
-			list_foreach(&closed, elm) {
-				search_node_t *n = (search_node_t *)elm;
-				if (n->pos == new_pos) {
-					in_closed = 1;
-					break;
-				}
-			}
+			search_node_t *n = node_table_get(new_pos);
 
-			if (in_closed) continue;
-
-			/* See if neighbour is already in open list. */
-			int in_open = 0;
-			for (int i = 0; i < open.size; i++) {
-				search_node_t *n = open.entries[i];
-				if (n->pos == new_pos) {
-					in_open = 1;
-					if (n->g_score >= node->g_score + cost) {
-						pqueue_remove(&open, i);
-						n->g_score = node->g_score + cost;
-						n->f_score = n->g_score + heuristic_cost(new_pos, end);
-						n->parent = node;
-						n->dir = d;
-						int r = pqueue_insert(&open, n);
-						if (r < 0) abort();
-					}
-					break;
+			/* Check if neighbour is in closed list. */
+			if (n != NULL && n->closed) continue;
+
+			if (n != NULL) {
+				/* Neighbour is already in open list. */
+				if (n->g_score >= node->g_score + cost) {
+					n->g_score = node->g_score + cost;
+					n->f_score = n->g_score + heuristic_cost(new_pos, end);
+					n->parent = node;
+					n->dir = d;
+					pqueue_decrease_key(&open_list, n->heap_index);
 				}
-			}
-
-			/* If not found in the open set, create a new node. */
-			if (!in_open) {
-				search_node_t *new_node = malloc(sizeof(search_node_t));
-				if (new_node == NULL) abort();
-
+			} else {
+				/* Not found in the open set, create a new node. */
+				search_node_t *new_node = node_arena_alloc();
 				new_node->pos = new_pos;
 				new_node->g_score = node->g_score + cost;
 				new_node->f_score = new_node->g_score + heuristic_cost(new_pos, end);
 				new_node->parent = node;
 				new_node->dir = d;
-				int r = pqueue_insert(&open, new_node);
+				new_node->closed = 0;
+				node_table_set(new_pos, new_node);
+				int r = pqueue_insert(&open_list, new_node);
 				if (r < 0) abort();
 			}
 		}
 	}
 
-	/* Clean up open list */
-	for (int i = 0; i < open.size; i++) {
-		free(open.entries[i]);
-	}
-
-	pqueue_deinit(&open);
-
-	/* Clean up closed list */
-	while (!list_is_empty(&closed)) {
-		search_node_t *node =
-			(search_node_t *)list_remove_head(&closed);
-		free(node);
-	}
-
-	return solution;
+	return result;
 }
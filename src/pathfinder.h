@@ -25,6 +25,7 @@
 #include "map.h"
 #include "freeserf.h"
 
-dir_t *pathfinder_map(map_pos_t start, map_pos_t end, uint *length);
+int pathfinder_map(map_pos_t start, map_pos_t end,
+		   const dir_t **dirs, uint *length);
 
 #endif /* !_PATHFINDER_H */
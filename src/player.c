@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "player.h"
@@ -171,10 +172,10 @@ populate_circular_map_pos_array(map_pos_t map_pos[], map_pos_t init_pos, int siz
 	}
 }
 
-/* Return the cursor type and various related values of a map_pos_t. */
+/* Determine the cursor type and various related values of a map_pos_t. */
 static void
-get_map_cursor_type(const player_sett_t *sett, map_pos_t pos, panel_btn_t *panel_btn,
-		    int *build_flags, int *cursor_type, int *height_after_level)
+determine_map_cursor_type(const player_sett_t *sett, map_pos_t pos, panel_btn_t *panel_btn,
+			  int *build_flags, int *cursor_type, int *height_after_level)
 {
 	map_pos_t map_pos[1+6+12+18];
 	populate_circular_map_pos_array(map_pos, pos, 1+6+12+18);
@@ -356,6 +357,127 @@ get_map_cursor_type(const player_sett_t *sett, map_pos_t pos, panel_btn_t *panel
 	}
 }
 
+/* The results of determine_map_cursor_type() are kept for each player
+   and map position, since they are needed every time the cursor moves
+   and for each neighbour of the cursor when building roads. The result
+   at a position depends on the map within three shells of it, so
+   player_invalidate_build_sites() is called when objects, paths,
+   heights or owners change on the map, or when a building changes in
+   a way that matters for building nearby. The result on a flag depends
+   on the roads connected to it, so it is not kept.
+
+   A result records which of the values determine_map_cursor_type()
+   changed, and to what:
+   bits 0-3: cursor type plus one, or zero if unchanged.
+   bits 4-6: panel button plus one, or zero if unchanged.
+   bit 7: build flag bit 1 (can not build flag) is cleared.
+   bit 8: value of build flag bit 0 (can not build military building).
+   bit 9: build flag bit 0 is changed.
+   bits 10-14: height after level.
+   bit 15: height after level is changed. */
+#define BUILD_SITE_INVALID  0xffff
+
+static uint16_t *build_sites[4];
+static uint build_sites_size;
+
+static uint16_t
+build_site_determine(const player_sett_t *sett, map_pos_t pos)
+{
+	panel_btn_t panel_btn = (panel_btn_t)-1;
+	int build_flags = BIT(1) | BIT(0);
+	int cursor_type = -1;
+	int height_after_level = -1;
+	determine_map_cursor_type(sett, pos, &panel_btn, &build_flags,
+				  &cursor_type, &height_after_level);
+
+	uint16_t site = 0;
+	if (cursor_type >= 0) site |= cursor_type + 1;
+	if (panel_btn != (panel_btn_t)-1) site |= (panel_btn + 1) << 4;
+	if (!BIT_TEST(build_flags, 1)) site |= BIT(7);
+	if (height_after_level >= 0) site |= BIT(15) | (height_after_level << 10);
+
+	if (!BIT_TEST(build_flags, 0)) {
+		site |= BIT(9);
+	} else {
+		/* Find out whether bit 0 was set or left unchanged. */
+		panel_btn_t p;
+		int c, h;
+		build_flags = BIT(1);
+		determine_map_cursor_type(sett, pos, &p, &build_flags, &c, &h);
+		if (BIT_TEST(build_flags, 0)) site |= BIT(9) | BIT(8);
+	}
+
+	return site;
+}
+
+/* Return the cursor type and various related values of a map_pos_t. */
+static void
+get_map_cursor_type(const player_sett_t *sett, map_pos_t pos, panel_btn_t *panel_btn,
+		    int *build_flags, int *cursor_type, int *height_after_level)
+{
+	if (map_space_from_obj[MAP_OBJ(pos)] == MAP_SPACE_FLAG) {
+		determine_map_cursor_type(sett, pos, panel_btn, build_flags,
+					  cursor_type, height_after_level);
+		return;
+	}
+
+	if (build_sites_size != globals.map.tile_count) {
+		player_reset_build_sites();
+		build_sites_size = globals.map.tile_count;
+	}
+
+	uint16_t *sites = build_sites[sett->player_num];
+	if (sites == NULL) {
+		sites = malloc(build_sites_size*sizeof(uint16_t));
+		if (sites == NULL) abort();
+		memset(sites, 0xff, build_sites_size*sizeof(uint16_t));
+		build_sites[sett->player_num] = sites;
+	}
+
+	if (sites[pos] == BUILD_SITE_INVALID) {
+		sites[pos] = build_site_determine(sett, pos);
+	}
+
+	uint16_t site = sites[pos];
+	if (site & 0xf) *cursor_type = (site & 0xf) - 1;
+	if ((site >> 4) & 7) *panel_btn = ((site >> 4) & 7) - 1;
+	if (BIT_TEST(site, 7)) *build_flags &= ~BIT(1);
+	if (BIT_TEST(site, 9)) {
+		*build_flags = (*build_flags & ~BIT(0)) | ((site >> 8) & 1);
+	}
+	if (BIT_TEST(site, 15)) *height_after_level = (site >> 10) & 0x1f;
+}
+
+/* Forget the cursor types of the positions that can be affected
+   by a change of the map at pos. */
+void
+player_invalidate_build_sites(map_pos_t pos)
+{
+	if (build_sites_size != globals.map.tile_count) return;
+
+	for (int p = 0; p < 4; p++) {
+		uint16_t *sites = build_sites[p];
+		if (sites == NULL) continue;
+
+		for (int i = 0; i < 1+6+12+18; i++) {
+			sites[MAP_POS_ADD(pos, globals.spiral_pos_pattern[i])] =
+				BUILD_SITE_INVALID;
+		}
+	}
+}
+
+/* Forget all cursor types. */
+void
+player_reset_build_sites()
+{
+	for (int p = 0; p < 4; p++) {
+		free(build_sites[p]);
+		build_sites[p] = NULL;
+	}
+
+	build_sites_size = 0;
+}
+
 /* Update the player_t object with the information returned
    in get_map_cursor_type(). */
 void
@@ -599,6 +721,8 @@ player_build_road_end(player_t *player)
 
 		tiles[pos].flags &= ~BIT(backtrack_dir);
 		tiles[next_pos].flags &= ~BIT(DIR_REVERSE(backtrack_dir));
+		player_invalidate_build_sites(pos);
+		player_invalidate_build_sites(next_pos);
 		pos = next_pos;
 	}
 
@@ -724,6 +848,8 @@ player_build_road_connect_flag(player_t *player, map_pos_t dest, dir_t out_dir)
 	dest_flag->other_endpoint.f[out_dir] = src_flag;
 	src_flag->other_endpoint.f[in_dir] = dest_flag;
 
+	flag_route_invalidate_paths(dest_flag);
+
 	return 0;
 }
 
@@ -749,6 +875,8 @@ player_build_road_segment(player_t *player, map_pos_t pos, dir_t dir)
 			player->sett->map_cursor_row = MAP_POS_ROW(dest);
 			tiles[pos].flags |= BIT(dir);
 			tiles[dest].flags |= BIT(dir_rev);
+			player_invalidate_build_sites(pos);
+			player_invalidate_build_sites(dest);
 			player->road_length = 0;
 			player_build_road_end(player);
 			return 1;
@@ -758,6 +886,8 @@ player_build_road_segment(player_t *player, map_pos_t pos, dir_t dir)
 		player->road_length += 1;
 		tiles[pos].flags |= BIT(dir);
 		tiles[dest].flags |= BIT(dir_rev);
+		player_invalidate_build_sites(pos);
+		player_invalidate_build_sites(dest);
 
 		player->sett->map_cursor_col = MAP_POS_COL(dest);
 		player->sett->map_cursor_row = MAP_POS_ROW(dest);
@@ -784,6 +914,8 @@ player_remove_road_segment(player_t *player, map_pos_t pos, dir_t dir)
 	player->road_length -= 1;
 	tiles[pos].flags &= ~BIT(dir);
 	tiles[dest].flags &= ~BIT(dir_rev);
+	player_invalidate_build_sites(pos);
+	player_invalidate_build_sites(dest);
 
 	player->sett->map_cursor_col = MAP_POS_COL(dest);
 	player->sett->map_cursor_row = MAP_POS_ROW(dest);
@@ -829,22 +961,27 @@ player_demolish_object(player_t *player)
 static int
 change_transporter_state_at_pos(map_pos_t pos, serf_state_t state)
 {
-	for (int i = 1; i < globals.max_ever_serf_index; i++) {
-		if (SERF_ALLOCATED(i)) {
-			serf_t *serf = game_get_serf(i);
-			if (serf->pos == pos &&
-			    (serf->state == SERF_STATE_WAKE_AT_FLAG ||
-			     serf->state == SERF_STATE_WAKE_ON_PATH ||
-			     serf->state == SERF_STATE_WAIT_IDLE_ON_PATH ||
-			     serf->state == SERF_STATE_IDLE_ON_PATH)) {
-				serf_log_state_change(serf, state);
-				serf->state = state;
-				return SERF_INDEX(serf);
-			}
+	/* Look up the serf in the serf index. If there is more
+	   than one, take the first in the serf array. */
+	serf_t *transporter = NULL;
+	int i, next;
+	serf_foreach_at_pos(pos, i, next) {
+		serf_t *serf = game_get_serf(i);
+		if ((transporter == NULL || i < SERF_INDEX(transporter)) &&
+		    (serf->state == SERF_STATE_WAKE_AT_FLAG ||
+		     serf->state == SERF_STATE_WAKE_ON_PATH ||
+		     serf->state == SERF_STATE_WAIT_IDLE_ON_PATH ||
+		     serf->state == SERF_STATE_IDLE_ON_PATH)) {
+			transporter = serf;
 		}
 	}
 
-	return -1;
+	if (transporter == NULL) return -1;
+
+	serf_log_state_change(transporter, state);
+	serf_set_state(transporter, state);
+
+	return SERF_INDEX(transporter);
 }
 
 static int
@@ -1003,7 +1140,7 @@ restore_path_serf_info(flag_t *flag, dir_t dir, serf_path_info_t *data)
 				}
 			} else {
 				serf_log_state_change(serf, SERF_STATE_WAKE_AT_FLAG);
-				serf->state = SERF_STATE_WAKE_AT_FLAG;
+				serf_set_state(serf, SERF_STATE_WAKE_AT_FLAG);
 			}
 		}
 	}
@@ -1057,43 +1194,55 @@ build_flag_split_path(map_pos_t pos)
 
 	int select = -1;
 	if (BIT_TEST(flag_2->length[dir_2], 7)) {
-		for (int i = 1; i < globals.max_ever_serf_index; i++) {
-			if (SERF_ALLOCATED(i)) {
+		/* Find the first serf in the serf array that is on its
+		   way to one of the paths. The candidates are taken
+		   from the serf destination index. */
+		const uint dests[] = {
+			path_1_data.flag_index,
+			path_2_data.flag_index
+		};
+
+		int select_index = 0;
+		for (int k = 0; k < 2; k++) {
+			int i, next;
+			serf_foreach_with_dest(dests[k], i, next) {
+				if (select_index != 0 && i > select_index) continue;
+
 				serf_t *serf = game_get_serf(i);
+				int match = -1;
 
 				if (serf->state == SERF_STATE_WALKING) {
 					if (serf->s.walking.dest == path_1_data.flag_index &&
 					    serf->s.walking.res == path_1_data.flag_dir) {
-						select = 0;
-						break;
+						match = 0;
 					} else if (serf->s.walking.dest == path_2_data.flag_index &&
 						   serf->s.walking.res == path_2_data.flag_dir) {
-						select = 1;
-						break;
+						match = 1;
 					}
 				} else if (serf->state == SERF_STATE_READY_TO_LEAVE_INVENTORY) {
 					if (serf->s.ready_to_leave_inventory.dest == path_1_data.flag_index &&
 					    serf->s.ready_to_leave_inventory.mode == path_1_data.flag_dir) {
-						select = 0;
-						break;
+						match = 0;
 					} else if (serf->s.ready_to_leave_inventory.dest == path_2_data.flag_index &&
 						   serf->s.ready_to_leave_inventory.mode == path_2_data.flag_dir) {
-						select = 1;
-						break;
+						match = 1;
 					}
 				} else if ((serf->state == SERF_STATE_READY_TO_LEAVE ||
 					    serf->state == SERF_STATE_LEAVING_BUILDING) &&
 					   serf->s.leaving_building.next_state == SERF_STATE_WALKING) {
 					if (serf->s.leaving_building.dest == path_1_data.flag_index &&
 					    serf->s.leaving_building.field_B == path_1_data.flag_dir) {
-						select = 0;
-						break;
+						match = 0;
 					} else if (serf->s.leaving_building.dest == path_2_data.flag_index &&
 						   serf->s.leaving_building.field_B == path_2_data.flag_dir) {
-						select = 1;
-						break;
+						match = 1;
 					}
 				}
+
+				if (match >= 0) {
+					select = match;
+					select_index = i;
+				}
 			}
 		}
 
@@ -1108,6 +1257,8 @@ build_flag_split_path(map_pos_t pos)
 
 	restore_path_serf_info(flag, path_1_dir, &path_1_data);
 	restore_path_serf_info(flag, path_2_dir, &path_2_data);
+
+	flag_route_invalidate_paths(flag);
 }
 
 /* Build new flag. */
@@ -1214,6 +1365,7 @@ build_building(player_t *player, map_obj_t obj_type)
 	bld->pos = pos;
 	player->sett->incomplete_building_count[bld_type] += 1;
 	bld->bld = BIT(7) | (bld_type << 2) | player->sett->player_num; /* bit 7: Unfinished building */
+	building_index_update(bld_index);
 	bld->progress = 0;
 	if (obj_type == 2) bld->progress = 1;
 
@@ -1238,7 +1390,7 @@ build_building(player_t *player, map_obj_t obj_type)
 
 	/* move_map_resources(pos, map_data); */
 	/* TODO Resources should be moved, just set them to zero for now */
-	tiles[pos].u.s.resource = 0;
+	map_remove_ground_deposit(pos, MAP_RES_AMOUNT(pos));
 	tiles[pos].u.s.field_1 = 0;
 
 	map_set_object(pos, obj_type, bld_index);
@@ -1359,7 +1511,7 @@ create_initial_castle_serfs(player_sett_t *sett)
 	serf->type = (serf->type & 0x83) | (SERF_4 << 2);
 
 	serf_log_state_change(serf, SERF_STATE_BUILDING_CASTLE);
-	serf->state = SERF_STATE_BUILDING_CASTLE;
+	serf_set_state(serf, SERF_STATE_BUILDING_CASTLE);
 	serf->s.building_castle.inv_index = sett->castle_inventory;
 	map_set_serf_index(serf->pos, SERF_INDEX(serf));
 
@@ -1550,6 +1702,7 @@ player_build_castle(player_t *player)
 	/* TODO set_map_redraw(); */
 
 	player->sett->flags |= BIT(0); /* Has castle */
+	player_reset_build_sites();
 	player->sett->build |= BIT(3);
 	player->sett->total_building_score += building_get_score_from_type(BUILDING_CASTLE);
 
@@ -1618,6 +1771,7 @@ player_build_castle(player_t *player)
 	castle->pos = map_cursor_pos;
 	flag->pos = MAP_MOVE_DOWN_RIGHT(map_cursor_pos);
 	castle->bld = BIT(7) | (BUILDING_CASTLE << 2) | player->sett->player_num;
+	building_index_update(bld_index);
 	castle->progress = 0;
 	castle->stock1 = 0xff;
 	castle->stock2 = 0xff;
@@ -1848,88 +2002,148 @@ player_promote_serfs_to_knights(player_sett_t *sett, int number)
 	return promoted;
 }
 
+/* Return the order in which the spiral around pos visits the offset
+   (dx, dy), as shell << 8 | step, or -1 if the spiral does not reach
+   the offset. The spiral visits the shells at distance 1 to 32, each
+   starting to the right of pos and going down, left, up-left, up,
+   right and down-right. */
 static int
-available_knights_at_pos(player_sett_t *sett, map_pos_t pos, int index, int dist)
+spiral_order(int dx, int dy)
 {
-	const int min_level_hut[] = { 1, 1, 2, 2, 3 };
-	const int min_level_tower[] = { 1, 2, 3, 4, 6 };
-	const int min_level_fortress[] = { 1, 3, 6, 9, 12 };
+	int r;
+	if ((dx >= 0) == (dy >= 0)) r = max(abs(dx), abs(dy));
+	else r = abs(dx) + abs(dy);
 
-	if (MAP_OWNER(pos) != sett->player_num || MAP_WATER(pos) ||
-	    MAP_OBJ(pos) < MAP_OBJ_SMALL_BUILDING ||
-	    MAP_OBJ(pos) > MAP_OBJ_CASTLE) {
-		return index;
-	}
+	if (r < 1 || r > 32) return -1;
+
+	int step;
+	if (dx == r && dy < r) step = dy;
+	else if (dy == r && dx > 0) step = r + (r - dx);
+	else if (dx <= 0 && dy > 0) step = 2*r - dx;
+	else if (dx == -r && dy > -r) step = 3*r - dy;
+	else step = 5*r + dx; /* Right or down-right */
+
+	return ((r-1) << 8) | step;
+}
 
-	int bld_index = MAP_OBJ_INDEX(pos);
-	for (int i = 0; i < index; i++) {
-		if (sett->attacking_buildings[i] == bld_index) {
-			return index;
+/* Return the first time the spiral around pos visits pos2, or -1 if
+   the spiral does not reach it. On small maps the spiral wraps around
+   and can visit pos2 more than once. */
+static int
+spiral_first_order(map_pos_t pos, map_pos_t pos2)
+{
+	int cols = globals.map.cols;
+	int rows = globals.map.rows;
+	int dcol = (MAP_POS_COL(pos2) - MAP_POS_COL(pos)) & globals.map.col_mask;
+	int drow = (MAP_POS_ROW(pos2) - MAP_POS_ROW(pos)) & globals.map.row_mask;
+
+	int first = -1;
+	for (int dx = dcol - cols; dx <= 32; dx += cols) {
+		if (dx < -32) continue;
+		for (int dy = drow - rows; dy <= 32; dy += rows) {
+			if (dy < -32) continue;
+			int order = spiral_order(dx, dy);
+			if (order >= 0 && (first < 0 || order < first)) {
+				first = order;
+			}
 		}
 	}
 
-	building_t *building = game_get_building(bld_index);
-	if (!BUILDING_IS_DONE(building) ||
-	    BUILDING_IS_BURNING(building)) {
-		return index;
+	return first;
+}
+
+typedef struct {
+	player_sett_t *sett;
+	map_pos_t pos;
+	int count;
+	int order[64];
+	int index[64];
+} attack_search_t;
+
+/* Keep the military buildings that can send knights to attack,
+   in the order they are found by a spiral around the target. */
+static int
+available_knights_search_cb(building_t *building, void *d)
+{
+	attack_search_t *data = d;
+	map_pos_t pos = building->pos;
+
+	if (MAP_OWNER(pos) != data->sett->player_num || MAP_WATER(pos) ||
+	    MAP_OBJ(pos) < MAP_OBJ_SMALL_BUILDING ||
+	    MAP_OBJ(pos) > MAP_OBJ_CASTLE ||
+	    MAP_OBJ_INDEX(pos) != (uint)BUILDING_INDEX(building)) {
+		return 0;
 	}
 
-	const int *min_level = NULL;
-	switch (BUILDING_TYPE(building)) {
-	case BUILDING_HUT: min_level = min_level_hut; break;
-	case BUILDING_TOWER: min_level = min_level_tower; break;
-	case BUILDING_FORTRESS: min_level = min_level_fortress; break;
-	default: return index; break;
+	if (!BUILDING_IS_DONE(building) ||
+	    BUILDING_IS_BURNING(building) ||
+	    BUILDING_TYPE(building) == BUILDING_CASTLE) {
+		return 0;
 	}
 
-	if (index >= 64) return index;
+	int order = spiral_first_order(data->pos, pos);
+	if (order < 0) return 0;
 
-	sett->attacking_buildings[index] = bld_index;
+	/* Insert in order, keeping only the first 64 buildings. */
+	int i = data->count;
+	if (i == 64) {
+		if (order >= data->order[63]) return 0;
+		i -= 1;
+	} else {
+		data->count += 1;
+	}
 
-	int state = building->serf & 3;
-	int knights_present = (building->stock1 >> 4) & 0xf;
-	int to_send = knights_present - min_level[sett->knight_occupation[state] & 0xf];
+	while (i > 0 && data->order[i-1] > order) {
+		data->order[i] = data->order[i-1];
+		data->index[i] = data->index[i-1];
+		i -= 1;
+	}
 
-	if (to_send > 0) sett->attacking_knights[dist] += to_send;
+	data->order[i] = order;
+	data->index[i] = BUILDING_INDEX(building);
 
-	return index + 1;
+	return 0;
 }
 
 int
 player_knights_available_for_attack(player_sett_t *sett, map_pos_t pos)
 {
+	const int min_level_hut[] = { 1, 1, 2, 2, 3 };
+	const int min_level_tower[] = { 1, 2, 3, 4, 6 };
+	const int min_level_fortress[] = { 1, 3, 6, 9, 12 };
+
 	/* Reset counters. */
 	for (int i = 0; i < 4; i++) sett->attacking_knights[i] = 0;
 
-	int index = 0;
+	/* Find buildings in the 32 shells around the position. */
+	attack_search_t data;
+	data.sett = sett;
+	data.pos = pos;
+	data.count = 0;
+	building_index_search_range(pos, 32, sett->player_num,
+				    available_knights_search_cb, &data);
 
-	/* Iterate each shell around the position.*/
-	for (int i = 0; i < 32; i++) {
-		pos = MAP_MOVE_RIGHT(pos);
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_DOWN(pos);
-		}
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_LEFT(pos);
-		}
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_UP_LEFT(pos);
-		}
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_UP(pos);
-		}
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_RIGHT(pos);
-		}
-		for (int j = 0; j < i+1; j++) {
-			index = available_knights_at_pos(sett, pos, index, i >> 3);
-			pos = MAP_MOVE_DOWN_RIGHT(pos);
+	int index;
+	for (index = 0; index < data.count; index++) {
+		int bld_index = data.index[index];
+		building_t *building = game_get_building(bld_index);
+
+		const int *min_level = NULL;
+		switch (BUILDING_TYPE(building)) {
+		case BUILDING_HUT: min_level = min_level_hut; break;
+		case BUILDING_TOWER: min_level = min_level_tower; break;
+		case BUILDING_FORTRESS: min_level = min_level_fortress; break;
+		default: NOT_REACHED(); break;
 		}
+
+		sett->attacking_buildings[index] = bld_index;
+
+		int dist = (data.order[index] >> 8) >> 3;
+		int state = building->serf & 3;
+		int knights_present = (building->stock1 >> 4) & 0xf;
+		int to_send = knights_present - min_level[sett->knight_occupation[state] & 0xf];
+
+		if (to_send > 0) sett->attacking_knights[dist] += to_send;
 	}
 
 	sett->attacking_building_count = index;
@@ -2034,7 +2248,7 @@ player_start_attack(player_sett_t *sett)
 
 			/* Send this serf off to fight. */
 			serf_log_state_change(def_serf, SERF_STATE_KNIGHT_LEAVE_FOR_WALK_TO_FIGHT);
-			def_serf->state = SERF_STATE_KNIGHT_LEAVE_FOR_WALK_TO_FIGHT;
+			serf_set_state(def_serf, SERF_STATE_KNIGHT_LEAVE_FOR_WALK_TO_FIGHT);
 			def_serf->s.leave_for_walk_to_fight.dist_col = dist_col;
 			def_serf->s.leave_for_walk_to_fight.dist_row = dist_row;
 			def_serf->s.leave_for_walk_to_fight.field_D = 0;
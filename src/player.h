@@ -254,6 +254,8 @@ void player_close_popup(player_t *player);
 
 void player_determine_map_cursor_type(player_t *player);
 void player_determine_map_cursor_type_road(player_t *player);
+void player_invalidate_build_sites(map_pos_t pos);
+void player_reset_build_sites();
 void player_update_interface(player_t *player);
 
 void player_build_road_begin(player_t *player);
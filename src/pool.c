@@ -0,0 +1,267 @@
+/*
+ * pool.c - Object pools indexed by allocation bitmaps
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "pool.h"
+#include "misc.h"
+
+
+/* The allocated indices are linked in increasing order through
+   live_next and live_prev. The extra element at index size is the
+   head of the list. */
+
+/* Return the lowest allocated index not less than index, or -1. */
+static int
+next_allocated(pool_t *pool, uint index)
+{
+	while (index < pool->size) {
+		if ((index & 7) == 0 && pool->bitmap[index/8] == 0) {
+			index += 8;
+			continue;
+		}
+		if (POOL_ALLOCATED(pool, index)) return index;
+		index += 1;
+	}
+
+	return -1;
+}
+
+/* Link index, which must already be marked in the bitmap. */
+static void
+live_insert(pool_t *pool, uint index)
+{
+	/* Find the previous allocated index. This is index-1
+	   when the lowest free index was allocated. */
+	uint prev = pool->size;
+	for (uint i = index; i > 0; i--) {
+		if (POOL_ALLOCATED(pool, i-1)) {
+			prev = i-1;
+			break;
+		}
+	}
+
+	uint next = pool->live_next[prev];
+	pool->live_next[index] = next;
+	pool->live_prev[index] = prev;
+	pool->live_next[prev] = index;
+	pool->live_prev[next] = index;
+}
+
+static void
+live_remove(pool_t *pool, uint index)
+{
+	uint prev = pool->live_prev[index];
+	uint next = pool->live_next[index];
+	pool->live_next[prev] = next;
+	pool->live_prev[next] = prev;
+}
+
+/* The free indices are kept in a binary min-heap, so the lowest free
+   index is found without scanning the bitmap. free_pos maps each index
+   to its position in the heap, or POOL_NOT_FREE if it is allocated. */
+#define POOL_NOT_FREE  ((uint)-1)
+
+static void
+free_heap_set(pool_t *pool, uint pos, uint index)
+{
+	pool->free_heap[pos] = index;
+	pool->free_pos[index] = pos;
+}
+
+static void
+free_heap_sift_up(pool_t *pool, uint pos)
+{
+	uint index = pool->free_heap[pos];
+	while (pos > 0) {
+		uint parent = (pos - 1)/2;
+		if (pool->free_heap[parent] < index) break;
+		free_heap_set(pool, pos, pool->free_heap[parent]);
+		pos = parent;
+	}
+
+	free_heap_set(pool, pos, index);
+}
+
+static void
+free_heap_sift_down(pool_t *pool, uint pos)
+{
+	uint index = pool->free_heap[pos];
+	while (1) {
+		uint child = 2*pos + 1;
+		if (child >= pool->free_count) break;
+		if (child + 1 < pool->free_count &&
+		    pool->free_heap[child+1] < pool->free_heap[child]) {
+			child += 1;
+		}
+		if (index < pool->free_heap[child]) break;
+		free_heap_set(pool, pos, pool->free_heap[child]);
+		pos = child;
+	}
+
+	free_heap_set(pool, pos, index);
+}
+
+static void
+free_heap_push(pool_t *pool, uint index)
+{
+	pool->free_heap[pool->free_count] = index;
+	pool->free_count += 1;
+	free_heap_sift_up(pool, pool->free_count - 1);
+}
+
+/* Remove index from the heap of free indices. */
+static void
+free_heap_remove(pool_t *pool, uint index)
+{
+	uint pos = pool->free_pos[index];
+	pool->free_pos[index] = POOL_NOT_FREE;
+	pool->free_count -= 1;
+	if (pos == pool->free_count) return;
+
+	free_heap_set(pool, pos, pool->free_heap[pool->free_count]);
+	if (pos > 0 && pool->free_heap[(pos - 1)/2] > pool->free_heap[pos]) {
+		free_heap_sift_up(pool, pos);
+	} else {
+		free_heap_sift_down(pool, pos);
+	}
+}
+
+/* Initialize pool using bitmap for allocation of size objects.
+   max_ever_index is raised to one above the highest index ever
+   allocated; it is not lowered when objects are freed.
+   pool_reset() must be called before the pool is used. */
+void
+pool_init(pool_t *pool, uint8_t *bitmap, uint size, uint16_t *max_ever_index)
+{
+	pool->bitmap = bitmap;
+	pool->size = size;
+	pool->max_ever_index = max_ever_index;
+
+	pool->free_heap = malloc(size*sizeof(uint));
+	if (pool->free_heap == NULL) abort();
+
+	pool->free_pos = malloc(size*sizeof(uint));
+	if (pool->free_pos == NULL) abort();
+
+	pool->free_count = 0;
+
+	pool->live_next = malloc((size+1)*sizeof(uint));
+	if (pool->live_next == NULL) abort();
+
+	pool->live_prev = malloc((size+1)*sizeof(uint));
+	if (pool->live_prev == NULL) abort();
+
+	pool->live_next[size] = size;
+	pool->live_prev[size] = size;
+}
+
+/* Rebuild pool state from the bitmap. Must be called when the bitmap was
+   changed without using the pool functions, e.g. when loading a game. */
+void
+pool_reset(pool_t *pool)
+{
+	pool->free_count = 0;
+
+	uint last = pool->size;
+
+	/* Free indices are added in increasing order,
+	   which is already a valid heap. */
+	for (uint i = 0; i < pool->size; i++) {
+		if (POOL_ALLOCATED(pool, i)) {
+			pool->live_next[last] = i;
+			pool->live_prev[i] = last;
+			last = i;
+			pool->free_pos[i] = POOL_NOT_FREE;
+		} else {
+			free_heap_set(pool, pool->free_count++, i);
+		}
+	}
+
+	pool->live_next[last] = pool->size;
+	pool->live_prev[pool->size] = last;
+}
+
+/* Allocate the lowest free index. Return -1 if the pool is full. */
+int
+pool_alloc(pool_t *pool)
+{
+	if (pool->free_count == 0) return -1;
+
+	uint index = pool->free_heap[0];
+	free_heap_remove(pool, index);
+
+	pool->bitmap[index/8] |= BIT(7-(index&7));
+	live_insert(pool, index);
+
+	if (index >= *pool->max_ever_index) {
+		*pool->max_ever_index = index + 1;
+	}
+
+	return index;
+}
+
+/* Free index in the pool. */
+void
+pool_free(pool_t *pool, uint index)
+{
+	if (!POOL_ALLOCATED(pool, index)) return;
+
+	pool->bitmap[index/8] &= ~BIT(7-(index&7));
+	free_heap_push(pool, index);
+	live_remove(pool, index);
+}
+
+/* Mark a specific index as allocated. Used when restoring objects
+   at known indices. */
+void
+pool_set_allocated(pool_t *pool, uint index)
+{
+	if (POOL_ALLOCATED(pool, index)) return;
+
+	pool->bitmap[index/8] |= BIT(7-(index&7));
+	free_heap_remove(pool, index);
+	live_insert(pool, index);
+
+	if (index >= *pool->max_ever_index) {
+		*pool->max_ever_index = index + 1;
+	}
+}
+
+/* Return the lowest allocated index greater than index,
+   or -1 if there is none. */
+int
+pool_next(pool_t *pool, int index)
+{
+	uint next;
+	if (index < 0) {
+		next = pool->live_next[pool->size];
+	} else if (POOL_ALLOCATED(pool, index)) {
+		next = pool->live_next[index];
+	} else {
+		/* Index was freed while iterating, or iteration
+		   started at a free index. */
+		return next_allocated(pool, index + 1);
+	}
+
+	if (next == pool->size) return -1;
+	return next;
+}
@@ -0,0 +1,71 @@
+/*
+ * pool.h - Object pools indexed by allocation bitmaps
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdint.h>
+
+#include "misc.h"
+
+#define POOL_ALLOCATED(pool,i)  BIT_TEST((pool)->bitmap[(i)>>3], 7-((i)&7))
+
+/* Iterate over allocated indices from start in increasing order.
+   Objects may be allocated and freed while iterating. */
+#define pool_foreach_from(pool,i,start)  \
+  for ((i) = pool_next((pool), (int)(start)-1); \
+       (i) >= 0; \
+       (i) = pool_next((pool), (i)))
+
+/* Allocation state of an array of game objects. Objects are identified
+   by their index in the array, and a bit in the allocation bitmap is set
+   for each allocated index (most significant bit first). The lowest free
+   index is always allocated next, so indices are the same as when the
+   bitmap is scanned from the beginning. The free indices are kept in
+   a min-heap, so the lowest one is found without scanning the bitmap.
+   The allocated indices are also kept in a doubly linked list in index
+   order. This allows iteration over the allocated objects in index order
+   without testing the bitmap for every index, and objects are unlinked
+   in constant time when freed. */
+typedef struct {
+	uint8_t *bitmap;
+	uint size;
+	uint16_t *max_ever_index;
+
+	uint *free_heap;
+	uint *free_pos;
+	uint free_count;
+
+	uint *live_next;
+	uint *live_prev;
+} pool_t;
+
+void pool_init(pool_t *pool, uint8_t *bitmap, uint size,
+	       uint16_t *max_ever_index);
+void pool_reset(pool_t *pool);
+
+int pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, uint index);
+void pool_set_allocated(pool_t *pool, uint index);
+
+int pool_next(pool_t *pool, int index);
+
+#endif /* ! _POOL_H */
@@ -31,6 +31,7 @@ pqueue_init(pqueue_t *queue, uint capacity, pqueue_less_func *less)
 	queue->size = 0;
 	queue->capacity = capacity;
 	queue->less = less;
+	queue->index = NULL;
 	queue->entries = malloc(capacity*sizeof(void *));
 	if (queue->entries == NULL) return -1;
 
@@ -44,6 +45,59 @@ pqueue_deinit(pqueue_t *queue)
 	free(queue->entries);
 }
 
+/* Set callback that is notified of the position of each element
+   in the queue. This allows elements to be located in constant time
+   for pqueue_remove() and pqueue_decrease_key(). */
+void
+pqueue_set_index_func(pqueue_t *queue, pqueue_index_func *index)
+{
+	queue->index = index;
+}
+
+static void
+pqueue_set_entry(pqueue_t *queue, uint i, void *elm)
+{
+	queue->entries[i] = elm;
+	if (queue->index != NULL) queue->index(elm, i);
+}
+
+static void
+pqueue_heapify_up(pqueue_t *queue, uint i)
+{
+	void *elm = queue->entries[i];
+
+	while (i > 0) {
+		uint parent = (i-1)/2;
+		if (!queue->less(elm, queue->entries[parent])) break;
+
+		pqueue_set_entry(queue, i, queue->entries[parent]);
+		i = parent;
+	}
+
+	pqueue_set_entry(queue, i, elm);
+}
+
+static void
+pqueue_heapify_down(pqueue_t *queue, uint i)
+{
+	void *elm = queue->entries[i];
+
+	while (2*i+1 < queue->size) {
+		uint child = 2*i+1;
+		if (child+1 < queue->size &&
+		    queue->less(queue->entries[child+1], queue->entries[child])) {
+			child += 1;
+		}
+
+		if (!queue->less(queue->entries[child], elm)) break;
+
+		pqueue_set_entry(queue, i, queue->entries[child]);
+		i = child;
+	}
+
+	pqueue_set_entry(queue, i, elm);
+}
+
 /* Insert an element in the queue. */
 int
 pqueue_insert(pqueue_t *queue, void *elm)
@@ -61,19 +115,7 @@ pqueue_insert(pqueue_t *queue, void *elm)
 	queue->entries[i] = elm;
 	queue->size += 1;
 
-	/* Heapify-up */
-	while (i > 0) {
-		uint parent = (i-1)/2;
-		if (queue->less(queue->entries[i], queue->entries[parent])) {
-			/* Swap */
-			void *temp = queue->entries[parent];
-			queue->entries[parent] = queue->entries[i];
-			queue->entries[i] = temp;
-			i = parent;
-		} else {
-			break;
-		}
-	}
+	pqueue_heapify_up(queue, i);
 
 	return 0;
 }
@@ -87,41 +129,31 @@ pqueue_remove(pqueue_t *queue, uint index)
 	void *elm = queue->entries[index];
 
 	/* Move last element to index */
-	uint i = index;
-	queue->entries[i] = queue->entries[queue->size-1];
 	queue->size -= 1;
+	if (index == queue->size) return elm;
 
-	if (queue->size == 0) return elm;
-
-	/* Heapify-down */
-	while (i < (queue->size-1)/2) {
-		uint child_l = 2*i+1;
-		uint child_r = 2*i+2;
-		uint swap = 0;
-		if (queue->less(queue->entries[child_l], queue->entries[i])) {
-			if (child_r < queue->size &&
-			    queue->less(queue->entries[child_r], queue->entries[child_l])) {
-				swap = child_r;
-			} else {
-				swap = child_l;
-			}
-		} else if (child_r < queue->size &&
-			   queue->less(queue->entries[child_r], queue->entries[i])) {
-			swap = child_r;
-		} else {
-			break;
-		}
+	queue->entries[index] = queue->entries[queue->size];
 
-		/* Swap */
-		void *temp = queue->entries[i];
-		queue->entries[i] = queue->entries[swap];
-		queue->entries[swap] = temp;
-		i = swap;
+	/* The moved element may belong either above or below index. */
+	if (index > 0 && queue->less(queue->entries[index],
+				     queue->entries[(index-1)/2])) {
+		pqueue_heapify_up(queue, index);
+	} else {
+		pqueue_heapify_down(queue, index);
 	}
 
 	return elm;
 }
 
+/* Restore heap order after the key of the element at index
+   was decreased (i.e. the element should now come earlier). */
+void
+pqueue_decrease_key(pqueue_t *queue, uint index)
+{
+	if (queue->size <= index) return;
+	pqueue_heapify_up(queue, index);
+}
+
 /* Remove and return the next element in the queue. */
 void *
 pqueue_pop(pqueue_t *queue)
@@ -27,6 +27,9 @@
 /* Return non-zero if e1 comes before e2. */
 typedef int pqueue_less_func(const void *e1, const void *e2);
 
+/* Called with the new position of an element whenever it moves. */
+typedef void pqueue_index_func(void *elm, uint index);
+
 /* Priority queue implemented as binary heap.
    This is a min-heap, but by inverting the less function
    it can be turned into a max-heap. */
@@ -35,13 +38,16 @@ typedef struct {
 	uint capacity;
 	void **entries;
 	pqueue_less_func *less;
+	pqueue_index_func *index;
 } pqueue_t;
 
 int pqueue_init(pqueue_t *queue, uint capacity, pqueue_less_func *less);
 void pqueue_deinit(pqueue_t *queue);
+void pqueue_set_index_func(pqueue_t *queue, pqueue_index_func *index);
 
 int pqueue_insert(pqueue_t *queue, void *elm);
 void *pqueue_remove(pqueue_t *queue, uint index);
+void pqueue_decrease_key(pqueue_t *queue, uint index);
 void *pqueue_pop(pqueue_t *queue);
 int pqueue_is_empty(pqueue_t *pqueue);
 
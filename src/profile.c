@@ -0,0 +1,219 @@
+/*
+ * profile.c - Timing of game update phases
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#endif
+
+#include "profile.h"
+#include "serf.h"
+#include "log.h"
+
+
+/* Length of a profile interval in nanoseconds. */
+#define PROFILE_INTERVAL  1000000000ull
+
+int profile_enabled;
+uint profile_serf_state_count[PROFILE_SERF_STATES];
+
+static const char *phase_name[] = {
+	"map_and_players",
+	"ai_and_more",
+	"flags",
+	"buildings",
+	"serfs",
+	"game_stats"
+};
+
+static FILE *csv_file;
+static int csv_header_written;
+
+static uint64_t interval_start;
+static uint64_t profile_start;
+static uint interval_updates;
+static uint64_t phase_time[PROFILE_PHASE_MAX];
+static uint64_t phase_max[PROFILE_PHASE_MAX];
+static uint64_t update_time;
+static uint64_t update_total;
+static uint64_t update_max;
+
+
+/* Monotonic time in nanoseconds. */
+uint64_t
+profile_time()
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart * (1000000000.0 / freq.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void
+reset_interval(uint64_t now)
+{
+	interval_start = now;
+	interval_updates = 0;
+	memset(phase_time, 0, sizeof(phase_time));
+	memset(phase_max, 0, sizeof(phase_max));
+	update_time = 0;
+	update_total = 0;
+	update_max = 0;
+	memset(profile_serf_state_count, 0, sizeof(profile_serf_state_count));
+}
+
+void
+profile_enable(int enable)
+{
+	if (enable && !profile_enabled) {
+		uint64_t now = profile_time();
+		profile_start = now;
+		reset_interval(now);
+	}
+
+	profile_enabled = enable;
+	LOGI("profile", "Profiling %s.", enable ? "enabled" : "disabled");
+}
+
+int
+profile_is_enabled()
+{
+	return profile_enabled;
+}
+
+/* Write profile as CSV to f instead of logging a table.
+   One row is written per interval. */
+void
+profile_set_csv_file(FILE *f)
+{
+	csv_file = f;
+	csv_header_written = 0;
+}
+
+/* Return start time of a game update, or 0 if profiling is disabled. */
+uint64_t
+profile_begin()
+{
+	if (!profile_enabled) return 0;
+	return profile_time();
+}
+
+/* Account time since start to phase. Returns the current time
+   so the calls can be chained for consecutive phases. */
+uint64_t
+profile_end_phase(profile_phase_t phase, uint64_t start)
+{
+	if (!profile_enabled || start == 0) return 0;
+
+	uint64_t now = profile_time();
+	uint64_t delta = now - start;
+	phase_time[phase] += delta;
+	if (delta > phase_max[phase]) phase_max[phase] = delta;
+
+	update_time += delta;
+
+	return now;
+}
+
+static void
+write_csv(double secs)
+{
+	if (!csv_header_written) {
+		fprintf(csv_file, "time,updates,update_max_ms");
+		for (int i = 0; i < PROFILE_PHASE_MAX; i++) {
+			fprintf(csv_file, ",%s_ms,%s_max_ms",
+				phase_name[i], phase_name[i]);
+		}
+		for (int i = 0; i < PROFILE_SERF_STATES; i++) {
+			fprintf(csv_file, ",\"%s\"", serf_get_state_name(i));
+		}
+		fprintf(csv_file, "\n");
+		csv_header_written = 1;
+	}
+
+	fprintf(csv_file, "%.3f,%u,%.3f", secs, interval_updates,
+		update_max / 1e6);
+	for (int i = 0; i < PROFILE_PHASE_MAX; i++) {
+		fprintf(csv_file, ",%.3f,%.3f",
+			phase_time[i] / 1e6, phase_max[i] / 1e6);
+	}
+	for (int i = 0; i < PROFILE_SERF_STATES; i++) {
+		fprintf(csv_file, ",%u", profile_serf_state_count[i]);
+	}
+	fprintf(csv_file, "\n");
+	fflush(csv_file);
+}
+
+static void
+log_table()
+{
+	uint updates = interval_updates;
+
+	LOGI("profile", "%u updates, %.3f ms/update, max %.3f ms",
+	     updates, update_total / 1e6 / updates, update_max / 1e6);
+	LOGI("profile", "%-16s %10s %10s %10s",
+	     "phase", "total ms", "avg ms", "max ms");
+	for (int i = 0; i < PROFILE_PHASE_MAX; i++) {
+		LOGI("profile", "%-16s %10.3f %10.3f %10.3f",
+		     phase_name[i], phase_time[i] / 1e6,
+		     phase_time[i] / 1e6 / updates, phase_max[i] / 1e6);
+	}
+
+	for (int i = 0; i < PROFILE_SERF_STATES; i++) {
+		if (profile_serf_state_count[i] == 0) continue;
+		LOGI("profile", "  %-32s %10u", serf_get_state_name(i),
+		     profile_serf_state_count[i]);
+	}
+}
+
+/* Finish a game update. The collected profile is written once
+   per interval. */
+void
+profile_end_update()
+{
+	if (!profile_enabled) return;
+
+	if (update_time > update_max) update_max = update_time;
+	update_total += update_time;
+	update_time = 0;
+	interval_updates += 1;
+
+	uint64_t now = profile_time();
+	if (now - interval_start < PROFILE_INTERVAL) return;
+
+	if (csv_file != NULL) {
+		write_csv((now - profile_start) / 1e9);
+	} else {
+		log_table();
+	}
+
+	reset_interval(now);
+}
@@ -0,0 +1,65 @@
+/*
+ * profile.h - Timing of game update phases
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This file is part of freeserf.
+ *
+ * freeserf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * freeserf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "serf.h"
+#include "misc.h"
+
+typedef enum {
+	PROFILE_PHASE_MAP_AND_PLAYERS = 0,
+	PROFILE_PHASE_AI_AND_MORE,
+	PROFILE_PHASE_FLAGS,
+	PROFILE_PHASE_BUILDINGS,
+	PROFILE_PHASE_SERFS,
+	PROFILE_PHASE_GAME_STATS,
+
+	PROFILE_PHASE_MAX
+} profile_phase_t;
+
+#define PROFILE_SERF_STATES  SERF_STATE_COUNT
+
+/* Accessed through the macro below to keep the disabled case cheap. */
+extern int profile_enabled;
+extern uint profile_serf_state_count[PROFILE_SERF_STATES];
+
+#define PROFILE_COUNT_SERF_STATE(state)			\
+	do {						\
+		if (profile_enabled) {			\
+			profile_serf_state_count[(state)] += 1;	\
+		}					\
+	} while (0)
+
+uint64_t profile_time();
+
+void profile_enable(int enable);
+int profile_is_enabled();
+void profile_set_csv_file(FILE *f);
+
+uint64_t profile_begin();
+uint64_t profile_end_phase(profile_phase_t phase, uint64_t start);
+void profile_end_update();
+
+#endif /* ! _PROFILE_H */
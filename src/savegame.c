@@ -19,15 +19,28 @@
  * along with freeserf.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
+#include "savegame.h"
 #include "game.h"
 #include "map.h"
 #include "globals.h"
 #include "version.h"
-#include "list.h"
 #include "debug.h"
 
 
@@ -381,8 +394,9 @@ load_v0_serf_state(FILE *f, const v0_map_t *map)
 		return -1;
 	}
 
-	memset(globals.serfs_bitmap, '\0', (globals.max_serf_cnt+31)/32);
+	memset(globals.serfs_bitmap, '\0', ((globals.max_serf_cnt-1) / 8) + 1);
 	memcpy(globals.serfs_bitmap, bitmap, bitmap_size);
+	pool_reset(&globals.serf_pool);
 
 	free(bitmap);
 
@@ -582,8 +596,11 @@ load_v0_flag_state(FILE *f)
 		return -1;
 	}
 
-	memset(globals.flg_bitmap, '\0', (globals.max_flg_cnt+31)/32);
+	memset(globals.flg_bitmap, '\0', ((globals.max_flg_cnt-1) / 8) + 1);
 	memcpy(globals.flg_bitmap, flag_bitmap, bitmap_size);
+	pool_reset(&globals.flg_pool);
+
+	flag_route_reset();
 
 	free(flag_bitmap);
 
@@ -666,8 +683,9 @@ load_v0_building_state(FILE *f, const v0_map_t *map)
 		return -1;
 	}
 
-	memset(globals.buildings_bitmap, '\0', (globals.max_building_cnt+31)/32);
+	memset(globals.buildings_bitmap, '\0', ((globals.max_building_cnt-1) / 8) + 1);
 	memcpy(globals.buildings_bitmap, bitmap, bitmap_size);
+	pool_reset(&globals.building_pool);
 
 	free(bitmap);
 
@@ -731,8 +749,9 @@ load_v0_inventory_state(FILE *f)
 		return -1;
 	}
 
-	memset(globals.inventories_bitmap, '\0', (globals.max_inventory_cnt+31)/32);
+	memset(globals.inventories_bitmap, '\0', ((globals.max_inventory_cnt-1) / 8) + 1);
 	memcpy(globals.inventories_bitmap, bitmap, bitmap_size);
+	pool_reset(&globals.inventory_pool);
 
 	free(bitmap);
 
@@ -1346,74 +1365,136 @@ trim_whitespace(char *str, size_t *len)
 	return str;
 }
 
-/* Read line from f, realloc'ing the buffer
-   if necessary. Return bytes read (0 on EOF). */
-static size_t
-load_text_readline(char **buffer, size_t *len, FILE *f)
-{
-	size_t i = 0;
-
-	while (1) {
-		if (i >= *len-1) {
-			/* Double buffer size, always keep enough
-			   space for input character plus zero-byte. */
-			*len = 2*(*len);
-			*buffer = realloc(*buffer, *len);
-		}
+typedef struct {
+	char *key;
+	char *value;
+} setting_t;
 
-		/* Read character */
-		int c = fgetc(f);
-		if (c == EOF) {
-			(*buffer)[i] = '\0';
-			break;
-		}
+/* The settings of a section are sorted by key, so single keys are
+   found by load_text_get_setting() with a binary search. The section
+   loaders walk all settings in order and match each key in turn. */
+typedef struct {
+	char *name;
+	char *param;
+	uint first; /* Index of the first setting in the file */
+	setting_t *settings;
+	uint setting_count;
+} section_t;
+
+/* A parsed text save game. The file is read or mapped into one
+   buffer and the section names, keys and values point into this
+   buffer. Settings of all sections are stored in one array. */
+typedef struct {
+	char *data;
+	size_t size;
+	int mapped;
 
-		(*buffer)[i++] = c;
+	section_t *sections;
+	uint section_count;
+	setting_t *settings;
+	uint setting_count;
+} text_file_t;
 
-		if (c == '\n') {
-			(*buffer)[i] = '\0';
-			break;
+#define section_foreach(file, section)					\
+	for ((section) = (file)->sections;				\
+	     (section) < (file)->sections + (file)->section_count;	\
+	     (section)++)
+
+#define setting_foreach(section, setting)				\
+	for ((setting) = (section)->settings;				\
+	     (setting) < (section)->settings + (section)->setting_count; \
+	     (setting)++)
+
+
+/* Read the file into a buffer that can be modified and that
+   ends with a zero-byte or newline. */
+static int
+load_text_read(FILE *f, text_file_t *file)
+{
+	file->data = NULL;
+	file->size = 0;
+	file->mapped = 0;
+
+#ifdef HAVE_MMAP
+	struct stat sb;
+	int r = fstat(fileno(f), &sb);
+	if (r == 0 && sb.st_size > 0) {
+		/* The mapping is private, so changes are not written
+		   back to the file. */
+		char *data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE, fileno(f), 0);
+		if (data != MAP_FAILED) {
+			if (data[sb.st_size-1] == '\n') {
+				file->data = data;
+				file->size = sb.st_size;
+				file->mapped = 1;
+				return 0;
+			}
+
+			/* No room to terminate the last line */
+			munmap(data, sb.st_size);
 		}
 	}
+#endif
 
-	return i;
-}
+	if (fseek(f, 0, SEEK_END) < 0) return -1;
+	long size = ftell(f);
+	if (size < 0 || fseek(f, 0, SEEK_SET) < 0) return -1;
 
+	file->data = malloc(size+1);
+	if (file->data == NULL) abort();
 
-typedef struct {
-	list_elm_t elm;
-	char *name;
-	char *param;
-	list_t settings;
-} section_t;
+	if (size > 0 && fread(file->data, size, 1, f) < 1) {
+		free(file->data);
+		file->data = NULL;
+		return -1;
+	}
 
-typedef struct {
-	list_elm_t elm;
-	char *key;
-	char *value;
-} setting_t;
+	file->data[size] = '\0';
+	file->size = size;
 
+	return 0;
+}
 
 static int
-load_text_parse(FILE *f, list_t *sections)
+setting_cmp(const void *a, const void *b)
 {
-	size_t buffer_len = 256;
-	char *buffer = malloc(buffer_len*sizeof(char));
+	return strcmp(((const setting_t *)a)->key,
+		      ((const setting_t *)b)->key);
+}
+
+/* Parse the file in a single pass over the buffer. Lines are
+   terminated in place, so no strings are copied. */
+static int
+load_text_parse(FILE *f, text_file_t *file)
+{
+	int r = load_text_read(f, file);
+	if (r < 0) return -1;
+
+	uint section_size = 64;
+	file->sections = malloc(section_size*sizeof(section_t));
+	if (file->sections == NULL) abort();
+	file->section_count = 0;
 
+	uint setting_size = 1024;
+	file->settings = malloc(setting_size*sizeof(setting_t));
+	if (file->settings == NULL) abort();
+	file->setting_count = 0;
+
+	/* Section settings are recorded as an index until
+	   the settings array has its final location. */
 	section_t *section = NULL;
 
-	while (1) {
-		/* Read line from file */
-		char *line = NULL;
-		size_t line_len = 0;
-		size_t len = load_text_readline(&buffer, &buffer_len, f);
-		if (len == 0) {
-			if (ferror(f)) return -1;
-			break;
-		}
+	char *next = file->data;
+	char *end = file->data + file->size;
+	while (next < end) {
+		char *line = next;
+		char *line_end = memchr(next, '\n', end - next);
+		if (line_end == NULL) line_end = end;
+		next = line_end + 1;
 
-		line_len = len;
-		line = buffer;
+		line_end[0] = '\0';
+		size_t line_len = line_end - line;
 
 		/* Skip leading whitespace */
 		line = trim_whitespace(line, &line_len);
@@ -1445,18 +1526,23 @@ load_text_parse(FILE *f, list_t *sections)
 			if (isspace(param[0])) {
 				param[0] = '\0';
 				param += 1;
-				header_len = param - header;
 				while (isspace(param[0])) param += 1;
 			}
 
 			/* Create section */
-			section = malloc(sizeof(section_t));
-			if (section == NULL) abort();
+			if (file->section_count == section_size) {
+				section_size *= 2;
+				file->sections = realloc(file->sections,
+					section_size*sizeof(section_t));
+				if (file->sections == NULL) abort();
+			}
 
-			section->name = strdup(header);
-			section->param = strdup(param);
-			list_init(&section->settings);
-			list_append(sections, (list_elm_t *)section);
+			section = &file->sections[file->section_count++];
+			section->name = header;
+			section->param = param;
+			section->first = file->setting_count;
+			section->settings = NULL;
+			section->setting_count = 0;
 		} else if (section != NULL) {
 			/* Setting line */
 			char *value = strchr(line, '=');
@@ -1475,53 +1561,56 @@ load_text_parse(FILE *f, list_t *sections)
 			value += 1;
 			while (isspace(value[0])) value += 1;
 
-			setting_t *setting = malloc(sizeof(setting_t));
-			if (setting == NULL) abort();
+			if (file->setting_count == setting_size) {
+				setting_size *= 2;
+				file->settings = realloc(file->settings,
+					setting_size*sizeof(setting_t));
+				if (file->settings == NULL) abort();
+			}
 
-			setting->key = strdup(key);
-			setting->value = strdup(value);
-			list_append(&section->settings, (list_elm_t *)setting);
+			setting_t *setting = &file->settings[file->setting_count++];
+			setting->key = key;
+			setting->value = value;
+			section->setting_count += 1;
 		}
 	}
 
-	free(buffer);
+	/* Resolve settings of each section and sort them
+	   by key for lookup with load_text_get_setting(). */
+	section_foreach(file, section) {
+		section->settings = &file->settings[section->first];
+		qsort(section->settings, section->setting_count,
+		      sizeof(setting_t), setting_cmp);
+	}
 
 	return 0;
 }
 
 static void
-load_text_free_sections(list_t *sections)
+load_text_free(text_file_t *file)
 {
-	while (!list_is_empty(sections)) {
-		section_t *section =
-			(section_t *)list_remove_head(sections);
-		free(section->name);
-		free(section->param);
-
-		while (!list_is_empty(&section->settings)) {
-			setting_t *setting =
-				(setting_t *)list_remove_head(&section->settings);
-			free(setting->key);
-			free(setting->value);
-			free(setting);
-		}
+	free(file->sections);
+	free(file->settings);
 
-		free(section);
-	}
+	if (file->data == NULL) return;
+
+#ifdef HAVE_MMAP
+	if (file->mapped) munmap(file->data, file->size);
+	else free(file->data);
+#else /* ! HAVE_MMAP */
+	free(file->data);
+#endif
 }
 
 static char *
 load_text_get_setting(const section_t *section, const char *key)
 {
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
-		if (!strcmp(s->key, key)) {
-			return s->value;
-		}
-	}
+	setting_t k = { .key = (char *)key };
+	setting_t *s = bsearch(&k, section->settings, section->setting_count,
+			       sizeof(setting_t), setting_cmp);
+	if (s == NULL) return NULL;
 
-	return NULL;
+	return s->value;
 }
 
 static map_pos_t
@@ -1551,17 +1640,16 @@ parse_array_value(char **str)
 }
 
 static int
-load_text_global_state(list_t *sections)
+load_text_global_state(text_file_t *file)
 {
 	const char *value;
 
 	/* Find the globals section */
 	section_t *section = NULL;
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
-		if (!strcmp(s->name, "globals")) {
-			section = s;
+	section_t *sect;
+	section_foreach(file, sect) {
+		if (!strcmp(sect->name, "globals")) {
+			section = sect;
 			break;
 		}
 	}
@@ -1584,8 +1672,8 @@ load_text_global_state(list_t *sections)
 	map_init_dimensions(&globals.map);
 
 	/* Load the remaining global state. */
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "version")) {
 			LOGV("savegame", "Loading save game from version %s.", s->value);
 		} else if (!strcmp(s->key, "map.col_size") ||
@@ -1683,9 +1771,8 @@ load_text_player_section(section_t *section)
 	player_sett_t *sett = globals.player_sett[n];
 
 	/* Load the player state. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "flags")) {
 			sett->flags = atoi(s->value);
 		} else if (!strcmp(s->key, "build")) {
@@ -1813,11 +1900,10 @@ load_text_player_section(section_t *section)
 }
 
 static int
-load_text_player_state(list_t *sections)
+load_text_player_state(text_file_t *file)
 {
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "player")) {
 			int r = load_text_player_section(s);
 			if (r < 0) return -1;
@@ -1835,12 +1921,11 @@ load_text_flag_section(section_t *section)
 	if (n >= globals.max_flg_cnt) return -1;
 
 	flag_t *flag = &globals.flgs[n];
-	globals.flg_bitmap[n/8] |= BIT(7-(n&7));
+	pool_set_allocated(&globals.flg_pool, n);
 
 	/* Load the flag state. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "pos")) {
 			flag->pos = parse_map_pos(s->value);
 		} else if (!strcmp(s->key, "search_num")) {
@@ -1910,17 +1995,19 @@ load_text_flag_section(section_t *section)
 }
 
 static int
-load_text_flag_state(list_t *sections)
+load_text_flag_state(text_file_t *file)
 {
 	/* Clear flag allocation bitmap */
 	memset(globals.flg_bitmap, 0, ((globals.max_flg_cnt-1) / 8) + 1);
+	pool_reset(&globals.flg_pool);
+
+	flag_route_reset();
 
 	/* Create NULL-flag (index 0 is undefined) */
 	game_alloc_flag(NULL, NULL);
 
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "flag")) {
 			int r = load_text_flag_section(s);
 			if (r < 0) return -1;
@@ -1938,12 +2025,11 @@ load_text_building_section(section_t *section)
 	if (n >= globals.max_building_cnt) return -1;
 
 	building_t *building = &globals.buildings[n];
-	globals.buildings_bitmap[n/8] |= BIT(7-(n&7));
+	pool_set_allocated(&globals.building_pool, n);
 
 	/* Load the building state. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "pos")) {
 			building->pos = parse_map_pos(s->value);
 		} else if (!strcmp(s->key, "bld")) {
@@ -1987,8 +2073,7 @@ load_text_building_section(section_t *section)
 			building->u.flag = &globals.flgs[atoi(value)];
 		}
 	} else {
-		list_foreach(&section->settings, elm) {
-			setting_t *s = (setting_t *)elm;
+		setting_foreach(section, s) {
 			if (!strcmp(s->key, "level")) {
 				building->u.s.level = atoi(s->value);
 			} else if (!strcmp(s->key, "planks_needed")) {
@@ -2003,19 +2088,19 @@ load_text_building_section(section_t *section)
 }
 
 static int
-load_text_building_state(list_t *sections)
+load_text_building_state(text_file_t *file)
 {
 	/* Clear building allocation bitmap */
 	memset(globals.buildings_bitmap, 0, ((globals.max_building_cnt-1) / 8) + 1);
+	pool_reset(&globals.building_pool);
 
 	/* Create NULL-building (index 0 is undefined) */
 	building_t *building;
 	game_alloc_building(&building, NULL);
 	building->bld = 0;
 
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "building")) {
 			int r = load_text_building_section(s);
 			if (r < 0) return -1;
@@ -2033,12 +2118,11 @@ load_text_inventory_section(section_t *section)
 	if (n >= globals.max_inventory_cnt) return -1;
 
 	inventory_t *inventory = &globals.inventories[n];
-	globals.inventories_bitmap[n/8] |= BIT(7-(n&7));
+	pool_set_allocated(&globals.inventory_pool, n);
 
 	/* Load the inventory state. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "player")) {
 			inventory->player_num = atoi(s->value);
 		} else if (!strcmp(s->key, "res_dir")) {
@@ -2082,14 +2166,14 @@ load_text_inventory_section(section_t *section)
 }
 
 static int
-load_text_inventory_state(list_t *sections)
+load_text_inventory_state(text_file_t *file)
 {
 	/* Clear inventory allocation bitmap */
 	memset(globals.inventories_bitmap, 0, ((globals.max_inventory_cnt-1) / 8) + 1);
+	pool_reset(&globals.inventory_pool);
 
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "inventory")) {
 			int r = load_text_inventory_section(s);
 			if (r < 0) return -1;
@@ -2107,12 +2191,11 @@ load_text_serf_section(section_t *section)
 	if (n >= globals.max_serf_cnt) return -1;
 
 	serf_t *serf = &globals.serfs[n];
-	globals.serfs_bitmap[n/8] |= BIT(7-(n&7));
+	pool_set_allocated(&globals.serf_pool, n);
 
 	/* Load the serf state. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "type")) {
 			serf->type = atoi(s->value);
 		} else if (!strcmp(s->key, "animation")) {
@@ -2133,8 +2216,7 @@ load_text_serf_section(section_t *section)
 	}
 
 	/* Load state variables */
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_foreach(section, s) {
 		switch (serf->state) {
 		case SERF_STATE_IDLE_IN_STOCK:
 			if (!strcmp(s->key, "state.inventory")) {
@@ -2362,10 +2444,11 @@ load_text_serf_section(section_t *section)
 }
 
 static int
-load_text_serf_state(list_t *sections)
+load_text_serf_state(text_file_t *file)
 {
 	/* Clear serf allocation bitmap */
 	memset(globals.serfs_bitmap, 0, ((globals.max_serf_cnt-1) / 8) + 1);
+	pool_reset(&globals.serf_pool);
 
 	/* Create NULL-serf */
 	serf_t *serf;
@@ -2376,9 +2459,8 @@ load_text_serf_state(list_t *sections)
 	serf->counter = 0;
 	serf->pos = -1;
 
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "serf")) {
 			int r = load_text_serf_section(s);
 			if (r < 0) return -1;
@@ -2418,9 +2500,8 @@ load_text_map_section(section_t *section)
 	uint water = 0;
 
 	/* Load the map tile. */
-	list_elm_t *elm;
-	list_foreach(&section->settings, elm) {
-		setting_t *s = (setting_t *)elm;
+	setting_t *s;
+	setting_foreach(section, s) {
 		if (!strcmp(s->key, "deep_water")) {
 			deep_water = atoi(s->value);
 		} else if (!strcmp(s->key, "paths")) {
@@ -2474,8 +2555,7 @@ load_text_map_section(section_t *section)
 		uint resource_type = 0;
 		uint resource_amount = 0;
 
-		list_foreach(&section->settings, elm) {
-			setting_t *s = (setting_t *)elm;
+		setting_foreach(section, s) {
 			if (!strcmp(s->key, "idle_serf")) {
 				idle_serf = atoi(s->value);
 			} else if (!strcmp(s->key, "player")) {
@@ -2503,11 +2583,10 @@ load_text_map_section(section_t *section)
 }
 
 static int
-load_text_map_state(list_t *sections)
+load_text_map_state(text_file_t *file)
 {
-	list_elm_t *elm;
-	list_foreach(sections, elm) {
-		section_t *s = (section_t *)elm;
+	section_t *s;
+	section_foreach(file, s) {
 		if (!strcmp(s->name, "map")) {
 			int r = load_text_map_section(s);
 			if (r < 0) return -1;
@@ -2522,39 +2601,689 @@ load_text_state(FILE *f)
 {
 	int r;
 
-	list_t sections;
-	list_init(&sections);
-
-	load_text_parse(f, &sections);
+	text_file_t file;
+	r = load_text_parse(f, &file);
+	if (r < 0) return -1;
 
-	r = load_text_global_state(&sections);
+	r = load_text_global_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_player_state(&sections);
+	r = load_text_player_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_flag_state(&sections);
+	r = load_text_flag_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_building_state(&sections);
+	r = load_text_building_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_inventory_state(&sections);
+	r = load_text_inventory_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_serf_state(&sections);
+	r = load_text_serf_state(&file);
 	if (r < 0) goto error;
 
-	r = load_text_map_state(&sections);
+	r = load_text_map_state(&file);
 	if (r < 0) goto error;
 
 	globals.game_speed = 0;
 	globals.game_speed_save = DEFAULT_GAME_SPEED;
 
-	load_text_free_sections(&sections);
+	load_text_free(&file);
 	return 0;
 
 error:
-	load_text_free_sections(&sections);
+	load_text_free(&file);
 	return -1;
 }
+
+
+/* Binary snapshot format
+
+   The snapshot is a header followed by a table of sections and the
+   section data. The object arrays and the map tiles are stored in
+   the native layout of the structs, so a snapshot can only be loaded
+   by a build with the same byte order and struct sizes. This is
+   checked with the byte order mark in the header and the element size
+   of each section. Pointers between game objects are stored as object
+   ids and fixed up on load. Section data is aligned to 8 bytes.
+   All other values are native 32 bit words.
+   The snapshot is much faster to save and load than the text format,
+   which is kept for debugging. */
+
+#define SNAPSHOT_MAGIC       0x4e535346 /* "FSSN" */
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_BYTE_ORDER  0x01020304
+
+#define SNAPSHOT_ALIGN(x)  (((x) + 7) & ~(uint64_t)7)
+
+typedef enum {
+	SNAPSHOT_SECTION_GLOBALS = 1,
+	SNAPSHOT_SECTION_PLAYERS,
+	SNAPSHOT_SECTION_MAP,
+	SNAPSHOT_SECTION_FLAGS,
+	SNAPSHOT_SECTION_FLAG_BITMAP,
+	SNAPSHOT_SECTION_BUILDINGS,
+	SNAPSHOT_SECTION_BUILDING_BITMAP,
+	SNAPSHOT_SECTION_INVENTORIES,
+	SNAPSHOT_SECTION_INVENTORY_BITMAP,
+	SNAPSHOT_SECTION_SERFS,
+	SNAPSHOT_SECTION_SERF_BITMAP,
+
+	SNAPSHOT_SECTION_MAX
+} snapshot_section_id_t;
+
+/* Section ids in the file start at one. Sections are stored in the
+   section table in id order, at the slot given by SNAPSHOT_SLOT(). */
+#define SNAPSHOT_SLOT(id)  ((id) - SNAPSHOT_SECTION_GLOBALS)
+#define SNAPSHOT_SECTIONS  SNAPSHOT_SLOT(SNAPSHOT_SECTION_MAX)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t section_count;
+} snapshot_header_t;
+
+typedef struct {
+	uint32_t id;
+	uint32_t elm_size;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+} snapshot_section_t;
+
+/* The global state in a snapshot. These are the
+   same values as in the globals section of the text format. */
+typedef struct {
+	int32_t map_col_size;
+	int32_t map_row_size;
+	int32_t split;
+	int32_t update_map_initial_pos_col;
+	int32_t update_map_initial_pos_row;
+	int32_t cfg_left;
+	int32_t cfg_right;
+	int32_t game_type;
+	int32_t game_tick;
+	int32_t game_stats_counter;
+	int32_t history_counter;
+	int32_t rnd[3];
+	int32_t max_ever_flag_index;
+	int32_t max_ever_building_index;
+	int32_t max_ever_serf_index;
+	int32_t next_index;
+	int32_t flag_search_counter;
+	int32_t update_map_last_anim;
+	int32_t update_map_counter;
+	int32_t player_history_index[4];
+	int32_t player_history_counter[3];
+	int32_t resource_history_index;
+	int32_t map_regions;
+	int32_t max_ever_inventory_index;
+	int32_t map_max_serfs_left;
+	int32_t max_next_index;
+	int32_t map_field_4A;
+	int32_t map_gold_deposit;
+	int32_t update_map_16_loop;
+	int32_t map_size;
+	int32_t map_field_52;
+	int32_t map_62_5_times_regions;
+	int32_t map_gold_morale_factor;
+	int32_t winning_player;
+	int32_t player_score_leader;
+} snapshot_globals_t;
+
+/* Object ids of pointers to game objects. */
+#define SNAPSHOT_ID_FLAG       (1 << 24)
+#define SNAPSHOT_ID_BUILDING   (2 << 24)
+#define SNAPSHOT_ID_INVENTORY  (3 << 24)
+#define SNAPSHOT_ID_INVALID    0xffffffff
+
+
+static uint32_t
+snapshot_ptr_id(const void *ptr)
+{
+	if (ptr == NULL) return 0;
+
+	uintptr_t p = (uintptr_t)ptr;
+
+	uintptr_t flags = (uintptr_t)globals.flgs;
+	if (p >= flags && p < flags + globals.max_flg_cnt*sizeof(flag_t) &&
+	    (p - flags) % sizeof(flag_t) == 0) {
+		return SNAPSHOT_ID_FLAG | ((p - flags) / sizeof(flag_t));
+	}
+
+	uintptr_t buildings = (uintptr_t)globals.buildings;
+	if (p >= buildings &&
+	    p < buildings + globals.max_building_cnt*sizeof(building_t) &&
+	    (p - buildings) % sizeof(building_t) == 0) {
+		return SNAPSHOT_ID_BUILDING | ((p - buildings) / sizeof(building_t));
+	}
+
+	uintptr_t inventories = (uintptr_t)globals.inventories;
+	if (p >= inventories &&
+	    p < inventories + globals.max_inventory_cnt*sizeof(inventory_t) &&
+	    (p - inventories) % sizeof(inventory_t) == 0) {
+		return SNAPSHOT_ID_INVENTORY |
+			((p - inventories) / sizeof(inventory_t));
+	}
+
+	return SNAPSHOT_ID_INVALID;
+}
+
+static void *
+snapshot_id_ptr(uintptr_t id)
+{
+	uint index = id & 0xffffff;
+	switch (id & ~(uintptr_t)0xffffff) {
+	case SNAPSHOT_ID_FLAG:
+		if (index < globals.max_flg_cnt) return &globals.flgs[index];
+		break;
+	case SNAPSHOT_ID_BUILDING:
+		if (index < globals.max_building_cnt) return &globals.buildings[index];
+		break;
+	case SNAPSHOT_ID_INVENTORY:
+		if (index < globals.max_inventory_cnt) return &globals.inventories[index];
+		break;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+#define SNAPSHOT_PTR_TO_ID(ptr)  ((ptr) = (void *)(uintptr_t)snapshot_ptr_id(ptr))
+#define SNAPSHOT_ID_TO_PTR(ptr)  ((ptr) = snapshot_id_ptr((uintptr_t)(ptr)))
+
+/* The union of a building holds a pointer when
+   the building is done and not burning. */
+static int
+building_has_ptr(const building_t *building)
+{
+	return !BUILDING_IS_BURNING(building) &&
+		(BUILDING_IS_DONE(building) ||
+		 BUILDING_TYPE(building) == BUILDING_CASTLE);
+}
+
+static int
+serf_has_flag_ptr(const serf_t *serf)
+{
+	return serf->state == SERF_STATE_IDLE_ON_PATH ||
+		serf->state == SERF_STATE_WAIT_IDLE_ON_PATH ||
+		serf->state == SERF_STATE_WAKE_AT_FLAG ||
+		serf->state == SERF_STATE_WAKE_ON_PATH;
+}
+
+static void
+snapshot_fill_globals(snapshot_globals_t *g)
+{
+	memset(g, 0, sizeof(snapshot_globals_t));
+
+	g->map_col_size = globals.map.col_size;
+	g->map_row_size = globals.map.row_size;
+	g->split = globals.split;
+	g->update_map_initial_pos_col = MAP_POS_COL(globals.update_map_initial_pos);
+	g->update_map_initial_pos_row = MAP_POS_ROW(globals.update_map_initial_pos);
+	g->cfg_left = globals.cfg_left;
+	g->cfg_right = globals.cfg_right;
+	g->game_type = globals.game_type;
+	g->game_tick = globals.game_tick;
+	g->game_stats_counter = globals.game_stats_counter;
+	g->history_counter = globals.history_counter;
+	for (int i = 0; i < 3; i++) g->rnd[i] = globals.rnd.state[i];
+	g->max_ever_flag_index = globals.max_ever_flag_index;
+	g->max_ever_building_index = globals.max_ever_building_index;
+	g->max_ever_serf_index = globals.max_ever_serf_index;
+	g->next_index = globals.next_index;
+	g->flag_search_counter = globals.flag_search_counter;
+	g->update_map_last_anim = globals.update_map_last_anim;
+	g->update_map_counter = globals.update_map_counter;
+	for (int i = 0; i < 4; i++) {
+		g->player_history_index[i] = globals.player_history_index[i];
+	}
+	for (int i = 0; i < 3; i++) {
+		g->player_history_counter[i] = globals.player_history_counter[i];
+	}
+	g->resource_history_index = globals.resource_history_index;
+	g->map_regions = globals.map_regions;
+	g->max_ever_inventory_index = globals.max_ever_inventory_index;
+	g->map_max_serfs_left = globals.map_max_serfs_left;
+	g->max_next_index = globals.max_next_index;
+	g->map_field_4A = globals.map_field_4A;
+	g->map_gold_deposit = globals.map_gold_deposit;
+	g->update_map_16_loop = globals.update_map_16_loop;
+	g->map_size = globals.map_size;
+	g->map_field_52 = globals.map_field_52;
+	g->map_62_5_times_regions = globals.map_62_5_times_regions;
+	g->map_gold_morale_factor = globals.map_gold_morale_factor;
+	g->winning_player = globals.winning_player;
+	g->player_score_leader = globals.player_score_leader;
+}
+
+static void
+snapshot_apply_globals(const snapshot_globals_t *g)
+{
+	globals.split = g->split;
+	globals.update_map_initial_pos = MAP_POS(g->update_map_initial_pos_col,
+						 g->update_map_initial_pos_row);
+	globals.cfg_left = g->cfg_left;
+	globals.cfg_right = g->cfg_right;
+	globals.game_type = g->game_type;
+	globals.game_tick = g->game_tick;
+	globals.game_stats_counter = g->game_stats_counter;
+	globals.history_counter = g->history_counter;
+	for (int i = 0; i < 3; i++) globals.rnd.state[i] = g->rnd[i];
+	globals.max_ever_flag_index = g->max_ever_flag_index;
+	globals.max_ever_building_index = g->max_ever_building_index;
+	globals.max_ever_serf_index = g->max_ever_serf_index;
+	globals.next_index = g->next_index;
+	globals.flag_search_counter = g->flag_search_counter;
+	globals.update_map_last_anim = g->update_map_last_anim;
+	globals.update_map_counter = g->update_map_counter;
+	for (int i = 0; i < 4; i++) {
+		globals.player_history_index[i] = g->player_history_index[i];
+	}
+	for (int i = 0; i < 3; i++) {
+		globals.player_history_counter[i] = g->player_history_counter[i];
+	}
+	globals.resource_history_index = g->resource_history_index;
+	globals.map_regions = g->map_regions;
+	globals.max_ever_inventory_index = g->max_ever_inventory_index;
+	globals.map_max_serfs_left = g->map_max_serfs_left;
+	globals.max_next_index = g->max_next_index;
+	globals.map_field_4A = g->map_field_4A;
+	globals.map_gold_deposit = g->map_gold_deposit;
+	globals.update_map_16_loop = g->update_map_16_loop;
+	globals.map_size = g->map_size;
+	globals.map_field_52 = g->map_field_52;
+	globals.map_62_5_times_regions = g->map_62_5_times_regions;
+	globals.map_gold_morale_factor = g->map_gold_morale_factor;
+	globals.winning_player = g->winning_player;
+	globals.player_score_leader = g->player_score_leader;
+}
+
+/* Replace pointers in the copied objects by ids. */
+static void
+snapshot_encode_flags(flag_t *flags, uint count)
+{
+	for (uint i = 0; i < count; i++) {
+		for (int d = 0; d < 6; d++) {
+			SNAPSHOT_PTR_TO_ID(flags[i].other_endpoint.v[d]);
+		}
+	}
+}
+
+static void
+snapshot_encode_buildings(building_t *buildings, uint count)
+{
+	for (uint i = 0; i < count; i++) {
+		if (!BUILDING_ALLOCATED(i) || !building_has_ptr(&buildings[i])) {
+			continue;
+		}
+
+		/* Both members of the union are pointers */
+		SNAPSHOT_PTR_TO_ID(buildings[i].u.flag);
+	}
+}
+
+static void
+snapshot_encode_serfs(serf_t *serfs, uint count)
+{
+	for (uint i = 0; i < count; i++) {
+		if (!SERF_ALLOCATED(i) || !serf_has_flag_ptr(&serfs[i])) continue;
+		SNAPSHOT_PTR_TO_ID(serfs[i].s.idle_on_path.flag);
+	}
+}
+
+static size_t
+bitmap_size(uint count)
+{
+	return ((count-1) / 8) + 1;
+}
+
+struct snapshot {
+	uint8_t *data;
+	size_t size;
+};
+
+/* Copy the game state into a snapshot in memory. The snapshot has the
+   layout of the file, so it can be written without accessing the game
+   state, e.g. from another thread while the game continues. */
+snapshot_t *
+snapshot_create()
+{
+	snapshot_globals_t g;
+	snapshot_fill_globals(&g);
+
+	player_sett_t players[4];
+	for (int i = 0; i < 4; i++) players[i] = *globals.player_sett[i];
+
+	struct {
+		uint32_t id;
+		uint32_t elm_size;
+		uint32_t count;
+		const void *data;
+	} sections[SNAPSHOT_SECTIONS] = {
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_GLOBALS)] =
+		{ SNAPSHOT_SECTION_GLOBALS, sizeof(snapshot_globals_t), 1, &g },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_PLAYERS)] =
+		{ SNAPSHOT_SECTION_PLAYERS, sizeof(player_sett_t), 4, players },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_MAP)] =
+		{ SNAPSHOT_SECTION_MAP, sizeof(map_tile_t),
+		  globals.map.tile_count, globals.map.tiles },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_FLAGS)] =
+		{ SNAPSHOT_SECTION_FLAGS, sizeof(flag_t),
+		  globals.max_ever_flag_index, globals.flgs },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_FLAG_BITMAP)] =
+		{ SNAPSHOT_SECTION_FLAG_BITMAP, 1,
+		  bitmap_size(globals.max_flg_cnt), globals.flg_bitmap },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_BUILDINGS)] =
+		{ SNAPSHOT_SECTION_BUILDINGS, sizeof(building_t),
+		  globals.max_ever_building_index, globals.buildings },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_BUILDING_BITMAP)] =
+		{ SNAPSHOT_SECTION_BUILDING_BITMAP, 1,
+		  bitmap_size(globals.max_building_cnt), globals.buildings_bitmap },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_INVENTORIES)] =
+		{ SNAPSHOT_SECTION_INVENTORIES, sizeof(inventory_t),
+		  globals.max_ever_inventory_index, globals.inventories },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_INVENTORY_BITMAP)] =
+		{ SNAPSHOT_SECTION_INVENTORY_BITMAP, 1,
+		  bitmap_size(globals.max_inventory_cnt), globals.inventories_bitmap },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_SERFS)] =
+		{ SNAPSHOT_SECTION_SERFS, sizeof(serf_t),
+		  globals.max_ever_serf_index, globals.serfs },
+		[SNAPSHOT_SLOT(SNAPSHOT_SECTION_SERF_BITMAP)] =
+		{ SNAPSHOT_SECTION_SERF_BITMAP, 1,
+		  bitmap_size(globals.max_serf_cnt), globals.serfs_bitmap }
+	};
+
+	snapshot_section_t table[SNAPSHOT_SECTIONS];
+	uint64_t offset = SNAPSHOT_ALIGN(sizeof(snapshot_header_t) +
+					 sizeof(table));
+	for (int i = 0; i < SNAPSHOT_SECTIONS; i++) {
+		table[i].id = sections[i].id;
+		table[i].elm_size = sections[i].elm_size;
+		table[i].count = sections[i].count;
+		table[i].reserved = 0;
+		table[i].offset = offset;
+		table[i].size = (uint64_t)sections[i].elm_size * sections[i].count;
+		offset = SNAPSHOT_ALIGN(offset + table[i].size);
+	}
+
+	snapshot_t *snapshot = malloc(sizeof(snapshot_t));
+	if (snapshot == NULL) abort();
+
+	snapshot->size = offset;
+	snapshot->data = calloc(snapshot->size, 1);
+	if (snapshot->data == NULL) abort();
+
+	snapshot_header_t *header = (snapshot_header_t *)snapshot->data;
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->byte_order = SNAPSHOT_BYTE_ORDER;
+	header->section_count = SNAPSHOT_SECTIONS;
+
+	memcpy(header + 1, table, sizeof(table));
+
+	void *data[SNAPSHOT_SECTIONS];
+	for (int i = 0; i < SNAPSHOT_SECTIONS; i++) {
+		data[i] = snapshot->data + table[i].offset;
+		memcpy(data[i], sections[i].data, table[i].size);
+	}
+
+	snapshot_encode_flags(data[SNAPSHOT_SLOT(SNAPSHOT_SECTION_FLAGS)],
+			      table[SNAPSHOT_SLOT(SNAPSHOT_SECTION_FLAGS)].count);
+	snapshot_encode_buildings(data[SNAPSHOT_SLOT(SNAPSHOT_SECTION_BUILDINGS)],
+				  table[SNAPSHOT_SLOT(SNAPSHOT_SECTION_BUILDINGS)].count);
+	snapshot_encode_serfs(data[SNAPSHOT_SLOT(SNAPSHOT_SECTION_SERFS)],
+			      table[SNAPSHOT_SLOT(SNAPSHOT_SECTION_SERFS)].count);
+
+	return snapshot;
+}
+
+int
+snapshot_write(const snapshot_t *snapshot, FILE *f)
+{
+	size_t wr = fwrite(snapshot->data, snapshot->size, 1, f);
+	if (wr < 1) return -1;
+
+	return 0;
+}
+
+void
+snapshot_free(snapshot_t *snapshot)
+{
+	free(snapshot->data);
+	free(snapshot);
+}
+
+/* Save the game state as a binary snapshot. */
+int
+save_snapshot_state(FILE *f)
+{
+	snapshot_t *snapshot = snapshot_create();
+	int r = snapshot_write(snapshot, f);
+	snapshot_free(snapshot);
+
+	return r;
+}
+
+/* Return the data of a section in the snapshot, or NULL if it is
+   missing or does not match the element size. */
+static const void *
+snapshot_get_section(const uint8_t *data, size_t size,
+		     snapshot_section_id_t id, size_t elm_size, uint *count)
+{
+	const snapshot_header_t *header = (snapshot_header_t *)data;
+	const snapshot_section_t *table = (snapshot_section_t *)(header + 1);
+
+	for (uint i = 0; i < header->section_count; i++) {
+		if (table[i].id != id) continue;
+
+		if (table[i].elm_size != elm_size ||
+		    table[i].size != (uint64_t)elm_size * table[i].count ||
+		    table[i].offset > size ||
+		    table[i].size > size - table[i].offset) {
+			LOGE("savegame", "Invalid snapshot section %i.", id);
+			return NULL;
+		}
+
+		*count = table[i].count;
+		return data + table[i].offset;
+	}
+
+	LOGE("savegame", "Snapshot section %i is missing.", id);
+	return NULL;
+}
+
+/* Load an object array with its allocation bitmap. */
+static int
+snapshot_load_objects(const uint8_t *data, size_t size,
+		      snapshot_section_id_t id, size_t elm_size,
+		      void *objects, uint max_count,
+		      uint8_t *bitmap, pool_t *pool)
+{
+	uint count, bitmap_count;
+	const void *src = snapshot_get_section(data, size, id,
+					       elm_size, &count);
+	const void *src_bitmap = snapshot_get_section(data, size, id+1,
+						      1, &bitmap_count);
+	if (src == NULL || src_bitmap == NULL) return -1;
+	if (count > max_count) return -1;
+
+	/* Only indices below count can be allocated */
+	memset(bitmap, 0, bitmap_size(max_count));
+	memcpy(bitmap, src_bitmap, min(bitmap_count, (count + 7) / 8));
+	if (count % 8 != 0 && bitmap_count >= (count + 7) / 8) {
+		bitmap[count / 8] &= 0xff << (8 - count % 8);
+	}
+
+	memcpy(objects, src, count * elm_size);
+	pool_reset(pool);
+
+	return 0;
+}
+
+static int
+snapshot_load(const uint8_t *data, size_t size)
+{
+	const snapshot_header_t *header = (snapshot_header_t *)data;
+	if (size < sizeof(snapshot_header_t) ||
+	    header->magic != SNAPSHOT_MAGIC) return -1;
+
+	if (header->byte_order != SNAPSHOT_BYTE_ORDER ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->section_count > (size - sizeof(snapshot_header_t)) /
+	    sizeof(snapshot_section_t)) {
+		LOGE("savegame", "Snapshot is from an incompatible version.");
+		return -1;
+	}
+
+	uint count;
+	const snapshot_globals_t *g =
+		snapshot_get_section(data, size, SNAPSHOT_SECTION_GLOBALS,
+				     sizeof(snapshot_globals_t), &count);
+	if (g == NULL || count != 1) return -1;
+
+	/* Initialize map dimensions before the map tiles are loaded. */
+	if (g->map_col_size < 1 || g->map_col_size > 10 ||
+	    g->map_row_size < 1 || g->map_row_size > 10) return -1;
+
+	globals.map.col_size = g->map_col_size;
+	globals.map.row_size = g->map_row_size;
+	globals.map.cols = 1 << globals.map.col_size;
+	globals.map.rows = 1 << globals.map.row_size;
+	map_init_dimensions(&globals.map);
+
+	snapshot_apply_globals(g);
+
+	const player_sett_t *players =
+		snapshot_get_section(data, size, SNAPSHOT_SECTION_PLAYERS,
+				     sizeof(player_sett_t), &count);
+	if (players == NULL || count != 4) return -1;
+	for (int i = 0; i < 4; i++) *globals.player_sett[i] = players[i];
+
+	const map_tile_t *tiles =
+		snapshot_get_section(data, size, SNAPSHOT_SECTION_MAP,
+				     sizeof(map_tile_t), &count);
+	if (tiles == NULL || count != globals.map.tile_count) return -1;
+	memcpy(globals.map.tiles, tiles, count * sizeof(map_tile_t));
+
+	int r;
+	r = snapshot_load_objects(data, size, SNAPSHOT_SECTION_FLAGS,
+				  sizeof(flag_t), globals.flgs,
+				  globals.max_flg_cnt, globals.flg_bitmap,
+				  &globals.flg_pool);
+	if (r < 0) return -1;
+
+	r = snapshot_load_objects(data, size, SNAPSHOT_SECTION_BUILDINGS,
+				  sizeof(building_t), globals.buildings,
+				  globals.max_building_cnt,
+				  globals.buildings_bitmap,
+				  &globals.building_pool);
+	if (r < 0) return -1;
+
+	r = snapshot_load_objects(data, size, SNAPSHOT_SECTION_INVENTORIES,
+				  sizeof(inventory_t), globals.inventories,
+				  globals.max_inventory_cnt,
+				  globals.inventories_bitmap,
+				  &globals.inventory_pool);
+	if (r < 0) return -1;
+
+	r = snapshot_load_objects(data, size, SNAPSHOT_SECTION_SERFS,
+				  sizeof(serf_t), globals.serfs,
+				  globals.max_serf_cnt, globals.serfs_bitmap,
+				  &globals.serf_pool);
+	if (r < 0) return -1;
+
+	/* Fix up pointers between game objects */
+	int i;
+	pool_foreach_from(&globals.flg_pool, i, 0) {
+		flag_t *flag = &globals.flgs[i];
+		for (int d = 0; d < 6; d++) {
+			SNAPSHOT_ID_TO_PTR(flag->other_endpoint.v[d]);
+		}
+	}
+
+	pool_foreach_from(&globals.building_pool, i, 0) {
+		building_t *building = &globals.buildings[i];
+		if (building_has_ptr(building)) SNAPSHOT_ID_TO_PTR(building->u.flag);
+	}
+
+	pool_foreach_from(&globals.serf_pool, i, 0) {
+		serf_t *serf = &globals.serfs[i];
+		if (serf_has_flag_ptr(serf)) {
+			SNAPSHOT_ID_TO_PTR(serf->s.idle_on_path.flag);
+		}
+	}
+
+	flag_route_reset();
+
+	globals.game_speed = 0;
+	globals.game_speed_save = DEFAULT_GAME_SPEED;
+
+	return 0;
+}
+
+/* Load a binary snapshot from path. The file is mapped into memory
+   and the sections are copied to the game state. Returns -1 if the
+   file is not a snapshot or can not be loaded. */
+int
+load_snapshot_state(const char *path)
+{
+	uint8_t *data;
+	size_t size;
+
+#ifdef HAVE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(snapshot_header_t)) {
+		close(fd);
+		return -1;
+	}
+
+	size = sb.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+#else /* ! HAVE_MMAP */
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return -1;
+
+	if (fseek(f, 0, SEEK_END) < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	long fsize = ftell(f);
+	if (fsize < (long)sizeof(snapshot_header_t) ||
+	    fseek(f, 0, SEEK_SET) < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	size = fsize;
+	data = malloc(size);
+	if (data == NULL) abort();
+
+	size_t rd = fread(data, size, 1, f);
+	fclose(f);
+	if (rd < 1) {
+		free(data);
+		return -1;
+	}
+#endif
+
+	int r = snapshot_load(data, size);
+
+#ifdef HAVE_MMAP
+	munmap(data, size);
+#else
+	free(data);
+#endif
+
+	return r;
+}
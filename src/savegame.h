@@ -30,4 +30,13 @@ int load_v0_state(FILE *f);
 int save_text_state(FILE *f);
 int load_text_state(FILE *f);
 
+typedef struct snapshot snapshot_t;
+
+snapshot_t *snapshot_create();
+int snapshot_write(const snapshot_t *snapshot, FILE *f);
+void snapshot_free(snapshot_t *snapshot);
+
+int save_snapshot_state(FILE *f);
+int load_snapshot_state(const char *path);
+
 #endif /* !_SAVEGAME_H */
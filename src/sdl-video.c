@@ -53,10 +53,11 @@ static SDL_Color pal_colors[256];
 static SDL_Rect dirty_rects[MAX_DIRTY_RECTS];
 static int dirty_rect_counter = 0;
 
-
-struct surface {
-	SDL_Surface *surf;
-};
+/* Surface in the format that SDL_DisplayFormatAlpha() converts to. Used
+   to convert transparent sprites directly with sprite_lut, which maps
+   palette indices to pixels in that format. */
+static SDL_Surface *sprite_format_surf;
+static uint32_t sprite_lut[256];
 
 
 /* Unique identifier for a surface. */
@@ -66,39 +67,65 @@ typedef struct {
 	uint offset;
 } surface_id_t;
 
-typedef struct surface_ht_entry surface_ht_entry_t;
-
-/* Entry in the hashtable of surfaces. */
-struct surface_ht_entry {
-	surface_ht_entry_t *next;
+/* Entry in the open addressing table of surfaces.
+   The entry is free when surf is NULL. Entries are also linked
+   by slot in order of use, least recently used first. */
+typedef struct {
 	surface_id_t id;
-	surface_t *value;
-};
+	SDL_Surface *surf;
+	uint32_t hash;
+	uint lru_prev;
+	uint lru_next;
+	size_t bytes;
+} surface_cache_entry_t;
 
-/* Hashtable of surfaces, used as sprite cache. */
+#define SURFACE_CACHE_NONE  ((uint)-1)
+
+/* Sprite cache with a memory limit. When the limit is
+   reached the least recently used surfaces are freed. */
 typedef struct {
-	size_t size;
+	const char *name;
+	surface_cache_entry_t *entries;
+	uint size;
 	uint entry_count;
-	surface_ht_entry_t **entries;
-} surface_ht_t;
+	size_t bytes;
+	size_t limit;
+	uint lru_head;
+	uint lru_tail;
+	uint hits;
+	uint misses;
+	uint evictions;
+} surface_cache_t;
+
+/* Share of the sprite cache memory limit given to each area, in 1/16th. */
+#define TRANSP_CACHE_SHARE   10
+#define OVERLAY_CACHE_SHARE   2
+#define MASKED_CACHE_SHARE    4
+
+#define SPRITE_CACHE_DEFAULT_LIMIT  (64*1024*1024)
 
 
 /* The sprite cache is divided in three areas for
    different sprite types. */
-static surface_ht_t transp_sprite_cache;
-static surface_ht_t overlay_sprite_cache;
-static surface_ht_t masked_sprite_cache;
+static surface_cache_t transp_sprite_cache;
+static surface_cache_t overlay_sprite_cache;
+static surface_cache_t masked_sprite_cache;
+
+static size_t sprite_cache_limit = SPRITE_CACHE_DEFAULT_LIMIT;
 
 
 /* Calculate hash of surface identifier. */
 static uint32_t
 surface_id_hash(const surface_id_t *id)
 {
-	const uint8_t *s = (uint8_t *)id;
+	uintptr_t fields[] = {
+		(uintptr_t)id->sprite, (uintptr_t)id->mask, id->offset
+	};
 
-	/* FNV-1 */
+	/* FNV-1 over the fields (not the struct, to skip padding). */
+	const uint8_t *s = (uint8_t *)fields;
 	uint32_t hash = 2166136261;
-	for (int i = 0; i < sizeof(surface_id_t); i++) {
+	for (int i = 0; i < sizeof(fields); i++) {
 		hash *= 16777619;
 		hash ^= s[i];
 	}
@@ -106,48 +133,235 @@ surface_id_hash(const surface_id_t *id)
 	return hash;
 }
 
-/* Intialize surface hashtable. */
 static int
-surface_ht_init(surface_ht_t *ht, size_t size)
+surface_id_equal(const surface_id_t *a, const surface_id_t *b)
 {
-	ht->size = size;
-	ht->entries = calloc(size, sizeof(surface_ht_entry_t *));
-	if (ht->entries == NULL) return -1;
+	return a->sprite == b->sprite && a->mask == b->mask &&
+		a->offset == b->offset;
+}
 
-	ht->entry_count = 0;
+/* Intialize surface cache. Size must be a power of two. */
+static void
+surface_cache_init(surface_cache_t *cache, const char *name, uint size)
+{
+	cache->name = name;
+	cache->size = size;
+	cache->entries = calloc(size, sizeof(surface_cache_entry_t));
+	if (cache->entries == NULL) abort();
+
+	cache->entry_count = 0;
+	cache->bytes = 0;
+	cache->lru_head = SURFACE_CACHE_NONE;
+	cache->lru_tail = SURFACE_CACHE_NONE;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+}
 
-	return 0;
+/* Point the neighbours in the use order of the entry in slot
+   to the slot. */
+static void
+surface_cache_lru_link(surface_cache_t *cache, uint slot)
+{
+	surface_cache_entry_t *entry = &cache->entries[slot];
+
+	if (entry->lru_prev != SURFACE_CACHE_NONE) {
+		cache->entries[entry->lru_prev].lru_next = slot;
+	} else {
+		cache->lru_head = slot;
+	}
+
+	if (entry->lru_next != SURFACE_CACHE_NONE) {
+		cache->entries[entry->lru_next].lru_prev = slot;
+	} else {
+		cache->lru_tail = slot;
+	}
+}
+
+static void
+surface_cache_lru_unlink(surface_cache_t *cache, uint slot)
+{
+	surface_cache_entry_t *entry = &cache->entries[slot];
+
+	if (entry->lru_prev != SURFACE_CACHE_NONE) {
+		cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+	} else {
+		cache->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next != SURFACE_CACHE_NONE) {
+		cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+	} else {
+		cache->lru_tail = entry->lru_prev;
+	}
+}
+
+/* Make the entry in slot the most recently used. */
+static void
+surface_cache_lru_append(surface_cache_t *cache, uint slot)
+{
+	surface_cache_entry_t *entry = &cache->entries[slot];
+	entry->lru_prev = cache->lru_tail;
+	entry->lru_next = SURFACE_CACHE_NONE;
+	surface_cache_lru_link(cache, slot);
+}
+
+/* Return the surface associated with id or NULL if not cached. */
+static SDL_Surface *
+surface_cache_lookup(surface_cache_t *cache, const surface_id_t *id)
+{
+	uint mask = cache->size - 1;
+	uint32_t hash = surface_id_hash(id);
+
+	for (uint i = hash & mask;; i = (i + 1) & mask) {
+		surface_cache_entry_t *entry = &cache->entries[i];
+		if (entry->surf == NULL) break;
+
+		if (entry->hash == hash && surface_id_equal(&entry->id, id)) {
+			surface_cache_lru_unlink(cache, i);
+			surface_cache_lru_append(cache, i);
+			cache->hits += 1;
+			return entry->surf;
+		}
+	}
+
+	cache->misses += 1;
+	return NULL;
+}
+
+/* Free the surface in slot and close the gap in the probe sequence
+   by moving later entries of the cluster back. */
+static void
+surface_cache_remove(surface_cache_t *cache, uint slot)
+{
+	uint mask = cache->size - 1;
+
+	SDL_FreeSurface(cache->entries[slot].surf);
+	cache->bytes -= cache->entries[slot].bytes;
+	cache->entry_count -= 1;
+	surface_cache_lru_unlink(cache, slot);
+
+	uint i = slot;
+	for (uint j = (slot + 1) & mask;; j = (j + 1) & mask) {
+		surface_cache_entry_t *entry = &cache->entries[j];
+		if (entry->surf == NULL) break;
+
+		/* Entry can move to i if its home slot is not
+		   cyclically within (i, j]. */
+		uint home = entry->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			cache->entries[i] = *entry;
+			surface_cache_lru_link(cache, i);
+			i = j;
+		}
+	}
+
+	cache->entries[i].surf = NULL;
+}
+
+/* Free the least recently used surface. */
+static void
+surface_cache_evict(surface_cache_t *cache)
+{
+	surface_cache_remove(cache, cache->lru_head);
+	cache->evictions += 1;
+}
+
+/* Evict surfaces until bytes more fit in the cache limit
+   and the table has room for one more entry. */
+static void
+surface_cache_make_room(surface_cache_t *cache, size_t bytes)
+{
+	while (cache->entry_count > 0 &&
+	       (cache->bytes + bytes > cache->limit ||
+		cache->entry_count + 1 > cache->size - cache->size/4)) {
+		surface_cache_evict(cache);
+	}
 }
 
-/* Return a pointer to the surface pointer associated with
-   id. If it does not exist in the table it a new entry is
-   created. */
-static surface_t **
-surface_ht_store(surface_ht_t *ht, const surface_id_t *id)
+/* Store surface for id. The cache takes ownership of the surface. */
+static void
+surface_cache_insert(surface_cache_t *cache, const surface_id_t *id,
+		     SDL_Surface *surf)
 {
+	size_t bytes = (size_t)surf->pitch * surf->h;
+	surface_cache_make_room(cache, bytes);
+
+	uint mask = cache->size - 1;
 	uint32_t hash = surface_id_hash(id);
-	surface_ht_entry_t *entry =
-		(surface_ht_entry_t *)&ht->entries[hash % ht->size];
 
-	/* The first entry pointed to is not really an
-	   entry but a sentinel. */
-	while (entry->next != NULL) {
-		entry = entry->next;
+	uint i = hash & mask;
+	while (cache->entries[i].surf != NULL) i = (i + 1) & mask;
+
+	surface_cache_entry_t *entry = &cache->entries[i];
+	entry->id = *id;
+	entry->surf = surf;
+	entry->hash = hash;
+	entry->bytes = bytes;
+	surface_cache_lru_append(cache, i);
 
-		if (memcmp(id, &entry->id, sizeof(surface_id_t)) == 0) {
-			return &entry->value;
+	cache->entry_count += 1;
+	cache->bytes += bytes;
+}
+
+static void
+surface_cache_deinit(surface_cache_t *cache)
+{
+	for (uint i = 0; i < cache->size; i++) {
+		if (cache->entries[i].surf != NULL) {
+			SDL_FreeSurface(cache->entries[i].surf);
 		}
 	}
 
-	surface_ht_entry_t *new_entry = calloc(1, sizeof(surface_ht_entry_t));
-	if (new_entry == NULL) return NULL;
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->entry_count = 0;
+	cache->bytes = 0;
+	cache->lru_head = SURFACE_CACHE_NONE;
+	cache->lru_tail = SURFACE_CACHE_NONE;
+}
+
+static void
+surface_cache_set_limit(surface_cache_t *cache, size_t limit)
+{
+	cache->limit = limit;
+	if (cache->entries != NULL) surface_cache_make_room(cache, 0);
+}
 
-	ht->entry_count += 1;
+/* Set the memory limit in bytes shared by the sprite caches. */
+void
+sdl_set_sprite_cache_limit(size_t limit)
+{
+	sprite_cache_limit = limit;
+
+	surface_cache_set_limit(&transp_sprite_cache,
+				limit / 16 * TRANSP_CACHE_SHARE);
+	surface_cache_set_limit(&overlay_sprite_cache,
+				limit / 16 * OVERLAY_CACHE_SHARE);
+	surface_cache_set_limit(&masked_sprite_cache,
+				limit / 16 * MASKED_CACHE_SHARE);
+}
 
-	entry->next = new_entry;
-	memcpy(&new_entry->id, id, sizeof(surface_id_t));
+static void
+surface_cache_log_stats(const surface_cache_t *cache)
+{
+	uint lookups = cache->hits + cache->misses;
+	LOGI("sdl-video", "%s cache: %u entries, %u KiB of %u KiB,"
+	     " %u hits, %u misses (%u%% hits), %u evictions.",
+	     cache->name, cache->entry_count,
+	     (uint)(cache->bytes / 1024), (uint)(cache->limit / 1024),
+	     cache->hits, cache->misses,
+	     lookups > 0 ? (uint)((100ULL * cache->hits) / lookups) : 0,
+	     cache->evictions);
+}
 
-	return &new_entry->value;
+/* Log usage counters of the sprite caches. */
+void
+sdl_log_sprite_cache_stats()
+{
+	surface_cache_log_stats(&transp_sprite_cache);
+	surface_cache_log_stats(&overlay_sprite_cache);
+	surface_cache_log_stats(&masked_sprite_cache);
 }
 
 
@@ -175,9 +389,10 @@ sdl_init()
 	SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
 
 	/* Init sprite cache */
-	surface_ht_init(&transp_sprite_cache, 4096);
-	surface_ht_init(&overlay_sprite_cache, 512);
-	surface_ht_init(&masked_sprite_cache, 1024);
+	surface_cache_init(&transp_sprite_cache, "transparent", 8192);
+	surface_cache_init(&overlay_sprite_cache, "overlay", 1024);
+	surface_cache_init(&masked_sprite_cache, "masked", 8192);
+	sdl_set_sprite_cache_limit(sprite_cache_limit);
 
 	return 0;
 }
@@ -185,9 +400,32 @@ sdl_init()
 void
 sdl_deinit()
 {
+	sdl_log_sprite_cache_stats();
+
+	surface_cache_deinit(&transp_sprite_cache);
+	surface_cache_deinit(&overlay_sprite_cache);
+	surface_cache_deinit(&masked_sprite_cache);
+
+	if (sprite_format_surf != NULL) SDL_FreeSurface(sprite_format_surf);
+	sprite_format_surf = NULL;
+
 	SDL_Quit();
 }
 
+static void
+update_sprite_lut()
+{
+	if (sprite_format_surf == NULL) return;
+
+	/* Index 0 is transparent */
+	SDL_PixelFormat *format = sprite_format_surf->format;
+	sprite_lut[0] = SDL_MapRGBA(format, 0, 0, 0, 0);
+	for (int i = 1; i < 256; i++) {
+		sprite_lut[i] = SDL_MapRGBA(format, pal_colors[i].r,
+					    pal_colors[i].g, pal_colors[i].b, 0xff);
+	}
+}
+
 int
 sdl_set_resolution(int width, int height, int fullscreen)
 {
@@ -202,6 +440,24 @@ sdl_set_resolution(int width, int height, int fullscreen)
 
 	SDL_GetClipRect(screen.surf, &screen.clip);
 
+	/* Find the pixel format of transparent sprites */
+	if (sprite_format_surf != NULL) SDL_FreeSurface(sprite_format_surf);
+	sprite_format_surf = NULL;
+
+	SDL_Surface *surf8 = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 8, 0, 0, 0, 0);
+	if (surf8 != NULL) {
+		sprite_format_surf = SDL_DisplayFormatAlpha(surf8);
+		SDL_FreeSurface(surf8);
+	}
+
+	if (sprite_format_surf != NULL &&
+	    sprite_format_surf->format->BytesPerPixel != 4) {
+		SDL_FreeSurface(sprite_format_surf);
+		sprite_format_surf = NULL;
+	}
+
+	update_sprite_lut();
+
 	return 0;
 }
 
@@ -250,6 +506,37 @@ static SDL_Surface *
 create_surface_from_data(void *data, int width, int height, int transparent) {
 	int r;
 
+	if (transparent && sprite_format_surf != NULL) {
+		/* Convert directly to the format of SDL_DisplayFormatAlpha() */
+		SDL_PixelFormat *format = sprite_format_surf->format;
+		SDL_Surface *surf =
+			SDL_CreateRGBSurface(SDL_SRCALPHA, width, height, 32,
+					     format->Rmask, format->Gmask,
+					     format->Bmask, format->Amask);
+		if (surf == NULL) {
+			LOGE("sdl-video", "Unable to create sprite surface: %s.",
+			     SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+
+		r = SDL_LockSurface(surf);
+		if (r < 0) {
+			LOGE("sdl-video", "Unable to lock sprite.");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int y = 0; y < height; y++) {
+			uint32_t *row = (uint32_t *)((uint8_t *)surf->pixels + y*surf->pitch);
+			gfx_palette_to_rgba(row, (uint8_t *)data + y*width, width, sprite_lut);
+		}
+
+		SDL_UnlockSurface(surf);
+
+		SDL_SetAlpha(surf, SDL_SRCALPHA | SDL_RLEACCEL, SDL_ALPHA_OPAQUE);
+
+		return surf;
+	}
+
 	/* Create sprite surface */
 	SDL_Surface *surf8 =
 	SDL_CreateRGBSurfaceFrom(data, (int)width, (int)height, 8,
@@ -361,14 +648,7 @@ create_masked_transp_surface(const sprite_t *sprite, const sprite_t *mask, int m
 
 	gfx_unpack_mask_sprite(m_unpack, m_data, m_unpack_size);
 
-	/* Fill alpha value from mask data */
-	for (int y = 0; y < m_height; y++) {
-		for (int x = 0; x < m_width; x++) {
-			if (!m_unpack[y*m_width+x]) {
-				*(s_copy + y * m_width + x) = 0;
-			}
-		}
-	}
+	gfx_apply_mask(s_copy, m_unpack, m_unpack_size);
 
 	free(m_unpack);
 
@@ -393,16 +673,12 @@ sdl_draw_transp_sprite(const sprite_t *sprite, int x, int y, int use_off, int y_
 	}
 
 	const surface_id_t id = { .sprite = sprite, .mask = NULL, .offset = color_off };
-	surface_t **surface = surface_ht_store(&transp_sprite_cache, &id);
-	if (*surface == NULL) {
-		*surface = malloc(sizeof(surface_t));
-		if (*surface == NULL) abort();
-
-		(*surface)->surf = create_transp_surface(sprite, color_off);
+	SDL_Surface *surf = surface_cache_lookup(&transp_sprite_cache, &id);
+	if (surf == NULL) {
+		surf = create_transp_surface(sprite, color_off);
+		surface_cache_insert(&transp_sprite_cache, &id, surf);
 	}
 
-	SDL_Surface *surf = (*surface)->surf;
-
 	SDL_Rect src_rect = { 0, y_off, surf->w, surf->h - y_off };
 	SDL_Rect dest_rect = { x, y + y_off, 0, 0 };
 
@@ -428,19 +704,16 @@ sdl_draw_waves_sprite(const sprite_t *sprite, const sprite_t *mask,
 	y += le16toh(sprite->y) + dest->clip.y;
 
 	const surface_id_t id = { .sprite = sprite, .mask = mask, .offset = 0 };
-	surface_t **surface = surface_ht_store(&transp_sprite_cache, &id);
-	if (*surface == NULL) {
-		*surface = malloc(sizeof(surface_t));
-		if (*surface == NULL) abort();
-
+	SDL_Surface *surf = surface_cache_lookup(&transp_sprite_cache, &id);
+	if (surf == NULL) {
 		if (mask != NULL) {
-			(*surface)->surf = create_masked_transp_surface(sprite, mask, mask_off);
+			surf = create_masked_transp_surface(sprite, mask, mask_off);
 		} else {
-			(*surface)->surf = create_transp_surface(sprite, 0);
+			surf = create_transp_surface(sprite, 0);
 		}
+		surface_cache_insert(&transp_sprite_cache, &id, surf);
 	}
 
-	SDL_Surface *surf = (*surface)->surf;
 	SDL_Rect dest_rect = { x, y, 0, 0 };
 
 	SDL_SetClipRect(dest->surf, &dest->clip);
@@ -523,11 +796,18 @@ create_overlay_surface(const sprite_t *sprite)
 	}
 
 	/* Fill alpha value from overlay data */
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			uint32_t *p = (uint32_t *)((uint8_t *)surf->pixels + y * surf->pitch);
-			p[x] = SDL_MapRGBA(surf->format, 0, 0, 0, unpack[y*width+x]);
+	static uint32_t alpha_lut[256];
+	static int alpha_lut_ready = 0;
+	if (!alpha_lut_ready) {
+		for (int i = 0; i < 256; i++) {
+			alpha_lut[i] = SDL_MapRGBA(surf->format, 0, 0, 0, i);
 		}
+		alpha_lut_ready = 1;
+	}
+
+	for (int y = 0; y < height; y++) {
+		uint32_t *p = (uint32_t *)((uint8_t *)surf->pixels + y * surf->pitch);
+		gfx_palette_to_rgba(p, &unpack[y*width], width, alpha_lut);
 	}
 
 	SDL_UnlockSurface(surf);
@@ -545,15 +825,12 @@ sdl_draw_overlay_sprite(const sprite_t *sprite, int x, int y, int y_off, frame_t
 	y += le16toh(sprite->y) + dest->clip.y;
 
 	const surface_id_t id = { .sprite = sprite, .mask = NULL, .offset = 0 };
-	surface_t **surface = surface_ht_store(&overlay_sprite_cache, &id);
-	if (*surface == NULL) {
-		*surface = malloc(sizeof(surface_t));
-		if (*surface == NULL) abort();
-
-		(*surface)->surf = create_overlay_surface(sprite);
+	SDL_Surface *surf = surface_cache_lookup(&overlay_sprite_cache, &id);
+	if (surf == NULL) {
+		surf = create_overlay_surface(sprite);
+		surface_cache_insert(&overlay_sprite_cache, &id, surf);
 	}
 
-	SDL_Surface *surf = (*surface)->surf;
 	SDL_Rect src_rect = { 0, y_off, surf->w, surf->h - y_off };
 	SDL_Rect dest_rect = { x, y + y_off, 0, 0 };
 
@@ -577,43 +854,10 @@ create_masked_surface(const sprite_t *sprite, const sprite_t *mask)
 	size_t m_width = le16toh(mask->w);
 	size_t m_height = le16toh(mask->h);
 
-	size_t s_width = le16toh(sprite->w);
-	size_t s_height = le16toh(sprite->h);
-
-	void *s_data = (uint8_t *)sprite + sizeof(sprite_t);
-
 	uint8_t *s_copy = malloc(m_width * m_height * sizeof(uint8_t));
 	if (s_copy == NULL) abort();
 
-	size_t to_copy = m_width * m_height;
-	uint8_t *copy_dest = s_copy;
-	while (to_copy) {
-		size_t s = min(to_copy, s_width * s_height);
-		memcpy(copy_dest, s_data, s * sizeof(uint8_t));
-		to_copy -= s;
-		copy_dest += s;
-	}
-
-	/* Mask */
-	void *m_data = (uint8_t *)mask + sizeof(sprite_t);
-
-	/* Unpack mask */
-	size_t unpack_size = m_width * m_height;
-	uint8_t *m_unpack = calloc(unpack_size, sizeof(uint8_t));
-	if (m_unpack == NULL) abort();
-
-	gfx_unpack_mask_sprite(m_unpack, m_data, unpack_size);
-
-	/* Fill alpha value from mask data */
-	for (int y = 0; y < m_height; y++) {
-		for (int x = 0; x < m_width; x++) {
-			if (!m_unpack[y*m_width+x]) {
-				*(s_copy + y * m_width + x) = 0;
-			}
-		}
-	}
-
-	free(m_unpack);
+	gfx_mask_sprite(s_copy, sprite, mask);
 
 	SDL_Surface *surf = create_surface_from_data(s_copy, (int)m_width, (int)m_height, 1);
 
@@ -622,28 +866,31 @@ create_masked_surface(const sprite_t *sprite, const sprite_t *mask)
 	return surf;
 }
 
-surface_t *
-sdl_draw_masked_sprite(const sprite_t *sprite, int x, int y, const sprite_t *mask, surface_t *surface, frame_t *dest)
+/* Draw sprite masked by mask. If masked is non-NULL it must point
+   to the already masked sprite data, which is then used instead of
+   applying the mask to the sprite. */
+void
+sdl_draw_masked_sprite(const sprite_t *sprite, int x, int y, const sprite_t *mask,
+		       const uint8_t *masked, frame_t *dest)
 {
 	int r;
 
 	x += le16toh(mask->x) + dest->clip.x;
 	y += le16toh(mask->y) + dest->clip.y;
 
-	if (surface == NULL) {
-		const surface_id_t id = { .sprite = sprite, .mask = mask, .offset = 0 };
-		surface_t **s = surface_ht_store(&masked_sprite_cache, &id);
-		if (*s == NULL) {
-			*s = malloc(sizeof(surface_t));
-			if (*s == NULL) abort();
-
-			(*s)->surf = create_masked_surface(sprite, mask);
+	const surface_id_t id = { .sprite = sprite, .mask = mask, .offset = 0 };
+	SDL_Surface *surf = surface_cache_lookup(&masked_sprite_cache, &id);
+	if (surf == NULL) {
+		if (masked != NULL) {
+			surf = create_surface_from_data((void *)masked,
+							le16toh(mask->w),
+							le16toh(mask->h), 1);
+		} else {
+			surf = create_masked_surface(sprite, mask);
 		}
-		surface = *s;
+		surface_cache_insert(&masked_sprite_cache, &id, surf);
 	}
 
-	SDL_Surface *surf = surface->surf;
-
 	SDL_Rect src_rect = { 0, 0, surf->w, surf->h };
 	SDL_Rect dest_rect = { x, y, 0, 0 };
 
@@ -654,8 +901,6 @@ sdl_draw_masked_sprite(const sprite_t *sprite, int x, int y, const sprite_t *mas
 	if (r < 0) {
 		LOGE("sdl-video", "BlitSurface error: %s", SDL_GetError());
 	}
-
-	return surface;
 }
 
 void
@@ -709,18 +954,62 @@ sdl_fill_rect(int x, int y, int width, int height, int color, frame_t *dest)
 	}
 }
 
+/* Return non-zero if the rectangles overlap or touch. */
+static int
+rects_touch(const SDL_Rect *a, const SDL_Rect *b)
+{
+	return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+		a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+/* Mark a rectangle of the screen as changed. Rectangles that overlap
+   or touch are merged. If there are too many rectangles, the whole
+   screen is updated. */
 void
 sdl_mark_dirty(int x, int y, int width, int height)
 {
+	if (dirty_rect_counter > MAX_DIRTY_RECTS) return;
+
+	/* Clip to screen */
+	int x1 = min(x + width, screen.surf->w);
+	int y1 = min(y + height, screen.surf->h);
+	x = max(x, 0);
+	y = max(y, 0);
+	if (x >= x1 || y >= y1) return;
+
+	SDL_Rect rect = { x, y, x1 - x, y1 - y };
+
+	/* Merge with existing rectangles. The merged
+	   rectangle may touch rectangles checked earlier. */
+	int i = 0;
+	while (i < dirty_rect_counter) {
+		SDL_Rect *r = &dirty_rects[i];
+		if (!rects_touch(r, &rect)) {
+			i += 1;
+			continue;
+		}
+
+		int mx0 = min(r->x, rect.x);
+		int my0 = min(r->y, rect.y);
+		int mx1 = max(r->x + r->w, rect.x + rect.w);
+		int my1 = max(r->y + r->h, rect.y + rect.h);
+		rect.x = mx0;
+		rect.y = my0;
+		rect.w = mx1 - mx0;
+		rect.h = my1 - my0;
+
+		dirty_rect_counter -= 1;
+		dirty_rects[i] = dirty_rects[dirty_rect_counter];
+		i = 0;
+	}
+
 	if (dirty_rect_counter < MAX_DIRTY_RECTS) {
-		dirty_rects[dirty_rect_counter].x = x;
-		dirty_rects[dirty_rect_counter].y = y;
-		dirty_rects[dirty_rect_counter].w = width;
-		dirty_rects[dirty_rect_counter].h = height;
+		dirty_rects[dirty_rect_counter] = rect;
 	}
 	dirty_rect_counter += 1;
 }
 
+/* Present the rectangles marked dirty since the last call. */
 void
 sdl_swap_buffers()
 {
@@ -746,5 +1035,7 @@ sdl_set_palette(const uint8_t *palette)
 		pal_colors[i].g = palette[i*3+1];
 		pal_colors[i].b = palette[i*3+2];
 	}
+
+	update_sprite_lut();
 }
 
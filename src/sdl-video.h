@@ -29,8 +29,6 @@
 #include "gfx.h"
 
 
-typedef struct surface surface_t;
-
 int sdl_init();
 void sdl_deinit();
 int sdl_set_resolution(int width, int height, int fullscreen);
@@ -43,7 +41,7 @@ void sdl_draw_transp_sprite(const sprite_t *sprite, int x, int y, int use_off, i
 void sdl_draw_waves_sprite(const sprite_t *sprite, const sprite_t *mask, int x, int y, int mask_off, frame_t *dest);
 void sdl_draw_sprite(const sprite_t *sprite, int x, int y, frame_t *dest);
 void sdl_draw_overlay_sprite(const sprite_t *sprite, int x, int y, int y_off, frame_t *dest);
-surface_t *sdl_draw_masked_sprite(const sprite_t *sprite, int x, int y, const sprite_t *mask, surface_t *surface, frame_t *dest);
+void sdl_draw_masked_sprite(const sprite_t *sprite, int x, int y, const sprite_t *mask, const uint8_t *masked, frame_t *dest);
 void sdl_draw_frame(int dx, int dy, frame_t *dest, int sx, int sy, frame_t *src, int w, int h);
 void sdl_draw_rect(int x, int y, int width, int height, int color, frame_t *dest);
 void sdl_fill_rect(int x, int y, int width, int height, int color, frame_t *dest);
@@ -51,5 +49,8 @@ void sdl_set_palette(const uint8_t *palette);
 void sdl_mark_dirty(int x, int y, int width, int height);
 void sdl_swap_buffers();
 
+void sdl_set_sprite_cache_limit(size_t limit);
+void sdl_log_sprite_cache_stats();
+
 
 #endif /* ! _SDL_VIDEO_H */
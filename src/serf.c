@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 
 
@@ -29,6 +30,8 @@
 #include "game.h"
 #include "random.h"
 #include "viewport.h"
+#include "player.h"
+#include "profile.h"
 #include "misc.h"
 #include "debug.h"
 
@@ -139,7 +142,8 @@ static const char *serf_state_name[] = {
 	[SERF_STATE_DEFENDING_FORTRESS] = "DEFENDING FORTRESS",
 	[SERF_STATE_SCATTER] = "SCATTER",
 	[SERF_STATE_FINISHED_BUILDING] = "FINISHED BUILDING",
-	[SERF_STATE_DEFENDING_CASTLE] = "DEFENDING CASTLE"
+	[SERF_STATE_DEFENDING_CASTLE] = "DEFENDING CASTLE",
+	[SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE] = "KNIGHT ATTACKING DEFEAT FREE"
 };
 
 
@@ -149,6 +153,236 @@ serf_get_state_name(serf_state_t state)
 	return serf_state_name[state];
 }
 
+
+/* Index of serfs by map position and by destination flag. Each serf is
+   linked into the list of its position and the list of its destination
+   flag, so code looking for serfs at a position or on the way to a flag
+   does not have to scan the whole serf array. The lists are kept in
+   increasing index order, which is the order of the serf array. They
+   are updated by serf_set_pos(), serf_set_dest() and serf_set_state(),
+   and rebuilt from the serf array when a game is started or loaded.
+   The NULL serf (index 0) terminates the lists. */
+typedef struct {
+	int next;
+	int prev;
+	uint key; /* Position or flag the serf is listed under */
+} serf_link_t;
+
+#define SERF_LINK_NONE  ((uint)-1)
+
+static serf_link_t *pos_links;
+static int *pos_first;
+static uint pos_count;
+
+static serf_link_t *dest_links;
+static int *dest_first;
+static uint dest_count;
+
+static int serf_index_ready = 0;
+
+/* Move serf to the list for key, keeping the list in index order.
+   Keys outside the range of lists leave the serf unlisted. */
+static void
+serf_link_update(serf_link_t *links, int *first, uint count,
+		 int index, uint key)
+{
+	serf_link_t *link = &links[index];
+	if (key >= count) key = SERF_LINK_NONE;
+	if (link->key == key) return;
+
+	if (link->key != SERF_LINK_NONE) {
+		if (link->prev != 0) links[link->prev].next = link->next;
+		else first[link->key] = link->next;
+		if (link->next != 0) links[link->next].prev = link->prev;
+	}
+
+	link->key = key;
+	link->prev = 0;
+	link->next = 0;
+
+	if (key == SERF_LINK_NONE) return;
+
+	int prev = 0;
+	int next = first[key];
+	while (next != 0 && next < index) {
+		prev = next;
+		next = links[next].next;
+	}
+
+	link->prev = prev;
+	link->next = next;
+	if (prev != 0) links[prev].next = index;
+	else first[key] = index;
+	if (next != 0) links[next].prev = index;
+}
+
+/* The destination flag is field C in the state data of all states
+   that have one, so it can be read through walking.dest. */
+STATIC_ASSERT(offsetof(serf_t, s.walking.dest) ==
+	      offsetof(serf_t, s.leaving_building.dest), leaving_building_dest);
+STATIC_ASSERT(offsetof(serf_t, s.walking.dest) ==
+	      offsetof(serf_t, s.move_resource_out.res_dest), move_resource_out_dest);
+STATIC_ASSERT(offsetof(serf_t, s.walking.dest) ==
+	      offsetof(serf_t, s.ready_to_leave_inventory.dest), ready_to_leave_inventory_dest);
+
+/* Return non-zero if serfs in state can be on their way to a flag. */
+static int
+serf_state_has_dest(serf_state_t state)
+{
+	switch (state) {
+	case SERF_STATE_WALKING:
+	case SERF_STATE_TRANSPORTING:
+	case SERF_STATE_LEAVING_BUILDING:
+	case SERF_STATE_READY_TO_LEAVE:
+	case SERF_STATE_MOVE_RESOURCE_OUT:
+	case SERF_STATE_DROP_RESOURCE_OUT:
+	case SERF_STATE_READY_TO_LEAVE_INVENTORY:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Return the flag the serf is listed under in the destination index.
+   This is field C for all states that can have a destination, even
+   when the state data does not currently hold a flag index. Users of
+   the index check the rest of the state data. */
+static uint
+serf_dest_key(serf_t *serf)
+{
+	if (!serf_state_has_dest(serf->state)) return SERF_LINK_NONE;
+	if (serf->s.walking.dest == 0) return SERF_LINK_NONE;
+	return serf->s.walking.dest;
+}
+
+/* Build the index from the serf array. */
+void
+serf_index_rebuild()
+{
+	if (pos_links == NULL) {
+		pos_links = malloc(globals.max_serf_cnt*sizeof(serf_link_t));
+		if (pos_links == NULL) abort();
+
+		dest_links = malloc(globals.max_serf_cnt*sizeof(serf_link_t));
+		if (dest_links == NULL) abort();
+
+		dest_count = globals.max_flg_cnt;
+		dest_first = malloc(dest_count*sizeof(int));
+		if (dest_first == NULL) abort();
+	}
+
+	if (pos_count != globals.map.tile_count) {
+		free(pos_first);
+		pos_count = globals.map.tile_count;
+		pos_first = malloc(pos_count*sizeof(int));
+		if (pos_first == NULL) abort();
+	}
+
+	for (int i = 0; i < globals.max_serf_cnt; i++) {
+		pos_links[i].key = SERF_LINK_NONE;
+		dest_links[i].key = SERF_LINK_NONE;
+	}
+
+	for (uint i = 0; i < pos_count; i++) pos_first[i] = 0;
+	for (uint i = 0; i < dest_count; i++) dest_first[i] = 0;
+
+	/* Add serfs in decreasing order, so each one goes
+	   at the head of its lists. */
+	for (int i = globals.max_serf_cnt-1; i > 0; i--) {
+		if (!SERF_ALLOCATED(i)) continue;
+		serf_t *serf = &globals.serfs[i];
+		serf_link_update(pos_links, pos_first, pos_count, i, serf->pos);
+		serf_link_update(dest_links, dest_first, dest_count,
+				 i, serf_dest_key(serf));
+	}
+
+	serf_index_ready = 1;
+}
+
+/* Remove serf from the index when it is freed. */
+void
+serf_index_remove(int index)
+{
+	if (!serf_index_ready || index == 0) return;
+
+	serf_link_update(pos_links, pos_first, pos_count,
+			 index, SERF_LINK_NONE);
+	serf_link_update(dest_links, dest_first, dest_count,
+			 index, SERF_LINK_NONE);
+}
+
+void
+serf_set_state(serf_t *serf, serf_state_t state)
+{
+	serf->state = state;
+
+	int index = SERF_INDEX(serf);
+	if (!serf_index_ready || index == 0) return;
+
+	serf_link_update(dest_links, dest_first, dest_count,
+			 index, serf_dest_key(serf));
+}
+
+void
+serf_set_pos(serf_t *serf, map_pos_t pos)
+{
+	serf->pos = pos;
+
+	int index = SERF_INDEX(serf);
+	if (!serf_index_ready || index == 0) return;
+
+	serf_link_update(pos_links, pos_first, pos_count, index, pos);
+}
+
+/* Set the destination flag of a serf. This is field C of the state
+   data in the walking, transporting, leaving_building, ready_to_leave,
+   move_resource_out, drop_resource_out and ready_to_leave_inventory
+   states. */
+void
+serf_set_dest(serf_t *serf, uint dest)
+{
+	serf->s.walking.dest = dest;
+
+	int index = SERF_INDEX(serf);
+	if (!serf_index_ready || index == 0) return;
+
+	serf_link_update(dest_links, dest_first, dest_count,
+			 index, serf_dest_key(serf));
+}
+
+/* Return the first serf at pos, or 0 if there is none. */
+int
+serf_index_first_at_pos(map_pos_t pos)
+{
+	if (!serf_index_ready) serf_index_rebuild();
+	if (pos >= pos_count) return 0;
+	return pos_first[pos];
+}
+
+int
+serf_index_next_at_pos(int index)
+{
+	if (index == 0) return 0;
+	return pos_links[index].next;
+}
+
+/* Return the first serf that may be on its way to the flag,
+   or 0 if there is none. */
+int
+serf_index_first_with_dest(uint flag_index)
+{
+	if (!serf_index_ready) serf_index_rebuild();
+	if (flag_index == 0 || flag_index >= dest_count) return 0;
+	return dest_first[flag_index];
+}
+
+int
+serf_index_next_with_dest(int index)
+{
+	if (index == 0) return 0;
+	return dest_links[index].next;
+}
+
 static int
 train_knight(serf_t *serf, int p)
 {
@@ -224,7 +458,7 @@ handle_serf_idle_in_stock_state(serf_t *serf)
 		inventory->serfs[SERF_4] += 1;
 
 		serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
-		serf->state = SERF_STATE_READY_TO_LEAVE_INVENTORY;
+		serf_set_state(serf, SERF_STATE_READY_TO_LEAVE_INVENTORY);
 		serf->s.ready_to_leave_inventory.mode = -3;
 		serf->s.ready_to_leave_inventory.inv_index = INVENTORY_INDEX(inventory);
 		/* TODO immediate switch to next state. */
@@ -264,7 +498,7 @@ serf_change_direction(serf_t *serf, int dir, int alt_end)
 		}
 
 		/* Do the switch */
-		other_serf->pos = serf->pos;
+		serf_set_pos(other_serf, serf->pos);
 		map_set_serf_index(other_serf->pos, MAP_SERF_INDEX(new_pos));
 		other_serf->animation = get_walking_animation(MAP_HEIGHT(other_serf->pos) - MAP_HEIGHT(new_pos),
 							      DIR_REVERSE(dir));
@@ -276,7 +510,7 @@ serf_change_direction(serf_t *serf, int dir, int alt_end)
 	}
 
 	if (!alt_end) serf->s.walking.wait_counter = 0;
-	serf->pos = new_pos;
+	serf_set_pos(serf, new_pos);
 	map_set_serf_index(new_pos, SERF_INDEX(serf));
 	serf->counter += counter_from_animation[animation];
 	if (alt_end && serf->counter < 0) {
@@ -286,27 +520,11 @@ serf_change_direction(serf_t *serf, int dir, int alt_end)
 	serf->animation = animation;
 }
 
-static int
-flag_search_inventory_search_cb(flag_t *flag, int *dest_index)
-{
-	if (BIT_TEST(flag->bld_flags, 7)) { /* Has inventory */
-		building_t *building = flag->other_endpoint.b[DIR_UP_LEFT];
-		*dest_index = building->flg_index;
-		return 1;
-	}
-
-	return 0;
-}
-
 static int
 flag_search_inventory(int flag_index)
 {
 	flag_t *src = game_get_flag(flag_index);
-
-	int dest_index = -1;
-	flag_search_single(src, (flag_search_func *)flag_search_inventory_search_cb, 1, 0, &dest_index);
-
-	return dest_index;
+	return flag_route_find_inventory(src, FLAG_ROUTE_SERF, NULL);
 }
 
 /* Precondition: serf state is in WALKING or TRANSPORTING state */
@@ -322,7 +540,7 @@ serf_transporter_move_to_flag(serf_t *serf, flag_t *flag)
 		if (serf->s.walking.res == 0) {
 			/* Pick up resource. */
 			serf->s.walking.res = flag->res_waiting[res_index] & 0x1f;
-			serf->s.walking.dest = flag->res_dest[res_index];
+			serf_set_dest(serf, flag->res_dest[res_index]);
 			flag->res_waiting[res_index] = 0;
 		} else {
 			/* Switch resources and destination. */
@@ -333,7 +551,7 @@ serf_transporter_move_to_flag(serf_t *serf, flag_t *flag)
 			flag->res_waiting[res_index] = res;
 
 			int dest = serf->s.walking.dest;
-			serf->s.walking.dest = flag->res_dest[res_index];
+			serf_set_dest(serf, flag->res_dest[res_index]);
 			flag->res_dest[res_index] = dest;
 		}
 
@@ -386,7 +604,7 @@ serf_start_walking(serf_t *serf, dir_t dir, int slope, int change_pos)
 		map_set_serf_index(new_pos, SERF_INDEX(serf));
 	}
 
-	serf->pos = new_pos;
+	serf_set_pos(serf, new_pos);
 }
 
 static const int road_building_slope[] = {
@@ -411,7 +629,7 @@ static void
 serf_enter_building(serf_t *serf, int field_B, int join_pos)
 {
 	serf_log_state_change(serf, SERF_STATE_ENTERING_BUILDING);
-	serf->state = SERF_STATE_ENTERING_BUILDING;
+	serf_set_state(serf, SERF_STATE_ENTERING_BUILDING);
 
 	serf_start_walking(serf, DIR_UP_LEFT, 32, !join_pos);
 	if (join_pos) map_set_serf_index(serf->pos, SERF_INDEX(serf));
@@ -434,7 +652,7 @@ serf_leave_building(serf_t *serf, int join_pos)
 	serf_start_walking(serf, DIR_DOWN_RIGHT, slope, !join_pos);
 
 	serf_log_state_change(serf, SERF_STATE_LEAVING_BUILDING);
-	serf->state = SERF_STATE_LEAVING_BUILDING;
+	serf_set_state(serf, SERF_STATE_LEAVING_BUILDING);
 }
 
 static void
@@ -451,13 +669,13 @@ handle_serf_walking_state_dest_reached(serf_t *serf)
 			serf->animation = 85;
 			serf->counter = 0;
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 		} else {
 			serf_enter_building(serf, serf->s.walking.res, 0);
 		}
 	} else if (serf->s.walking.res == 6) {
 		serf_log_state_change(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT);
-		serf->state = SERF_STATE_LOOKING_FOR_GEO_SPOT;
+		serf_set_state(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT);
 		serf->counter = 0;
 	} else {
 		flag_t *flag = game_get_flag(MAP_OBJ_INDEX(serf->pos));
@@ -472,7 +690,7 @@ handle_serf_walking_state_dest_reached(serf_t *serf)
 		other_flag->length[other_dir] += 1;
 
 		serf_log_state_change(serf, SERF_STATE_TRANSPORTING);
-		serf->state = SERF_STATE_TRANSPORTING;
+		serf_set_state(serf, SERF_STATE_TRANSPORTING);
 		serf->s.walking.dir = dir;
 		serf->s.walking.res = 0;
 		serf->s.walking.wait_counter = 0;
@@ -541,12 +759,12 @@ handle_serf_walking_state(serf_t *serf)
 				int r = flag_search_inventory(MAP_OBJ_INDEX(serf->pos));
 				if (r < 0) {
 					serf_log_state_change(serf, SERF_STATE_LOST);
-					serf->state = SERF_STATE_LOST;
+					serf_set_state(serf, SERF_STATE_LOST);
 					serf->s.lost.field_B = 1;
 					serf->counter = 0;
 					return;
 				}
-				serf->s.walking.dest = r;
+				serf_set_dest(serf, r);
 			}
 
 			/* Check whether destination has been reached.
@@ -557,6 +775,15 @@ handle_serf_walking_state(serf_t *serf)
 				return;
 			} else {
 				flag_t *src = game_get_flag(MAP_OBJ_INDEX(serf->pos));
+
+				/* Use the cached route if walking to the nearest inventory. */
+				int dir;
+				int inventory = flag_route_find_inventory(src, FLAG_ROUTE_SERF, &dir);
+				if (inventory == serf->s.walking.dest && dir >= 0) {
+					serf_change_direction(serf, dir, 0);
+					continue;
+				}
+
 				flag_search_t search;
 				flag_search_init(&search);
 				for (int i = 0; i < 6; i++) {
@@ -597,7 +824,7 @@ handle_serf_walking_state(serf_t *serf)
 		if (serf->s.walking.res < 0) {
 			if (serf->s.walking.res < -1) {
 				serf_log_state_change(serf, SERF_STATE_LOST);
-				serf->state = SERF_STATE_LOST;
+				serf_set_state(serf, SERF_STATE_LOST);
 				serf->s.lost.field_B = 1;
 				serf->counter = 0;
 				return;
@@ -616,7 +843,7 @@ handle_serf_walking_state(serf_t *serf)
 		}
 
 		serf->s.walking.res = -2;
-		serf->s.walking.dest = 0;
+		serf_set_dest(serf, 0);
 		serf->counter = 0;
 	}
 }
@@ -640,10 +867,10 @@ handle_serf_transporting_state(serf_t *serf)
 			/* Current position occupied by waiting transporter */
 			if (serf->s.walking.wait_counter < 0) {
 				serf_log_state_change(serf, SERF_STATE_WALKING);
-				serf->state = SERF_STATE_WALKING;
+				serf_set_state(serf, SERF_STATE_WALKING);
 				serf->s.walking.wait_counter = 0;
 				serf->s.walking.res = -2;
-				serf->s.walking.dest = 0;
+				serf_set_dest(serf, 0);
 				serf->counter = 0;
 				return;
 			}
@@ -653,7 +880,7 @@ handle_serf_transporting_state(serf_t *serf)
 			    MAP_OBJ_INDEX(serf->pos) == serf->s.walking.dest) {
 				/* At resource destination */
 				serf_log_state_change(serf, SERF_STATE_DELIVERING);
-				serf->state = SERF_STATE_DELIVERING;
+				serf_set_state(serf, SERF_STATE_DELIVERING);
 				serf->s.walking.wait_counter = 0;
 
 				map_pos_t new_pos = MAP_MOVE_UP_LEFT(serf->pos);
@@ -680,7 +907,7 @@ handle_serf_transporting_state(serf_t *serf)
 
 			if (dir < 0) {
 				serf_log_state_change(serf, SERF_STATE_LOST);
-				serf->state = SERF_STATE_LOST;
+				serf_set_state(serf, SERF_STATE_LOST);
 				serf->counter = 0;
 				return;
 			}
@@ -718,10 +945,11 @@ handle_serf_transporting_state(serf_t *serf)
 					/* TODO Don't use anim as state var */
 					serf->anim = (serf->anim & 0xff00) | (serf->s.walking.dir & 0xff);
 					serf_log_state_change(serf, SERF_STATE_IDLE_ON_PATH);
-					serf->state = SERF_STATE_IDLE_ON_PATH;
+					serf_set_state(serf, SERF_STATE_IDLE_ON_PATH);
 					serf->s.idle_on_path.rev_dir = rev_dir;
 					serf->s.idle_on_path.flag = flag;
 					tiles[serf->pos].u.s.field_1 = BIT(7) | SERF_PLAYER(serf);
+					viewport_index_add_serf(serf->pos);
 					map_set_serf_index(serf->pos, 0);
 					return;
 				}
@@ -736,7 +964,7 @@ serf_enter_inventory(serf_t *serf)
 	map_set_serf_index(serf->pos, 0);
 	building_t *building = game_get_building(MAP_OBJ_INDEX(serf->pos));
 	serf_log_state_change(serf, SERF_STATE_IDLE_IN_STOCK);
-	serf->state = SERF_STATE_IDLE_IN_STOCK;
+	serf_set_state(serf, SERF_STATE_IDLE_IN_STOCK);
 	/*serf->s.idle_in_stock.field_B = 0;
 	  serf->s.idle_in_stock.field_C = 0;*/
 	serf->s.idle_in_stock.inv_index = INVENTORY_INDEX(building->u.inventory);
@@ -753,7 +981,7 @@ handle_serf_entering_building_state(serf_t *serf)
 		if (MAP_OBJ_INDEX(serf->pos) == 0 ||
 		    BIT_TEST(game_get_building(MAP_OBJ_INDEX(serf->pos))->serf, 5)) { /* Burning */
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 			serf->s.lost.field_B = 0;
 			serf->counter = 0;
 			return;
@@ -770,9 +998,10 @@ handle_serf_entering_building_state(serf_t *serf)
 				flag_t *flag = game_get_flag(flag_index);
 				flag->bld_flags = BIT(7) | BIT(6); /* Why set these here? */
 				flag->bld2_flags = BIT(7);
+				flag_route_invalidate_paths(flag);
 
 				serf_log_state_change(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
-				serf->state = SERF_STATE_WAIT_FOR_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
 				serf->counter = 63;
 				serf->type = (SERF_4 << 2) | (serf->type & 0x83);
 			}
@@ -785,7 +1014,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				serf_enter_inventory(serf);
 			} else {
 				serf_log_state_change(serf, SERF_STATE_DIGGING);
-				serf->state = SERF_STATE_DIGGING;
+				serf_set_state(serf, SERF_STATE_DIGGING);
 				serf->s.digging.h_index = 15;
 
 				building_t *building = game_get_building(MAP_OBJ_INDEX(serf->pos));
@@ -799,7 +1028,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				serf_enter_inventory(serf);
 			} else {
 				serf_log_state_change(serf, SERF_STATE_BUILDING);
-				serf->state = SERF_STATE_BUILDING;
+				serf_set_state(serf, SERF_STATE_BUILDING);
 				serf->animation = 98;
 				serf->counter = 127;
 				serf->s.building.mode = 1;
@@ -823,7 +1052,7 @@ handle_serf_entering_building_state(serf_t *serf)
 		case SERF_4:
 			map_set_serf_index(serf->pos, 0);
 			serf_log_state_change(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
-			serf->state = SERF_STATE_WAIT_FOR_RESOURCE_OUT;
+			serf_set_state(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
 			serf->counter = 63;
 			break;
 		case SERF_LUMBERJACK:
@@ -832,7 +1061,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			} else {
 				map_set_serf_index(serf->pos, 0);
 				serf_log_state_change(serf, SERF_STATE_PLANNING_LOGGING);
-				serf->state = SERF_STATE_PLANNING_LOGGING;
+				serf_set_state(serf, SERF_STATE_PLANNING_LOGGING);
 			}
 			break;
 		case SERF_SAWMILLER:
@@ -848,7 +1077,7 @@ handle_serf_entering_building_state(serf_t *serf)
 					flag->stock2_prio = 0;
 				}
 				serf_log_state_change(serf, SERF_STATE_SAWING);
-				serf->state = SERF_STATE_SAWING;
+				serf_set_state(serf, SERF_STATE_SAWING);
 				serf->s.sawing.mode = 0;
 			}
 			break;
@@ -858,7 +1087,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			} else {
 				map_set_serf_index(serf->pos, 0);
 				serf_log_state_change(serf, SERF_STATE_PLANNING_STONECUTTING);
-				serf->state = SERF_STATE_PLANNING_STONECUTTING;
+				serf_set_state(serf, SERF_STATE_PLANNING_STONECUTTING);
 			}
 			break;
 		case SERF_FORESTER:
@@ -867,7 +1096,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			} else {
 				map_set_serf_index(serf->pos, 0);
 				serf_log_state_change(serf, SERF_STATE_PLANNING_PLANTING);
-				serf->state = SERF_STATE_PLANNING_PLANTING;
+				serf_set_state(serf, SERF_STATE_PLANNING_PLANTING);
 			}
 			break;
 		case SERF_MINER:
@@ -894,7 +1123,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_MINING);
-				serf->state = SERF_STATE_MINING;
+				serf_set_state(serf, SERF_STATE_MINING);
 				serf->s.mining.substate = 0;
 				serf->s.mining.deposit = 4 - (bld_type - BUILDING_STONEMINE);
 				/*serf->s.mining.field_C = 0;*/
@@ -925,7 +1154,7 @@ handle_serf_entering_building_state(serf_t *serf)
 
 				/* Switch to smelting state to begin work. */
 				serf_log_state_change(serf, SERF_STATE_SMELTING);
-				serf->state = SERF_STATE_SMELTING;
+				serf_set_state(serf, SERF_STATE_SMELTING);
 
 				if (BUILDING_TYPE(building) == BUILDING_STEELSMELTER) {
 					serf->s.smelting.type = 0;
@@ -942,7 +1171,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			} else {
 				map_set_serf_index(serf->pos, 0);
 				serf_log_state_change(serf, SERF_STATE_PLANNING_FISHING);
-				serf->state = SERF_STATE_PLANNING_FISHING;
+				serf_set_state(serf, SERF_STATE_PLANNING_FISHING);
 			}
 			break;
 		case SERF_PIGFARMER:
@@ -961,11 +1190,11 @@ handle_serf_entering_building_state(serf_t *serf)
 					flag->stock1_prio = 0;
 
 					serf_log_state_change(serf, SERF_STATE_PIGFARMING);
-					serf->state = SERF_STATE_PIGFARMING;
+					serf_set_state(serf, SERF_STATE_PIGFARMING);
 					serf->s.pigfarming.mode = 0;
 				} else {
 					serf_log_state_change(serf, SERF_STATE_PIGFARMING);
-					serf->state = SERF_STATE_PIGFARMING;
+					serf_set_state(serf, SERF_STATE_PIGFARMING);
 					serf->s.pigfarming.mode = 6;
 					serf->counter = 0;
 				}
@@ -985,7 +1214,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_BUTCHERING);
-				serf->state = SERF_STATE_BUTCHERING;
+				serf_set_state(serf, SERF_STATE_BUTCHERING);
 				serf->s.butchering.mode = 0;
 			}
 			break;
@@ -995,7 +1224,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			} else {
 				map_set_serf_index(serf->pos, 0);
 				serf_log_state_change(serf, SERF_STATE_PLANNING_FARMING);
-				serf->state = SERF_STATE_PLANNING_FARMING;
+				serf_set_state(serf, SERF_STATE_PLANNING_FARMING);
 			}
 			break;
 		case SERF_MILLER:
@@ -1012,7 +1241,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_MILLING);
-				serf->state = SERF_STATE_MILLING;
+				serf_set_state(serf, SERF_STATE_MILLING);
 				serf->s.milling.mode = 0;
 			}
 			break;
@@ -1030,7 +1259,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_BAKING);
-				serf->state = SERF_STATE_BAKING;
+				serf_set_state(serf, SERF_STATE_BAKING);
 				serf->s.baking.mode = 0;
 			}
 			break;
@@ -1047,7 +1276,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_BUILDING_BOAT);
-				serf->state = SERF_STATE_BUILDING_BOAT;
+				serf_set_state(serf, SERF_STATE_BUILDING_BOAT);
 				serf->s.building_boat.mode = 0;
 			}
 			break;
@@ -1065,7 +1294,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_MAKING_TOOL);
-				serf->state = SERF_STATE_MAKING_TOOL;
+				serf_set_state(serf, SERF_STATE_MAKING_TOOL);
 				serf->s.making_tool.mode = 0;
 			}
 			break;
@@ -1083,7 +1312,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_MAKING_WEAPON);
-				serf->state = SERF_STATE_MAKING_WEAPON;
+				serf_set_state(serf, SERF_STATE_MAKING_WEAPON);
 				serf->s.making_weapon.mode = 0;
 			}
 			break;
@@ -1092,7 +1321,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				serf_enter_inventory(serf);
 			} else {
 				serf_log_state_change(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT);
-				serf->state = SERF_STATE_LOOKING_FOR_GEO_SPOT; /* TODO Should never be reached */
+				serf_set_state(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT); /* TODO Should never be reached */
 				serf->counter = 0;
 			}
 			break;
@@ -1104,7 +1333,7 @@ handle_serf_entering_building_state(serf_t *serf)
 			inventory->spawn_priority += 1;
 
 			serf_log_state_change(serf, SERF_STATE_IDLE_IN_STOCK);
-			serf->state = SERF_STATE_IDLE_IN_STOCK;
+			serf_set_state(serf, SERF_STATE_IDLE_IN_STOCK);
 			/*serf->s.idle_in_stock.field_B = 0;
 			  serf->s.idle_in_stock.field_C = 0;*/
 			serf->s.idle_in_stock.inv_index = INVENTORY_INDEX(inventory);
@@ -1120,7 +1349,7 @@ handle_serf_entering_building_state(serf_t *serf)
 				building_t *building = game_get_building(MAP_OBJ_INDEX(serf->pos));
 				if (BIT_TEST(building->serf, 5)) { /* Burning */
 					serf_log_state_change(serf, SERF_STATE_LOST);
-					serf->state = SERF_STATE_LOST;
+					serf_set_state(serf, SERF_STATE_LOST);
 					serf->counter = 0;
 				} else {
 					map_set_serf_index(serf->pos, 0);
@@ -1131,7 +1360,7 @@ handle_serf_entering_building_state(serf_t *serf)
 
 					if (building->stock1 == 0xff) { /* Castle */
 						serf_log_state_change(serf, SERF_STATE_DEFENDING_CASTLE);
-						serf->state = SERF_STATE_DEFENDING_CASTLE;
+						serf_set_state(serf, SERF_STATE_DEFENDING_CASTLE);
 						serf->counter = 6000;
 
 						globals.player_sett[BUILDING_PLAYER(building)]->castle_knights += 1;
@@ -1150,7 +1379,7 @@ handle_serf_entering_building_state(serf_t *serf)
 
 					/* Switch to defending state */
 					serf_log_state_change(serf, next_state);
-					serf->state = next_state;
+					serf_set_state(serf, next_state);
 					serf->counter = 6000;
 
 					/* Test whether building is already occupied by knights */
@@ -1197,20 +1426,20 @@ handle_serf_leaving_building_state(serf_t *serf)
 	if (serf->counter < 0) {
 		serf->counter = 0;
 		serf_log_state_change(serf, serf->s.leaving_building.next_state);
-		serf->state = serf->s.leaving_building.next_state;
+		serf_set_state(serf, serf->s.leaving_building.next_state);
 
 		/* Set field_F to 0, do this for individual states if necessary */
 		if (serf->state == SERF_STATE_WALKING) {
 			int mode = serf->s.leaving_building.field_B;
 			uint dest = serf->s.leaving_building.dest;
 			serf->s.walking.res = mode;
-			serf->s.walking.dest = dest;
+			serf_set_dest(serf, dest);
 			serf->s.walking.wait_counter = 0;
 		} else if (serf->state == SERF_STATE_DROP_RESOURCE_OUT) {
 			uint res = serf->s.leaving_building.field_B;
 			uint res_dest = serf->s.leaving_building.dest;
 			serf->s.move_resource_out.res = res;
-			serf->s.move_resource_out.res_dest = res_dest;
+			serf_set_dest(serf, res_dest);
 		} else if (serf->state == SERF_STATE_FREE_WALKING ||
 			   serf->state == SERF_STATE_KNIGHT_FREE_WALKING ||
 			   serf->state == SERF_STATE_STONECUTTER_FREE_WALKING) {
@@ -1298,7 +1527,7 @@ handle_serf_digging_state(serf_t *serf)
 			} else {
 				serf->animation = MAP_HEIGHT(new_pos) - MAP_HEIGHT(serf->pos);
 			}
-			serf->pos = new_pos;
+			serf_set_pos(serf, new_pos);
 			serf->s.digging.substate = 3;
 			serf->counter += counter_from_animation[serf->animation];
 		} else if (serf->s.digging.substate == 1) {
@@ -1368,11 +1597,12 @@ handle_serf_digging_state(serf_t *serf)
 				/* Done digging */
 				building_t *building = game_get_building(MAP_OBJ_INDEX(serf->pos));
 				building->progress = 1;
+				player_invalidate_build_sites(building->pos);
 				building->serf &= ~BIT(6);
 				building->serf_index = 0;
 				serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-				serf->state = SERF_STATE_READY_TO_LEAVE;
-				serf->s.leaving_building.dest = 0;
+				serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
+				serf_set_dest(serf, 0);
 				serf->s.leaving_building.field_B = -2;
 				serf->s.leaving_building.dir = 0;
 				serf->s.leaving_building.next_state = SERF_STATE_WALKING;
@@ -1444,7 +1674,7 @@ handle_serf_building_state(serf_t *serf)
 				serf->counter = 0;
 
 				serf_log_state_change(serf, SERF_STATE_FINISHED_BUILDING);
-				serf->state = SERF_STATE_FINISHED_BUILDING;
+				serf_set_state(serf, SERF_STATE_FINISHED_BUILDING);
 				return;
 			}
 
@@ -1537,7 +1767,7 @@ handle_serf_building_castle_state(serf_t *serf)
 
 	if (building->progress >= 0x10000) { /* Finished */
 		serf_log_state_change(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
-		serf->state = SERF_STATE_WAIT_FOR_RESOURCE_OUT;
+		serf_set_state(serf, SERF_STATE_WAIT_FOR_RESOURCE_OUT);
 		map_set_serf_index(serf->pos, 0);
 		building->bld &= ~BIT(7); /* Building finished */
 		building->serf_index = 0;
@@ -1577,7 +1807,7 @@ handle_serf_move_resource_out_state(serf_t *serf)
 	serf_leave_building(serf, 0);
 	serf->s.leaving_building.next_state = next_state;
 	serf->s.leaving_building.field_B = res;
-	serf->s.leaving_building.dest = res_dest;
+	serf_set_dest(serf, res_dest);
 }
 
 static void
@@ -1598,9 +1828,9 @@ handle_serf_wait_for_resource_out_state(serf_t *serf)
 	if (inventory->serfs[SERF_4] != 0 || inventory->out_queue[0] == -1) return;
 
 	serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-	serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+	serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 	serf->s.move_resource_out.res = inventory->out_queue[0] + 1;
-	serf->s.move_resource_out.res_dest = inventory->out_dest[0];
+	serf_set_dest(serf, inventory->out_dest[0]);
 	serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 	inventory->out_queue[0] = inventory->out_queue[1];
@@ -1629,7 +1859,7 @@ handle_serf_drop_resource_out_state(serf_t *serf)
 	flag->endpoint |= BIT(7); /* Resources waiting */
 
 	serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-	serf->state = SERF_STATE_READY_TO_ENTER;
+	serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 	serf->s.ready_to_enter.field_B = 0;
 }
 
@@ -1643,7 +1873,7 @@ handle_serf_delivering_state(serf_t *serf)
 	while (serf->counter < 0) {
 		if (serf->s.walking.wait_counter != 0) {
 			serf_log_state_change(serf, SERF_STATE_TRANSPORTING);
-			serf->state = SERF_STATE_TRANSPORTING;
+			serf_set_state(serf, SERF_STATE_TRANSPORTING);
 			serf->s.walking.wait_counter = 0;
 			flag_t *flag = game_get_flag(MAP_OBJ_INDEX(serf->pos));
 			serf_transporter_move_to_flag(serf, flag);
@@ -1714,7 +1944,7 @@ handle_serf_ready_to_leave_inventory_state(serf_t *serf)
 	serf_leave_building(serf, 0);
 	serf->s.leaving_building.next_state = next_state;
 	serf->s.leaving_building.field_B = mode;
-	serf->s.leaving_building.dest = dest;
+	serf_set_dest(serf, dest);
 	serf->s.leaving_building.dir = 0;
 }
 
@@ -1755,7 +1985,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			}
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 			serf->s.ready_to_enter.field_B = 0;
 			serf->counter = 0;
 		} else {
@@ -1765,7 +1995,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			if (obj >= MAP_OBJ_TREE_0 &&
 			    obj <= MAP_OBJ_PINE_7) {
 				serf_log_state_change(serf, SERF_STATE_LOGGING);
-				serf->state = SERF_STATE_LOGGING;
+				serf_set_state(serf, SERF_STATE_LOGGING);
 				serf->s.free_walking.neg_dist1 = 0;
 				serf->s.free_walking.neg_dist2 = 0;
 				if (obj < 16) serf->s.free_walking.neg_dist1 = -1;
@@ -1789,7 +2019,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			}
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 			serf->s.ready_to_enter.field_B = 0;
 			serf->counter = 0;
 		} else {
@@ -1805,7 +2035,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 				serf_start_walking(serf, DIR_UP_LEFT, 32, 1);
 
 				serf_log_state_change(serf, SERF_STATE_STONECUTTING);
-				serf->state = SERF_STATE_STONECUTTING;
+				serf_set_state(serf, SERF_STATE_STONECUTTING);
 				serf->s.free_walking.neg_dist2 = serf->counter >> 2;
 				serf->s.free_walking.neg_dist1 = 0;
 			} else {
@@ -1822,7 +2052,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			if (serf->s.free_walking.neg_dist2 < 0) goto other_type;
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 			serf->s.ready_to_enter.field_B = 0;
 			serf->counter = 0;
 		} else {
@@ -1830,7 +2060,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			serf->s.free_walking.dist2 = serf->s.free_walking.neg_dist2;
 			if (MAP_OBJ(serf->pos) == MAP_OBJ_NONE) {
 				serf_log_state_change(serf, SERF_STATE_PLANTING);
-				serf->state = SERF_STATE_PLANTING;
+				serf_set_state(serf, SERF_STATE_PLANTING);
 				serf->s.free_walking.neg_dist2 = 0;
 				serf->animation = 121;
 				serf->counter = counter_from_animation[serf->animation];
@@ -1852,7 +2082,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			}
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 			serf->s.ready_to_enter.field_B = 0;
 			serf->counter = 0;
 		} else {
@@ -1878,7 +2108,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 				serf->counter = 0;
 			} else {
 				serf_log_state_change(serf, SERF_STATE_FISHING);
-				serf->state = SERF_STATE_FISHING;
+				serf_set_state(serf, SERF_STATE_FISHING);
 				serf->s.free_walking.neg_dist1 = 0;
 				serf->s.free_walking.neg_dist2 = 0;
 				serf->s.free_walking.flags = 0;
@@ -1896,7 +2126,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			}
 
 			serf_log_state_change(serf, SERF_STATE_READY_TO_ENTER);
-			serf->state = SERF_STATE_READY_TO_ENTER;
+			serf_set_state(serf, SERF_STATE_READY_TO_ENTER);
 			serf->s.ready_to_enter.field_B = 0;
 			serf->counter = 0;
 		} else {
@@ -1926,7 +2156,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			}
 
 			serf_log_state_change(serf, SERF_STATE_FARMING);
-			serf->state = SERF_STATE_FARMING;
+			serf_set_state(serf, SERF_STATE_FARMING);
 			serf->s.free_walking.neg_dist2 = 0;
 		}
 		break;
@@ -1936,7 +2166,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			if (MAP_OBJ(serf->pos) == MAP_OBJ_FLAG &&
 			    MAP_OWNER(serf->pos) == SERF_PLAYER(serf)) {
 				serf_log_state_change(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT);
-				serf->state = SERF_STATE_LOOKING_FOR_GEO_SPOT;
+				serf_set_state(serf, SERF_STATE_LOOKING_FOR_GEO_SPOT);
 				serf->counter = 0;
 			} else {
 				serf_log_state_change(serf, SERF_STATE_LOST);
@@ -1948,7 +2178,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			serf->s.free_walking.dist2 = serf->s.free_walking.neg_dist2;
 			if (MAP_OBJ(serf->pos) == MAP_OBJ_NONE) {
 				serf_log_state_change(serf, SERF_STATE_SAMPLING_GEO_SPOT);
-				serf->state = SERF_STATE_SAMPLING_GEO_SPOT;
+				serf_set_state(serf, SERF_STATE_SAMPLING_GEO_SPOT);
 				serf->s.free_walking.neg_dist1 = 0;
 				serf->animation = 141;
 				serf->counter = counter_from_animation[serf->animation];
@@ -1970,7 +2200,7 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 			goto other_type;
 		} else {
 			serf_log_state_change(serf, SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING);
-			serf->state = SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING;
+			serf_set_state(serf, SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING);
 			serf->counter = 0;
 		}
 		break;
@@ -1980,14 +2210,14 @@ handle_serf_free_walking_state_dest_reached(serf_t *serf)
 		    game_get_flag(MAP_OBJ_INDEX(serf->pos))->endpoint & 0x3f &&
 		    MAP_OWNER(serf->pos) == SERF_PLAYER(serf)) {
 			serf_log_state_change(serf, SERF_STATE_WALKING);
-			serf->state = SERF_STATE_WALKING;
+			serf_set_state(serf, SERF_STATE_WALKING);
 			serf->s.walking.res = -2;
-			serf->s.walking.dest = 0;
+			serf_set_dest(serf, 0);
 			serf->s.walking.dir = 0;
 			serf->counter = 0;
 		} else {
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 			serf->s.lost.field_B = 0;
 			serf->counter = 0;
 		}
@@ -2068,7 +2298,7 @@ handle_free_walking_common(serf_t *serf)
 					serf->counter = counter_from_animation[serf->animation];
 				} else {
 					serf_log_state_change(serf, SERF_STATE_LOST);
-					serf->state = SERF_STATE_LOST;
+					serf_set_state(serf, SERF_STATE_LOST);
 					serf->s.lost.field_B = 0;
 					serf->counter = 0;
 				}
@@ -2187,7 +2417,7 @@ next_handler:;
 				serf->s.free_walking.flags = 0;
 			} else {
 				serf_log_state_change(serf, SERF_STATE_LOST);
-				serf->state = SERF_STATE_LOST;
+				serf_set_state(serf, SERF_STATE_LOST);
 				serf->s.lost.field_B = 0;
 				serf->counter = 0;
 			}
@@ -2325,8 +2555,8 @@ switch_with_other:;
 		other_serf->counter = counter_from_animation[other_serf->animation];
 		serf->counter = counter_from_animation[serf->animation];
 
-		other_serf->pos = serf->pos;
-		serf->pos = new_pos;
+		serf_set_pos(other_serf, serf->pos);
+		serf_set_pos(serf, new_pos);
 	} else {
 		serf->animation = 82;
 		serf->counter = counter_from_animation[serf->animation];
@@ -2371,7 +2601,7 @@ handle_serf_logging_state(serf_t *serf)
 			serf->counter += counter_from_animation[serf->animation];
 		} else {
 			serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-			serf->state = SERF_STATE_FREE_WALKING;
+			serf_set_state(serf, SERF_STATE_FREE_WALKING);
 			serf->counter = 0;
 			serf->s.free_walking.neg_dist1 = -128;
 			serf->s.free_walking.neg_dist2 = 1;
@@ -2395,9 +2625,9 @@ handle_serf_planning_logging_state(serf_t *serf)
 		int obj = MAP_OBJ(pos);
 		if (obj >= MAP_OBJ_TREE_0 && obj <= MAP_OBJ_PINE_7) {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-			serf->state = SERF_STATE_READY_TO_LEAVE;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
 			serf->s.leaving_building.field_B = globals.spiral_pattern[2*index] - 1;
-			serf->s.leaving_building.dest = globals.spiral_pattern[2*index+1] - 1;
+			serf_set_dest(serf, globals.spiral_pattern[2*index+1] - 1);
 			serf->s.leaving_building.dest2 = -globals.spiral_pattern[2*index] + 1;
 			serf->s.leaving_building.dir = -globals.spiral_pattern[2*index+1] + 1;
 			serf->s.leaving_building.next_state = SERF_STATE_FREE_WALKING;
@@ -2430,9 +2660,9 @@ handle_serf_planning_planting_state(serf_t *serf)
 		    MAP_TYPE_UP(MAP_MOVE_UP_LEFT(pos)) == 5 &&
 		    MAP_TYPE_DOWN(MAP_MOVE_UP_LEFT(pos)) == 5) {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-			serf->state = SERF_STATE_READY_TO_LEAVE;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
 			serf->s.leaving_building.field_B = globals.spiral_pattern[2*index] - 1;
-			serf->s.leaving_building.dest = globals.spiral_pattern[2*index+1] - 1;
+			serf_set_dest(serf, globals.spiral_pattern[2*index+1] - 1);
 			serf->s.leaving_building.dest2 = -globals.spiral_pattern[2*index] + 1;
 			serf->s.leaving_building.dir = -globals.spiral_pattern[2*index+1] + 1;
 			serf->s.leaving_building.next_state = SERF_STATE_FREE_WALKING;
@@ -2456,7 +2686,7 @@ handle_serf_planting_state(serf_t *serf)
 	while (serf->counter < 0) {
 		if (serf->s.free_walking.neg_dist2 != 0) {
 			serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-			serf->state = SERF_STATE_FREE_WALKING;
+			serf_set_state(serf, SERF_STATE_FREE_WALKING);
 			serf->s.free_walking.neg_dist1 = -128;
 			serf->s.free_walking.neg_dist2 = 0;
 			serf->s.free_walking.flags = 0;
@@ -2494,9 +2724,9 @@ handle_serf_planning_stonecutting(serf_t *serf)
 		    obj <= MAP_OBJ_STONE_7 &&
 		    !MAP_DEEP_WATER(pos)) {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-			serf->state = SERF_STATE_READY_TO_LEAVE;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
 			serf->s.leaving_building.field_B = globals.spiral_pattern[2*index] - 1;
-			serf->s.leaving_building.dest = globals.spiral_pattern[2*index+1] - 1;
+			serf_set_dest(serf, globals.spiral_pattern[2*index+1] - 1);
 			serf->s.leaving_building.dest2 = -globals.spiral_pattern[2*index] + 1;
 			serf->s.leaving_building.dir = -globals.spiral_pattern[2*index+1] + 1;
 			serf->s.leaving_building.next_state = SERF_STATE_STONECUTTER_FREE_WALKING;
@@ -2551,7 +2781,7 @@ handle_serf_stonecutting_state(serf_t *serf)
 	while (serf->counter < 0) {
 		if (serf->s.free_walking.neg_dist1 != 1) {
 			serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-			serf->state = SERF_STATE_FREE_WALKING;
+			serf_set_state(serf, SERF_STATE_FREE_WALKING);
 			serf->s.free_walking.neg_dist1 = -128;
 			serf->s.free_walking.neg_dist2 = 1;
 			serf->s.free_walking.flags = 0;
@@ -2601,9 +2831,9 @@ handle_serf_sawing_state(serf_t *serf)
 
 		map_set_serf_index(serf->pos, 0);
 		serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-		serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+		serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 		serf->s.move_resource_out.res = 1 + RESOURCE_PLANK;
-		serf->s.move_resource_out.res_dest = 0;
+		serf_set_dest(serf, 0);
 		serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 		/* Update resource stats. */
@@ -2633,10 +2863,10 @@ handle_serf_lost_state(serf_t *serf)
 					if (SERF_TYPE(serf) >= SERF_KNIGHT_0 &&
 					    SERF_TYPE(serf) <= SERF_KNIGHT_4) {
 						serf_log_state_change(serf, SERF_STATE_KNIGHT_FREE_WALKING);
-						serf->state = SERF_STATE_KNIGHT_FREE_WALKING;
+						serf_set_state(serf, SERF_STATE_KNIGHT_FREE_WALKING);
 					} else {
 						serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-						serf->state = SERF_STATE_FREE_WALKING;
+						serf_set_state(serf, SERF_STATE_FREE_WALKING);
 					}
 
 					serf->s.free_walking.dist1 = globals.spiral_pattern[2*index];
@@ -2680,10 +2910,10 @@ handle_serf_lost_state(serf_t *serf)
 				if (SERF_TYPE(serf) >= SERF_KNIGHT_0 &&
 				    SERF_TYPE(serf) <= SERF_KNIGHT_4) {
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_FREE_WALKING);
-					serf->state = SERF_STATE_KNIGHT_FREE_WALKING;
+					serf_set_state(serf, SERF_STATE_KNIGHT_FREE_WALKING);
 				} else {
 					serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-					serf->state = SERF_STATE_FREE_WALKING;
+					serf_set_state(serf, SERF_STATE_FREE_WALKING);
 				}
 
 				serf->s.free_walking.dist1 = col;
@@ -2716,7 +2946,7 @@ handle_lost_sailor(serf_t *serf)
 				if ((flag->endpoint & 0x3f) != 0 &&
 				    MAP_HAS_OWNER(dest) && MAP_OWNER(dest) == SERF_PLAYER(serf)) {
 					serf_log_state_change(serf, SERF_STATE_FREE_SAILING);
-					serf->state = SERF_STATE_FREE_SAILING;
+					serf_set_state(serf, SERF_STATE_FREE_SAILING);
 
 					serf->s.free_walking.dist1 = globals.spiral_pattern[2*i];
 					serf->s.free_walking.dist2 = globals.spiral_pattern[2*i+1];
@@ -2739,7 +2969,7 @@ handle_lost_sailor(serf_t *serf)
 						     MAP_POS(col, row));
 			if (MAP_OBJ(dest) == 0) {
 				serf_log_state_change(serf, SERF_STATE_FREE_SAILING);
-				serf->state = SERF_STATE_FREE_SAILING;
+				serf_set_state(serf, SERF_STATE_FREE_SAILING);
 
 				serf->s.free_walking.dist1 = col;
 				serf->s.free_walking.dist2 = row;
@@ -2763,7 +2993,7 @@ handle_free_sailing(serf_t *serf)
 	while (serf->counter < 0) {
 		if (!MAP_DEEP_WATER(serf->pos)) {
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 			serf->s.lost.field_B = 0;
 			return;
 		}
@@ -2782,7 +3012,7 @@ handle_serf_escape_building_state(serf_t *serf)
 		serf->anim = globals.anim;
 
 		serf_log_state_change(serf, SERF_STATE_LOST);
-		serf->state = SERF_STATE_LOST;
+		serf_set_state(serf, SERF_STATE_LOST);
 		serf->s.lost.field_B = 0;
 	}
 }
@@ -2907,9 +3137,9 @@ handle_serf_mining_state(serf_t *serf)
 				map_set_serf_index(serf->pos, 0);
 
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 				serf->s.move_resource_out.res = res;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				/* Update resource stats. */
@@ -2964,10 +3194,10 @@ handle_serf_smelting_state(serf_t *serf)
 				else res = 1 + RESOURCE_GOLDBAR;
 
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 
 				serf->s.move_resource_out.res = res;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				/* Update resource stats. */
@@ -3002,9 +3232,9 @@ handle_serf_planning_fishing_state(serf_t *serf)
 		     ((MAP_TYPE_DOWN(MAP_MOVE_LEFT(dest)) & 0xc) == 0 &&
 		      (MAP_TYPE_UP(MAP_MOVE_UP(dest)) & 0xc) != 0))) {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-			serf->state = SERF_STATE_READY_TO_LEAVE;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
 			serf->s.leaving_building.field_B = globals.spiral_pattern[2*index] - 1;
-			serf->s.leaving_building.dest = globals.spiral_pattern[2*index+1] - 1;
+			serf_set_dest(serf, globals.spiral_pattern[2*index+1] - 1);
 			serf->s.leaving_building.dest2 = -globals.spiral_pattern[2*index] + 1;
 			serf->s.leaving_building.dir = -globals.spiral_pattern[2*index+1] + 1;
 			serf->s.leaving_building.next_state = SERF_STATE_FREE_WALKING;
@@ -3030,7 +3260,7 @@ handle_serf_fishing_state(serf_t *serf)
 		    serf->s.free_walking.flags == 10) {
 			/* Stop fishing. Walk back. */
 			serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-			serf->state = SERF_STATE_FREE_WALKING;
+			serf_set_state(serf, SERF_STATE_FREE_WALKING);
 			serf->s.free_walking.neg_dist1 = -128;
 			serf->s.free_walking.flags = 0;
 			serf->counter = 0;
@@ -3105,9 +3335,9 @@ handle_serf_planning_farming_state(serf_t *serf)
 		    (MAP_OBJ(dest) >= MAP_OBJ_FIELD_0 &&
 		     MAP_OBJ(dest) <= MAP_OBJ_FIELD_5)) {
 			serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-			serf->state = SERF_STATE_READY_TO_LEAVE;
+			serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
 			serf->s.leaving_building.field_B = globals.spiral_pattern[2*index] - 1;
-			serf->s.leaving_building.dest = globals.spiral_pattern[2*index+1] - 1;
+			serf_set_dest(serf, globals.spiral_pattern[2*index+1] - 1);
 			serf->s.leaving_building.dest2 = -globals.spiral_pattern[2*index] + 1;
 			serf->s.leaving_building.dir = -globals.spiral_pattern[2*index+1] + 1;
 			serf->s.leaving_building.next_state = SERF_STATE_FREE_WALKING;
@@ -3149,7 +3379,7 @@ handle_serf_farming_state(serf_t *serf)
 	}
 
 	serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-	serf->state = SERF_STATE_FREE_WALKING;
+	serf_set_state(serf, SERF_STATE_FREE_WALKING);
 	serf->s.free_walking.neg_dist1 = -128;
 	serf->s.free_walking.flags = 0;
 	serf->counter = 0;
@@ -3183,9 +3413,9 @@ handle_serf_milling_state(serf_t *serf)
 				/* Done milling. */
 				building->serf &= ~BIT(4);
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 				serf->s.move_resource_out.res = 1 + RESOURCE_FLOUR;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				player_sett_t *sett = globals.player_sett[SERF_PLAYER(serf)];
@@ -3231,9 +3461,9 @@ handle_serf_baking_state(serf_t *serf)
 				building->serf &= ~BIT(4);
 
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 				serf->s.move_resource_out.res = 1 + RESOURCE_BREAD;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				player_sett_t *sett = globals.player_sett[SERF_PLAYER(serf)];
@@ -3290,9 +3520,9 @@ handle_serf_pigfarming_state(serf_t *serf)
 					building->stock2 -= 1;
 
 					serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-					serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+					serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 					serf->s.move_resource_out.res = 1 + RESOURCE_PIG;
-					serf->s.move_resource_out.res_dest = 0;
+					serf_set_dest(serf, 0);
 					serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 					/* Update resource stats. */
@@ -3346,9 +3576,9 @@ handle_serf_butchering_state(serf_t *serf)
 			map_set_serf_index(serf->pos, 0);
 
 			serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-			serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+			serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 			serf->s.move_resource_out.res = 1 + RESOURCE_MEAT;
-			serf->s.move_resource_out.res_dest = 0;
+			serf_set_dest(serf, 0);
 			serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 			/* Update resource stats. */
@@ -3400,9 +3630,9 @@ handle_serf_making_weapon_state(serf_t *serf)
 				building->serf ^= BIT(3);
 
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 				serf->s.move_resource_out.res = 1 + res;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				/* Update resource stats. */
@@ -3467,9 +3697,9 @@ handle_serf_making_tool_state(serf_t *serf)
 				}
 
 				serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-				serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+				serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 				serf->s.move_resource_out.res = 1 + res;
-				serf->s.move_resource_out.res_dest = 0;
+				serf_set_dest(serf, 0);
 				serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 				/* Update resource stats. */
@@ -3518,9 +3748,9 @@ handle_serf_building_boat_state(serf_t *serf)
 					map_set_serf_index(serf->pos, 0);
 
 					serf_log_state_change(serf, SERF_STATE_MOVE_RESOURCE_OUT);
-					serf->state = SERF_STATE_MOVE_RESOURCE_OUT;
+					serf_set_state(serf, SERF_STATE_MOVE_RESOURCE_OUT);
 					serf->s.move_resource_out.res = 1 + RESOURCE_BOAT;
-					serf->s.move_resource_out.res_dest = 0;
+					serf_set_dest(serf, 0);
 					serf->s.move_resource_out.next_state = SERF_STATE_DROP_RESOURCE_OUT;
 
 					/* Update resource stats. */
@@ -3555,7 +3785,7 @@ handle_serf_looking_for_geo_spot_state(serf_t *serf)
 			if ((t1 >= 11 && t1 < 15) || (t2 >= 11 && t2 < 15) ||
 			    (t3 >= 11 && t3 < 15) || (t4 >= 11 && t4 < 15)) {	
 				serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-				serf->state = SERF_STATE_FREE_WALKING;
+				serf_set_state(serf, SERF_STATE_FREE_WALKING);
 				serf->s.free_walking.dist1 = globals.spiral_pattern[2*index];
 				serf->s.free_walking.dist2 = globals.spiral_pattern[2*index+1];
 				serf->s.free_walking.neg_dist1 = -globals.spiral_pattern[2*index];
@@ -3575,8 +3805,8 @@ handle_serf_looking_for_geo_spot_state(serf_t *serf)
 	}
 
 	serf_log_state_change(serf, SERF_STATE_WALKING);
-	serf->state = SERF_STATE_WALKING;
-	serf->s.walking.dest = 0;
+	serf_set_state(serf, SERF_STATE_WALKING);
+	serf_set_dest(serf, 0);
 	serf->s.walking.res = -2;
 	serf->s.walking.dir = 0;
 	serf->s.walking.wait_counter = 0;
@@ -3630,7 +3860,7 @@ handle_serf_sampling_geo_spot_state(serf_t *serf)
 		}
 
 		serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-		serf->state = SERF_STATE_FREE_WALKING;
+		serf_set_state(serf, SERF_STATE_FREE_WALKING);
 		serf->s.free_walking.neg_dist1 = -128;
 		serf->s.free_walking.neg_dist2 = 0;
 		serf->s.free_walking.flags = 0;
@@ -3664,7 +3894,7 @@ handle_serf_knight_engaging_building_state(serf_t *serf)
 
 				/* Change state of attacking knight */
 				serf->counter = 0;
-				serf->state = SERF_STATE_KNIGHT_PREPARE_ATTACKING;
+				serf_set_state(serf, SERF_STATE_KNIGHT_PREPARE_ATTACKING);
 				serf->animation = 168;
 
 				/* Remove knight from stats of defending building */
@@ -3687,7 +3917,7 @@ handle_serf_knight_engaging_building_state(serf_t *serf)
 
 				/* Change state of defending knight */
 				serf_log_state_change(def_serf, SERF_STATE_KNIGHT_LEAVE_FOR_FIGHT);
-				def_serf->state = SERF_STATE_KNIGHT_LEAVE_FOR_FIGHT;
+				serf_set_state(def_serf, SERF_STATE_KNIGHT_LEAVE_FOR_FIGHT);
 				def_serf->s.leaving_building.next_state = SERF_STATE_KNIGHT_PREPARE_DEFENDING;
 				def_serf->counter = 0;
 				return;
@@ -3696,7 +3926,7 @@ handle_serf_knight_engaging_building_state(serf_t *serf)
 
 		/* No one to defend this building. Occupy it. */
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING);
-		serf->state = SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING;
+		serf_set_state(serf, SERF_STATE_KNIGHT_OCCUPY_ENEMY_BUILDING);
 		serf->animation = 179;
 		serf->counter = counter_from_animation[serf->animation];
 		serf->anim = globals.anim;
@@ -3754,13 +3984,13 @@ handle_serf_knight_prepare_attacking(serf_t *serf)
 	if (def_serf->state == SERF_STATE_KNIGHT_PREPARE_DEFENDING) {
 		/* Change state of attacker. */
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING);
-		serf->state = SERF_STATE_KNIGHT_ATTACKING;
+		serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING);
 		serf->counter = 0;
 		serf->anim = globals.anim;
 
 		/* Change state of defender. */
 		serf_log_state_change(def_serf, SERF_STATE_KNIGHT_DEFENDING);
-		def_serf->state = SERF_STATE_KNIGHT_DEFENDING;
+		serf_set_state(def_serf, SERF_STATE_KNIGHT_DEFENDING);
 		def_serf->counter = 0;
 
 		serf_set_fight_outcome(serf, def_serf);
@@ -3825,14 +4055,14 @@ handle_knight_attacking(serf_t *serf)
 				/* Defender won. */
 				if (serf->state == SERF_STATE_KNIGHT_ATTACKING_FREE) {
 					serf_log_state_change(def_serf, SERF_STATE_KNIGHT_DEFENDING_VICTORY_FREE);
-					def_serf->state = SERF_STATE_KNIGHT_DEFENDING_VICTORY_FREE;
+					serf_set_state(def_serf, SERF_STATE_KNIGHT_DEFENDING_VICTORY_FREE);
 
 					def_serf->animation = 180;
 					def_serf->counter = 0;
 
 					/* Attacker dies. */
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE);
-					serf->state = SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE;
+					serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE);
 					serf->animation = 152 + SERF_TYPE(serf);
 					serf->counter = 255;
 					serf->type = (serf->type & 0x80) | (SERF_DEAD << 2) | SERF_PLAYER(serf);
@@ -3842,7 +4072,7 @@ handle_knight_attacking(serf_t *serf)
 
 					/* Attacker dies. */
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_DEFEAT);
-					serf->state = SERF_STATE_KNIGHT_ATTACKING_DEFEAT;
+					serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_DEFEAT);
 					serf->animation = 152 + SERF_TYPE(serf);
 					serf->counter = 255;
 					serf->type = (serf->type & 0x80) | (SERF_DEAD << 2) | SERF_PLAYER(serf);
@@ -3851,7 +4081,7 @@ handle_knight_attacking(serf_t *serf)
 				/* Attacker won. */
 				if (serf->state == SERF_STATE_KNIGHT_ATTACKING_FREE) {
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_VICTORY_FREE);
-					serf->state = SERF_STATE_KNIGHT_ATTACKING_VICTORY_FREE;
+					serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_VICTORY_FREE);
 					serf->animation = 168;
 					serf->counter = 0;
 
@@ -3860,7 +4090,7 @@ handle_knight_attacking(serf_t *serf)
 					serf->s.attacking.field_D = def_serf->s.defending_free.other_dist_row;
 				} else {
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_VICTORY);
-					serf->state = SERF_STATE_KNIGHT_ATTACKING_VICTORY;
+					serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_VICTORY);
 					serf->animation = 168;
 					serf->counter = 0;
 
@@ -3906,7 +4136,7 @@ handle_serf_knight_attacking_victory_state(serf_t *serf)
 		serf->s.attacking.def_index = 0;
 
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_ENGAGING_BUILDING);
-		serf->state = SERF_STATE_KNIGHT_ENGAGING_BUILDING;
+		serf_set_state(serf, SERF_STATE_KNIGHT_ENGAGING_BUILDING);
 		serf->anim = globals.anim;
 		serf->counter = 0;
 	}
@@ -3975,7 +4205,7 @@ handle_knight_occupy_enemy_building(serf_t *serf)
 					return;
 				} else {
 					serf_log_state_change(serf, SERF_STATE_KNIGHT_ENGAGING_BUILDING);
-					serf->state = SERF_STATE_KNIGHT_ENGAGING_BUILDING;
+					serf_set_state(serf, SERF_STATE_KNIGHT_ENGAGING_BUILDING);
 					serf->animation = 167;
 					serf->counter = 191;
 					return;
@@ -3985,7 +4215,7 @@ handle_knight_occupy_enemy_building(serf_t *serf)
 
 		/* Something is wrong. */
 		serf_log_state_change(serf, SERF_STATE_LOST);
-		serf->state = SERF_STATE_LOST;
+		serf_set_state(serf, SERF_STATE_LOST);
 		serf->s.lost.field_B = 0;
 		serf->counter = 0;
 	}
@@ -4013,7 +4243,7 @@ handle_state_knight_free_walking(serf_t *serf)
 							int dist_row = serf->s.free_walking.dist2;
 
 							serf_log_state_change(serf, SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE);
-							serf->state = SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE;
+							serf_set_state(serf, SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE);
 
 							serf->s.defending_free.dist_col = dist_col;
 							serf->s.defending_free.dist_row = dist_row;
@@ -4024,7 +4254,7 @@ handle_state_knight_free_walking(serf_t *serf)
 							serf->counter = 255;
 
 							serf_log_state_change(other, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE);
-							other->state = SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE;
+							serf_set_state(other, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE);
 							other->s.attacking.field_D = d;
 							other->s.attacking.def_index = SERF_INDEX(serf);
 							return;
@@ -4038,7 +4268,7 @@ handle_state_knight_free_walking(serf_t *serf)
 							int dist_row = serf->s.free_walking.dist2;
 
 							serf_log_state_change(serf, SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE);
-							serf->state = SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE;
+							serf_set_state(serf, SERF_STATE_KNIGHT_ENGAGE_DEFENDING_FREE);
 							serf->s.defending_free.dist_col = dist_col;
 							serf->s.defending_free.dist_row = dist_row;
 							serf->s.defending_free.field_D = 0;
@@ -4050,7 +4280,7 @@ handle_state_knight_free_walking(serf_t *serf)
 							building->stock1 -= 1;
 
 							serf_log_state_change(other, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE);
-							other->state = SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE;
+							serf_set_state(other, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE);
 							other->s.attacking.field_D = d;
 							other->s.attacking.def_index = SERF_INDEX(serf);
 							return;
@@ -4083,7 +4313,7 @@ handle_state_knight_engage_attacking_free(serf_t *serf)
 
 	while (serf->counter < 0) {
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE_JOIN);
-		serf->state = SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE_JOIN;
+		serf_set_state(serf, SERF_STATE_KNIGHT_ENGAGE_ATTACKING_FREE_JOIN);
 		serf->animation = 167;
 		serf->counter += 191;
 		return;
@@ -4099,14 +4329,14 @@ handle_state_knight_engage_attacking_free_join(serf_t *serf)
 
 	while (serf->counter < 0) {
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_PREPARE_ATTACKING_FREE);
-		serf->state = SERF_STATE_KNIGHT_PREPARE_ATTACKING_FREE;
+		serf_set_state(serf, SERF_STATE_KNIGHT_PREPARE_ATTACKING_FREE);
 		serf->animation = 168;
 		serf->counter = 0;
 
 		serf_t *other = game_get_serf(serf->s.attacking.def_index);
 		map_pos_t other_pos = other->pos;
 		serf_log_state_change(other, SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE);
-		other->state = SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE;
+		serf_set_state(other, SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE);
 		other->counter = serf->counter;
 
 		/* Adjust distance to final destination. */
@@ -4135,11 +4365,11 @@ handle_state_knight_prepare_attacking_free(serf_t *serf)
 	serf_t *other = game_get_serf(serf->s.attacking.def_index);
 	if (other->state == SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE_WAIT) {
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_FREE);
-		serf->state = SERF_STATE_KNIGHT_ATTACKING_FREE;
+		serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_FREE);
 		serf->counter = 0;
 
 		serf_log_state_change(other, SERF_STATE_KNIGHT_DEFENDING_FREE);
-		other->state = SERF_STATE_KNIGHT_DEFENDING_FREE;
+		serf_set_state(other, SERF_STATE_KNIGHT_DEFENDING_FREE);
 		other->counter = 0;
 
 		serf_set_fight_outcome(serf, other);
@@ -4155,7 +4385,7 @@ handle_state_knight_prepare_defending_free(serf_t *serf)
 
 	while (serf->counter < 0) {
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE_WAIT);
-		serf->state = SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE_WAIT;
+		serf_set_state(serf, SERF_STATE_KNIGHT_PREPARE_DEFENDING_FREE_WAIT);
 		serf->counter = 0;
 		return;
 	}
@@ -4177,7 +4407,7 @@ handle_knight_attacking_victory_free(serf_t *serf)
 		int dist_row = serf->s.attacking.field_D;
 
 		serf_log_state_change(serf, SERF_STATE_KNIGHT_ATTACKING_FREE_WAIT);
-		serf->state = SERF_STATE_KNIGHT_ATTACKING_FREE_WAIT;
+		serf_set_state(serf, SERF_STATE_KNIGHT_ATTACKING_FREE_WAIT);
 
 		serf->s.free_walking.dist1 = dist_col;
 		serf->s.free_walking.dist2 = dist_row;
@@ -4218,7 +4448,7 @@ handle_serf_knight_attacking_defeat_free_state(serf_t *serf)
 		int dist_row = other->s.defending_free.dist_row;
 
 		serf_log_state_change(other, SERF_STATE_KNIGHT_FREE_WALKING);
-		other->state = SERF_STATE_KNIGHT_FREE_WALKING;
+		serf_set_state(other, SERF_STATE_KNIGHT_FREE_WALKING);
 
 		other->s.free_walking.dist1 = dist_col;
 		other->s.free_walking.dist2 = dist_row;
@@ -4246,10 +4476,10 @@ handle_knight_attacking_free_wait(serf_t *serf)
 	while (serf->counter < 0) {
 		if (serf->s.free_walking.flags != 0) {
 			serf_log_state_change(serf, SERF_STATE_KNIGHT_FREE_WALKING);
-			serf->state = SERF_STATE_KNIGHT_FREE_WALKING;
+			serf_set_state(serf, SERF_STATE_KNIGHT_FREE_WALKING);
 		} else {
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 		}
 
 		serf->counter = 0;
@@ -4286,7 +4516,7 @@ handle_serf_state_knight_leave_for_walk_to_fight(serf_t *serf)
 		serf_leave_building(serf, 0);
 		/* TODO names for leaving_building vars make no sense here. */
 		serf->s.leaving_building.field_B = dist_col;
-		serf->s.leaving_building.dest = dist_row;
+		serf_set_dest(serf, dist_row);
 		serf->s.leaving_building.dest2 = field_D;
 		serf->s.leaving_building.dir = field_E;
 		serf->s.leaving_building.next_state = next_state;
@@ -4301,17 +4531,17 @@ handle_serf_state_knight_leave_for_walk_to_fight(serf_t *serf)
 			switch (BUILDING_TYPE(building)) {
 			case BUILDING_HUT:
 				serf_log_state_change(serf, SERF_STATE_DEFENDING_HUT);
-				serf->state = SERF_STATE_DEFENDING_HUT;
+				serf_set_state(serf, SERF_STATE_DEFENDING_HUT);
 				max_capacity = 3;
 				break;
 			case BUILDING_TOWER:
 				serf_log_state_change(serf, SERF_STATE_DEFENDING_TOWER);
-				serf->state = SERF_STATE_DEFENDING_TOWER;
+				serf_set_state(serf, SERF_STATE_DEFENDING_TOWER);
 				max_capacity = 6;
 				break;
 			case BUILDING_FORTRESS:
 				serf_log_state_change(serf, SERF_STATE_DEFENDING_FORTRESS);
-				serf->state = SERF_STATE_DEFENDING_FORTRESS;
+				serf_set_state(serf, SERF_STATE_DEFENDING_FORTRESS);
 				max_capacity = 12;
 				break;
 			default:
@@ -4360,7 +4590,7 @@ handle_serf_idle_on_path_state(serf_t *serf)
 		int dir = serf->s.idle_on_path.field_E;
 
 		serf_log_state_change(serf, SERF_STATE_TRANSPORTING);
-		serf->state = SERF_STATE_TRANSPORTING;
+		serf_set_state(serf, SERF_STATE_TRANSPORTING);
 		serf->s.walking.res = 0;
 		serf->s.walking.wait_counter = 0;
 		serf->s.walking.dir = dir;
@@ -4368,7 +4598,7 @@ handle_serf_idle_on_path_state(serf_t *serf)
 		serf->counter = 0;
 	} else {
 		serf_log_state_change(serf, SERF_STATE_WAIT_IDLE_ON_PATH);
-		serf->state = SERF_STATE_WAIT_IDLE_ON_PATH;
+		serf_set_state(serf, SERF_STATE_WAIT_IDLE_ON_PATH);
 	}
 }
 
@@ -4385,7 +4615,7 @@ handle_serf_wait_idle_on_path_state(serf_t *serf)
 		int dir = serf->s.idle_on_path.field_E;
 
 		serf_log_state_change(serf, SERF_STATE_TRANSPORTING);
-		serf->state = SERF_STATE_TRANSPORTING;
+		serf_set_state(serf, SERF_STATE_TRANSPORTING);
 		serf->s.walking.res = 0;
 		serf->s.walking.wait_counter = 0;
 		serf->s.walking.dir = dir;
@@ -4412,10 +4642,10 @@ handle_scatter_state(serf_t *serf)
 			if (SERF_TYPE(serf) >= SERF_KNIGHT_0 &&
 			    SERF_TYPE(serf) >= SERF_KNIGHT_4) {
 				serf_log_state_change(serf, SERF_STATE_KNIGHT_FREE_WALKING);
-				serf->state = SERF_STATE_KNIGHT_FREE_WALKING;
+				serf_set_state(serf, SERF_STATE_KNIGHT_FREE_WALKING);
 			} else {
 				serf_log_state_change(serf, SERF_STATE_FREE_WALKING);
-				serf->state = SERF_STATE_FREE_WALKING;
+				serf_set_state(serf, SERF_STATE_FREE_WALKING);
 			}
 
 			serf->s.free_walking.dist1 = col;
@@ -4434,8 +4664,8 @@ handle_serf_finished_building_state(serf_t *serf)
 {
 	if (MAP_SERF_INDEX(MAP_MOVE_DOWN_RIGHT(serf->pos)) == 0) {
 		serf_log_state_change(serf, SERF_STATE_READY_TO_LEAVE);
-		serf->state = SERF_STATE_READY_TO_LEAVE;
-		serf->s.leaving_building.dest = 0;
+		serf_set_state(serf, SERF_STATE_READY_TO_LEAVE);
+		serf_set_dest(serf, 0);
 		serf->s.leaving_building.field_B = -2;
 		serf->s.leaving_building.dir = 0;
 		serf->s.leaving_building.next_state = SERF_STATE_WALKING;
@@ -4460,10 +4690,10 @@ handle_serf_wake_at_flag_state(serf_t *serf)
 
 		if (SERF_TYPE(serf) == SERF_SAILOR) {
 			serf_log_state_change(serf, SERF_STATE_LOST_SAILOR);
-			serf->state = SERF_STATE_LOST_SAILOR;
+			serf_set_state(serf, SERF_STATE_LOST_SAILOR);
 		} else {
 			serf_log_state_change(serf, SERF_STATE_LOST);
-			serf->state = SERF_STATE_LOST;
+			serf_set_state(serf, SERF_STATE_LOST);
 			serf->s.lost.field_B = 0;
 		}
 	}
@@ -4473,7 +4703,7 @@ static void
 handle_serf_wake_on_path_state(serf_t *serf)
 {
 	serf_log_state_change(serf, SERF_STATE_WAIT_IDLE_ON_PATH);
-	serf->state = SERF_STATE_WAIT_IDLE_ON_PATH;
+	serf_set_state(serf, SERF_STATE_WAIT_IDLE_ON_PATH);
 
 	for (dir_t d = DIR_UP; d >= DIR_RIGHT; d--) {
 		if (BIT_TEST(MAP_PATHS(serf->pos), d)) {
@@ -4531,6 +4761,8 @@ handle_serf_defending_castle_state(serf_t *serf)
 void
 update_serf(serf_t *serf)
 {
+	PROFILE_COUNT_SERF_STATE(serf->state);
+
 	switch (serf->state) {
 	case SERF_STATE_NULL: /* 0 */
 		break;
@@ -4760,7 +4992,7 @@ update_serf(serf_t *serf)
 		break;
 	default:
 		LOGD("serf", "Serf state %d isn't processed", serf->state);
-		serf->state = SERF_STATE_NULL;
+		serf_set_state(serf, SERF_STATE_NULL);
 	}
 }
 
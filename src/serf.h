@@ -160,6 +160,8 @@ typedef enum {
 	SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE
 } serf_state_t;
 
+#define SERF_STATE_COUNT  (SERF_STATE_KNIGHT_ATTACKING_DEFEAT_FREE+1)
+
 
 typedef struct {
 	int type;
@@ -352,4 +354,29 @@ typedef struct {
 void update_serf(serf_t *serf);
 const char *serf_get_state_name(serf_state_t state);
 
+void serf_set_state(serf_t *serf, serf_state_t state);
+void serf_set_pos(serf_t *serf, map_pos_t pos);
+void serf_set_dest(serf_t *serf, uint dest);
+
+void serf_index_rebuild();
+void serf_index_remove(int index);
+int serf_index_first_at_pos(map_pos_t pos);
+int serf_index_next_at_pos(int index);
+int serf_index_first_with_dest(uint flag_index);
+int serf_index_next_with_dest(int index);
+
+/* Iterate over the indices of serfs at a position or on the way to a
+   flag, in increasing order. The next serf is looked up before the body
+   is run, so the body may change the state, position or destination of
+   the current serf or free it. */
+#define serf_foreach_at_pos(pos, i, next)				\
+	for ((i) = serf_index_first_at_pos(pos),			\
+		     (next) = serf_index_next_at_pos(i);		\
+	     (i) != 0; (i) = (next), (next) = serf_index_next_at_pos(i))
+
+#define serf_foreach_with_dest(dest, i, next)				\
+	for ((i) = serf_index_first_with_dest(dest),			\
+		     (next) = serf_index_next_with_dest(i);		\
+	     (i) != 0; (i) = (next), (next) = serf_index_next_with_dest(i))
+
 #endif /* ! _SERF_H */
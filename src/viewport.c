@@ -28,6 +28,7 @@
 #include "interface.h"
 #include "panel.h"
 #include "gfx.h"
+#include "atlas.h"
 #include "data.h"
 #include "map.h"
 #include "random.h"
@@ -40,31 +41,15 @@
 #include "pathfinder.h"
 
 
-#define MAP_TILE_TEXTURES  33
-#define MAP_TILE_MASKS     81
-
-
 #define VIEWPORT_COLS(viewport)  (2*((viewport)->obj.width / MAP_TILE_WIDTH) + 1)
 
 
-/* Cache all combinations of textures and masks, and both up tiles and down tiles. */
-static surface_t *map_tile_cache[2*MAP_TILE_TEXTURES*MAP_TILE_MASKS];
-
-
 static void
 draw_map_tile(int x, int y, int mask, int sprite, frame_t *frame)
 {
 	sprite_t *spr = gfx_get_data_object(sprite, NULL);
 	sprite_t *msk = gfx_get_data_object(mask, NULL);
-	sdl_draw_masked_sprite(spr, x, y, msk, NULL, frame);
-}
-
-static void
-draw_map_tile_cached(int x, int y, int mask, int sprite, unsigned int index, frame_t *frame)
-{
-	sprite_t *spr = gfx_get_data_object(sprite, NULL);
-	sprite_t *msk = gfx_get_data_object(mask, NULL);
-	map_tile_cache[index] = sdl_draw_masked_sprite(spr, x, y, msk, map_tile_cache[index], frame);
+	sdl_draw_masked_sprite(spr, x, y, msk, atlas_get_tile(mask, sprite), frame);
 }
 
 
@@ -114,9 +99,8 @@ draw_triangle_up(int x, int y, int m, int left, int right, map_pos_t pos, frame_
 
 	int sprite = tri_spr[index];
 
-	draw_map_tile_cached(x, y,
-			     DATA_MAP_MASK_UP_BASE + mask,
-			     DATA_MAP_GROUND_BASE + sprite, 33*80 + 33*mask + sprite, frame);
+	draw_map_tile(x, y, DATA_MAP_MASK_UP_BASE + mask,
+		      DATA_MAP_GROUND_BASE + sprite, frame);
 }
 
 static void
@@ -146,9 +130,8 @@ draw_triangle_down(int x, int y, int m, int left, int right, map_pos_t pos, fram
 
 	int sprite = tri_spr[index];
 
-	draw_map_tile_cached(x, y + MAP_TILE_HEIGHT,
-			     DATA_MAP_MASK_DOWN_BASE + mask,
-			     DATA_MAP_GROUND_BASE + sprite, 33*mask + sprite, frame);
+	draw_map_tile(x, y + MAP_TILE_HEIGHT, DATA_MAP_MASK_DOWN_BASE + mask,
+		      DATA_MAP_GROUND_BASE + sprite, frame);
 }
 
 /* Draw a column (vertical) of tiles, starting at an up pointing tile. */
@@ -274,76 +257,272 @@ draw_down_tile_col(map_pos_t pos, int x_base, int y_base, int max_y, frame_t *fr
 	}
 }
 
-static frame_t landscape_frame;
 int landscape_frame_init = 0;
 int landscape_frame_redraw = 0;
 
+/* The landscape is drawn into chunks of tiles that are kept in a
+   cache of limited size. Chunks are drawn when they become visible
+   and redrawn when the map changes. */
+#define LANDSCAPE_CHUNK_SIZE    16
+#define LANDSCAPE_CHUNK_WIDTH   (LANDSCAPE_CHUNK_SIZE*MAP_TILE_WIDTH)
+#define LANDSCAPE_CHUNK_HEIGHT  (LANDSCAPE_CHUNK_SIZE*MAP_TILE_HEIGHT)
+#define LANDSCAPE_CHUNK_BYTES  \
+	(LANDSCAPE_CHUNK_WIDTH*LANDSCAPE_CHUNK_HEIGHT*4)
+
+#define LANDSCAPE_CACHE_DEFAULT_LIMIT  (32*1024*1024)
+
+/* Tiles are displaced upwards by up to this many pixels by their height. */
+#define LANDSCAPE_MAX_ELEVATION  (4*32)
+
+typedef struct {
+	frame_t frame;
+	int chunk; /* Index of chunk in slot, or -1. */
+	int dirty;
+	uint last_used;
+} landscape_slot_t;
+
+static size_t landscape_cache_limit = LANDSCAPE_CACHE_DEFAULT_LIMIT;
+static landscape_slot_t *landscape_slots;
+static int landscape_slot_count;
+static uint landscape_use_counter;
+
+/* Slot index of each chunk, or -1 if not cached. */
+static int *landscape_chunk_slot;
+static int landscape_chunk_cols;
+static int landscape_chunk_rows;
+
+/* Floor division and modulo that work for negative values. */
+static int
+floor_div(int a, int b)
+{
+	return (a >= 0) ? a/b : -((-a + b - 1)/b);
+}
+
+static int
+wrap_mod(int a, int b)
+{
+	int r = a % b;
+	return (r < 0) ? r + b : r;
+}
+
+/* Set the memory limit of the landscape chunk cache in bytes.
+   Only takes effect before the landscape is first drawn. */
+void
+viewport_set_landscape_cache_limit(size_t limit)
+{
+	landscape_cache_limit = limit;
+}
+
+/* Mark the chunks covering the landscape rectangle dirty.
+   The rectangle wraps around the edges of the map. */
+static void
+landscape_mark_dirty(int x, int y, int width, int height)
+{
+	int c0 = floor_div(x, LANDSCAPE_CHUNK_WIDTH);
+	int c1 = floor_div(x + width - 1, LANDSCAPE_CHUNK_WIDTH);
+	int r0 = floor_div(y, LANDSCAPE_CHUNK_HEIGHT);
+	int r1 = floor_div(y + height - 1, LANDSCAPE_CHUNK_HEIGHT);
+
+	for (int r = r0; r <= r1; r++) {
+		int row = wrap_mod(r, landscape_chunk_rows);
+		for (int c = c0; c <= c1; c++) {
+			int col = wrap_mod(c, landscape_chunk_cols);
+			int slot = landscape_chunk_slot[row*landscape_chunk_cols + col];
+			if (slot >= 0) landscape_slots[slot].dirty = 1;
+		}
+	}
+}
+
 void
 viewport_redraw_map_pos(map_pos_t pos)
 {
-	/* Ignore pos for now. */
-	landscape_frame_redraw = 1;
+	/* Chunks are drawn from scratch when first used. */
+	if (!landscape_frame_init) return;
+
+	/* Pixel position of the map position at zero height. */
+	int col = MAP_POS_COL(pos);
+	int row = MAP_POS_ROW(pos);
+	int x = col*MAP_TILE_WIDTH - row*(MAP_TILE_WIDTH/2);
+	int y = row*MAP_TILE_HEIGHT;
+
+	/* Cover the triangles sharing this position, at any height. */
+	landscape_mark_dirty(x - MAP_TILE_WIDTH,
+			     y - MAP_TILE_HEIGHT - LANDSCAPE_MAX_ELEVATION,
+			     2*MAP_TILE_WIDTH,
+			     3*MAP_TILE_HEIGHT + LANDSCAPE_MAX_ELEVATION);
 }
 
+/* Draw the tiles of the landscape rectangle at x, y into dest.
+   Drawing is clipped to the rectangle, and the tiles are drawn in the
+   same order for any rectangle, so the chunks fit together as if the
+   whole landscape was drawn at once. */
 static void
-draw_landscape(viewport_t *viewport, frame_t *frame)
+draw_landscape_rect(int x, int y, int width, int height, frame_t *dest)
 {
-	int map_width = globals.map.cols*MAP_TILE_WIDTH;
-	int map_height = globals.map.rows*MAP_TILE_HEIGHT;
+	/* Tiles further down the map can be raised into the
+	   rectangle, so continue past the bottom. */
+	int max_y = height + LANDSCAPE_MAX_ELEVATION + 2*MAP_TILE_HEIGHT;
 
-	if (!landscape_frame_init) {
-		/* Initialize landscape frame. */
+	/* Draw one extra column as half a column will be outside the
+	   map tile on both right and left side.. */
+	int first_col = max(0, x/MAP_TILE_WIDTH - 1);
+	int last_col = min(globals.map.cols, (x + width)/MAP_TILE_WIDTH + 1);
+
+	map_pos_t pos = MAP_POS(first_col, 0);
+	int x_base = first_col*MAP_TILE_WIDTH - (MAP_TILE_WIDTH/2) - x;
+
+	for (int col = first_col; col <= last_col; col++) {
+		draw_up_tile_col(pos, x_base, -y, max_y, dest);
+		draw_down_tile_col(pos, x_base + 16, -y, max_y, dest);
+
+		pos = MAP_MOVE_RIGHT(pos);
+		x_base += MAP_TILE_WIDTH;
+	}
+}
+
+static void
+landscape_init()
+{
+	landscape_chunk_cols = globals.map.cols / LANDSCAPE_CHUNK_SIZE;
+	landscape_chunk_rows = globals.map.rows / LANDSCAPE_CHUNK_SIZE;
+
+	int chunks = landscape_chunk_cols*landscape_chunk_rows;
+	landscape_chunk_slot = malloc(chunks*sizeof(int));
+	if (landscape_chunk_slot == NULL) abort();
+
+	for (int i = 0; i < chunks; i++) landscape_chunk_slot[i] = -1;
+
+	/* The cache must hold all chunks a viewport can show at once,
+	   or every visible chunk is redrawn on every frame. */
+	frame_t *screen = sdl_get_screen_frame();
+	int visible = (sdl_frame_get_width(screen)/LANDSCAPE_CHUNK_WIDTH + 2)*
+		(sdl_frame_get_height(screen)/LANDSCAPE_CHUNK_HEIGHT + 2);
+
+	landscape_slot_count = landscape_cache_limit / LANDSCAPE_CHUNK_BYTES;
+	if (landscape_slot_count < visible) {
+		LOGI("viewport", "Landscape cache limit raised to %i KB"
+		     " to fit the screen.", visible*(LANDSCAPE_CHUNK_BYTES/1024));
+		landscape_slot_count = visible;
+	}
+	landscape_slot_count = min(chunks, landscape_slot_count);
+
+	landscape_slots = calloc(landscape_slot_count, sizeof(landscape_slot_t));
+	if (landscape_slots == NULL) abort();
+
+	for (int i = 0; i < landscape_slot_count; i++) {
+		landscape_slot_t *slot = &landscape_slots[i];
 		/* TODO It shouldn't have an alpha channel but sdl_frame_init()
 		   creates the surface with alpha, so we have to fill the frame. */
-		sdl_frame_init(&landscape_frame, 0, 0, map_width, map_height, NULL);
-		sdl_fill_rect(0, 0, map_width, map_height, 72, &landscape_frame);
-		landscape_frame_init = 1;
-		landscape_frame_redraw = 1;
+		sdl_frame_init(&slot->frame, 0, 0, LANDSCAPE_CHUNK_WIDTH,
+			       LANDSCAPE_CHUNK_HEIGHT, NULL);
+		slot->chunk = -1;
 	}
 
-	if (landscape_frame_redraw) {
-		/* Draw complete map tile. */
-		map_pos_t pos = MAP_POS(0, 0);
-		int x_base = -(MAP_TILE_WIDTH/2);
-
-		/* Draw one extra column as half a column will be outside the
-		   map tile on both right and left side.. */
-		for (int col = 0; col < globals.map.cols+1; col++) {
-			draw_up_tile_col(pos, x_base, 0, map_height, &landscape_frame);
-			draw_down_tile_col(pos, x_base + 16, 0, map_height, &landscape_frame);
-
-			pos = MAP_MOVE_RIGHT(pos);
-			x_base += MAP_TILE_WIDTH;
+	LOGD("viewport", "Landscape cache of %i chunks (%i KB).",
+	     landscape_slot_count,
+	     landscape_slot_count*(LANDSCAPE_CHUNK_BYTES/1024));
+}
+
+/* Return the frame of a landscape chunk, drawing it if it is not
+   cached or has changed. The least recently used chunk is evicted
+   when the cache is full. */
+static frame_t *
+landscape_get_chunk(int col, int row)
+{
+	int chunk = row*landscape_chunk_cols + col;
+	int index = landscape_chunk_slot[chunk];
+
+	if (index < 0) {
+		index = 0;
+		for (int i = 0; i < landscape_slot_count; i++) {
+			if (landscape_slots[i].chunk < 0) {
+				index = i;
+				break;
+			}
+			if (landscape_slots[i].last_used <
+			    landscape_slots[index].last_used) {
+				index = i;
+			}
 		}
 
+		landscape_slot_t *slot = &landscape_slots[index];
+		if (slot->chunk >= 0) landscape_chunk_slot[slot->chunk] = -1;
+
+		slot->chunk = chunk;
+		slot->dirty = 1;
+		landscape_chunk_slot[chunk] = index;
+	}
+
+	landscape_slot_t *slot = &landscape_slots[index];
+	slot->last_used = ++landscape_use_counter;
+
+	if (slot->dirty) {
+		sdl_fill_rect(0, 0, LANDSCAPE_CHUNK_WIDTH,
+			      LANDSCAPE_CHUNK_HEIGHT, 72, &slot->frame);
+		draw_landscape_rect(col*LANDSCAPE_CHUNK_WIDTH,
+				    row*LANDSCAPE_CHUNK_HEIGHT,
+				    LANDSCAPE_CHUNK_WIDTH,
+				    LANDSCAPE_CHUNK_HEIGHT, &slot->frame);
+
 #if 0
-		/* Draw a border around the tile for debug. */
-		sdl_fill_rect(0, 0, map_width, 2, 76, &landscape_frame);
-		sdl_fill_rect(0, 0, 2, map_height, 76, &landscape_frame);
-		sdl_fill_rect(0, map_height-2, map_width, 2, 76, &landscape_frame);
-		sdl_fill_rect(map_width-2, 0, 2, map_height, 76, &landscape_frame);
+		/* Draw a border around the chunk for debug. */
+		sdl_draw_rect(0, 0, LANDSCAPE_CHUNK_WIDTH,
+			      LANDSCAPE_CHUNK_HEIGHT, 76, &slot->frame);
 #endif
 
+		slot->dirty = 0;
+	}
+
+	return &slot->frame;
+}
+
+static void
+draw_landscape(viewport_t *viewport, frame_t *frame)
+{
+	int map_width = globals.map.cols*MAP_TILE_WIDTH;
+	int map_height = globals.map.rows*MAP_TILE_HEIGHT;
+
+	if (!landscape_frame_init) {
+		landscape_init();
+		landscape_frame_init = 1;
+	}
+
+	if (landscape_frame_redraw) {
+		for (int i = 0; i < landscape_slot_count; i++) {
+			landscape_slots[i].dirty = 1;
+		}
 		landscape_frame_redraw = 0;
 	}
 
 	int mx = viewport->offset_x;
 	int my = viewport->offset_y;
 
-	int y = 0, x_base = 0;
+	/* The map is shifted by half its width each
+	   time it wraps around vertically. */
+	int y = 0;
 	while (y < viewport->obj.height) {
+		int wraps = (my + y) / map_height - my / map_height;
+		int x_base = (wraps * (map_width/2)) % map_width;
+		int ly = (my + y) % map_height;
+		int h = min(LANDSCAPE_CHUNK_HEIGHT - ly % LANDSCAPE_CHUNK_HEIGHT,
+			    viewport->obj.height - y);
+
 		int x = 0;
 		while (x < viewport->obj.width) {
+			int lx = (mx + x_base + x) % map_width;
+			int w = min(LANDSCAPE_CHUNK_WIDTH - lx % LANDSCAPE_CHUNK_WIDTH,
+				    viewport->obj.width - x);
+
+			frame_t *chunk = landscape_get_chunk(lx / LANDSCAPE_CHUNK_WIDTH,
+							     ly / LANDSCAPE_CHUNK_HEIGHT);
 			sdl_draw_frame(x, y, frame,
-				       (mx + x_base + x) % map_width,
-				       (my + y) % map_height,
-				       &landscape_frame,
-				       viewport->obj.width - x, viewport->obj.height - y);
-			x += map_width - ((mx + x_base + x) % map_width);
+				       lx % LANDSCAPE_CHUNK_WIDTH,
+				       ly % LANDSCAPE_CHUNK_HEIGHT,
+				       chunk, w, h);
+			x += w;
 		}
 
-		y += map_height - ((my + y) % map_height);
-		x_base = (x_base + map_width/2) % map_width;
+		y += h;
 	}
 }
 
@@ -1377,11 +1556,109 @@ draw_flag_and_res(map_pos_t pos, int x, int y, frame_t *frame)
 	if (flag->res_waiting[7] != 0) draw_game_sprite(x-4, y+4, flag->res_waiting[7] & 0x1f, frame);
 }
 
+/* Index of the map positions that may have an object or a serf to
+   draw. Each map row has a bitmap with one bit per column. Bits are
+   set when an object or serf is placed, and cleared when the position
+   is found to be empty while drawing. The index is built from the map
+   when the viewport is first drawn. */
+static uint32_t *object_draw_index;
+static uint32_t *serf_draw_index;
+static int index_row_words;
+static int index_init = 0;
+
+#define INDEX_WORD(index,pos)  \
+	(&(index)[MAP_POS_ROW(pos)*index_row_words + (MAP_POS_COL(pos) >> 5)])
+#define INDEX_BIT(pos)  (1u << (MAP_POS_COL(pos) & 31))
+
 static void
-draw_map_objects_row(map_pos_t pos, int y_base, int cols, int x_base, frame_t *frame)
+index_set(uint32_t *index, map_pos_t pos)
 {
-	for (int i = 0; i < cols; i++, x_base += MAP_TILE_WIDTH, pos = MAP_MOVE_RIGHT(pos)) {
-		if (MAP_OBJ(pos) == MAP_OBJ_NONE) continue;
+	*INDEX_WORD(index, pos) |= INDEX_BIT(pos);
+}
+
+static void
+index_clear(uint32_t *index, map_pos_t pos)
+{
+	*INDEX_WORD(index, pos) &= ~INDEX_BIT(pos);
+}
+
+static void
+init_draw_index()
+{
+	index_row_words = (globals.map.cols + 31) / 32;
+
+	size_t size = globals.map.rows*index_row_words*sizeof(uint32_t);
+	object_draw_index = calloc(1, size);
+	if (object_draw_index == NULL) abort();
+
+	serf_draw_index = calloc(1, size);
+	if (serf_draw_index == NULL) abort();
+
+	for (map_pos_t pos = 0; pos < globals.map.tile_count; pos++) {
+		if (MAP_OBJ(pos) != MAP_OBJ_NONE) index_set(object_draw_index, pos);
+		if (MAP_SERF_INDEX(pos) != 0 || MAP_IDLE_SERF(pos)) {
+			index_set(serf_draw_index, pos);
+		}
+	}
+
+	index_init = 1;
+}
+
+/* Record that an object was placed at pos. */
+void
+viewport_index_add_object(map_pos_t pos)
+{
+	if (index_init) index_set(object_draw_index, pos);
+}
+
+/* Record that a serf, active or idle, was placed at pos. */
+void
+viewport_index_add_serf(map_pos_t pos)
+{
+	if (index_init) index_set(serf_draw_index, pos);
+}
+
+/* Return the first i in [first, count) where the position i columns
+   to the right of col in the row has its bit set in the index,
+   or count if there is none. */
+static int
+index_next(const uint32_t *row_bits, int col, int first, int count)
+{
+	int i = first;
+	while (i < count) {
+		int c = (col + i) & globals.map.col_mask;
+		uint32_t word = row_bits[c >> 5] >> (c & 31);
+		if (word == 0) {
+			i += 32 - (c & 31);
+			continue;
+		}
+
+		while (!(word & 1)) {
+			word >>= 1;
+			i += 1;
+		}
+		break;
+	}
+
+	return min(i, count);
+}
+
+static void
+draw_map_objects_row(map_pos_t row_pos, int y_base, int cols, int x_start, frame_t *frame)
+{
+	int col_0 = MAP_POS_COL(row_pos);
+	int row = MAP_POS_ROW(row_pos);
+	const uint32_t *row_bits = &object_draw_index[row*index_row_words];
+
+	for (int i = index_next(row_bits, col_0, 0, cols); i < cols;
+	     i = index_next(row_bits, col_0, i+1, cols)) {
+		map_pos_t pos = MAP_POS((col_0 + i) & globals.map.col_mask, row);
+		int x_base = x_start + i*MAP_TILE_WIDTH;
+
+		if (MAP_OBJ(pos) == MAP_OBJ_NONE) {
+			index_clear(object_draw_index, pos);
+			continue;
+		}
 
 		int y = y_base - 4*MAP_HEIGHT(pos);
 		if (MAP_OBJ(pos) < MAP_OBJ_TREE_0) {
@@ -2021,7 +2298,7 @@ serf_get_body(serf_t *serf)
    Note that idle serfs do not have a serf_t object so they are drawn seperately
    from active serfs. */
 static void
-draw_serf_row(map_pos_t pos, int y_base, int cols, int x_base, frame_t *frame)
+draw_serf_row(map_pos_t row_pos, int y_base, int cols, int x_start, frame_t *frame)
 {
 	const int arr_1[] = {
 		0x240, 0x40, 0x380, 0x140, 0x300, 0x80, 0x180, 0x200,
@@ -2066,7 +2343,20 @@ draw_serf_row(map_pos_t pos, int y_base, int cols, int x_base, frame_t *frame)
 		5, 8, 0, 0, 0, 0, 0, 0
 	};
 
-	for (int i = 0; i < cols; i++, x_base += MAP_TILE_WIDTH, pos = MAP_MOVE_RIGHT(pos)) {
+	int col_0 = MAP_POS_COL(row_pos);
+	int row = MAP_POS_ROW(row_pos);
+	const uint32_t *row_bits = &serf_draw_index[row*index_row_words];
+
+	for (int i = index_next(row_bits, col_0, 0, cols); i < cols;
+	     i = index_next(row_bits, col_0, i+1, cols)) {
+		map_pos_t pos = MAP_POS((col_0 + i) & globals.map.col_mask, row);
+		int x_base = x_start + i*MAP_TILE_WIDTH;
+
+		if (MAP_SERF_INDEX(pos) == 0 && !MAP_IDLE_SERF(pos)) {
+			index_clear(serf_draw_index, pos);
+			continue;
+		}
+
 #if 0
 		/* Draw serf marker */
 		if (MAP_SERF_INDEX(pos) != 0) {
@@ -2174,6 +2464,8 @@ draw_game_objects(viewport_t *viewport, int layers, frame_t *frame)
 	int draw_serfs = layers & VIEWPORT_LAYER_SERFS;
 	if (!draw_landscape && !draw_objects && !draw_serfs) return;
 
+	if (!index_init) init_draw_index();
+
 	int cols = VIEWPORT_COLS(viewport);
 	int short_row_len = ((cols + 1) >> 1) + 1;
 	int long_row_len = ((cols + 2) >> 1) + 1;
@@ -2340,8 +2632,9 @@ viewport_handle_event_click(viewport_t *viewport, int x, int y, gui_event_button
 			map_pos_t pos = MAP_POS(player->sett->map_cursor_col,
 						player->sett->map_cursor_row);
 			uint length;
-			dir_t *dirs = pathfinder_map(pos, clk_pos, &length);
-			if (dirs != NULL) {
+			const dir_t *dirs;
+			int r = pathfinder_map(pos, clk_pos, &dirs, &length);
+			if (r == 0) {
 				for (int i = 0; i < length; i++) {
 					dir_t dir = dirs[i];
 					int r = player_build_road_segment(player, pos, dir);
@@ -2360,8 +2653,6 @@ viewport_handle_event_click(viewport_t *viewport, int x, int y, gui_event_button
 					}
 					pos = MAP_MOVE(pos, dir);
 				}
-				free(dirs);
-
 			} else {
 				sfx_play_clip(SFX_NOT_ACCEPTED);
 			}
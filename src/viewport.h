@@ -59,6 +59,9 @@ void viewport_map_pix_from_map_coord(viewport_t *viewport, map_pos_t pos, int h,
 map_pos_t viewport_map_pos_from_screen_pix(viewport_t *viewport, int x, int y);
 
 void viewport_redraw_map_pos(map_pos_t pos);
+void viewport_index_add_object(map_pos_t pos);
+void viewport_index_add_serf(map_pos_t pos);
+void viewport_set_landscape_cache_limit(size_t limit);
 
 
 #endif /* ! _VIEWPORT_H */